@@ -0,0 +1,162 @@
+#include "nhttp_chunked.h"
+#include "nhttp_simd.h"
+
+void _nhttp_chunked_init(struct _nhttp_chunked *c, uint64_t max_total) {
+  c->state     = NHTTP_CHUNKED_SIZE_START;
+  c->status    = NHTTP_CHUNKED_AGAIN;
+  c->size      = 0;
+  c->total     = 0;
+  c->max_total = max_total;
+  c->nchunks   = 0;
+  c->meta      = 0;
+}
+
+static int _nhttp_chunked_fail(struct _nhttp_chunked *c, size_t *used,
+                               size_t pos, int status) {
+  c->state  = NHTTP_CHUNKED_FAILED;
+  c->status = status;
+  *used     = pos;
+  return status;
+}
+
+/* _nhttp_chunked_hex returns the value of the hex digit `c`, or -1 */
+static int _nhttp_chunked_hex(unsigned char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* _nhttp_chunked_skip skips the bytes of an extension or trailer line up */
+/* to the CR ending it, accounting them against `max`. Returns the offset */
+/* of the CR or of an invalid byte, or `n` if the line goes on. */
+static size_t _nhttp_chunked_skip(struct _nhttp_chunked *c, const char *buf,
+                                  size_t i, size_t n, uint32_t max) {
+  size_t end = i;
+
+  /* tabs are the only control characters allowed within a line */
+  while ((end += _nhttp_simd_find_ctl(buf + end, n - end, 0x1f)) < n &&
+         buf[end] == '\t')
+    end++;
+  c->meta += (uint32_t)(end - i < max ? end - i : max);
+  return end;
+}
+
+int _nhttp_chunked_execute(struct _nhttp_chunked *c, const char *buf,
+                           size_t len, size_t *used, const char **data,
+                           size_t *data_len) {
+  const unsigned char *s = (const unsigned char *)buf;
+  size_t               i;
+  int                  d;
+
+  *used = 0;
+  if (c->state == NHTTP_CHUNKED_FINISHED || c->state == NHTTP_CHUNKED_FAILED)
+    return c->status;
+
+  for (i = 0; i < len; i++) {
+    switch (c->state) {
+    case NHTTP_CHUNKED_SIZE_START:
+    case NHTTP_CHUNKED_SIZE:
+      if ((d = _nhttp_chunked_hex(s[i])) != -1) {
+        c->size  = c->size * 16 + (uint64_t)d;
+        c->state = NHTTP_CHUNKED_SIZE;
+        if (c->size > NHTTP_CHUNKED_MAX_CHUNK_SIZE ||
+            ++c->meta > NHTTP_CHUNKED_MAX_SIZE_DIGITS)
+          return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_TOO_LARGE);
+        break;
+      }
+      if (c->state == NHTTP_CHUNKED_SIZE_START)
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_INVALID);
+      if (s[i] == '\r') {
+        c->state = NHTTP_CHUNKED_SIZE_LF;
+      } else if (s[i] == ';' || s[i] == ' ' || s[i] == '\t') {
+        c->state = NHTTP_CHUNKED_EXTENSION;
+      } else {
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_INVALID);
+      }
+      break;
+    case NHTTP_CHUNKED_EXTENSION:
+      i = _nhttp_chunked_skip(c, buf, i, len, NHTTP_CHUNKED_MAX_EXTENSION);
+      if (c->meta > NHTTP_CHUNKED_MAX_EXTENSION)
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_TOO_LARGE);
+      if (i == len)
+        break;
+      if (s[i] != '\r')
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_INVALID);
+      c->state = NHTTP_CHUNKED_SIZE_LF;
+      break;
+    case NHTTP_CHUNKED_SIZE_LF:
+      if (s[i] != '\n')
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_INVALID);
+      if (++c->nchunks > NHTTP_CHUNKED_MAX_CHUNKS)
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_TOO_LARGE);
+      c->meta = 0;
+      if (c->size == 0) { /* the last chunk */
+        c->state = NHTTP_CHUNKED_TRAILER_START;
+        break;
+      }
+      if (c->max_total && c->size > c->max_total - c->total)
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_TOO_LARGE);
+      c->state = NHTTP_CHUNKED_PAYLOAD;
+      break;
+    case NHTTP_CHUNKED_PAYLOAD:
+      *data     = buf + i;
+      *data_len = len - i < c->size ? len - i : (size_t)c->size;
+      *used     = i + *data_len;
+      c->size -= *data_len;
+      c->total += *data_len;
+      if (c->size == 0)
+        c->state = NHTTP_CHUNKED_PAYLOAD_CR;
+      return NHTTP_CHUNKED_DATA;
+    case NHTTP_CHUNKED_PAYLOAD_CR:
+      if (s[i] != '\r')
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_INVALID);
+      c->state = NHTTP_CHUNKED_PAYLOAD_LF;
+      break;
+    case NHTTP_CHUNKED_PAYLOAD_LF:
+      if (s[i] != '\n')
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_INVALID);
+      c->state = NHTTP_CHUNKED_SIZE_START;
+      break;
+    case NHTTP_CHUNKED_TRAILER_START:
+      if (s[i] == '\r') {
+        c->state = NHTTP_CHUNKED_END_LF;
+        break;
+      }
+      /* also rejects obsolete line folding, which starts with whitespace */
+      if (s[i] <= ' ' || s[i] == 0x7f || s[i] == ':')
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_INVALID);
+      c->state = NHTTP_CHUNKED_TRAILER;
+      /* fall through */
+    case NHTTP_CHUNKED_TRAILER:
+      i = _nhttp_chunked_skip(c, buf, i, len, NHTTP_CHUNKED_MAX_TRAILER);
+      if (c->meta > NHTTP_CHUNKED_MAX_TRAILER)
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_TOO_LARGE);
+      if (i == len)
+        break;
+      if (s[i] != '\r')
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_INVALID);
+      c->state = NHTTP_CHUNKED_TRAILER_LF;
+      break;
+    case NHTTP_CHUNKED_TRAILER_LF:
+      if (s[i] != '\n')
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_INVALID);
+      c->state = NHTTP_CHUNKED_TRAILER_START;
+      break;
+    case NHTTP_CHUNKED_END_LF:
+      if (s[i] != '\n')
+        return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_INVALID);
+      c->state  = NHTTP_CHUNKED_FINISHED;
+      c->status = NHTTP_CHUNKED_DONE;
+      *used     = i + 1;
+      return NHTTP_CHUNKED_DONE;
+    default:
+      return _nhttp_chunked_fail(c, used, i, NHTTP_CHUNKED_INVALID);
+    }
+  }
+  *used = len;
+  return NHTTP_CHUNKED_AGAIN;
+}
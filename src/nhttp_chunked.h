@@ -0,0 +1,82 @@
+#ifndef NHTTP_CHUNKED_H
+#define NHTTP_CHUNKED_H
+
+#include <stdint.h>    /* uint32_t, uint64_t */
+#include <sys/types.h> /* size_t, */
+
+/* nhttp chunked is an incremental decoder of request bodies sent with */
+/* "Transfer-Encoding: chunked" (RFC 7230 4.1). Like `nhttp_parser`, it is */
+/* fed the bytes received so far and never reads by itself, but it consumes */
+/* them as it goes: the framing (chunk sizes, extensions, CRLFs and the */
+/* trailer section) is skipped, and the chunk payloads are returned as */
+/* pointers into the fed bytes, so they are never copied. Extensions and */
+/* trailers are validated and discarded. */
+
+/* chunks larger than this are rejected */
+#define NHTTP_CHUNKED_MAX_CHUNK_SIZE (1UL << 30)
+
+/* chunk sizes written with more digits than this (leading zeros */
+/* included) are rejected */
+#define NHTTP_CHUNKED_MAX_SIZE_DIGITS 16
+
+/* bodies with more chunks than this (including the last, empty one) are */
+/* rejected, bounding the framing overhead of tiny chunks */
+#define NHTTP_CHUNKED_MAX_CHUNKS (1024 * 1024)
+
+/* the extensions of a chunk, and the trailer section, longer than this */
+/* are rejected */
+#define NHTTP_CHUNKED_MAX_EXTENSION 4096
+#define NHTTP_CHUNKED_MAX_TRAILER 4096
+
+/* statuses returned by `_nhttp_chunked_execute` */
+#define NHTTP_CHUNKED_DONE 0
+#define NHTTP_CHUNKED_AGAIN 1
+#define NHTTP_CHUNKED_DATA 2
+#define NHTTP_CHUNKED_INVALID -1
+#define NHTTP_CHUNKED_TOO_LARGE -2
+
+enum _nhttp_chunked_state {
+  NHTTP_CHUNKED_SIZE_START, /* at the first digit of a chunk size */
+  NHTTP_CHUNKED_SIZE,
+  NHTTP_CHUNKED_EXTENSION, /* skipping extensions, up to the CR */
+  NHTTP_CHUNKED_SIZE_LF,
+  NHTTP_CHUNKED_PAYLOAD,
+  NHTTP_CHUNKED_PAYLOAD_CR,
+  NHTTP_CHUNKED_PAYLOAD_LF,
+  NHTTP_CHUNKED_TRAILER_START, /* at the start of a trailer line */
+  NHTTP_CHUNKED_TRAILER,       /* skipping a trailer line, up to the CR */
+  NHTTP_CHUNKED_TRAILER_LF,
+  NHTTP_CHUNKED_END_LF, /* after the CR of the empty line ending the body */
+  NHTTP_CHUNKED_FINISHED,
+  NHTTP_CHUNKED_FAILED
+};
+
+struct _nhttp_chunked {
+  enum _nhttp_chunked_state state;
+  int                       status;    /* of a finished or failed body */
+  uint64_t                  size;      /* payload left in the chunk */
+  uint64_t                  total;     /* payload of the previous chunks */
+  uint64_t                  max_total; /* 0 if unlimited */
+  uint32_t                  nchunks;
+  uint32_t                  meta; /* size digits, extension or trailer bytes */
+};
+
+/* _nhttp_chunked_init prepares the decoder for a new body of at most */
+/* `max_total` payload bytes (0 for no limit). */
+void _nhttp_chunked_init(struct _nhttp_chunked *c, uint64_t max_total);
+
+/* _nhttp_chunked_execute decodes the `len` bytes of `buf`, which follow */
+/* the bytes passed to the previous calls, and sets `*used` to the number */
+/* of them consumed. Returns NHTTP_CHUNKED_DATA when it reaches payload */
+/* bytes, with `*data` and `*data_len` set to them (they are the last */
+/* `*data_len` bytes consumed), NHTTP_CHUNKED_AGAIN once all of `buf` has */
+/* been consumed without reaching payload bytes, NHTTP_CHUNKED_DONE after */
+/* the end of the body (which is followed by the unconsumed bytes), */
+/* NHTTP_CHUNKED_INVALID if the framing is malformed, and */
+/* NHTTP_CHUNKED_TOO_LARGE if a limit is exceeded. Once done or failed, */
+/* further calls return the same status without consuming anything. */
+int _nhttp_chunked_execute(struct _nhttp_chunked *c, const char *buf,
+                           size_t len, size_t *used, const char **data,
+                           size_t *data_len);
+
+#endif /* NHTTP_CHUNKED_H */
@@ -0,0 +1,24 @@
+#include "nhttp_codel.h"
+
+void _nhttp_codel_init(struct _nhttp_codel *c, int target_ms, int interval_ms,
+                       long now) {
+  c->target_ms    = target_ms;
+  c->interval_ms  = interval_ms;
+  c->interval_end = now + interval_ms;
+  c->min_sojourn  = -1;
+  c->overloaded   = 0;
+}
+
+int _nhttp_codel_admit(struct _nhttp_codel *c, long sojourn_ms, long now) {
+  if (now >= c->interval_end) {
+    /* a whole interval without requests means there is no standing queue */
+    c->overloaded = c->min_sojourn > c->target_ms &&
+                    now < c->interval_end + c->interval_ms;
+    c->interval_end = now + c->interval_ms;
+    c->min_sojourn  = -1;
+  }
+  if (c->min_sojourn == -1 || sojourn_ms < c->min_sojourn) {
+    c->min_sojourn = sojourn_ms;
+  }
+  return !(c->overloaded && sojourn_ms > 2L * c->target_ms);
+}
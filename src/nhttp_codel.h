@@ -0,0 +1,34 @@
+#ifndef NHTTP_CODEL_H
+#define NHTTP_CODEL_H
+
+/* nhttp codel is an admission controller modeled after CoDel (Controlled */
+/* Delay, RFC 8289), as adapted for request queues: instead of the length */
+/* of the queue, it watches the time requests spend waiting in it before */
+/* they get served (their sojourn time). */
+/* A short burst is fine, it drains soon enough. A standing queue isn't: */
+/* once even the shortest sojourn time within an interval stays above the */
+/* target, the server is overloaded, and every request that has waited for */
+/* longer than twice the target gets shed until the sojourn times fall */
+/* back below the target. Shedding the requests that have waited the */
+/* longest keeps the latency of the served ones bounded, as they would be */
+/* late anyway. */
+
+struct _nhttp_codel {
+  int  target_ms;    /* acceptable sojourn time */
+  int  interval_ms;  /* window over which the minimum sojourn is taken */
+  long interval_end; /* ms, see `_nhttp_util_now_ms` */
+  long min_sojourn;  /* ms, minimum within the interval, -1 if none */
+  int  overloaded;   /* minimum of the last interval exceeded the target */
+};
+
+/* _nhttp_codel_init initializes the admission controller, with `now` as the */
+/* current time in ms. */
+void _nhttp_codel_init(struct _nhttp_codel *c, int target_ms, int interval_ms,
+                       long now);
+
+/* _nhttp_codel_admit records the sojourn time of a request which is about */
+/* to be served at `now` ms. Returns 1 if it should be served, and 0 if it */
+/* should be shed. */
+int _nhttp_codel_admit(struct _nhttp_codel *c, long sojourn_ms, long now);
+
+#endif /* NHTTP_CODEL_H */
@@ -0,0 +1,92 @@
+#include "nhttp_coro.h"
+#include "nhttp_util.h"
+#include <errno.h>  /* errno, */
+#include <poll.h>   /* poll, */
+#include <stdlib.h> /* malloc, free */
+#include <string.h> /* strerror, */
+
+/* coroutine currently running on this thread, and stacks of finished */
+/* coroutines kept for reuse. */
+static __thread struct _nhttp_coro *_nhttp_coro_running;
+static __thread char               *_nhttp_coro_pool[NHTTP_CORO_STACK_POOL];
+static __thread int                 _nhttp_coro_pool_len;
+
+static void _nhttp_coro_trampoline(void);
+
+struct _nhttp_coro *_nhttp_coro_create(void (*fn)(void *), void *arg) {
+  struct _nhttp_coro *co = malloc(sizeof(struct _nhttp_coro));
+  co->fn                 = fn;
+  co->arg                = arg;
+  co->done               = 0;
+  co->wait_fd            = -1;
+  co->wait_events        = 0;
+  co->wait_timeout       = -1;
+  co->wait_result        = 0;
+  co->stack              = _nhttp_coro_pool_len
+                               ? _nhttp_coro_pool[--_nhttp_coro_pool_len]
+                               : malloc(NHTTP_CORO_STACK_SIZE);
+
+  if (getcontext(&co->context) == -1) {
+    _nhttp_panicf("getcontext failed: %s", strerror(errno));
+  }
+  co->context.uc_stack.ss_sp   = co->stack;
+  co->context.uc_stack.ss_size = NHTTP_CORO_STACK_SIZE;
+  co->context.uc_link          = &co->caller;
+  /* makecontext passes int arguments only, so the trampoline picks the */
+  /* coroutine up from _nhttp_coro_running instead. */
+  makecontext(&co->context, _nhttp_coro_trampoline, 0);
+  return co;
+}
+
+void _nhttp_coro_free(struct _nhttp_coro *co) {
+  if (_nhttp_coro_pool_len < NHTTP_CORO_STACK_POOL) {
+    _nhttp_coro_pool[_nhttp_coro_pool_len++] = co->stack;
+  } else {
+    free(co->stack);
+  }
+  free(co);
+}
+
+static void _nhttp_coro_trampoline(void) {
+  struct _nhttp_coro *co = _nhttp_coro_running;
+  co->fn(co->arg);
+  co->done = 1;
+  /* returning switches to uc_link, i.e. back into _nhttp_coro_resume */
+}
+
+void _nhttp_coro_resume(struct _nhttp_coro *co) {
+  struct _nhttp_coro *prev = _nhttp_coro_running;
+  _nhttp_coro_running      = co;
+  if (swapcontext(&co->caller, &co->context) == -1) {
+    _nhttp_panicf("swapcontext failed: %s", strerror(errno));
+  }
+  _nhttp_coro_running = prev;
+}
+
+struct _nhttp_coro *_nhttp_coro_self(void) { return _nhttp_coro_running; }
+
+int _nhttp_coro_wait(int fd, short events, int timeout_ms) {
+  struct _nhttp_coro *co = _nhttp_coro_running;
+  struct pollfd       pfd;
+  int                 ret;
+
+  if (co == NULL) { /* not in a coroutine, block the thread */
+    pfd.fd     = fd;
+    pfd.events = events;
+    do {
+      ret = poll(&pfd, fd == -1 ? 0 : 1, timeout_ms);
+    } while (ret == -1 && errno == EINTR);
+    if (fd == -1)
+      return ret == 0 ? 0 : -1;
+    return ret > 0 ? 0 : -1;
+  }
+
+  co->wait_fd      = fd;
+  co->wait_events  = events;
+  co->wait_timeout = timeout_ms;
+  co->wait_result  = -1;
+  if (swapcontext(&co->context, &co->caller) == -1) {
+    _nhttp_panicf("swapcontext failed: %s", strerror(errno));
+  }
+  return co->wait_result;
+}
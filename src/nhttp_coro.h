@@ -0,0 +1,63 @@
+#ifndef NHTTP_CORO_H
+#define NHTTP_CORO_H
+
+#include <stddef.h>   /* size_t, */
+#include <ucontext.h> /* ucontext_t, */
+
+/* stack size of a coroutine. Requests are parsed in place in the read */
+/* buffer, so request handling itself needs little stack: the body helpers */
+/* need the most, ~16KiB (a copy buffer of NHTTP_SERVER_BODY_CHUNK bytes, */
+/* or the multipart parser state), the rest is left for the handler. */
+#define NHTTP_CORO_STACK_SIZE (256 * 1024)
+/* number of stacks of finished coroutines kept (per thread) for reuse */
+#define NHTTP_CORO_STACK_POOL 64
+
+/* nhttp coroutines are stackful coroutines built on ucontext(3), which */
+/* allow a handler to suspend in the middle of its execution (e.g. while */
+/* waiting for a backend) and have the event loop resume it later. */
+/* A coroutine describes what it is waiting for in its `wait_*` fields */
+/* before it yields, the resumer waits for that and stores the outcome in */
+/* `wait_result` before resuming it: */
+/* - wait_fd: fd to wait on (-1 if none), for `wait_events` (POLLIN/OUT) */
+/* - wait_timeout: ms to wait for at most (-1 if there is no timeout) */
+/* - wait_result: 0 if the fd became ready (or the timeout of a wait */
+/*   without an fd expired), -1 if the timeout expired first. */
+/* Coroutines are owned by the thread that created them. */
+
+struct _nhttp_coro {
+  ucontext_t context, caller;
+  char      *stack;
+  void (*fn)(void *);
+  void *arg;
+  int   done; /* fn has returned */
+  int   wait_fd;
+  short wait_events;
+  int   wait_timeout;
+  int   wait_result;
+};
+
+/* _nhttp_coro_create creates a coroutine that runs `fn(arg)` once it is */
+/* resumed for the first time. Panics if the context can't be created. */
+struct _nhttp_coro *_nhttp_coro_create(void (*fn)(void *), void *arg);
+
+/* _nhttp_coro_free frees the coroutine, which must not be suspended in the */
+/* middle of its execution, as its stack is reused. */
+void _nhttp_coro_free(struct _nhttp_coro *co);
+
+/* _nhttp_coro_resume switches to the coroutine, and returns once it either */
+/* yields or finishes (`co->done` is set). */
+void _nhttp_coro_resume(struct _nhttp_coro *co);
+
+/* _nhttp_coro_self returns the coroutine running on the calling thread, or */
+/* NULL when called from outside of a coroutine. */
+struct _nhttp_coro *_nhttp_coro_self(void);
+
+/* _nhttp_coro_wait waits until `fd` becomes ready for `events`, or until */
+/* `timeout_ms` milliseconds have passed (-1 waits indefinitely). Pass -1 as */
+/* `fd` to only wait for the timeout. When called from a coroutine, it */
+/* yields to the resumer, otherwise it blocks the thread in poll(2). */
+/* Returns 0 if the fd became ready (or the timeout of a wait without an fd */
+/* expired), and -1 if the timeout expired first or on error. */
+int _nhttp_coro_wait(int fd, short events, int timeout_ms);
+
+#endif /* NHTTP_CORO_H */
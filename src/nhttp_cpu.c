@@ -0,0 +1,80 @@
+#define _GNU_SOURCE /* cpu_set_t, sched_*affinity */
+#include "nhttp_cpu.h"
+#include <errno.h>        /* errno, EINVAL */
+#include <linux/filter.h> /* struct sock_filter, BPF_*, SKF_AD_* */
+#include <sched.h>        /* sched_getaffinity, sched_setaffinity, CPU_* */
+#include <stdlib.h>       /* malloc, free */
+#include <sys/socket.h>   /* setsockopt, getsockopt, SO_* */
+
+int _nhttp_cpu_allowed(int **cpus) {
+  cpu_set_t set;
+  int       cpu, n = 0;
+
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &set))
+    return -1;
+  *cpus = malloc((size_t)CPU_COUNT(&set) * sizeof(int));
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET((size_t)cpu, &set))
+      (*cpus)[n++] = cpu;
+  }
+  return n;
+}
+
+int _nhttp_cpu_pin(int cpu) {
+  cpu_set_t set;
+
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    errno = EINVAL;
+    return -1;
+  }
+  CPU_ZERO(&set);
+  CPU_SET((size_t)cpu, &set);
+  /* pid 0 is the calling thread, not the whole process */
+  return sched_setaffinity(0, sizeof(cpu_set_t), &set);
+}
+
+int _nhttp_cpu_steer(int sockfd, const int *cpus, int ncpus) {
+  struct sock_filter *code;
+  struct sock_fprog   prog;
+  int                 i, err;
+
+  /* A = cpu; if A == cpus[i] return i; ...; return out of range, which */
+  /* makes the kernel fall back to hashing */
+  if (ncpus <= 0 || 2 * ncpus + 2 > BPF_MAXINSNS)
+    return -1;
+  code = malloc((size_t)(2 * ncpus + 2) * sizeof(struct sock_filter));
+  code[0].code = BPF_LD | BPF_W | BPF_ABS;
+  code[0].jt   = 0;
+  code[0].jf   = 0;
+  code[0].k    = (unsigned)(SKF_AD_OFF + SKF_AD_CPU);
+  for (i = 0; i < ncpus; i++) {
+    code[1 + 2 * i].code = BPF_JMP | BPF_JEQ | BPF_K;
+    code[1 + 2 * i].jt   = 0;
+    code[1 + 2 * i].jf   = 1;
+    code[1 + 2 * i].k    = (unsigned)cpus[i];
+    code[2 + 2 * i].code = BPF_RET | BPF_K;
+    code[2 + 2 * i].jt   = 0;
+    code[2 + 2 * i].jf   = 0;
+    code[2 + 2 * i].k    = (unsigned)i;
+  }
+  code[1 + 2 * ncpus].code = BPF_RET | BPF_K;
+  code[1 + 2 * ncpus].jt   = 0;
+  code[1 + 2 * ncpus].jf   = 0;
+  code[1 + 2 * ncpus].k    = 0xffffffffU;
+
+  prog.len    = (unsigned short)(2 * ncpus + 2);
+  prog.filter = code;
+  err = setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                   sizeof(struct sock_fprog));
+  free(code);
+  return err ? -1 : 0;
+}
+
+int _nhttp_cpu_incoming(int connfd) {
+  int       cpu;
+  socklen_t len = sizeof(int);
+
+  if (getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len))
+    return -1;
+  return cpu;
+}
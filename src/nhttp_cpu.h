@@ -0,0 +1,33 @@
+#ifndef NHTTP_CPU_H
+#define NHTTP_CPU_H
+
+/* nhttp cpu pins workers (processes or threads) to CPUs, and steers every */
+/* connection to the worker pinned to the CPU which received its packets, */
+/* so that the packets, the socket and the buffers of a connection stay in */
+/* the caches of a single core instead of migrating between them. */
+/* Linux allocates memory on the NUMA node of the CPU that first touches */
+/* it, so workers are pinned before they allocate their buffers, which then */
+/* end up on their local node without a libnuma dependency. */
+/* see `nhttp_server_set_cpu_affinity` */
+
+/* _nhttp_cpu_allowed returns the CPUs the calling thread is allowed to run */
+/* on, in ascending order, in a malloc'd array. Returns their count, or -1 */
+/* on error. */
+int _nhttp_cpu_allowed(int **cpus);
+
+/* _nhttp_cpu_pin pins the calling thread (and the threads and processes */
+/* it creates afterwards) to `cpu`. Returns 0 on success, -1 otherwise. */
+int _nhttp_cpu_pin(int cpu);
+
+/* _nhttp_cpu_steer attaches a classic BPF program to the SO_REUSEPORT */
+/* group of `sockfd`, which hands connections received on `cpus[i]` to the */
+/* i-th socket of the group (in the order the sockets joined it). */
+/* Connections received on other CPUs are balanced by the usual hash. */
+/* Returns 0 on success, -1 otherwise. */
+int _nhttp_cpu_steer(int sockfd, const int *cpus, int ncpus);
+
+/* _nhttp_cpu_incoming returns the CPU which received the last packets of */
+/* the connection (SO_INCOMING_CPU), or -1 if unknown. */
+int _nhttp_cpu_incoming(int connfd);
+
+#endif /* NHTTP_CPU_H */
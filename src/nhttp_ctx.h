@@ -1,19 +1,48 @@
 #ifndef NHTTP_CTX_H
 #define NHTTP_CTX_H
 
+#include "nhttp_chunked.h"
 #include "nhttp_map.h"
+#include "nhttp_parser.h"
 #include "nhttp_util.h"
 
+struct _nhttp_header {
+  struct _nhttp_view name, value;
+};
+
+/* _nhttp_request is a parsed request head. Its elements are views into the */
+/* read buffer, which are also NUL-terminated in place, so they are used as */
+/* strings without copying them. Known headers (see `_nhttp_header_id`) */
+/* are also indexed by their id. The head is pinned in the read buffer (see */
+/* `_nhttp_buf_reader`) while the request is being handled. */
+struct _nhttp_request {
+  struct _nhttp_view   method;
+  struct _nhttp_view   path;  /* without the query, split in place by routing */
+  struct _nhttp_view   query; /* empty if there is none */
+  struct _nhttp_view   proto;
+  struct _nhttp_header headers[NHTTP_PARSER_MAX_HEADERS];
+  int                  nheaders;
+  /* the last of the headers with each known id, NULL if there is none */
+  const struct _nhttp_header *known[NHTTP_HEADER_KNOWN];
+};
+
 struct nhttp_ctx {
-  /* both connfd and bufr share the same file descriptor. connfd should be */
-  /* used for writing (preferably via `_nhttp_util_write_all`), and bufr */
-  /* should be used for reading as it is a read-only buffer above the connfd.*/
-  int                       connfd;
-  struct _nhttp_buf_reader *bufr;
-  struct _nhttp_map        *path_params;
-  struct _nhttp_map        *query_params;
-  struct _nhttp_map        *req_headers;
-  struct _nhttp_map        *resp_headers;
+  /* connfd, bufr and bufw share the same file descriptor. bufr should be */
+  /* used for reading as it is a read-only buffer above the connfd, and bufw */
+  /* should be used for writing, as the response gets flushed by the server */
+  /* once the handler returns (the connfd may be non-blocking). */
+  int                          connfd;
+  struct _nhttp_buf_reader    *bufr;
+  struct _nhttp_buf_writer    *bufw;
+  struct _nhttp_map           *path_params;
+  struct _nhttp_map           *query_params;
+  const struct _nhttp_request *req;
+  struct _nhttp_map           *resp_headers;
+  size_t                       body_left; /* bytes of the body not read */
+  struct _nhttp_chunked       *chunked;   /* NULL if it isn't chunked */
+  /* the client waits for "100 Continue" before sending the body */
+  int                          expect_continue;
+  size_t                       written; /* bufw->len before the response */
 };
 
 #endif /* NHTTP_CTX_H */
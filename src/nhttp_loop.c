@@ -0,0 +1,608 @@
+#include "nhttp_loop.h"
+#include "nhttp_coro.h"
+#include "nhttp_upgrade.h"
+#include <errno.h>      /* errno, E* */
+#include <linux/types.h> /* __u8, __u16, __u32 */
+#include <poll.h>       /* POLLOUT, */
+#include <stdlib.h>     /* malloc, free */
+#include <string.h>     /* strerror, */
+#include <sys/epoll.h>  /* epoll_*, */
+#include <sys/ioctl.h>  /* ioctl, _IOW */
+#include <sys/socket.h> /* accept, */
+#include <unistd.h>     /* close, */
+
+/* per epoll instance busy polling, see linux/eventpoll.h (Linux 6.9) */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+  __u32 busy_poll_usecs;
+  __u16 busy_poll_budget;
+  __u8  prefer_busy_poll;
+  __u8  __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+/* packets processed per busy poll of a NIC queue, the kernel default */
+#define NHTTP_LOOP_BUSY_POLL_BUDGET 8
+
+static struct _nhttp_conn *_nhttp_conn_create(struct _nhttp_loop *l,
+                                              int                 fd);
+static void                _nhttp_conn_free(struct _nhttp_conn *c);
+static void                _nhttp_loop_accept(struct _nhttp_loop *l);
+static void                _nhttp_loop_take_inbox(struct _nhttp_loop *l);
+static void _nhttp_loop_add_conn(struct _nhttp_loop *l, int connfd,
+                                 long ready_since);
+static void                _nhttp_loop_on_readable(struct _nhttp_loop *l,
+                                                   struct _nhttp_conn *c);
+static void _nhttp_loop_on_body(struct _nhttp_loop *l, struct _nhttp_conn *c);
+static void _nhttp_loop_process(struct _nhttp_loop *l, struct _nhttp_conn *c);
+static int  _nhttp_loop_shed(struct _nhttp_loop *l, struct _nhttp_conn *c);
+static void _nhttp_loop_coro_main(void *arg);
+static int  _nhttp_loop_resume(struct _nhttp_loop *l, struct _nhttp_conn *c);
+static void _nhttp_loop_wake(struct _nhttp_loop *l, struct _nhttp_conn *c,
+                             int result);
+static void _nhttp_loop_set_phase(struct _nhttp_loop      *l,
+                                  struct _nhttp_conn      *c,
+                                  enum _nhttp_server_phase phase);
+static void _nhttp_loop_on_timeout(struct _nhttp_timer *t);
+static int  _nhttp_loop_flush(struct _nhttp_loop *l, struct _nhttp_conn *c);
+static int  _nhttp_loop_discard(struct _nhttp_loop *l, struct _nhttp_conn *c);
+static int  _nhttp_loop_expire(struct _nhttp_loop *l);
+static void _nhttp_loop_drain(struct _nhttp_loop *l);
+static void _nhttp_loop_close(struct _nhttp_loop *l, struct _nhttp_conn *c);
+static int  _nhttp_loop_wait(struct _nhttp_loop *l, struct epoll_event *events,
+                             int timeout);
+
+void _nhttp_loop_run(struct nhttp_server *s, int listenfd,
+                     struct _nhttp_queue *inbox) {
+  struct _nhttp_loop l;
+  struct epoll_event ev, events[NHTTP_LOOP_MAX_EVENTS];
+  struct epoll_params params;
+  void              *ptr;
+  int                n, i, timeout;
+  long               waited_at, woke_at;
+
+  l.s        = s;
+  l.listenfd = listenfd;
+  l.inbox    = inbox;
+  _nhttp_timer_wheel_init(&l.timers, _nhttp_util_now_ms());
+  _nhttp_codel_init(&l.codel, s->shed_target_ms, NHTTP_SERVER_SHED_INTERVAL_MS,
+                    _nhttp_util_now_ms());
+  l.spare_fd            = _nhttp_util_open_spare_fd();
+  l.accept_paused_until = 0;
+  l.conns               = NULL;
+  l.draining            = 0;
+  woke_at               = _nhttp_util_now_ms();
+  if ((l.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    _nhttp_panicf("could not create epoll instance: %s", strerror(errno));
+  }
+  /* older kernels reject the ioctl, busy polling is then done by */
+  /* `_nhttp_loop_wait` alone */
+  if (s->busy_poll_us > 0) {
+    memset(&params, 0, sizeof(struct epoll_params));
+    params.busy_poll_usecs  = (__u32)s->busy_poll_us;
+    params.busy_poll_budget = NHTTP_LOOP_BUSY_POLL_BUDGET;
+    params.prefer_busy_poll = 1;
+    ioctl(l.epfd, EPIOCSPARAMS, &params);
+  }
+
+  /* the listening socket and the inbox are registered with pointers to */
+  /* the corresponding loop fields as data.ptr, so that they can be told */
+  /* apart from the connections. */
+  if (listenfd != -1) {
+    if (_nhttp_util_set_nonblocking(listenfd)) {
+      _nhttp_panicf("could not make listening socket non-blocking: %s",
+                    strerror(errno));
+    }
+    ev.events   = EPOLLIN;
+    ev.data.ptr = &l.listenfd;
+    if (epoll_ctl(l.epfd, EPOLL_CTL_ADD, listenfd, &ev)) {
+      _nhttp_panicf("could not register listening socket: %s",
+                    strerror(errno));
+    }
+  }
+  if (inbox != NULL) {
+    ev.events   = EPOLLIN;
+    ev.data.ptr = &l.inbox;
+    if (epoll_ctl(l.epfd, EPOLL_CTL_ADD, inbox->wakefd, &ev)) {
+      _nhttp_panicf("could not register inbox: %s", strerror(errno));
+    }
+  }
+
+  while (1) {
+    /* conns may also get closed by their timers */
+    timeout = _nhttp_loop_expire(&l);
+    if (l.draining && l.conns == NULL)
+      break;
+    waited_at = _nhttp_util_now_ms();
+    n         = _nhttp_loop_wait(&l, events, timeout);
+    if (n == -1) {
+      if (errno != EINTR)
+        _nhttp_panicf("epoll_wait failed: %s", strerror(errno));
+      n = 0;
+    }
+    /* events reported without blocking were already pending, possibly */
+    /* ever since the previous epoll_wait returned */
+    l.ready_at = woke_at;
+    woke_at    = _nhttp_util_now_ms();
+    if (woke_at > waited_at)
+      l.ready_at = woke_at;
+    for (i = 0; i < n; i++) {
+      ptr = events[i].data.ptr;
+      if (ptr == &l.listenfd) {
+        _nhttp_loop_accept(&l);
+      } else if (ptr == &l.inbox) {
+        _nhttp_loop_take_inbox(&l);
+      } else if (((struct _nhttp_conn *)ptr)->state == NHTTP_CONN_SUSPENDED) {
+        _nhttp_loop_wake(&l, ptr, 0);
+      } else if (((struct _nhttp_conn *)ptr)->state == NHTTP_CONN_READING) {
+        _nhttp_loop_on_readable(&l, ptr);
+      } else if (((struct _nhttp_conn *)ptr)->state ==
+                 NHTTP_CONN_DISCARDING) {
+        _nhttp_loop_on_body(&l, ptr);
+      } else {
+        _nhttp_loop_flush(&l, ptr);
+      }
+    }
+
+    if (l.listenfd != -1 && _nhttp_upgrade_requested())
+      _nhttp_upgrade_start(&l.listenfd, 1);
+    if (!l.draining && _nhttp_upgrade_draining())
+      _nhttp_loop_drain(&l);
+  }
+
+  close(l.epfd);
+  if (l.spare_fd != -1)
+    close(l.spare_fd);
+}
+
+/* _nhttp_loop_wait waits for events with `_nhttp_upgrade_sigmask`, for up */
+/* to `timeout` ms. When busy polling, it polls without sleeping for up to */
+/* the busy poll time first, which saves the wakeup of the events arriving */
+/* meanwhile. */
+static int _nhttp_loop_wait(struct _nhttp_loop *l, struct epoll_event *events,
+                            int timeout) {
+  long until;
+  int  n;
+
+  if (l->s->busy_poll_us > 0 && timeout != 0) {
+    until = _nhttp_util_now_us() + l->s->busy_poll_us;
+    if (timeout > 0 && timeout < l->s->busy_poll_us / 1000)
+      until = _nhttp_util_now_us() + (long)timeout * 1000;
+    do {
+      n = epoll_pwait(l->epfd, events, NHTTP_LOOP_MAX_EVENTS, 0,
+                      _nhttp_upgrade_sigmask());
+      if (n != 0)
+        return n;
+    } while (_nhttp_util_now_us() < until);
+  }
+  return epoll_pwait(l->epfd, events, NHTTP_LOOP_MAX_EVENTS, timeout,
+                     _nhttp_upgrade_sigmask());
+}
+
+static struct _nhttp_conn *_nhttp_conn_create(struct _nhttp_loop *l,
+                                              int                 fd) {
+  struct _nhttp_conn *c = malloc(sizeof(struct _nhttp_conn));
+  int                 timeout;
+  c->fd                 = fd;
+  c->state              = NHTTP_CONN_READING;
+  c->bufr               = _nhttp_util_buf_reader_create(fd);
+  c->bufw               = _nhttp_util_buf_writer_create(fd);
+  _nhttp_parser_init(&c->parser);
+  c->body.pending       = 0;
+  c->requests           = 0;
+  c->keepalive          = 0;
+  c->loop               = l;
+  c->coro               = NULL;
+  c->handler_deadline   = 0;
+  _nhttp_timer_init(&c->timer, _nhttp_loop_on_timeout, c);
+  /* the body is read while handling the request */
+  timeout = _nhttp_server_phase_timeout(l->s, NHTTP_SERVER_PHASE_BODY);
+  c->bufr->timeout_ms = timeout ? timeout : -1;
+  return c;
+}
+
+static void _nhttp_conn_free(struct _nhttp_conn *c) {
+  _nhttp_util_buf_reader_free(c->bufr);
+  _nhttp_util_buf_writer_free(c->bufw);
+  free(c);
+}
+
+/* _nhttp_loop_accept accepts all of the pending connections. If the */
+/* process runs out of fds and there is no spare fd to shed connections */
+/* with, accepting is paused for NHTTP_SERVER_ACCEPT_BACKOFF_MS, as the */
+/* listening socket would keep the loop spinning otherwise. */
+static void _nhttp_loop_accept(struct _nhttp_loop *l) {
+  int connfd;
+  while (1) {
+    connfd = _nhttp_util_accept(l->listenfd, SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                &l->spare_fd);
+    if (connfd != -1) {
+      _nhttp_loop_add_conn(l, connfd, 0);
+      continue;
+    }
+    if (errno == ECONNABORTED)
+      continue; /* shed, or reset by the client */
+    if ((errno == EMFILE || errno == ENFILE) &&
+        epoll_ctl(l->epfd, EPOLL_CTL_DEL, l->listenfd, NULL) == 0) {
+      l->accept_paused_until =
+          _nhttp_util_now_ms() + NHTTP_SERVER_ACCEPT_BACKOFF_MS;
+    }
+    return; /* EAGAIN, i.e. drained, or an error */
+  }
+}
+
+static void _nhttp_loop_take_inbox(struct _nhttp_loop *l) {
+  uint64_t counter;
+  int      connfd;
+  long     pushed_at;
+  /* reset the wakeup counter before draining, so a push racing with the */
+  /* draining leaves the eventfd readable for the next epoll_wait. */
+  if (read(l->inbox->wakefd, &counter, sizeof(uint64_t)) == -1 &&
+      errno != EAGAIN) {
+    return;
+  }
+  /* connections have been waiting since they were handed over */
+  while ((connfd = _nhttp_queue_pop_timed(l->inbox, &pushed_at)) != -1) {
+    _nhttp_loop_add_conn(l, connfd, pushed_at);
+  }
+}
+
+static void _nhttp_loop_add_conn(struct _nhttp_loop *l, int connfd,
+                                 long ready_since) {
+  struct epoll_event  ev;
+  struct _nhttp_conn *c;
+
+  c              = _nhttp_conn_create(l, connfd);
+  c->ready_since = ready_since;
+  ev.events   = EPOLLIN;
+  ev.data.ptr = c;
+  if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, connfd, &ev)) {
+    _nhttp_conn_free(c);
+    close(connfd);
+    return;
+  }
+  c->prev = NULL;
+  c->next = l->conns;
+  if (l->conns != NULL)
+    l->conns->prev = c;
+  l->conns = c;
+  _nhttp_loop_set_phase(l, c, NHTTP_SERVER_PHASE_IDLE);
+}
+
+static void _nhttp_loop_on_readable(struct _nhttp_loop *l,
+                                    struct _nhttp_conn *c) {
+  enum _nhttp_server_phase phase;
+  ssize_t                  n;
+
+  if (!c->ready_since)
+    c->ready_since = l->ready_at;
+  /* read until the whole request head is buffered */
+  while (_nhttp_server_parse_head(&c->parser, c->bufr) == NHTTP_PARSER_AGAIN) {
+    phase = _nhttp_server_head_phase(&c->parser, c->bufr);
+    if (phase != c->phase)
+      _nhttp_loop_set_phase(l, c, phase);
+    n = _nhttp_util_buf_reader_fill(c->bufr);
+    if (n > 0)
+      continue;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return; /* resume once more data arrives */
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno == ENOBUFS) {
+      /* request head does not fit in the buffer */
+      _nhttp_server_send_empty(c->bufw, 431, 0);
+      c->keepalive = 0;
+      _nhttp_loop_flush(l, c);
+      return;
+    }
+    _nhttp_loop_close(l, c); /* EOF or error */
+    return;
+  }
+
+  _nhttp_loop_process(l, c);
+}
+
+/* _nhttp_loop_on_body resumes discarding the rest of the body of the last */
+/* request once more of it arrived, and reads the next request once done. */
+static void _nhttp_loop_on_body(struct _nhttp_loop *l, struct _nhttp_conn *c) {
+  if (_nhttp_loop_discard(l, c))
+    return; /* still discarding, or closed */
+  _nhttp_loop_set_phase(l, c, _nhttp_server_head_phase(&c->parser, c->bufr));
+  _nhttp_loop_on_readable(l, c); /* the next head may follow the body */
+}
+
+/* _nhttp_loop_process handles the request heads buffered in the conn's */
+/* reader, a batch of pipelined requests at a time, for as long as their */
+/* responses can be flushed right away. */
+static void _nhttp_loop_process(struct _nhttp_loop *l, struct _nhttp_conn *c) {
+  while (c->state == NHTTP_CONN_READING &&
+         _nhttp_server_parse_head(&c->parser, c->bufr) != NHTTP_PARSER_AGAIN) {
+    if (l->s->shed_target_ms && _nhttp_loop_shed(l, c))
+      return;
+    _nhttp_loop_set_phase(l, c, NHTTP_SERVER_PHASE_HANDLER);
+    if (l->s->async || _nhttp_server_awaits_body(&c->parser, c->bufr)) {
+      /* without async, only the reads of the body are bounded */
+      if (!l->s->async)
+        c->handler_deadline = 0;
+      c->coro = _nhttp_coro_create(_nhttp_loop_coro_main, c);
+      if (_nhttp_loop_resume(l, c))
+        return; /* handler got suspended */
+    } else {
+      c->keepalive = _nhttp_server_handle_pipeline(
+          l->s, &c->parser, &c->body, c->bufr, c->bufw, &c->requests);
+    }
+    if (_nhttp_loop_flush(l, c))
+      return; /* c was closed */
+  }
+}
+
+/* _nhttp_loop_shed runs admission control for the request buffered in the */
+/* conn. Returns 0 if it should be served, and -1 if it was shed, in which */
+/* case the 503 is being flushed and the conn is closed afterwards. */
+static int _nhttp_loop_shed(struct _nhttp_loop *l, struct _nhttp_conn *c) {
+  long now     = _nhttp_util_now_ms();
+  long sojourn = c->ready_since ? now - c->ready_since : 0;
+
+  c->ready_since = 0;
+  if (_nhttp_codel_admit(&l->codel, sojourn, now))
+    return 0;
+  _nhttp_server_send_shed(l->s, c->bufw);
+  c->keepalive = 0;
+  _nhttp_loop_flush(l, c);
+  return -1;
+}
+
+static void _nhttp_loop_coro_main(void *arg) {
+  struct _nhttp_conn *c = arg;
+  c->keepalive          = _nhttp_server_handle_pipeline(
+      c->loop->s, &c->parser, &c->body, c->bufr, c->bufw, &c->requests);
+}
+
+/* _nhttp_loop_resume resumes the conn's coroutine. Returns 0 once it has */
+/* finished, with the conn back in NHTTP_CONN_READING. Returns -1 if it got */
+/* suspended, with the conn in NHTTP_CONN_SUSPENDED: the conn's socket is */
+/* removed from the epoll interest list, and the awaited fd is registered */
+/* with the conn as data.ptr instead, while the conn's timer is set to the */
+/* timeout, or to the handler deadline if that comes first. */
+static int _nhttp_loop_resume(struct _nhttp_loop *l, struct _nhttp_conn *c) {
+  struct _nhttp_coro *co = c->coro;
+  struct epoll_event  ev;
+  long                now, deadline;
+
+  while (1) {
+    _nhttp_coro_resume(co);
+    now = _nhttp_util_now_ms();
+    if (co->done) {
+      _nhttp_coro_free(co);
+      c->coro = NULL;
+      if (c->handler_deadline && now >= c->handler_deadline) {
+        c->keepalive = 0; /* the handler timed out */
+      }
+      if (c->state == NHTTP_CONN_SUSPENDED) {
+        c->state    = NHTTP_CONN_READING;
+        ev.events   = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->fd, &ev)) {
+          c->keepalive = 0; /* flushing will close it */
+        }
+      }
+      return 0;
+    }
+
+    if (c->handler_deadline && now >= c->handler_deadline) {
+      co->wait_result = -1; /* out of time, fail waits right away */
+      continue;
+    }
+    if (c->state != NHTTP_CONN_SUSPENDED) {
+      c->state = NHTTP_CONN_SUSPENDED;
+      epoll_ctl(l->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    }
+    if (co->wait_fd != -1) {
+      ev.events   = (co->wait_events & POLLOUT) ? EPOLLOUT : EPOLLIN;
+      ev.data.ptr = c;
+      if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, co->wait_fd, &ev)) {
+        co->wait_result = -1; /* e.g. fd is awaited by another handler */
+        continue;
+      }
+    } else if (co->wait_timeout < 0) {
+      co->wait_result = -1; /* would never be resumed */
+      continue;
+    }
+    deadline = co->wait_timeout >= 0 ? now + co->wait_timeout : 0;
+    if (c->handler_deadline && (!deadline || c->handler_deadline < deadline))
+      deadline = c->handler_deadline;
+    if (deadline) {
+      _nhttp_timer_add(&l->timers, &c->timer, deadline);
+    }
+    return -1;
+  }
+}
+
+/* _nhttp_loop_wake resumes the suspended conn once the awaited fd became */
+/* ready, or the timeout expired, passing `result` to the coroutine. */
+static void _nhttp_loop_wake(struct _nhttp_loop *l, struct _nhttp_conn *c,
+                             int result) {
+  if (c->coro->wait_fd != -1) {
+    epoll_ctl(l->epfd, EPOLL_CTL_DEL, c->coro->wait_fd, NULL);
+  }
+  _nhttp_timer_remove(&l->timers, &c->timer);
+  c->coro->wait_result = result;
+  if (_nhttp_loop_resume(l, c))
+    return; /* suspended again */
+  if (_nhttp_loop_flush(l, c))
+    return; /* c was closed */
+  _nhttp_loop_process(l, c);
+}
+
+/* _nhttp_loop_set_phase moves the conn into the phase, setting its timer */
+/* to the deadline of the phase. In the handler phase, the deadline only */
+/* applies to handlers running as coroutines. */
+static void _nhttp_loop_set_phase(struct _nhttp_loop      *l,
+                                  struct _nhttp_conn      *c,
+                                  enum _nhttp_server_phase phase) {
+  int timeout = _nhttp_server_phase_timeout(l->s, phase);
+
+  c->phase = phase;
+  if (phase == NHTTP_SERVER_PHASE_HANDLER) {
+    _nhttp_timer_remove(&l->timers, &c->timer);
+    c->handler_deadline = timeout ? _nhttp_util_now_ms() + timeout : 0;
+  } else if (timeout) {
+    _nhttp_timer_add(&l->timers, &c->timer, _nhttp_util_now_ms() + timeout);
+  } else {
+    _nhttp_timer_remove(&l->timers, &c->timer);
+  }
+}
+
+/* _nhttp_loop_on_timeout is called once the conn's timer expires: the */
+/* suspended handler is resumed, and the connection is closed otherwise. */
+/* Idle connections are closed gracefully, the others are reset. */
+static void _nhttp_loop_on_timeout(struct _nhttp_timer *t) {
+  struct _nhttp_conn *c = t->data;
+  struct _nhttp_loop *l = c->loop;
+  int                 expired;
+
+  if (c->state != NHTTP_CONN_SUSPENDED) {
+    if (c->phase != NHTTP_SERVER_PHASE_IDLE)
+      _nhttp_util_set_abortive_close(c->fd);
+    _nhttp_loop_close(l, c);
+    return;
+  }
+  /* a timeout is a success for plain sleeps, and a failure otherwise, as */
+  /* well as when the handler ran out of time */
+  expired = c->handler_deadline && l->timers.now >= c->handler_deadline;
+  _nhttp_loop_wake(l, c, c->coro->wait_fd == -1 && !expired ? 0 : -1);
+}
+
+/* _nhttp_loop_flush flushes the response, and closes the connection once */
+/* it has been sent unless it is kept alive. The rest of the body of the */
+/* last request is discarded then. Returns -1 if the connection was */
+/* closed, 0 otherwise. */
+static int _nhttp_loop_flush(struct _nhttp_loop *l, struct _nhttp_conn *c) {
+  struct epoll_event ev;
+  int                writing, ret = _nhttp_util_buf_writer_flush(c->bufw);
+
+  if (ret == 1) {
+    /* socket buffer is full, resume once it is writable, which has to */
+    /* happen before the write timeout */
+    _nhttp_loop_set_phase(l, c, NHTTP_SERVER_PHASE_WRITE);
+    if (c->state != NHTTP_CONN_WRITING) {
+      c->state    = NHTTP_CONN_WRITING;
+      ev.events   = EPOLLOUT;
+      ev.data.ptr = c;
+      if (epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->fd, &ev)) {
+        _nhttp_loop_close(l, c);
+        return -1;
+      }
+    }
+    return 0;
+  }
+  if (ret == -1 || !c->keepalive || l->draining) {
+    _nhttp_loop_close(l, c);
+    return -1;
+  }
+
+  /* response was sent, wait for the next request */
+  writing = c->state == NHTTP_CONN_WRITING;
+  if (writing) {
+    c->state    = NHTTP_CONN_READING;
+    ev.events   = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->fd, &ev)) {
+      _nhttp_loop_close(l, c);
+      return -1;
+    }
+  }
+  if (c->body.pending && (ret = _nhttp_loop_discard(l, c)))
+    return ret == -1 ? -1 : 0;
+  _nhttp_loop_set_phase(l, c, _nhttp_server_head_phase(&c->parser, c->bufr));
+  if (writing)
+    _nhttp_loop_process(l, c); /* the next head may already be buffered */
+  return 0;
+}
+
+/* _nhttp_loop_discard discards the rest of the body of the last request */
+/* as far as it has been received (see `_nhttp_server_discard`). While */
+/* more of it has to arrive, the conn is NHTTP_CONN_DISCARDING, until the */
+/* body timeout. Returns 0 once it has been discarded, with the conn in */
+/* NHTTP_CONN_READING, 1 while it is still being discarded, and -1 if the */
+/* connection was closed. */
+static int _nhttp_loop_discard(struct _nhttp_loop *l, struct _nhttp_conn *c) {
+  switch (_nhttp_server_discard(&c->body, c->bufr, 1)) {
+  case 0:
+    c->state = NHTTP_CONN_READING;
+    return 0;
+  case 1:
+    if (c->state != NHTTP_CONN_DISCARDING) {
+      c->state = NHTTP_CONN_DISCARDING;
+      _nhttp_loop_set_phase(l, c, NHTTP_SERVER_PHASE_BODY);
+    }
+    return 1;
+  default:
+    _nhttp_loop_close(l, c);
+    return -1;
+  }
+}
+
+/* _nhttp_loop_expire runs the expired timers of the conns, and resumes */
+/* accepting once the backoff is over. Returns the number of milliseconds */
+/* until it has to be called next, or -1 if there is nothing to wait for, */
+/* for use as the epoll_wait timeout. */
+static int _nhttp_loop_expire(struct _nhttp_loop *l) {
+  long               now  = _nhttp_util_now_ms();
+  long               next = -1;
+  long               left;
+  struct epoll_event ev;
+
+  if (l->accept_paused_until) {
+    left = l->accept_paused_until - now;
+    if (left <= 0) {
+      ev.events   = EPOLLIN;
+      ev.data.ptr = &l->listenfd;
+      epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->listenfd, &ev);
+      l->accept_paused_until = 0;
+      if (l->spare_fd == -1)
+        l->spare_fd = _nhttp_util_open_spare_fd();
+    } else {
+      next = left;
+    }
+  }
+
+  _nhttp_timer_advance(&l->timers, now);
+  left = _nhttp_timer_next(&l->timers);
+  if (left != -1 && (next == -1 || left < next))
+    next = left;
+  return (int)next;
+}
+
+/* _nhttp_loop_drain stops accepting, and closes the conns which are idle */
+/* after a response, or discarding the rest of a body after it. The others */
+/* are closed once their response has been flushed, including the fresh */
+/* ones, whose first request may be in flight. */
+static void _nhttp_loop_drain(struct _nhttp_loop *l) {
+  struct _nhttp_conn *c, *next;
+
+  l->draining = 1;
+  if (l->listenfd != -1 && !l->accept_paused_until)
+    epoll_ctl(l->epfd, EPOLL_CTL_DEL, l->listenfd, NULL);
+  l->accept_paused_until = 0;
+  for (c = l->conns; c != NULL; c = next) {
+    next = c->next;
+    if ((c->state == NHTTP_CONN_READING &&
+         c->phase == NHTTP_SERVER_PHASE_IDLE && c->requests > 0) ||
+        c->state == NHTTP_CONN_DISCARDING)
+      _nhttp_loop_close(l, c);
+  }
+}
+
+static void _nhttp_loop_close(struct _nhttp_loop *l, struct _nhttp_conn *c) {
+  if (c->prev != NULL)
+    c->prev->next = c->next;
+  else
+    l->conns = c->next;
+  if (c->next != NULL)
+    c->next->prev = c->prev;
+  /* closing the fd also removes it from the epoll interest list */
+  _nhttp_timer_remove(&l->timers, &c->timer);
+  close(c->fd);
+  _nhttp_conn_free(c);
+}
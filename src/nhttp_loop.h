@@ -0,0 +1,105 @@
+#ifndef NHTTP_LOOP_H
+#define NHTTP_LOOP_H
+
+#include "nhttp_codel.h"
+#include "nhttp_queue.h"
+#include "nhttp_server.h"
+#include "nhttp_timer.h"
+#include "nhttp_util.h"
+
+#define NHTTP_LOOP_MAX_EVENTS 256
+
+/* nhttp event loop serves all connections of a server from a single thread, */
+/* using epoll(7) and non-blocking sockets. Every connection carries its own */
+/* state, which is advanced whenever its socket becomes ready: */
+/* 1: NHTTP_CONN_READING - bytes are read into the conn's buffered reader */
+/*    until the whole request head (request line and headers) is buffered. */
+/*    The head therefore has to fit in NHTTP_UTIL_BUF_READER_SIZE bytes. */
+/* 2: the request is handled, the handler writes the response into the */
+/*    conn's buffered writer. Pipelined requests whose heads were read */
+/*    along with it are handled right after, so that all of the responses */
+/*    get flushed together (see `_nhttp_server_handle_pipeline`). */
+/* 3: NHTTP_CONN_WRITING - the response is flushed as the socket becomes */
+/*    writable, after which the connection is either closed, or goes back */
+/*    to NHTTP_CONN_READING if it is kept alive. A request head that was */
+/*    already buffered along with the previous one is handled right away. */
+/* 4: NHTTP_CONN_DISCARDING - if the handler did not read the whole body, */
+/*    and it hadn't been received along with the head, the rest of it is */
+/*    read and discarded as it arrives once the response has been sent, */
+/*    before going back to NHTTP_CONN_READING. */
+/* Every connection has a single timer on the loop's timer wheel, set to */
+/* the deadline of the phase of the request it is in (idle, request line, */
+/* headers, body, handler, write, see `struct nhttp_server_timeouts`), which */
+/* closes the connection once it expires. */
+/* With load shedding enabled, step 2 is preceded by admission control: */
+/* the time the request has been ready and waiting for the loop (or in the */
+/* inbox) is fed to `_nhttp_codel_admit`, and shed requests are answered */
+/* with a 503 right away. */
+/* In async mode (`nhttp_server_set_async`) step 2 runs in a coroutine, */
+/* as it does for a request whose body has yet to be received otherwise */
+/* (see `_nhttp_server_awaits_body`), so that reading it never blocks the */
+/* loop. */
+/* When a handler awaits an fd or a timer, the coroutine yields back to the */
+/* loop and the conn is NHTTP_CONN_SUSPENDED until the fd becomes ready or */
+/* the timeout expires, while the loop keeps serving other connections. */
+/* A handler that exceeds the handler timeout gets its waits failed, and */
+/* its connection is closed once it returns. */
+/* A slow client therefore only ever occupies its own connection state, */
+/* instead of blocking the whole server. */
+
+enum _nhttp_conn_state {
+  NHTTP_CONN_READING,
+  NHTTP_CONN_WRITING,
+  NHTTP_CONN_DISCARDING,
+  NHTTP_CONN_SUSPENDED
+};
+
+struct _nhttp_conn {
+  int                       fd;
+  enum _nhttp_conn_state    state;
+  struct _nhttp_buf_reader *bufr;
+  struct _nhttp_buf_writer *bufw;
+  struct _nhttp_parser      parser; /* of the next request head */
+  struct _nhttp_server_body body;   /* of the last request */
+  int                       requests;  /* number of requests served */
+  int                       keepalive; /* keep open after the response */
+  struct _nhttp_loop       *loop;
+  struct _nhttp_coro       *coro; /* running handlers, see above */
+  enum _nhttp_server_phase  phase;
+  struct _nhttp_timer       timer; /* deadline of the phase, or of a wait */
+  long handler_deadline; /* ms, 0 if the handler has no timeout */
+  long ready_since; /* ms, since when a request waits for the loop, or 0 */
+  struct _nhttp_conn *prev, *next; /* in the loop's list of conns */
+};
+
+struct _nhttp_loop {
+  struct nhttp_server *s;
+  int                  epfd;
+  int                  listenfd; /* -1 if the loop doesn't accept by itself */
+  struct _nhttp_queue *inbox;    /* conns handed over by another thread */
+  struct _nhttp_timer_wheel timers;
+  struct _nhttp_codel       codel;    /* if load shedding is enabled */
+  long                      ready_at; /* ms, since when the events of the */
+                                      /* last epoll_wait are pending, at most */
+  int                  spare_fd; /* see `_nhttp_util_accept` */
+  long                 accept_paused_until; /* ms, 0 if accepting */
+  struct _nhttp_conn  *conns;    /* all of the open conns */
+  int                  draining; /* after an upgrade, see `nhttp_upgrade.h` */
+};
+
+/* _nhttp_loop_run runs the event loop, accepting connections on the */
+/* passed listening socket (which gets switched to non-blocking mode), */
+/* and/or taking over non-blocking connections pushed into the `inbox` */
+/* queue by another thread. Pass -1 as `listenfd` or NULL as `inbox` to */
+/* disable either. */
+/* All the state of the loop is owned by the calling thread, the server is */
+/* only read from. */
+/* Once the process drains after an upgrade, the loop stops accepting, */
+/* closes its idle conns, and returns once the others have been closed */
+/* after their last response. A loop with a listening socket in the */
+/* process which owns it also starts the upgrade, see `nhttp_upgrade.h`. */
+/* Never returns otherwise, panics if the event loop could not be set up. */
+void _nhttp_loop_run(struct nhttp_server *s, int listenfd,
+                     struct _nhttp_queue *inbox);
+
+#endif /* NHTTP_LOOP_H */
@@ -98,7 +98,8 @@ void _nhttp_map_free(struct _nhttp_map *map) {
   free(map);
 }
 
-void _nhttp_map_write_as_http_header(struct _nhttp_map *map, int fd) {
+void _nhttp_map_write_as_http_header(struct _nhttp_map        *map,
+                                     struct _nhttp_buf_writer *w) {
   /* NOTE: RFC 1945: HTTP-header = field-name ":" [ field-value ] CRLF */
   char buf[NHTTP_MAP_KEY_SIZE + NHTTP_MAP_VALUE_SIZE + 4]; /* 4 -> */
   /* ":" + CRLF + '\0' */
@@ -109,43 +110,11 @@ void _nhttp_map_write_as_http_header(struct _nhttp_map *map, int fd) {
     for (loc = map->bins[bin]; loc != NULL; loc = loc->next) {
       bzero(buf, NHTTP_MAP_KEY_SIZE + NHTTP_MAP_VALUE_SIZE + 4);
       sprintf(buf, "%s:%s\r\n", loc->key, loc->val);
-      _nhttp_util_write_all(fd, buf, strlen(buf));
+      _nhttp_util_buf_write(w, buf, strlen(buf));
     }
   }
 }
 
-struct _nhttp_map *
-_nhttp_map_create_from_http_headers(struct _nhttp_buf_reader *br) {
-  struct _nhttp_map *m                             = _nhttp_map_create();
-  char               line[NHTTP_SERVER_LINE_SIZE]  = {0};
-  char               key[NHTTP_SERVER_LINE_SIZE]   = {0};
-  char               value[NHTTP_SERVER_LINE_SIZE] = {0};
-
-  while (1) {
-    memset(line, 0, NHTTP_SERVER_LINE_SIZE);
-    memset(key, 0, NHTTP_SERVER_LINE_SIZE);
-    memset(value, 0, NHTTP_SERVER_LINE_SIZE);
-
-    if (_nhttp_util_buf_read_until_crlf(br, line, NHTTP_SERVER_LINE_SIZE - 1) ==
-        -1) {
-      _nhttp_map_free(m);
-      return NULL;
-    }
-
-    /* break condition = empty line (CRLF) --> start of req body is next */
-    if (strlen(line) <= 2) {
-      return m;
-    }
-
-    sscanf(line, "%[^:]: %[^\r]\r\n", key, value); /* also strips leading */
-                                                   /* whitespace from value */
-
-    _nhttp_map_set(m, key, value);
-  }
-
-  return m;
-}
-
 /* TODO(sbrki): rewrite this more elegantly */
 /* Also, in current impl. empty keys are undefined behaviour, but don't */
 /* cause segfaults. For example, foo= and foo=&bar=2 have different outcomes, */
@@ -160,14 +129,7 @@ struct _nhttp_map *_nhttp_map_create_from_urlencoded(char *str) {
   char               val[NHTTP_SERVER_LINE_SIZE] = {0};
   char              *kp                          = key;
   char              *vp                          = val;
-  char              *unesc_key;
-  char              *unesc_val;
-
-  if (_nhttp_util_str_triplets_validate(str)) {
-    _nhttp_map_free(m);
-    return NULL;
-  }
-  _nhttp_util_str_triplets_to_upper(str);
+  ssize_t            key_len, val_len;
 
   for (i = 0; i < len; i++) {
     if (mode == 0) {
@@ -187,25 +149,22 @@ struct _nhttp_map *_nhttp_map_create_from_urlencoded(char *str) {
         }
         /* save k,v pair, cleanup */
 
-        /* unescape hex triplets */
-        unesc_key = _nhttp_util_str_unescape(key);
-        unesc_val = _nhttp_util_str_unescape(val);
+        /* unescape hex triplets in place, validating them */
+        key_len = _nhttp_util_url_decode(key, key, (size_t)(kp - key));
+        val_len = _nhttp_util_url_decode(val, val, strlen(val));
 
         /* check lengths */
-        if ((strlen(unesc_key) + 1 > NHTTP_MAP_KEY_SIZE) ||
-            (strlen(unesc_val) + 1 > NHTTP_MAP_VALUE_SIZE)) {
-          free(unesc_key);
-          free(unesc_val);
+        if (key_len == -1 || val_len == -1 ||
+            (size_t)key_len + 1 > NHTTP_MAP_KEY_SIZE ||
+            (size_t)val_len + 1 > NHTTP_MAP_VALUE_SIZE) {
           _nhttp_map_free(m);
           return NULL;
         }
 
         /* save */
-        _nhttp_map_set(m, unesc_key, unesc_val);
+        _nhttp_map_set(m, key, val);
 
         /* cleanup */
-        free(unesc_key);
-        free(unesc_val);
         memset(key, 0, NHTTP_SERVER_LINE_SIZE);
         memset(val, 0, NHTTP_SERVER_LINE_SIZE);
         kp = key;
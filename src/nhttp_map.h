@@ -46,18 +46,9 @@ void _nhttp_map_free(struct _nhttp_map *map);
 
 /* _nhttp_map_write_as_http_header is a utility that serializes all the map */
 /* entries as response headers (HTTP/1.0 - RTF1945) and writes them to the */
-/* passed file descriptor.*/
-void _nhttp_map_write_as_http_header(struct _nhttp_map *map, int fd);
-
-/* _nhttp_map_create_from_http_headers is a utility that initializes a nhttp */
-/* map and fills it with values parsed from http headers. It reads the passed */
-/* buffered reader until it encounters empty line (inclusive), ie until it */
-/* reads two subsequent CRLF sequences, latter one representing the empty line*/
-/* Returns NULL if either line size is exceeded (NHTTP_SERVER_LINE_SIZE) */
-/* when reading from the fd, or if the request headers are malformed */
-/* (e.g. misplaced CR and/or LF octets). */
-struct _nhttp_map *
-_nhttp_map_create_from_http_headers(struct _nhttp_buf_reader *br);
+/* passed buffered writer.*/
+void _nhttp_map_write_as_http_header(struct _nhttp_map        *map,
+                                     struct _nhttp_buf_writer *w);
 
 /* _nhttp_map_create_from_urlencoded initializes a nhttp map and fills it with*/
 /* values parsed from a urlencoded string. String has to be properly escaped */
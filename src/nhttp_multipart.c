@@ -0,0 +1,340 @@
+#include "nhttp_multipart.h"
+#include <string.h>  /* memchr, memcmp, memcpy, strchr, strlen */
+#include <strings.h> /* strcasecmp, strncasecmp */
+
+/* _nhttp_multipart_token returns the length of the token at `s`. Tokens */
+/* are parsed leniently, up to whitespace, a control or a separator of */
+/* parameters. */
+static size_t _nhttp_multipart_token(const char *s) {
+  size_t n = 0;
+  while ((unsigned char)s[n] > ' ' && s[n] != 0x7f && !strchr(";=\"", s[n]))
+    n++;
+  return n;
+}
+
+/* _nhttp_multipart_param parses the parameter (`; name=value`) of a header */
+/* value at `*s`, and moves `*s` past it. Sets `*name` and `*value` to the */
+/* start of its name and value, and `*nlen` and `*vlen` to their length. */
+/* The quotes of a quoted value are excluded, and `*quoted` is set if it */
+/* had them (its escapes are kept). Returns 1, 0 at the end of the value, */
+/* and -1 if the parameter is malformed. */
+static int _nhttp_multipart_param(const char **s, const char **name,
+                                  size_t *nlen, const char **value,
+                                  size_t *vlen, int *quoted) {
+  const char *p = *s;
+
+  while (*p == ' ' || *p == '\t')
+    p++;
+  if (*p == '\0')
+    return 0;
+  if (*p++ != ';')
+    return -1;
+  while (*p == ' ' || *p == '\t')
+    p++;
+  *name = p;
+  *nlen = _nhttp_multipart_token(p);
+  p += *nlen;
+  if (*nlen == 0 || *p++ != '=')
+    return -1;
+  if ((*quoted = *p == '"')) {
+    for (*value = ++p; *p != '"'; p++) {
+      if (*p == '\0' || (*p == '\\' && *++p == '\0'))
+        return -1;
+    }
+    *vlen = (size_t)(p++ - *value);
+  } else {
+    *value = p;
+    if ((*vlen = _nhttp_multipart_token(p)) == 0)
+      return -1;
+    p += *vlen;
+  }
+  *s = p;
+  return 1;
+}
+
+/* _nhttp_multipart_bchar returns whether `c` may be part of a boundary, */
+/* per RFC 2046. Notably, CR isn't, which `_nhttp_multipart_execute` */
+/* relies on. */
+static int _nhttp_multipart_bchar(char c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+         (c >= 'A' && c <= 'Z') || (c != '\0' && strchr("'()+_,-./:=? ", c));
+}
+
+int _nhttp_multipart_boundary(char *dest, const char *content_type) {
+  const char *s = content_type, *name, *value;
+  size_t      nlen, vlen, i;
+  int         quoted, rc, found = 0;
+
+  while (*s == ' ' || *s == '\t')
+    s++;
+  if (strncasecmp(s, "multipart/form-data", 19))
+    return -1;
+  s += 19;
+  while ((rc = _nhttp_multipart_param(&s, &name, &nlen, &value, &vlen,
+                                      &quoted)) == 1) {
+    if (nlen != 8 || strncasecmp(name, "boundary", 8))
+      continue;
+    if (vlen == 0 || vlen > NHTTP_MULTIPART_MAX_BOUNDARY ||
+        value[vlen - 1] == ' ')
+      return -1;
+    for (i = 0; i < vlen; i++) {
+      if (!_nhttp_multipart_bchar(value[i]))
+        return -1;
+    }
+    memcpy(dest, value, vlen);
+    dest[vlen] = '\0';
+    found      = 1;
+  }
+  return rc == 0 && found ? 0 : -1;
+}
+
+void _nhttp_multipart_init(struct _nhttp_multipart *m, const char *boundary) {
+  size_t i;
+
+  m->state  = NHTTP_MULTIPART_PREAMBLE;
+  m->status = NHTTP_MULTIPART_AGAIN;
+  memcpy(m->delim, "\r\n--", 4);
+  m->dlen = (uint32_t)(4 + strlen(boundary));
+  memcpy(m->delim + 4, boundary, m->dlen - 4);
+  for (i = 0; i < 256; i++)
+    m->skip[i] = (uint8_t)m->dlen;
+  for (i = 0; i + 1 < m->dlen; i++)
+    m->skip[(unsigned char)m->delim[i]] = (uint8_t)(m->dlen - 1 - i);
+  /* the first delimiter may start the body, without a CRLF before it */
+  m->matched = 2;
+  m->hlen    = 0;
+  m->name = m->filename = m->content_type = NULL;
+}
+
+static int _nhttp_multipart_fail(struct _nhttp_multipart *m, size_t *used,
+                                 size_t pos, int status) {
+  m->state  = NHTTP_MULTIPART_FAILED;
+  m->status = status;
+  *used     = pos;
+  return status;
+}
+
+/* _nhttp_multipart_find returns the offset of the first delimiter in the */
+/* `n` bytes of `s`, setting `*matched` to its length. If there is none, */
+/* returns the offset of a prefix of the delimiter ending the bytes, with */
+/* `*matched` set to its length, or `n`, with `*matched` set to 0. */
+static size_t _nhttp_multipart_find(const struct _nhttp_multipart *m,
+                                    const char *s, size_t n,
+                                    uint32_t *matched) {
+  size_t      i = 0, last = m->dlen - 1;
+  const char *cr;
+
+  while (i + m->dlen <= n) {
+    if (s[i + last] == m->delim[last] && !memcmp(s + i, m->delim, last)) {
+      *matched = m->dlen;
+      return i;
+    }
+    i += m->skip[(unsigned char)s[i + last]];
+  }
+  /* the delimiter can only start with its CR, as boundaries have none */
+  while ((cr = memchr(s + i, '\r', n - i)) != NULL) {
+    i = (size_t)(cr - s);
+    if (!memcmp(cr, m->delim, n - i)) {
+      *matched = (uint32_t)(n - i);
+      return i;
+    }
+    i++;
+  }
+  *matched = 0;
+  return n;
+}
+
+/* _nhttp_multipart_disposition parses the Content-Disposition `value` of */
+/* a part, which must be "form-data" with a name, and sets the name and */
+/* file name of the part, NUL-terminated and unquoted in place. */
+static int _nhttp_multipart_disposition(struct _nhttp_multipart *m,
+                                        char                    *value) {
+  const char *s, *name, *pvalue, *param[2];
+  size_t      nlen, vlen, plen[2], i, j;
+  int         quoted, rc, pquoted[2];
+  char       *v;
+
+  if (_nhttp_multipart_token(value) != 9 ||
+      strncasecmp(value, "form-data", 9))
+    return -1;
+  s        = value + 9;
+  param[0] = param[1] = NULL;
+  while ((rc = _nhttp_multipart_param(&s, &name, &nlen, &pvalue, &vlen,
+                                      &quoted)) == 1) {
+    if (nlen == 4 && !strncasecmp(name, "name", 4))
+      i = 0;
+    else if (nlen == 8 && !strncasecmp(name, "filename", 8))
+      i = 1;
+    else
+      continue;
+    param[i]   = pvalue;
+    plen[i]    = vlen;
+    pquoted[i] = quoted;
+  }
+  if (rc || !param[0])
+    return -1;
+  /* terminated once all parameters are parsed, as the byte after a value */
+  /* may be the ";" of the next one */
+  for (i = 0; i < 2; i++) {
+    if (!param[i])
+      continue;
+    v = (char *)param[i];
+    for (j = 0; pquoted[i] && j < plen[i]; j++) {
+      if (param[i][j] == '\\')
+        j++;
+      *v++ = param[i][j];
+    }
+    if (!pquoted[i])
+      v += plen[i];
+    *v = '\0';
+  }
+  m->name     = param[0];
+  m->filename = param[1];
+  return 0;
+}
+
+/* _nhttp_multipart_head parses the headers of a part, copied into */
+/* `m->head`. Headers other than Content-Disposition and Content-Type */
+/* are ignored. */
+static int _nhttp_multipart_head(struct _nhttp_multipart *m) {
+  char *line = m->head, *end = m->head + m->hlen - 2, *eol, *value, *p;
+
+  m->name = m->filename = m->content_type = NULL;
+  if (memchr(m->head, '\0', m->hlen))
+    return -1;
+  m->head[m->hlen] = '\0';
+  for (; line < end; line = eol + 1) {
+    eol = memchr(line, '\n', (size_t)(end - line) + 1);
+    /* lines must end with CRLF, and can't be folded */
+    if (eol == line || eol[-1] != '\r' || *line == ' ' || *line == '\t' ||
+        !(p = memchr(line, ':', (size_t)(eol - line))) || p == line)
+      return -1;
+    *p = eol[-1] = '\0';
+    for (value = p + 1; *value == ' ' || *value == '\t'; value++)
+      ;
+    for (p = eol - 1; p > value && (p[-1] == ' ' || p[-1] == '\t'); p--)
+      p[-1] = '\0';
+    if (!strcasecmp(line, "Content-Disposition")) {
+      if (_nhttp_multipart_disposition(m, value))
+        return -1;
+    } else if (!strcasecmp(line, "Content-Type")) {
+      m->content_type = value;
+    }
+  }
+  return m->name ? 0 : -1;
+}
+
+int _nhttp_multipart_execute(struct _nhttp_multipart *m, const char *buf,
+                             size_t len, size_t *used, const char **data,
+                             size_t *data_len) {
+  const char *lf;
+  size_t      i = 0, off, n;
+  uint32_t    matched;
+  int         prev;
+
+  *used = 0;
+  if (m->state == NHTTP_MULTIPART_FAILED)
+    return m->status;
+  if (m->state == NHTTP_MULTIPART_FINISHED) {
+    *used = len;
+    return NHTTP_MULTIPART_DONE;
+  }
+
+  while (i < len) {
+    switch (m->state) {
+    case NHTTP_MULTIPART_PREAMBLE:
+    case NHTTP_MULTIPART_BODY:
+      if (m->matched) {
+        /* continue the delimiter the previous piece ended with */
+        n = m->dlen - m->matched < len - i ? m->dlen - m->matched : len - i;
+        if (memcmp(buf + i, m->delim + m->matched, n)) {
+          /* it wasn't one, so the bytes matched were data */
+          n          = m->matched;
+          m->matched = 0;
+          if (m->state == NHTTP_MULTIPART_PREAMBLE)
+            break;
+          *data     = m->delim;
+          *data_len = n;
+          *used     = i;
+          return NHTTP_MULTIPART_DATA;
+        }
+        i += n;
+        if ((m->matched += (uint32_t)n) < m->dlen)
+          break;
+      } else {
+        off = i + _nhttp_multipart_find(m, buf + i, len - i, &matched);
+        if (off > i && m->state == NHTTP_MULTIPART_BODY) {
+          /* the data before the delimiter, which is parsed next time, */
+          /* or before its prefix, which is consumed */
+          *data      = buf + i;
+          *data_len  = off - i;
+          *used      = matched == m->dlen ? off : len;
+          m->matched = matched == m->dlen ? 0 : matched;
+          return NHTTP_MULTIPART_DATA;
+        }
+        if (matched < m->dlen) {
+          m->matched = matched;
+          i          = len;
+          break;
+        }
+        i = off + m->dlen;
+      }
+      m->matched = 0;
+      prev       = m->state;
+      m->state   = NHTTP_MULTIPART_AFTER;
+      if (prev == NHTTP_MULTIPART_BODY) {
+        *used = i;
+        return NHTTP_MULTIPART_PART_END;
+      }
+      break;
+    case NHTTP_MULTIPART_AFTER:
+    case NHTTP_MULTIPART_PADDING:
+      if (buf[i] == '-' && m->state == NHTTP_MULTIPART_AFTER) {
+        m->state = NHTTP_MULTIPART_CLOSE;
+      } else if (buf[i] == '\r') {
+        m->state = NHTTP_MULTIPART_DELIM_LF;
+      } else if (buf[i] == ' ' || buf[i] == '\t') {
+        m->state = NHTTP_MULTIPART_PADDING;
+      } else {
+        return _nhttp_multipart_fail(m, used, i, NHTTP_MULTIPART_INVALID);
+      }
+      i++;
+      break;
+    case NHTTP_MULTIPART_CLOSE:
+      if (buf[i] != '-')
+        return _nhttp_multipart_fail(m, used, i, NHTTP_MULTIPART_INVALID);
+      m->state = NHTTP_MULTIPART_FINISHED;
+      *used    = len;
+      return NHTTP_MULTIPART_DONE;
+    case NHTTP_MULTIPART_DELIM_LF:
+      if (buf[i] != '\n')
+        return _nhttp_multipart_fail(m, used, i, NHTTP_MULTIPART_INVALID);
+      m->state = NHTTP_MULTIPART_HEAD;
+      m->hlen  = 0;
+      i++;
+      break;
+    case NHTTP_MULTIPART_HEAD:
+      /* copied a line at a time, up to the empty one */
+      lf = memchr(buf + i, '\n', len - i);
+      n  = lf ? (size_t)(lf - buf) + 1 - i : len - i;
+      if (m->hlen + n > NHTTP_MULTIPART_MAX_HEAD)
+        return _nhttp_multipart_fail(m, used, i, NHTTP_MULTIPART_TOO_LARGE);
+      memcpy(m->head + m->hlen, buf + i, n);
+      m->hlen += (uint32_t)n;
+      i += n;
+      if (!lf || !(m->hlen == 2 ? !memcmp(m->head, "\r\n", 2)
+                                : m->hlen >= 4 && !memcmp(m->head + m->hlen - 4,
+                                                          "\r\n\r\n", 4)))
+        break;
+      if (_nhttp_multipart_head(m))
+        return _nhttp_multipart_fail(m, used, i, NHTTP_MULTIPART_INVALID);
+      m->state = NHTTP_MULTIPART_BODY;
+      *used    = i;
+      return NHTTP_MULTIPART_PART;
+    default:
+      return _nhttp_multipart_fail(m, used, i, NHTTP_MULTIPART_INVALID);
+    }
+  }
+  *used = len;
+  return NHTTP_MULTIPART_AGAIN;
+}
@@ -0,0 +1,91 @@
+#ifndef NHTTP_MULTIPART_H
+#define NHTTP_MULTIPART_H
+
+#include <stdint.h>    /* uint8_t, uint32_t */
+#include <sys/types.h> /* size_t, */
+
+/* nhttp multipart is an incremental parser of "multipart/form-data" bodies */
+/* (RFC 7578). Like `nhttp_chunked`, it is fed consecutive pieces of the */
+/* body and never reads by itself, but it needs no bytes to be fed again: */
+/* part data is returned as pointers into the fed bytes, and a delimiter */
+/* split between two pieces is carried over by counting the bytes of it */
+/* matched so far, which are known to be a prefix of the delimiter. Only */
+/* the headers of the current part are copied, into a buffer of fixed */
+/* size, so the memory used is the same for any size of body. */
+/* Delimiters are found with the Boyer-Moore-Horspool algorithm, which */
+/* skips over most data bytes without looking at them. */
+
+/* longest boundary allowed by RFC 2046 */
+#define NHTTP_MULTIPART_MAX_BOUNDARY 70
+
+/* headers of a part (including their CRLFs) longer than this are rejected */
+#define NHTTP_MULTIPART_MAX_HEAD 4096
+
+/* statuses returned by `_nhttp_multipart_execute` */
+#define NHTTP_MULTIPART_DONE 0
+#define NHTTP_MULTIPART_AGAIN 1
+#define NHTTP_MULTIPART_DATA 2
+#define NHTTP_MULTIPART_PART 3
+#define NHTTP_MULTIPART_PART_END 4
+#define NHTTP_MULTIPART_INVALID -1
+#define NHTTP_MULTIPART_TOO_LARGE -2
+
+enum _nhttp_multipart_state {
+  NHTTP_MULTIPART_PREAMBLE, /* discarding bytes up to the first delimiter */
+  NHTTP_MULTIPART_AFTER,    /* after a delimiter */
+  NHTTP_MULTIPART_PADDING,  /* skipping whitespace after a delimiter */
+  NHTTP_MULTIPART_DELIM_LF,
+  NHTTP_MULTIPART_CLOSE,    /* after the first dash of the close delimiter */
+  NHTTP_MULTIPART_HEAD,     /* copying the headers of a part */
+  NHTTP_MULTIPART_BODY,     /* returning the data of a part */
+  NHTTP_MULTIPART_FINISHED, /* discarding the epilogue */
+  NHTTP_MULTIPART_FAILED
+};
+
+struct _nhttp_multipart {
+  enum _nhttp_multipart_state state;
+  int                         status; /* of a failed body */
+  /* "\r\n--" and the boundary, and its length */
+  char                        delim[4 + NHTTP_MULTIPART_MAX_BOUNDARY];
+  uint32_t                    dlen;
+  /* Horspool shifts by the byte at the end of the compared window */
+  uint8_t                     skip[256];
+  /* bytes of the delimiter matched at the end of the previous piece */
+  uint32_t                    matched;
+  char                        head[NHTTP_MULTIPART_MAX_HEAD + 1];
+  uint32_t                    hlen;
+  /* of the current part, NUL-terminated strings in `head`, NULL if the */
+  /* part doesn't have them */
+  const char                 *name, *filename, *content_type;
+};
+
+/* _nhttp_multipart_boundary copies the boundary parameter of the */
+/* `content_type` of a request into `dest`, which must have room for */
+/* NHTTP_MULTIPART_MAX_BOUNDARY + 1 bytes. Returns 0, or -1 if the type */
+/* isn't multipart/form-data or the boundary is missing or invalid. */
+int _nhttp_multipart_boundary(char *dest, const char *content_type);
+
+/* _nhttp_multipart_init prepares the parser for a new body, delimited by */
+/* the NUL-terminated `boundary`, which must be valid (see */
+/* `_nhttp_multipart_boundary`). */
+void _nhttp_multipart_init(struct _nhttp_multipart *m, const char *boundary);
+
+/* _nhttp_multipart_execute parses the `len` bytes of `buf`, which follow */
+/* the bytes passed to the previous calls, and sets `*used` to the number */
+/* of them consumed. Returns NHTTP_MULTIPART_PART once the headers of a */
+/* part have been parsed, with `m->name`, `m->filename` and */
+/* `m->content_type` set from them (they stay valid until the next part), */
+/* NHTTP_MULTIPART_DATA with `*data` and `*data_len` set to data of the */
+/* part (which aren't necessarily within `buf`), NHTTP_MULTIPART_PART_END */
+/* after the last data of the part, NHTTP_MULTIPART_AGAIN once all of */
+/* `buf` has been consumed without any of these, NHTTP_MULTIPART_DONE once */
+/* the close delimiter has been parsed (after which the bytes fed, the */
+/* epilogue, are consumed and ignored), NHTTP_MULTIPART_INVALID if the */
+/* body is malformed, and NHTTP_MULTIPART_TOO_LARGE if the headers of a */
+/* part are too long. Once failed, further calls return the same status */
+/* without consuming anything. */
+int _nhttp_multipart_execute(struct _nhttp_multipart *m, const char *buf,
+                             size_t len, size_t *used, const char **data,
+                             size_t *data_len);
+
+#endif /* NHTTP_MULTIPART_H */
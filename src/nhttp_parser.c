@@ -0,0 +1,214 @@
+#include "nhttp_parser.h"
+#include "nhttp_simd.h"
+#include <string.h>  /* memset, memcmp */
+#include <strings.h> /* strncasecmp */
+
+/* token characters of method and header names, per RFC 7230 3.2.6 */
+static const unsigned char _nhttp_parser_tchar[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+/* names of the known headers, in the order of `enum _nhttp_header_id` */
+static const struct {
+  const char *name;
+  size_t      len;
+} _nhttp_parser_known[NHTTP_HEADER_KNOWN] = {
+    {"Accept", 6},
+    {"Accept-Encoding", 15},
+    {"Authorization", 13},
+    {"Connection", 10},
+    {"Content-Length", 14},
+    {"Content-Type", 12},
+    {"Cookie", 6},
+    {"Expect", 6},
+    {"Host", 4},
+    {"If-Modified-Since", 17},
+    {"If-None-Match", 13},
+    {"If-Range", 8},
+    {"Range", 5},
+    {"Transfer-Encoding", 17},
+    {"Upgrade", 7},
+    {"User-Agent", 10},
+};
+
+enum _nhttp_header_id _nhttp_parser_header_id(const char *name, size_t len) {
+  int i;
+  for (i = 0; i < NHTTP_HEADER_KNOWN; i++) {
+    if (_nhttp_parser_known[i].len == len &&
+        !strncasecmp(_nhttp_parser_known[i].name, name, len))
+      return (enum _nhttp_header_id)i;
+  }
+  return NHTTP_HEADER_OTHER;
+}
+
+void _nhttp_parser_init(struct _nhttp_parser *p) {
+  p->state    = NHTTP_PARSER_START;
+  p->status   = NHTTP_PARSER_AGAIN;
+  p->pos      = 0;
+  p->mark     = 0;
+  p->nheaders = 0;
+  memset(&p->method, 0, sizeof(struct _nhttp_parser_slice));
+  memset(&p->target, 0, sizeof(struct _nhttp_parser_slice));
+  memset(&p->version, 0, sizeof(struct _nhttp_parser_slice));
+}
+
+static int _nhttp_parser_fail(struct _nhttp_parser *p, uint32_t pos,
+                              int status) {
+  p->state  = NHTTP_PARSER_FAILED;
+  p->status = status;
+  p->pos    = pos;
+  return status;
+}
+
+/* _nhttp_parser_slice_to sets the slice to [from, to) */
+static void _nhttp_parser_slice_to(struct _nhttp_parser_slice *s,
+                                   uint32_t from, uint32_t to) {
+  s->off = from;
+  s->len = to - from;
+}
+
+/* _nhttp_parser_valid_version checks for "HTTP/" DIGIT "." DIGIT */
+static int _nhttp_parser_valid_version(const unsigned char *v, uint32_t len) {
+  return len == 8 && !memcmp(v, "HTTP/", 5) && v[5] >= '0' && v[5] <= '9' &&
+         v[6] == '.' && v[7] >= '0' && v[7] <= '9';
+}
+
+int _nhttp_parser_execute(struct _nhttp_parser *p, const char *buf,
+                          size_t len) {
+  const unsigned char         *s = (const unsigned char *)buf;
+  struct _nhttp_parser_header *h = &p->headers[p->nheaders];
+  uint32_t                     i, end, n = (uint32_t)len;
+  unsigned char                c;
+
+  if (p->state == NHTTP_PARSER_FINISHED || p->state == NHTTP_PARSER_FAILED)
+    return p->status;
+
+  for (i = p->pos; i < n; i++) {
+    c = s[i];
+    switch (p->state) {
+    case NHTTP_PARSER_START:
+      if (c == '\r' || c == '\n')
+        break;
+      if (!_nhttp_parser_tchar[c])
+        return _nhttp_parser_fail(p, i, NHTTP_PARSER_INVALID);
+      p->mark  = i;
+      p->state = NHTTP_PARSER_METHOD;
+      break;
+    case NHTTP_PARSER_METHOD:
+      while (i < n && _nhttp_parser_tchar[s[i]])
+        i++;
+      if (i == n)
+        break;
+      if (s[i] != ' ')
+        return _nhttp_parser_fail(p, i, NHTTP_PARSER_INVALID);
+      _nhttp_parser_slice_to(&p->method, p->mark, i);
+      p->mark  = i + 1;
+      p->state = NHTTP_PARSER_TARGET;
+      break;
+    case NHTTP_PARSER_TARGET:
+      /* skip to the space ending the target */
+      i += (uint32_t)_nhttp_simd_find_ctl(buf + i, n - i, ' ');
+      if (i == n)
+        break;
+      c = s[i];
+      if (c == ' ' && i > p->mark) {
+        _nhttp_parser_slice_to(&p->target, p->mark, i);
+        p->mark  = i + 1;
+        p->state = NHTTP_PARSER_VERSION;
+      } else if (c <= ' ' || c == 0x7f) {
+        return _nhttp_parser_fail(p, i, NHTTP_PARSER_INVALID);
+      }
+      break;
+    case NHTTP_PARSER_VERSION:
+      if (c == '\r') {
+        _nhttp_parser_slice_to(&p->version, p->mark, i);
+        if (!_nhttp_parser_valid_version(s + p->mark, p->version.len))
+          return _nhttp_parser_fail(p, i, NHTTP_PARSER_INVALID);
+        p->state = NHTTP_PARSER_LINE_LF;
+      } else if (c <= ' ' || c >= 0x7f) {
+        return _nhttp_parser_fail(p, i, NHTTP_PARSER_INVALID);
+      }
+      break;
+    case NHTTP_PARSER_LINE_LF:
+    case NHTTP_PARSER_VALUE_LF:
+      if (c != '\n')
+        return _nhttp_parser_fail(p, i, NHTTP_PARSER_INVALID);
+      p->state = NHTTP_PARSER_FIELD;
+      break;
+    case NHTTP_PARSER_FIELD:
+      if (c == '\r') {
+        p->state = NHTTP_PARSER_HEAD_LF;
+        break;
+      }
+      /* also rejects obsolete line folding, which starts with whitespace */
+      if (!_nhttp_parser_tchar[c])
+        return _nhttp_parser_fail(p, i, NHTTP_PARSER_INVALID);
+      if (p->nheaders == NHTTP_PARSER_MAX_HEADERS)
+        return _nhttp_parser_fail(p, i, NHTTP_PARSER_TOO_MANY_HEADERS);
+      p->mark  = i;
+      p->state = NHTTP_PARSER_NAME;
+      break;
+    case NHTTP_PARSER_NAME:
+      while (i < n && _nhttp_parser_tchar[s[i]])
+        i++;
+      if (i == n)
+        break;
+      if (s[i] != ':')
+        return _nhttp_parser_fail(p, i, NHTTP_PARSER_INVALID);
+      _nhttp_parser_slice_to(&h->name, p->mark, i);
+      h->id    = _nhttp_parser_header_id(buf + p->mark, h->name.len);
+      p->state = NHTTP_PARSER_VALUE_WS;
+      break;
+    case NHTTP_PARSER_VALUE_WS:
+      if (c == ' ' || c == '\t')
+        break;
+      p->mark  = i;
+      p->state = NHTTP_PARSER_VALUE;
+      /* fall through */
+    case NHTTP_PARSER_VALUE:
+      /* skip to the CR ending the value (or a tab, or an invalid byte) */
+      i += (uint32_t)_nhttp_simd_find_ctl(buf + i, n - i, 0x1f);
+      if (i == n)
+        break;
+      c = s[i];
+      if (c == '\r') {
+        /* trailing whitespace is not part of the value */
+        end = i;
+        while (end > p->mark && (s[end - 1] == ' ' || s[end - 1] == '\t'))
+          end--;
+        _nhttp_parser_slice_to(&h->value, p->mark, end);
+        h = &p->headers[++p->nheaders];
+        p->state = NHTTP_PARSER_VALUE_LF;
+      } else if (c != '\t') {
+        return _nhttp_parser_fail(p, i, NHTTP_PARSER_INVALID);
+      }
+      break;
+    case NHTTP_PARSER_HEAD_LF:
+      if (c != '\n')
+        return _nhttp_parser_fail(p, i, NHTTP_PARSER_INVALID);
+      p->state  = NHTTP_PARSER_FINISHED;
+      p->status = NHTTP_PARSER_DONE;
+      p->pos    = i + 1;
+      return NHTTP_PARSER_DONE;
+    default:
+      return _nhttp_parser_fail(p, i, NHTTP_PARSER_INVALID);
+    }
+  }
+  p->pos = n;
+  return NHTTP_PARSER_AGAIN;
+}
@@ -0,0 +1,113 @@
+#ifndef NHTTP_PARSER_H
+#define NHTTP_PARSER_H
+
+#include <stdint.h>    /* uint32_t, */
+#include <sys/types.h> /* size_t, */
+
+/* nhttp parser is an incremental parser of HTTP/1.x request heads (the */
+/* request line and the headers, up to the empty line). It never reads or */
+/* blocks by itself: it is fed the bytes of the head received so far, */
+/* and either finishes or asks for more, in which case it is called again */
+/* once more bytes have been appended, resuming where it left off instead */
+/* of scanning the head again. */
+/* The parsed elements are slices, i.e. offsets relative to the start of */
+/* the fed bytes, so they remain valid when the buffer holding the head is */
+/* moved (e.g. compacted by `_nhttp_util_buf_reader_fill`), and nothing is */
+/* copied while parsing. Targets and header values, the bulk of a head, */
+/* are skipped over with the vectorized scanners of `nhttp_simd.h`, and */
+/* common headers are recognized as their names are parsed. */
+/* Lines must end with CR LF, and obsolete line folding is rejected, as */
+/* lenient parsing of line ends is a source of request smuggling. Empty */
+/* lines before the request line are skipped, per RFC 7230 3.5. */
+
+/* headers in a request head beyond this are rejected */
+#define NHTTP_PARSER_MAX_HEADERS 64
+
+/* statuses returned by `_nhttp_parser_execute` */
+#define NHTTP_PARSER_DONE 0
+#define NHTTP_PARSER_AGAIN 1
+#define NHTTP_PARSER_INVALID -1
+#define NHTTP_PARSER_TOO_MANY_HEADERS -2
+
+/* headers recognized while parsing, which are looked up by their id */
+/* instead of by name */
+enum _nhttp_header_id {
+  NHTTP_HEADER_ACCEPT,
+  NHTTP_HEADER_ACCEPT_ENCODING,
+  NHTTP_HEADER_AUTHORIZATION,
+  NHTTP_HEADER_CONNECTION,
+  NHTTP_HEADER_CONTENT_LENGTH,
+  NHTTP_HEADER_CONTENT_TYPE,
+  NHTTP_HEADER_COOKIE,
+  NHTTP_HEADER_EXPECT,
+  NHTTP_HEADER_HOST,
+  NHTTP_HEADER_IF_MODIFIED_SINCE,
+  NHTTP_HEADER_IF_NONE_MATCH,
+  NHTTP_HEADER_IF_RANGE,
+  NHTTP_HEADER_RANGE,
+  NHTTP_HEADER_TRANSFER_ENCODING,
+  NHTTP_HEADER_UPGRADE,
+  NHTTP_HEADER_USER_AGENT,
+  NHTTP_HEADER_KNOWN, /* the number of known headers */
+  NHTTP_HEADER_OTHER = NHTTP_HEADER_KNOWN
+};
+
+/* states, in the order in which they are passed */
+enum _nhttp_parser_state {
+  NHTTP_PARSER_START, /* skipping empty lines before the request line */
+  NHTTP_PARSER_METHOD,
+  NHTTP_PARSER_TARGET,
+  NHTTP_PARSER_VERSION,
+  NHTTP_PARSER_LINE_LF,    /* after the CR of the request line */
+  NHTTP_PARSER_FIELD,      /* at the start of a header line */
+  NHTTP_PARSER_NAME,
+  NHTTP_PARSER_VALUE_WS,   /* skipping whitespace before the value */
+  NHTTP_PARSER_VALUE,
+  NHTTP_PARSER_VALUE_LF,   /* after the CR of a header line */
+  NHTTP_PARSER_HEAD_LF,    /* after the CR of the empty line */
+  NHTTP_PARSER_FINISHED,   /* the whole head has been parsed */
+  NHTTP_PARSER_FAILED      /* the head is malformed */
+};
+
+/* _nhttp_parser_slice is a part of the parsed head, `len` bytes starting */
+/* `off` bytes after the start of the fed bytes. */
+struct _nhttp_parser_slice {
+  uint32_t off, len;
+};
+
+struct _nhttp_parser_header {
+  struct _nhttp_parser_slice name;
+  struct _nhttp_parser_slice value; /* without surrounding whitespace */
+  enum _nhttp_header_id      id;
+};
+
+struct _nhttp_parser {
+  enum _nhttp_parser_state    state;
+  int                         status; /* of a finished or failed parse */
+  uint32_t                    pos;    /* number of bytes parsed */
+  uint32_t                    mark;   /* start of the current element */
+  struct _nhttp_parser_slice  method, target, version;
+  struct _nhttp_parser_header headers[NHTTP_PARSER_MAX_HEADERS];
+  int                         nheaders;
+};
+
+/* _nhttp_parser_init prepares the parser for a new request head. */
+void _nhttp_parser_init(struct _nhttp_parser *p);
+
+/* _nhttp_parser_execute parses the `len` bytes of `buf`, which hold the */
+/* request head received so far (starting with the bytes passed to the */
+/* previous calls, which are not parsed again). Returns NHTTP_PARSER_DONE */
+/* once the head has been parsed, with `p->pos` set to its length, */
+/* NHTTP_PARSER_AGAIN if the head is incomplete, NHTTP_PARSER_INVALID if it */
+/* is malformed, and NHTTP_PARSER_TOO_MANY_HEADERS if it has more than */
+/* NHTTP_PARSER_MAX_HEADERS headers. Once done or failed, further calls */
+/* return the same status until the parser is initialized again. */
+int _nhttp_parser_execute(struct _nhttp_parser *p, const char *buf,
+                          size_t len);
+
+/* _nhttp_parser_header_id returns the id of the header named by the `len` */
+/* bytes of `name`, compared case-insensitively, or NHTTP_HEADER_OTHER if */
+/* it is not a known header. */
+enum _nhttp_header_id _nhttp_parser_header_id(const char *name, size_t len);
+
+#endif /* NHTTP_PARSER_H */
@@ -0,0 +1,77 @@
+#include "nhttp_queue.h"
+#include "nhttp_util.h"
+#include <errno.h>       /* errno, */
+#include <poll.h>        /* poll, */
+#include <stdlib.h>      /* malloc, free */
+#include <string.h>      /* memset, strerror */
+#include <sys/eventfd.h> /* eventfd, */
+#include <unistd.h>      /* read, write, close */
+
+struct _nhttp_queue *_nhttp_queue_create(void) {
+  struct _nhttp_queue *q = malloc(sizeof(struct _nhttp_queue));
+  memset(q, 0, sizeof(struct _nhttp_queue));
+  if ((q->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+    _nhttp_panicf("could not create eventfd: %s", strerror(errno));
+  }
+  return q;
+}
+
+void _nhttp_queue_free(struct _nhttp_queue *q) {
+  close(q->wakefd);
+  free(q);
+}
+
+int _nhttp_queue_push(struct _nhttp_queue *q, int fd) {
+  uint32_t tail = q->tail; /* only the producer writes tail */
+  uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+  if (tail - head == NHTTP_QUEUE_SIZE) {
+    return -1;
+  }
+  q->fds[tail & (NHTTP_QUEUE_SIZE - 1)]       = fd;
+  q->pushed_at[tail & (NHTTP_QUEUE_SIZE - 1)] = _nhttp_util_now_ms();
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+  _nhttp_queue_wake(q);
+  return 0;
+}
+
+void _nhttp_queue_wake(struct _nhttp_queue *q) {
+  uint64_t one = 1;
+  ssize_t  written;
+  /* the write can only fail if the counter would overflow, in which case */
+  /* the consumer has a pending wakeup anyway. */
+  written = write(q->wakefd, &one, sizeof(uint64_t));
+  (void)written;
+}
+
+int _nhttp_queue_pop(struct _nhttp_queue *q) {
+  long pushed_at;
+  return _nhttp_queue_pop_timed(q, &pushed_at);
+}
+
+int _nhttp_queue_pop_timed(struct _nhttp_queue *q, long *pushed_at) {
+  int      fd;
+  uint32_t head = q->head; /* only the consumer writes head */
+  uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+  if (head == tail) {
+    return -1;
+  }
+  fd         = q->fds[head & (NHTTP_QUEUE_SIZE - 1)];
+  *pushed_at = q->pushed_at[head & (NHTTP_QUEUE_SIZE - 1)];
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return fd;
+}
+
+void _nhttp_queue_wait(struct _nhttp_queue *q) {
+  uint64_t      counter;
+  struct pollfd pfd;
+  pfd.fd     = q->wakefd;
+  pfd.events = POLLIN;
+  /* a pending wakeup (counter > 0) makes read return immediately, so a */
+  /* push that happened right before the call is never missed. */
+  while (read(q->wakefd, &counter, sizeof(uint64_t)) == -1 &&
+         (errno == EAGAIN || errno == EINTR)) {
+    poll(&pfd, 1, -1);
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef NHTTP_QUEUE_H
+#define NHTTP_QUEUE_H
+
+#include <stdint.h> /* uint32_t, */
+
+/* must be a power of two */
+#define NHTTP_QUEUE_SIZE 1024
+#define NHTTP_QUEUE_CACHE_LINE 64
+
+/* _nhttp_queue is a bounded, lock-free, single-producer single-consumer */
+/* queue of file descriptors, used to hand accepted connections from the */
+/* acceptor thread over to a worker thread. */
+/* `head` is only written by the consumer and `tail` only by the producer, */
+/* each of them being published with release semantics and read with */
+/* acquire semantics by the other side. They live on separate cache lines */
+/* to avoid false sharing between the two threads. */
+/* The consumer can sleep on `wakefd` (an eventfd), which the producer */
+/* signals after every push. Every fd is stamped with the time it was */
+/* pushed, so that the consumer can tell how long it has been waiting. */
+struct _nhttp_queue {
+  uint32_t head;
+  char     _pad1[NHTTP_QUEUE_CACHE_LINE - sizeof(uint32_t)];
+  uint32_t tail;
+  char     _pad2[NHTTP_QUEUE_CACHE_LINE - sizeof(uint32_t)];
+  int      wakefd;
+  int      fds[NHTTP_QUEUE_SIZE];
+  long     pushed_at[NHTTP_QUEUE_SIZE]; /* ms, see `_nhttp_util_now_ms` */
+};
+
+/* _nhttp_queue_create allocates an empty queue and its eventfd. */
+/* Panics if the eventfd could not be created. */
+struct _nhttp_queue *_nhttp_queue_create(void);
+
+/* _nhttp_queue_free closes the eventfd and frees the queue. */
+void _nhttp_queue_free(struct _nhttp_queue *q);
+
+/* _nhttp_queue_push appends fd to the queue and wakes up the consumer. */
+/* Must only be called from the producer thread. */
+/* Returns 0 on success, or -1 if the queue is full. */
+int _nhttp_queue_push(struct _nhttp_queue *q, int fd);
+
+/* _nhttp_queue_pop removes and returns the oldest fd in the queue. */
+/* Must only be called from the consumer thread. */
+/* Returns -1 if the queue is empty. Never blocks. */
+int _nhttp_queue_pop(struct _nhttp_queue *q);
+
+/* _nhttp_queue_pop_timed is `_nhttp_queue_pop` that also stores the time */
+/* the fd was pushed at into `pushed_at`. */
+int _nhttp_queue_pop_timed(struct _nhttp_queue *q, long *pushed_at);
+
+/* _nhttp_queue_wake wakes up the consumer without pushing anything. */
+void _nhttp_queue_wake(struct _nhttp_queue *q);
+
+/* _nhttp_queue_wait blocks the consumer until the producer signals it. */
+/* Also resets the wakeup counter, call it only when the queue is empty. */
+void _nhttp_queue_wait(struct _nhttp_queue *q);
+
+#endif /* NHTTP_QUEUE_H */
@@ -132,8 +132,7 @@ _nhttp_route_match(struct _nhttp_route_node *node, char **path,
                    enum _nhttp_req_type rt, struct _nhttp_map *vars) {
   uint32_t                         i;
   struct _nhttp_route_match_result res;
-  char                            *next_path_element, *unesc_next_path_element;
-  char                             buf[NHTTP_SERVER_LINE_SIZE + 1];
+  char                            *next_path_element;
 
   if (vars == NULL) {
     vars = _nhttp_map_create();
@@ -152,24 +151,21 @@ _nhttp_route_match(struct _nhttp_route_node *node, char **path,
   /*              as they would cause strsep to return "" for non-root paths */
   if (next_path_element != NULL && strlen(next_path_element) > 0) {
 
-    /* unescape path */
-    strcpy(buf, next_path_element);
-    if (_nhttp_util_str_triplets_validate(buf)) {
+    /* unescape path, in place as *path is a scratch copy */
+    if (_nhttp_util_url_decode(next_path_element, next_path_element,
+                               strlen(next_path_element)) == -1) {
       res.found   = -2; /* -> 404 */
       res.handler = NULL;
       res.vars    = NULL;
       _nhttp_map_free(vars);
       return res;
     }
-    _nhttp_util_str_triplets_to_upper(buf);
-    unesc_next_path_element = _nhttp_util_str_unescape(buf);
 
     /* iterate through static_children first */
     for (i = 0;
          i < NHTTP_ROUTER_MAX_CHILDREN && node->static_children[i] != NULL;
          i++) {
-      if (!strcmp(unesc_next_path_element, node->static_children[i]->name)) {
-        free(unesc_next_path_element);
+      if (!strcmp(next_path_element, node->static_children[i]->name)) {
         return _nhttp_route_match(node->static_children[i], path, rt, vars);
       }
     }
@@ -177,8 +173,7 @@ _nhttp_route_match(struct _nhttp_route_node *node, char **path,
     /* if none of the static_children matched, continue with dynamic */
     /* child, if present */
     if (node->var_child) {
-      _nhttp_map_set(vars, node->var_child->name, unesc_next_path_element);
-      free(unesc_next_path_element);
+      _nhttp_map_set(vars, node->var_child->name, next_path_element);
       return _nhttp_route_match(node->var_child, path, rt, vars);
     }
 
@@ -187,7 +182,6 @@ _nhttp_route_match(struct _nhttp_route_node *node, char **path,
     res.found   = -2; /* -> 404 */
     res.handler = NULL;
     _nhttp_map_free(vars);
-    free(unesc_next_path_element);
     return res;
   } else {
     /* at this point there is no next element in the incoming path, */
@@ -1,22 +1,42 @@
+#define _GNU_SOURCE /* mkostemp */
 #include "nhttp_server.h"
+#include "nhttp_chunked.h"
+#include "nhttp_coro.h"
+#include "nhttp_cpu.h"
+#include "nhttp_loop.h"
 #include "nhttp_map.h"
+#include "nhttp_multipart.h"
+#include "nhttp_parser.h"
 #include "nhttp_req_type.h"
 #include "nhttp_router.h"
+#include "nhttp_simd.h"
+#include "nhttp_upgrade.h"
+#include "nhttp_uring.h"
 #include "nhttp_util.h"
 #include <errno.h>
 #include <fcntl.h> /* O_* */
+#include <limits.h> /* PATH_MAX, */
+#include <arpa/inet.h> /* inet_pton, */
 #include <netinet/in.h>
+#include <netinet/tcp.h> /* TCP_* */
+#include <poll.h>       /* poll, */
 #include <signal.h>     /* signal, SIG* */
 #include <string.h>     /* memset,strerror,strlen,strcmp,strcpy */
+#include <strings.h>    /* strncasecmp, strcasecmp */
+#include <stddef.h>     /* offsetof, */
+#include <stdint.h>     /* SIZE_MAX, */
 #include <sys/socket.h> /* socket, */
+#include <sys/stat.h>   /* lstat, chmod, S_ISSOCK */
+#include <sys/time.h>   /* struct timeval, */
+#include <sys/un.h>     /* struct sockaddr_un, */
+#include <unistd.h>     /* unlink, close */
 
-#include <stdlib.h> /* malloc,strcpy, */
+#include <stdlib.h> /* malloc,mkostemp, */
 
 static void _nhttp_on_req_type(struct nhttp_server *s, const char *path,
                                nhttp_handler_func   handler,
                                enum _nhttp_req_type rt);
-static void _nhttp_server_dispatch(struct nhttp_server *s, int connfd);
-static void _nhttp_server_send_status_line(int connfd, int status_code);
+static void _nhttp_server_run_blocking(struct nhttp_server *s, int sockfd);
 static int  _nhttp_send_generic(const struct nhttp_ctx *ctx,
                                 const unsigned char *data, size_t count,
                                 const char *ctype, int status_code);
@@ -26,6 +46,8 @@ static int _nhttp_send_byte_range(const struct nhttp_ctx *ctx, const char *path,
                                   size_t filelen);
 static int _nhttp_send_file(const struct nhttp_ctx *ctx, const char *path,
                             size_t filelen);
+static int _nhttp_server_parse_length(const char *v, size_t vlen,
+                                      size_t *len);
 
 enum _nhttp_req_type _nhttp_server_parse_method(const char *method);
 
@@ -33,61 +55,420 @@ struct nhttp_server *nhttp_server_create() {
   struct nhttp_server *s = malloc(sizeof(struct nhttp_server));
   memset(s, 0, sizeof(struct nhttp_server));
   s->router_root = _nhttp_route_node_create("");
+  s->io          = NHTTP_SERVER_IO_EPOLL;
+  nhttp_server_config_init(&s->config);
+  nhttp_server_timeouts_init(&s->timeouts);
+  /* the shed response is serialized once, as it is sent under load */
+  s->shed_response = _nhttp_util_buf_writer_create(-1);
+  _nhttp_server_send_empty(s->shed_response, 503, 0);
+  s->keepalive_max_requests = NHTTP_SERVER_KEEPALIVE_MAX_REQUESTS;
+  s->keepalive_timeout_ms   = NHTTP_SERVER_KEEPALIVE_TIMEOUT_MS;
+  s->max_body_size          = NHTTP_SERVER_MAX_BODY_SIZE;
   return s;
 }
 
+void nhttp_server_set_io(struct nhttp_server *s, enum nhttp_server_io io) {
+  s->io = io;
+}
+
+void nhttp_server_config_init(struct nhttp_server_config *cfg) {
+  memset(cfg, 0, sizeof(struct nhttp_server_config));
+  cfg->bind_address = NULL;
+  cfg->backlog      = NHTTP_SERVER_BACKLOG;
+  cfg->tcp_nodelay  = 1;
+}
+
+void nhttp_server_set_config(struct nhttp_server             *s,
+                             const struct nhttp_server_config *cfg) {
+  s->config = *cfg;
+}
+
+void nhttp_server_timeouts_init(struct nhttp_server_timeouts *t) {
+  memset(t, 0, sizeof(struct nhttp_server_timeouts));
+  t->request_line_ms = NHTTP_SERVER_REQUEST_LINE_TIMEOUT_MS;
+  t->headers_ms      = NHTTP_SERVER_HEADERS_TIMEOUT_MS;
+  t->body_ms         = NHTTP_SERVER_BODY_TIMEOUT_MS;
+  t->handler_ms      = NHTTP_SERVER_HANDLER_TIMEOUT_MS;
+  t->write_ms        = NHTTP_SERVER_WRITE_TIMEOUT_MS;
+}
+
+void nhttp_server_set_timeouts(struct nhttp_server                *s,
+                               const struct nhttp_server_timeouts *t) {
+  s->timeouts = *t;
+}
+
+int _nhttp_server_parse_head(struct _nhttp_parser          *p,
+                             const struct _nhttp_buf_reader *r) {
+  return _nhttp_parser_execute(p, &(r->buf[r->head]), r->tail - r->head);
+}
+
+enum _nhttp_server_phase
+_nhttp_server_head_phase(const struct _nhttp_parser          *p,
+                         const struct _nhttp_buf_reader *r) {
+  if (r->head == r->tail)
+    return NHTTP_SERVER_PHASE_IDLE;
+  if (p->state < NHTTP_PARSER_FIELD)
+    return NHTTP_SERVER_PHASE_REQUEST_LINE;
+  return NHTTP_SERVER_PHASE_HEADERS;
+}
+
+int _nhttp_server_awaits_body(const struct _nhttp_parser     *p,
+                              const struct _nhttp_buf_reader *r) {
+  const struct _nhttp_parser_slice *clen = NULL;
+  size_t                            len;
+  int                               i;
+
+  if (p->state != NHTTP_PARSER_FINISHED)
+    return 0;
+  for (i = 0; i < p->nheaders; i++) {
+    if (p->headers[i].id == NHTTP_HEADER_TRANSFER_ENCODING)
+      return 1; /* the end of the chunks is only known once decoded */
+    if (p->headers[i].id == NHTTP_HEADER_CONTENT_LENGTH)
+      clen = &p->headers[i].value;
+  }
+  /* a malformed length gets the request rejected without reading it */
+  return clen != NULL &&
+         !_nhttp_server_parse_length(&(r->buf[r->head + clen->off]),
+                                     clen->len, &len) &&
+         len > r->tail - r->head - p->pos;
+}
+
+int _nhttp_server_phase_timeout(const struct nhttp_server *s,
+                                enum _nhttp_server_phase   phase) {
+  int ms = 0;
+  switch (phase) {
+  case NHTTP_SERVER_PHASE_IDLE:
+    ms = s->keepalive_timeout_ms;
+    break;
+  case NHTTP_SERVER_PHASE_REQUEST_LINE:
+    ms = s->timeouts.request_line_ms;
+    break;
+  case NHTTP_SERVER_PHASE_HEADERS:
+    ms = s->timeouts.headers_ms;
+    break;
+  case NHTTP_SERVER_PHASE_BODY:
+    ms = s->timeouts.body_ms;
+    break;
+  case NHTTP_SERVER_PHASE_HANDLER:
+    ms = s->timeouts.handler_ms;
+    break;
+  case NHTTP_SERVER_PHASE_WRITE:
+    ms = s->timeouts.write_ms;
+    break;
+  }
+  return ms > 0 ? ms : 0;
+}
+
+void nhttp_server_set_load_shedding(struct nhttp_server *s, int target_ms) {
+  s->shed_target_ms = target_ms > 0 ? target_ms : 0;
+}
+
+void _nhttp_server_send_shed(const struct nhttp_server *s,
+                             struct _nhttp_buf_writer  *w) {
+  _nhttp_util_buf_write(w, s->shed_response->buf, s->shed_response->len);
+}
+
+void nhttp_server_set_async(struct nhttp_server *s, int enabled) {
+  s->async = enabled;
+}
+
+void nhttp_server_set_keepalive(struct nhttp_server *s, int max_requests,
+                                int idle_timeout_ms) {
+  s->keepalive_max_requests = max_requests;
+  s->keepalive_timeout_ms   = idle_timeout_ms;
+}
+
+void nhttp_server_set_max_body_size(struct nhttp_server *s, size_t bytes) {
+  s->max_body_size = bytes;
+}
+
+void nhttp_server_set_upgrade_signal(struct nhttp_server *s, int sig) {
+  s->upgrade_signal = sig;
+}
+
+void nhttp_server_set_busy_poll(struct nhttp_server *s, int usec) {
+  s->busy_poll_us = usec > 0 ? usec : 0;
+}
+
+void nhttp_server_set_cpu_affinity(struct nhttp_server *s, const int *cpus,
+                                   int ncpus) {
+  int i;
+
+  free(s->cpus);
+  s->cpus  = NULL;
+  s->ncpus = 0;
+  if (ncpus == NHTTP_SERVER_CPUS_ALLOWED) {
+    if ((s->ncpus = _nhttp_cpu_allowed(&s->cpus)) == -1) {
+      _nhttp_panicf("could not get the allowed cpus: %s", strerror(errno));
+    }
+    return;
+  }
+  if (ncpus <= 0)
+    return;
+  s->cpus  = malloc((size_t)ncpus * sizeof(int));
+  s->ncpus = ncpus;
+  for (i = 0; i < ncpus; i++) {
+    if (cpus[i] < 0) {
+      _nhttp_panicf("invalid cpu %d", cpus[i]);
+    }
+    s->cpus[i] = cpus[i];
+  }
+}
+
 void nhttp_server_run(struct nhttp_server *s, int port) {
   /* TODO(sbrki): register sig handlers for gracefully shutting down the serv*/
 
-  int                sockfd, connfd;
-  struct sockaddr_in serv_info;
-  int                one = 1; /* for setsockopt */
+  int sockfd;
 
   /* ignore SIGPIPE which is raised when client closes the conn */
   if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
     _nhttp_panicf("could not set ignoring SIGPIPE: %s", strerror(errno));
   }
+  if (s->upgrade_signal) {
+    _nhttp_upgrade_install(s->upgrade_signal, 1);
+  }
+
+  sockfd = _nhttp_server_listen(s, port, 0);
+  _nhttp_upgrade_close_inherited();
+  printf("server listening!\n");
+  _nhttp_server_serve(s, sockfd);
+  close(sockfd);
+}
+
+void _nhttp_server_serve(struct nhttp_server *s, int sockfd) {
+  switch (s->io) {
+  case NHTTP_SERVER_IO_BLOCKING:
+    _nhttp_server_run_blocking(s, sockfd);
+    break;
+  case NHTTP_SERVER_IO_EPOLL:
+    _nhttp_loop_run(s, sockfd, NULL);
+    break;
+  case NHTTP_SERVER_IO_URING:
+    if (_nhttp_uring_run(s, sockfd) == 0)
+      break;
+    printf("io_uring is not supported, falling back to epoll\n");
+    _nhttp_loop_run(s, sockfd, NULL);
+    break;
+  default:
+    _nhttp_panic("unknown server io mode");
+  }
+}
+
+/* _nhttp_server_setsockopt sets an int socket option, panicking on error. */
+static void _nhttp_server_setsockopt(int sockfd, int level, int name,
+                                     int value, const char *desc) {
+  if (setsockopt(sockfd, level, name, &value, sizeof(int))) {
+    _nhttp_panicf("could not set %s: %s", desc, strerror(errno));
+  }
+}
+
+/* _nhttp_server_try_setsockopt sets an int socket option, reporting */
+/* errors instead of panicking, for options which are only an */
+/* optimization and may be unsupported or unprivileged. */
+static void _nhttp_server_try_setsockopt(int sockfd, int level, int name,
+                                         int value, const char *desc) {
+  if (setsockopt(sockfd, level, name, &value, sizeof(int))) {
+    printf("could not set %s, skipping it: %s\n", desc, strerror(errno));
+  }
+}
+
+/* _nhttp_server_set_timeout sets a timeval socket option to `ms` */
+/* milliseconds, unless it is 0 or less. Panics on error. */
+static void _nhttp_server_set_timeout(int sockfd, int name, int ms,
+                                      const char *desc) {
+  struct timeval tv;
+  if (ms <= 0)
+    return;
+  tv.tv_sec  = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+  if (setsockopt(sockfd, SOL_SOCKET, name, &tv, sizeof(struct timeval))) {
+    _nhttp_panicf("could not set %s: %s", desc, strerror(errno));
+  }
+}
+
+/* _nhttp_server_unix_addr fills `addr` with the Unix domain socket address */
+/* of `path`, where a leading '@' selects the abstract namespace. Returns */
+/* its length, which is the one getsockname(2) reports for it. Panics if */
+/* the path is too long. */
+static socklen_t _nhttp_server_unix_addr(const char         *path,
+                                         struct sockaddr_un *addr) {
+  size_t len = strlen(path);
+
+  if (len >= sizeof(addr->sun_path)) {
+    _nhttp_panicf("unix socket path <%s> is too long", path);
+  }
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, path, len);
+  if (path[0] == '@') {
+    /* abstract names aren't NUL-terminated, the length delimits them */
+    addr->sun_path[0] = '\0';
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+  }
+  return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len + 1);
+}
 
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd == -1) {
+int _nhttp_server_listen(struct nhttp_server *s, int port, int reuseport) {
+  const struct nhttp_server_config *cfg = &s->config;
+  int                               sockfd, inherited;
+  struct sockaddr_storage           addr;
+  socklen_t                         addrlen;
+  struct sockaddr_in               *addr4 = (struct sockaddr_in *)&addr;
+  struct sockaddr_in6              *addr6 = (struct sockaddr_in6 *)&addr;
+  struct stat                       st;
+
+  memset(&addr, 0, sizeof(struct sockaddr_storage));
+  if (cfg->unix_path != NULL) {
+    addrlen = _nhttp_server_unix_addr(cfg->unix_path,
+                                      (struct sockaddr_un *)&addr);
+  } else if (cfg->bind_address == NULL) {
+    addr4->sin_family      = AF_INET;
+    addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+    addr4->sin_port        = htons((uint16_t)port);
+    addrlen                = sizeof(struct sockaddr_in);
+  } else if (inet_pton(AF_INET, cfg->bind_address, &addr4->sin_addr) == 1) {
+    addr4->sin_family = AF_INET;
+    addr4->sin_port   = htons((uint16_t)port);
+    addrlen           = sizeof(struct sockaddr_in);
+  } else if (inet_pton(AF_INET6, cfg->bind_address, &addr6->sin6_addr) == 1) {
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_port   = htons((uint16_t)port);
+    addrlen            = sizeof(struct sockaddr_in6);
+  } else {
+    _nhttp_panicf("invalid bind address <%s>", cfg->bind_address);
+  }
+
+  /* a socket inherited on an upgrade is already bound, and may hold */
+  /* pending connections. The options are set again, as they may differ. */
+  inherited = (sockfd = _nhttp_upgrade_take((struct sockaddr *)&addr,
+                                            addrlen)) != -1;
+  if (!inherited &&
+      (sockfd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
     _nhttp_panicf("could not create socket: %s", strerror(errno));
-    exit(1);
+  }
+
+  /* a socket file outlives its socket, so binding to the path of a */
+  /* previous run fails unless the file is removed. Other files are left */
+  /* alone, and bind(2) fails on them. */
+  if (!inherited && addr.ss_family == AF_UNIX && cfg->unix_path[0] != '@' &&
+      lstat(cfg->unix_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(cfg->unix_path);
   }
 
   /* set SO_REUSEADDR socket option to allow rapid restart of server proc with*/
   /* call to bind on the same port. Makes the OS ignore any previous socket on*/
   /* the same port that is in TIME_WAIT state (dying). */
-  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int))) {
-    _nhttp_panicf("could not set SO_REUSEADDR: %s", strerror(errno));
-    exit(1);
+  _nhttp_server_setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, 1,
+                           "SO_REUSEADDR");
+
+  /* SO_REUSEPORT allows multiple sockets to bind to the same port, with the */
+  /* kernel load-balancing incoming connections between them. */
+  if (reuseport) {
+    _nhttp_server_setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, 1,
+                             "SO_REUSEPORT");
+  }
+
+  /* buffer sizes have to be set before listen(2), as they determine the */
+  /* TCP window scale negotiated in the handshake. */
+  if (cfg->rcvbuf > 0) {
+    _nhttp_server_setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, cfg->rcvbuf,
+                             "SO_RCVBUF");
+  }
+  if (cfg->sndbuf > 0) {
+    _nhttp_server_setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, cfg->sndbuf,
+                             "SO_SNDBUF");
+  }
+  if (addr.ss_family != AF_UNIX && cfg->tcp_nodelay) {
+    _nhttp_server_setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, 1,
+                             "TCP_NODELAY");
+  }
+  if (addr.ss_family != AF_UNIX && cfg->tcp_defer_accept > 0) {
+    _nhttp_server_setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                             cfg->tcp_defer_accept, "TCP_DEFER_ACCEPT");
+  }
+  if (addr.ss_family != AF_UNIX && cfg->tcp_fastopen > 0) {
+    _nhttp_server_setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN,
+                             cfg->tcp_fastopen, "TCP_FASTOPEN");
   }
 
-  serv_info.sin_family      = AF_INET;
-  serv_info.sin_addr.s_addr = ntohl(INADDR_ANY);
-  serv_info.sin_port        = htons((uint16_t)port);
+  /* the kernel polls the NIC queue of the socket in blocking reads and */
+  /* polls instead of waiting for an interrupt, accepted sockets inherit it */
+  if (s->busy_poll_us > 0) {
+    _nhttp_server_try_setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL,
+                                 s->busy_poll_us, "SO_BUSY_POLL");
+    _nhttp_server_try_setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, 1,
+                                 "SO_PREFER_BUSY_POLL");
+  }
+
+  /* bound the reads of the body and the writes of the response on the */
+  /* accepted sockets which are used in blocking mode, reads and writes of */
+  /* non-blocking sockets never wait. */
+  _nhttp_server_set_timeout(sockfd, SO_RCVTIMEO, s->timeouts.body_ms,
+                            "SO_RCVTIMEO");
+  _nhttp_server_set_timeout(sockfd, SO_SNDTIMEO, s->timeouts.write_ms,
+                            "SO_SNDTIMEO");
 
-  if (bind(sockfd, (struct sockaddr *)&serv_info, sizeof(struct sockaddr_in)) !=
-      0) {
+  if (!inherited && bind(sockfd, (struct sockaddr *)&addr, addrlen) != 0) {
+    if (addr.ss_family == AF_UNIX) {
+      _nhttp_panicf("bind on <%s> failed: %s", cfg->unix_path,
+                    strerror(errno));
+    }
     _nhttp_panicf("bind on port %d failed: %s", port, strerror(errno));
-    exit(1);
   }
 
-  if (listen(sockfd, 128) != 0) {
+  /* connecting to a socket file requires write permission on it. The mode */
+  /* is set before listen(2), so no connection gets in with the one given */
+  /* by the umask. */
+  if (addr.ss_family == AF_UNIX && cfg->unix_path[0] != '@' &&
+      cfg->unix_mode > 0 && chmod(cfg->unix_path, (mode_t)cfg->unix_mode)) {
+    _nhttp_panicf("could not set the mode of <%s>: %s", cfg->unix_path,
+                  strerror(errno));
+  }
+
+  /* on an inherited socket, this only updates the backlog */
+  if (listen(sockfd, cfg->backlog) != 0) {
     _nhttp_panicf("listen failed: %s", strerror(errno));
-    exit(1);
   }
+  return sockfd;
+}
 
-  printf("server listening!\n");
+/* _nhttp_server_run_blocking is the blocking accept->dispatch loop, which */
+/* serves one connection at a time. With upgrades enabled, the listening */
+/* socket is polled before accepting, so that the upgrade signal can */
+/* interrupt the wait. */
+static void _nhttp_server_run_blocking(struct nhttp_server *s, int sockfd) {
+  int           connfd;
+  int           spare_fd = _nhttp_util_open_spare_fd();
+  struct pollfd pfd;
 
-  while (1) {
-    connfd =
-        accept(sockfd, NULL, 0); /* TODO(sbrki): get IP and set it to req.IP */
+  pfd.fd     = sockfd;
+  pfd.events = POLLIN;
+  if (s->upgrade_signal) {
+    _nhttp_util_set_nonblocking(sockfd);
+  }
+  while (!_nhttp_upgrade_draining()) {
+    if (_nhttp_upgrade_requested()) {
+      _nhttp_upgrade_start(&sockfd, 1);
+      continue;
+    }
+    if (s->upgrade_signal && _nhttp_upgrade_poll(&pfd, 1, -1) == -1)
+      continue;
+    /* TODO(sbrki): get IP and set it to req.IP */
+    connfd = _nhttp_util_accept(sockfd, SOCK_CLOEXEC, &spare_fd);
     if (connfd < 0) {
-      printf("accept failed: %s\n", strerror(errno));
+      if (errno == EMFILE || errno == ENFILE) {
+        poll(NULL, 0, NHTTP_SERVER_ACCEPT_BACKOFF_MS);
+        spare_fd = spare_fd == -1 ? _nhttp_util_open_spare_fd() : spare_fd;
+      }
       continue;
     }
     _nhttp_server_dispatch(s, connfd);
+#ifdef NHTTP_DEBUG
     printf("dispatch returned\n");
+#endif
+  }
+  if (spare_fd != -1) {
+    close(spare_fd);
   }
 }
 
@@ -106,95 +487,482 @@ enum _nhttp_req_type _nhttp_server_parse_method(const char *method) {
   return X_UNKNOWN;
 }
 
-static void _nhttp_server_dispatch(struct nhttp_server *s, int connfd) {
-  char                             request_line[NHTTP_SERVER_LINE_SIZE] = {0};
-  char                             method[NHTTP_SERVER_LINE_SIZE]       = {0};
-  char                             path[NHTTP_SERVER_LINE_SIZE]         = {0};
-  char                             proto[NHTTP_SERVER_LINE_SIZE]        = {0};
-  char                             query_params[NHTTP_SERVER_LINE_SIZE] = {0};
-  char                            *pp                                   = path;
-  struct _nhttp_buf_reader        *bufr;
+/* _nhttp_server_poll_head is `_nhttp_upgrade_poll` on the connection, */
+/* which busy polls for up to the busy poll time before sleeping. */
+static int _nhttp_server_poll_head(const struct nhttp_server *s,
+                                   struct pollfd *pfd, int timeout) {
+  long until;
+  int  ret;
+
+  if (s->busy_poll_us > 0 && timeout != 0) {
+    until = _nhttp_util_now_us() + s->busy_poll_us;
+    do {
+      if ((ret = _nhttp_upgrade_poll(pfd, 1, 0)) != 0)
+        return ret;
+    } while (_nhttp_util_now_us() < until);
+  }
+  return _nhttp_upgrade_poll(pfd, 1, timeout);
+}
+
+/* _nhttp_server_read_head reads from the blocking connection and parses */
+/* what has been read with `p`, until the parser is done with the next */
+/* request head (or fails), or the buffer is full. Every phase of reading */
+/* the head has to finish before its timeout. Returns 0 once the head has */
+/* been read, and -1 on timeout, EOF or error, as well as when the */
+/* connection is idle after `requests` requests and an upgrade has been */
+/* requested. */
+static int _nhttp_server_read_head(struct nhttp_server      *s,
+                                   struct _nhttp_parser     *p,
+                                   struct _nhttp_buf_reader *bufr,
+                                   int                       requests) {
+  enum _nhttp_server_phase phase = (enum _nhttp_server_phase)-1;
+  struct pollfd            pfd;
+  long                     deadline = 0;
+  int                      timeout, ret;
+  ssize_t                  n;
+
+  pfd.fd     = bufr->fd;
+  pfd.events = POLLIN;
+  while (_nhttp_server_parse_head(p, bufr) == NHTTP_PARSER_AGAIN) {
+    if (_nhttp_server_head_phase(p, bufr) != phase) {
+      phase    = _nhttp_server_head_phase(p, bufr);
+      timeout  = _nhttp_server_phase_timeout(s, phase);
+      deadline = timeout ? _nhttp_util_now_ms() + timeout : 0;
+    }
+    timeout = -1;
+    if (deadline && (timeout = (int)(deadline - _nhttp_util_now_ms())) < 0)
+      timeout = 0;
+    if ((ret = _nhttp_server_poll_head(s, &pfd, timeout)) == -1 &&
+        errno == EINTR) {
+      if (phase == NHTTP_SERVER_PHASE_IDLE && requests > 0 &&
+          _nhttp_upgrade_pending())
+        return -1; /* close idle connections on an upgrade */
+      continue;
+    }
+    if (ret == 0 && phase != NHTTP_SERVER_PHASE_IDLE)
+      _nhttp_util_set_abortive_close(bufr->fd); /* timed out */
+    if (ret <= 0)
+      return -1;
+    if ((n = _nhttp_util_buf_reader_fill(bufr)) > 0)
+      continue;
+    if (n == -1 && errno == EINTR)
+      continue;
+    return n == -1 && errno == ENOBUFS ? 0 : -1;
+  }
+  return 0;
+}
+
+void _nhttp_server_dispatch(struct nhttp_server *s, int connfd) {
+  struct _nhttp_buf_reader *bufr = _nhttp_util_buf_reader_create(connfd);
+  struct _nhttp_buf_writer *bufw = _nhttp_util_buf_writer_create(connfd);
+  struct _nhttp_parser      parser;
+  struct _nhttp_server_body body;
+  int                       requests = 0;
+  int                       keepalive, flushed = 0;
+
+  _nhttp_parser_init(&parser);
+  body.pending = 0;
+  do {
+    if (_nhttp_server_read_head(s, &parser, bufr, requests))
+      break;
+    keepalive = _nhttp_server_handle_pipeline(s, &parser, &body, bufr, bufw,
+                                              &requests);
+    /* the rest of the body is discarded once the response has been sent */
+  } while (!(flushed = _nhttp_util_buf_writer_flush(bufw)) && keepalive &&
+           _nhttp_server_discard(&body, bufr, 1) == 0);
+  if (flushed == 1) { /* a write blocked for longer than SO_SNDTIMEO */
+    _nhttp_util_set_abortive_close(connfd);
+  }
+
+  _nhttp_util_buf_writer_free(bufw);
+  _nhttp_util_buf_reader_free(bufr);
+  close(connfd);
+}
+
+int _nhttp_server_handle_pipeline(struct nhttp_server       *s,
+                                  struct _nhttp_parser      *p,
+                                  struct _nhttp_server_body *body,
+                                  struct _nhttp_buf_reader  *bufr,
+                                  struct _nhttp_buf_writer  *bufw,
+                                  int                       *requests) {
+  int keepalive;
+  do {
+    /* connections are closed after their last response once an upgrade */
+    /* has been requested */
+    keepalive = _nhttp_server_handle(s, p, body, bufr, bufw,
+                                     ++*requests < s->keepalive_max_requests &&
+                                         !_nhttp_upgrade_pending());
+  } while (keepalive && !body->pending && bufw->file_fd == -1 &&
+           bufw->len < NHTTP_SERVER_PIPELINE_BYTES &&
+           _nhttp_server_parse_head(p, bufr) != NHTTP_PARSER_AGAIN &&
+           (_nhttp_coro_self() || !_nhttp_server_awaits_body(p, bufr)));
+  return keepalive;
+}
+
+/* _nhttp_server_has_token reports whether the comma separated header value */
+/* `list` contains `token`, ignoring case. */
+static int _nhttp_server_has_token(const char *list, const char *token) {
+  size_t n = strlen(token);
+  while (*list) {
+    while (*list == ' ' || *list == '\t' || *list == ',')
+      list++;
+    if (!strncasecmp(list, token, n) &&
+        (list[n] == '\0' || list[n] == ',' || list[n] == ' ' ||
+         list[n] == '\t'))
+      return 1;
+    while (*list && *list != ',')
+      list++;
+  }
+  return 0;
+}
+
+/* _nhttp_server_known_header returns the value of the last request header */
+/* with the known `id`, or NULL if there is none. */
+static const char *
+_nhttp_server_known_header(const struct _nhttp_request *req,
+                           enum _nhttp_header_id        id) {
+  return req->known[id] ? req->known[id]->value.ptr : NULL;
+}
+
+/* _nhttp_server_request_header returns the value of the last request */
+/* header named `name`, compared case-insensitively, or NULL if there is */
+/* none. */
+static const char *
+_nhttp_server_request_header(const struct _nhttp_request *req,
+                             const char                  *name) {
+  size_t                len = strlen(name);
+  enum _nhttp_header_id id  = _nhttp_parser_header_id(name, len);
+  int                   i;
+
+  if (id != NHTTP_HEADER_OTHER)
+    return _nhttp_server_known_header(req, id);
+  for (i = req->nheaders - 1; i >= 0; i--) {
+    if (req->headers[i].name.len == len &&
+        !strncasecmp(req->headers[i].name.ptr, name, len))
+      return req->headers[i].value.ptr;
+  }
+  return NULL;
+}
+
+/* _nhttp_server_wants_keepalive reports whether the client asked for the */
+/* connection to be kept alive. HTTP/1.1 connections are persistent unless */
+/* the client sent "Connection: close", while HTTP/1.0 clients have to opt */
+/* in with "Connection: keep-alive". */
+static int _nhttp_server_wants_keepalive(const struct _nhttp_request *req) {
+  const char *conn = _nhttp_server_known_header(req, NHTTP_HEADER_CONNECTION);
+  if (conn && _nhttp_server_has_token(conn, "close"))
+    return 0;
+  if (!strcmp(req->proto.ptr, "HTTP/1.1"))
+    return 1;
+  return conn && _nhttp_server_has_token(conn, "keep-alive");
+}
+
+/* _nhttp_server_is_chunked reports whether the last transfer coding of */
+/* the Transfer-Encoding header value `te` is "chunked". */
+static int _nhttp_server_is_chunked(const char *te) {
+  size_t len = strlen(te);
+  while (len && (te[len - 1] == ' ' || te[len - 1] == '\t'))
+    len--;
+  return len >= 7 && !strncasecmp(te + len - 7, "chunked", 7) &&
+         (len == 7 || te[len - 8] == ',' || te[len - 8] == ' ' ||
+          te[len - 8] == '\t');
+}
+
+/* _nhttp_server_parse_length sets `len` to the value of the Content-Length */
+/* header value `v`, `vlen` bytes long. Returns -1 unless it is 1*DIGIT, */
+/* or if it overflows. */
+static int _nhttp_server_parse_length(const char *v, size_t vlen,
+                                      size_t *len) {
+  size_t n = 0, i;
+
+  if (vlen == 0)
+    return -1;
+  for (i = 0; i < vlen; i++) {
+    if (v[i] < '0' || v[i] > '9' || n > (SIZE_MAX - 9) / 10)
+      return -1;
+    n = n * 10 + (size_t)(v[i] - '0');
+  }
+  *len = n;
+  return 0;
+}
+
+/* _nhttp_server_body_length sets `len` to the Content-Length of the */
+/* request, 0 if there is none, and `chunked` to whether its body is */
+/* chunked instead. Returns -1 if the length of the body can't be told */
+/* reliably: if a Content-Length is malformed or differs from another one, */
+/* if the last transfer coding isn't chunked, or if both headers are */
+/* present (request smuggling vectors, see RFC 7230 3.3.3). */
+static int _nhttp_server_body_length(const struct _nhttp_request *req,
+                                     size_t *len, int *chunked) {
+  const char *clen, *te;
+  size_t      n;
+  int         i;
+
+  *len     = 0;
+  clen     = _nhttp_server_known_header(req, NHTTP_HEADER_CONTENT_LENGTH);
+  te       = _nhttp_server_known_header(req, NHTTP_HEADER_TRANSFER_ENCODING);
+  *chunked = te != NULL;
+  if (te)
+    return !clen && _nhttp_server_is_chunked(te) ? 0 : -1;
+  if (!clen)
+    return 0;
+  if (_nhttp_server_parse_length(clen, strlen(clen), len))
+    return -1;
+  /* `clen` is the last one, any others have to agree with it */
+  for (i = 0; i < req->nheaders; i++) {
+    if (req->headers[i].name.len == sizeof("Content-Length") - 1 &&
+        !strcasecmp(req->headers[i].name.ptr, "Content-Length") &&
+        (_nhttp_server_parse_length(req->headers[i].value.ptr,
+                                    req->headers[i].value.len, &n) ||
+         n != *len))
+      return -1;
+  }
+  return 0;
+}
+
+/* _nhttp_server_chunked_next decodes the chunked body read from `bufr` */
+/* with `c` up to the next payload bytes, reading more as needed, and sets */
+/* `*data` to at most `max` of them, in the read buffer (valid until the */
+/* next read). Returns their count, 0 at the end of the body, and -1 on */
+/* error, with errno set to EBADMSG if the body is malformed and to EFBIG */
+/* if it exceeds a limit. */
+static ssize_t _nhttp_server_chunked_next(struct _nhttp_buf_reader *bufr,
+                                          struct _nhttp_chunked    *c,
+                                          const char **data, size_t max) {
+  size_t  avail, used, len = 0;
+  ssize_t bytes_read;
+  int     status;
+
+  for (;;) {
+    avail  = bufr->tail - bufr->head;
+    status = _nhttp_chunked_execute(c, &(bufr->buf[bufr->head]),
+                                    avail < max ? avail : max, &used, data,
+                                    &len);
+    bufr->head += (uint32_t)used;
+    bufr->consumed += used;
+    switch (status) {
+    case NHTTP_CHUNKED_DATA:
+      return (ssize_t)len;
+    case NHTTP_CHUNKED_DONE:
+      return 0;
+    case NHTTP_CHUNKED_TOO_LARGE:
+      errno = EFBIG;
+      return -1;
+    case NHTTP_CHUNKED_INVALID:
+      errno = EBADMSG;
+      return -1;
+    }
+    if (bufr->head != bufr->tail)
+      continue; /* only the first `max` bytes were decoded */
+    if ((bytes_read = _nhttp_util_buf_reader_more(bufr)) <= 0) {
+      if (bytes_read == 0) /* the client is gone before sending it all */
+        errno = ECONNRESET;
+      return -1;
+    }
+  }
+}
+
+int _nhttp_server_discard(struct _nhttp_server_body *body,
+                          struct _nhttp_buf_reader *bufr, int read) {
+  const char *data;
+  size_t      avail, used, len;
+  ssize_t     bytes_read;
+  int         status;
+
+  while (body->pending) {
+    avail = bufr->tail - bufr->head;
+    if (body->chunked) {
+      status = _nhttp_chunked_execute(&body->decoder, &(bufr->buf[bufr->head]),
+                                      avail, &used, &data, &len);
+      if (status == NHTTP_CHUNKED_DATA)
+        body->discarded += len;
+      else if (status == NHTTP_CHUNKED_DONE)
+        body->pending = 0;
+      else if (status != NHTTP_CHUNKED_AGAIN)
+        return -1;
+    } else {
+      used = avail < body->left ? avail : body->left;
+      body->left -= used;
+      body->discarded += used;
+      body->pending = body->left != 0;
+    }
+    bufr->head += (uint32_t)used;
+    bufr->consumed += used;
+    /* cheaper to close the connection than to read it all */
+    if (body->discarded + (body->chunked ? 0 : body->left) >
+        NHTTP_SERVER_MAX_DISCARD)
+      return -1;
+    if (!body->pending || bufr->head != bufr->tail)
+      continue;
+    if (!read)
+      return 1;
+    if ((bytes_read = _nhttp_util_buf_reader_more(bufr)) == -1)
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+    if (bytes_read == 0) /* the client is gone */
+      return -1;
+  }
+  return 0;
+}
+
+/* _nhttp_server_view sets `v` to the slice of `head`, and terminates it in */
+/* place. The byte after a slice is always a delimiter of the head. */
+static void _nhttp_server_view(struct _nhttp_view *v, char *head,
+                               struct _nhttp_parser_slice slice) {
+  v->ptr         = head + slice.off;
+  v->len         = slice.len;
+  v->ptr[v->len] = '\0';
+}
+
+/* _nhttp_server_request_init sets up `req` from the head parsed by `p`, */
+/* which starts at `head`. The request target is split into the path and */
+/* the query, and the fragment is dropped. */
+static void _nhttp_server_request_init(struct _nhttp_request      *req,
+                                       const struct _nhttp_parser *p,
+                                       char                       *head) {
+  struct _nhttp_view target;
+  char              *end;
+  int                i;
+
+  _nhttp_server_view(&req->method, head, p->method);
+  _nhttp_server_view(&target, head, p->target);
+  _nhttp_server_view(&req->proto, head, p->version);
+  memset(req->known, 0, sizeof(req->known));
+  for (i = 0; i < p->nheaders; i++) {
+    _nhttp_server_view(&req->headers[i].name, head, p->headers[i].name);
+    _nhttp_server_view(&req->headers[i].value, head, p->headers[i].value);
+    if (p->headers[i].id != NHTTP_HEADER_OTHER)
+      req->known[p->headers[i].id] = &req->headers[i];
+  }
+  req->nheaders = p->nheaders;
+
+  req->path.ptr = target.ptr;
+  req->path.len = _nhttp_simd_find_any(target.ptr, target.len, "?#", 2);
+  end           = target.ptr + req->path.len;
+  if (*end == '?') {
+    req->query.ptr = end + 1;
+    req->query.len = _nhttp_simd_find_any(
+        req->query.ptr, target.len - req->path.len - 1, "#", 1);
+    req->query.ptr[req->query.len] = '\0';
+  } else {
+    req->query.ptr = end; /* the terminator of the path */
+    req->query.len = 0;
+  }
+  *end = '\0';
+}
+
+int _nhttp_server_handle(struct nhttp_server *s, struct _nhttp_parser *p,
+                         struct _nhttp_server_body *body,
+                         struct _nhttp_buf_reader  *bufr,
+                         struct _nhttp_buf_writer  *bufw, int keepalive) {
+  char                            *head = &(bufr->buf[bufr->head]);
+  char                            *pp;
+  struct _nhttp_request            req;
   enum _nhttp_req_type             method_enum;
   struct _nhttp_route_match_result rmr;
   struct nhttp_ctx                *ctx;
+  const char                      *conn, *expect;
+  int                              status_code = 0;
 
-  bufr = _nhttp_util_buf_reader_create(connfd);
-  if (_nhttp_util_buf_read_until_crlf(bufr, request_line,
-                                      NHTTP_SERVER_LINE_SIZE - 1)) {
-    _nhttp_server_send_status_line(connfd, 413);
-    close(connfd);
-    _nhttp_util_buf_reader_free(bufr);
-    return;
+  switch (_nhttp_server_parse_head(p, bufr)) {
+  case NHTTP_PARSER_DONE:
+    break;
+  case NHTTP_PARSER_INVALID:
+    _nhttp_server_send_empty(bufw, 400, 0);
+    return 0;
+  default: /* too many headers, or a head that does not fit in bufr */
+    _nhttp_server_send_empty(bufw, 431, 0);
+    return 0;
   }
-  sscanf(request_line, "%s %s %s", method, path, proto);
-  printf("<%s> <%s> <%s>\n", method, path, proto);
+  _nhttp_server_request_init(&req, p, head);
+#ifdef NHTTP_DEBUG
+  printf("<%s> <%s> <%s>\n", req.method.ptr, req.path.ptr, req.proto.ptr);
+#endif
+
+  /* the head is consumed from bufr even if the request is rejected, as the */
+  /* connection may be reused, but stays pinned until the request has been */
+  /* handled, as `req` points into it. */
+  bufr->head += p->pos;
+  bufr->consumed += p->pos;
+  bufr->pin = bufr->head;
+  _nhttp_parser_init(p);
+  keepalive = keepalive && _nhttp_server_wants_keepalive(&req);
 
   /* match path against the router */
-  _nhttp_util_cut_path_query_params(query_params, path);
-  _nhttp_util_remove_trailing_slash(path);
-  _nhttp_util_remove_leading_slash(path);
-
-  method_enum = _nhttp_server_parse_method(method);
-  if (method_enum == X_UNKNOWN) {
-    _nhttp_server_send_status_line(connfd, 400);
-    close(connfd);
-    _nhttp_util_buf_reader_free(bufr);
-    return;
-  }
-  rmr = _nhttp_route_match(s->router_root, &pp, method_enum, NULL);
+  _nhttp_util_remove_trailing_slash(req.path.ptr);
+  _nhttp_util_remove_leading_slash(req.path.ptr);
+  pp = req.path.ptr;
 
-  if (rmr.found == -2) {
-    _nhttp_server_send_status_line(connfd, 404);
-    close(connfd);
-    _nhttp_util_buf_reader_free(bufr);
-    return;
-  } else if (rmr.found == -1) {
-    _nhttp_server_send_status_line(connfd, 405);
-    close(connfd);
-    _nhttp_util_buf_reader_free(bufr);
-    return;
+  method_enum = _nhttp_server_parse_method(req.method.ptr);
+  /* the length of chunked bodies is only known once they have been read */
+  _nhttp_chunked_init(&body->decoder, s->max_body_size);
+  if (_nhttp_server_body_length(&req, &body->left, &body->chunked)) {
+    /* the end of the body is unknown, and so is the next request */
+    status_code = 400;
+    keepalive   = 0;
+  } else if (s->max_body_size && body->left > s->max_body_size) {
+    status_code = 413;
+    keepalive   = 0; /* the client may still be sending the body */
+  } else if (method_enum == X_UNKNOWN) {
+    status_code = 400;
+  } else {
+    rmr = _nhttp_route_match(s->router_root, &pp, method_enum, NULL);
+    if (rmr.found == -2) {
+      status_code = 404;
+    } else if (rmr.found == -1) {
+      status_code = 405;
+    }
   }
 
-  /* prepare context */
-  ctx              = malloc(sizeof(struct nhttp_ctx));
-  ctx->connfd      = connfd;
-  ctx->bufr        = bufr;
-  ctx->path_params = rmr.vars;
-  if ((ctx->req_headers = _nhttp_map_create_from_http_headers(bufr)) == NULL) {
-    /* TODO(sbrki): consider checking if we should return 413 */
-    _nhttp_map_free(ctx->path_params);
-    _nhttp_map_free(ctx->resp_headers);
-    _nhttp_util_buf_reader_free(bufr);
-    free(ctx);
-    _nhttp_server_send_status_line(connfd, 400);
-    close(connfd);
-    return;
-  }
-  if (!(ctx->query_params = _nhttp_map_create_from_urlencoded(query_params))) {
+  if (status_code) {
+    _nhttp_server_send_empty(bufw, status_code, keepalive);
+  } else {
+    /* prepare context */
+    ctx               = malloc(sizeof(struct nhttp_ctx));
+    ctx->connfd       = bufr->fd;
+    ctx->bufr         = bufr;
+    ctx->bufw         = bufw;
+    ctx->path_params  = rmr.vars;
+    ctx->req          = &req;
+    ctx->query_params = NULL; /* parsed on first use */
+    ctx->body_left    = body->left;
+    ctx->chunked      = body->chunked ? &body->decoder : NULL;
+    ctx->resp_headers = _nhttp_map_create();
+    _nhttp_map_set(ctx->resp_headers, "Connection",
+                   keepalive ? "keep-alive" : "close");
+    /* HTTP/1.0 clients never wait for "100 Continue" (RFC 7231 5.1.1) */
+    expect = _nhttp_server_known_header(&req, NHTTP_HEADER_EXPECT);
+    ctx->expect_continue = (body->left || body->chunked) && expect &&
+                           !strcasecmp(expect, "100-continue") &&
+                           !strcmp(req.proto.ptr, "HTTP/1.1");
+
+    /* execute handler */
+    ctx->written = bufw->len;
+    rmr.handler(ctx);
+
+    /* the handler may have asked for the connection to be closed, and */
+    /* a handler that did not respond leaves the client hanging */
+    conn      = _nhttp_map_get(ctx->resp_headers, "Connection");
+    keepalive = keepalive && bufw->len != ctx->written && conn &&
+                !strcmp(conn, "keep-alive");
+    /* a client still waiting for "100 Continue" may send the body or not, */
+    /* so the next request couldn't be told apart from it */
+    keepalive = keepalive && !ctx->expect_continue;
+
+    /* cleanup */
+    body->left = ctx->body_left;
     _nhttp_map_free(ctx->path_params);
     _nhttp_map_free(ctx->resp_headers);
-    _nhttp_map_free(ctx->req_headers);
-    _nhttp_util_buf_reader_free(bufr);
+    if (ctx->query_params)
+      _nhttp_map_free(ctx->query_params);
     free(ctx);
-    _nhttp_server_send_status_line(connfd, 400);
-    close(connfd);
-    return;
   }
 
-  ctx->resp_headers = _nhttp_map_create();
-
-  /* execute handler */
-  rmr.handler(ctx);
-
-  /* cleanup */
-  _nhttp_map_free(ctx->path_params);
-  _nhttp_map_free(ctx->req_headers);
-  _nhttp_map_free(ctx->resp_headers);
-  _nhttp_map_free(ctx->query_params);
-  _nhttp_util_buf_reader_free(bufr);
-  free(ctx);
-  close(connfd);
-  return;
+  /* the rest of the body is discarded as far as it is buffered, and once */
+  /* the response has been flushed otherwise, so that it isn't delayed */
+  bufr->pin       = 0;
+  body->pending   = keepalive;
+  body->discarded = 0;
+  return keepalive && _nhttp_server_discard(body, bufr, 0) != -1;
 }
 
 static void _nhttp_server_assert_path_len(const char *path) {
@@ -247,7 +1015,7 @@ static int _nhttp_send_generic(const struct nhttp_ctx *ctx,
                                const unsigned char *data, size_t count,
                                const char *ctype, int status_code) {
   char clen_buf[32] = {0};
-  _nhttp_server_send_status_line(ctx->connfd, status_code);
+  _nhttp_server_send_status_line(ctx->bufw, status_code);
   if (!_nhttp_map_get(ctx->resp_headers, "Content-Length")) {
     sprintf(clen_buf, "%lu", count);
     _nhttp_map_set(ctx->resp_headers, "Content-Length", clen_buf);
@@ -255,9 +1023,9 @@ static int _nhttp_send_generic(const struct nhttp_ctx *ctx,
   if (!_nhttp_map_get(ctx->resp_headers, "Content-Type")) {
     _nhttp_map_set(ctx->resp_headers, "Content-Type", ctype);
   }
-  _nhttp_map_write_as_http_header(ctx->resp_headers, ctx->connfd);
-  _nhttp_util_write_all(ctx->connfd, "\r\n", 2);
-  _nhttp_util_write_all(ctx->connfd, data, count);
+  _nhttp_map_write_as_http_header(ctx->resp_headers, ctx->bufw);
+  _nhttp_util_buf_write(ctx->bufw, "\r\n", 2);
+  _nhttp_util_buf_write(ctx->bufw, data, count);
   return 0;
 }
 
@@ -285,9 +1053,9 @@ static int _nhttp_send_byte_range(const struct nhttp_ctx *ctx, const char *path,
   char buf[128] = {0};
   int  filefd;
 
-  if ((filefd = open(path, O_RDONLY)) == -1) {
-    _nhttp_server_send_status_line(ctx->connfd, 500);
-    return 0;
+  if ((filefd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+    return _nhttp_send_generic(ctx, (const unsigned char *)"", 0,
+                               "text/plain", 500);
   }
 
   sprintf(buf, "%ld", range_end - range_start + 1);
@@ -296,12 +1064,11 @@ static int _nhttp_send_byte_range(const struct nhttp_ctx *ctx, const char *path,
   sprintf(buf, "bytes %ld-%ld/%ld", range_start, range_end, filelen);
   _nhttp_map_set(ctx->resp_headers, "Content-Range", buf);
 
-  _nhttp_server_send_status_line(ctx->connfd, 206);
-  _nhttp_map_write_as_http_header(ctx->resp_headers, ctx->connfd);
-  _nhttp_util_write_all(ctx->connfd, "\r\n", 2);
-  _nhttp_util_sendfile_all(ctx->connfd, filefd, range_start,
-                           (size_t)(range_end - range_start + 1));
-  close(filefd);
+  _nhttp_server_send_status_line(ctx->bufw, 206);
+  _nhttp_map_write_as_http_header(ctx->resp_headers, ctx->bufw);
+  _nhttp_util_buf_write(ctx->bufw, "\r\n", 2);
+  _nhttp_util_buf_writer_sendfile(ctx->bufw, filefd, range_start,
+                                  (size_t)(range_end - range_start + 1));
   return 0;
 }
 
@@ -310,19 +1077,18 @@ static int _nhttp_send_file(const struct nhttp_ctx *ctx, const char *path,
   char buf[128] = {0};
   int  filefd;
 
-  if ((filefd = open(path, O_RDONLY)) == -1) {
-    _nhttp_server_send_status_line(ctx->connfd, 500);
-    return 0;
+  if ((filefd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+    return _nhttp_send_generic(ctx, (const unsigned char *)"", 0,
+                               "text/plain", 500);
   }
 
   sprintf(buf, "%ld", filelen);
   _nhttp_map_set(ctx->resp_headers, "Content-Length", buf);
 
-  _nhttp_server_send_status_line(ctx->connfd, 200);
-  _nhttp_map_write_as_http_header(ctx->resp_headers, ctx->connfd);
-  _nhttp_util_write_all(ctx->connfd, "\r\n", 2);
-  _nhttp_util_sendfile_all(ctx->connfd, filefd, 0, filelen);
-  close(filefd);
+  _nhttp_server_send_status_line(ctx->bufw, 200);
+  _nhttp_map_write_as_http_header(ctx->resp_headers, ctx->bufw);
+  _nhttp_util_buf_write(ctx->bufw, "\r\n", 2);
+  _nhttp_util_buf_writer_sendfile(ctx->bufw, filefd, 0, filelen);
   return 0;
 }
 
@@ -334,11 +1100,11 @@ int nhttp_send_file(const struct nhttp_ctx *ctx, const char *path) {
   const char *r;
 
   if (len == -1) {
-    _nhttp_server_send_status_line(ctx->connfd, 500);
-    return 0;
+    return _nhttp_send_generic(ctx, (const unsigned char *)"", 0,
+                               "text/plain", 500);
   }
 
-  if ((r = _nhttp_map_get(ctx->req_headers, "Range"))) {
+  if ((r = _nhttp_server_known_header(ctx->req, NHTTP_HEADER_RANGE))) {
     /* TODO(sbrki): support multiple byte ranges */
     /* this implementation only looks at the first byte range if there are */
     /* multiple present. */
@@ -347,8 +1113,8 @@ int nhttp_send_file(const struct nhttp_ctx *ctx, const char *path) {
       range_end = len - 1;
     }
     if (range_start >= range_end || range_start >= len) {
-      _nhttp_server_send_status_line(ctx->connfd, 416);
-      return 0;
+      return _nhttp_send_generic(ctx, (const unsigned char *)"", 0,
+                                 "text/plain", 416);
     }
     if (range_end >= len) {
       range_end = len - 1;
@@ -365,105 +1131,120 @@ int nhttp_redirect(const struct nhttp_ctx *ctx, const char *to, int permanent) {
   _nhttp_map_set(ctx->resp_headers, "Content-Length", "0");
   _nhttp_map_set(ctx->resp_headers, "Location", to);
   if (permanent) {
-    _nhttp_server_send_status_line(ctx->connfd, 301);
+    _nhttp_server_send_status_line(ctx->bufw, 301);
   } else {
-    _nhttp_server_send_status_line(ctx->connfd, 302);
+    _nhttp_server_send_status_line(ctx->bufw, 302);
   }
-  _nhttp_map_write_as_http_header(ctx->resp_headers, ctx->connfd);
+  _nhttp_map_write_as_http_header(ctx->resp_headers, ctx->bufw);
+  _nhttp_util_buf_write(ctx->bufw, "\r\n", 2);
   return 0;
 }
 
-static void _nhttp_server_send_status_line(int connfd, int status_code) {
+void _nhttp_server_send_empty(struct _nhttp_buf_writer *w, int status_code,
+                              int keepalive) {
+  const char *headers = keepalive
+                            ? "Content-Length: 0\r\nConnection: keep-alive\r\n\r\n"
+                            : "Content-Length: 0\r\nConnection: close\r\n\r\n";
+  _nhttp_server_send_status_line(w, status_code);
+  _nhttp_util_buf_write(w, headers, strlen(headers));
+}
+
+void _nhttp_server_send_status_line(struct _nhttp_buf_writer *w,
+                                    int                       status_code) {
   /* TODO(sbrki): finish this */
   char *str;
   char  buf[64];
   switch (status_code) {
   case 200:
-    str = "HTTP/1.0 200 OK\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 200 OK\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 201:
-    str = "HTTP/1.0 201 Created\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 201 Created\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 202:
-    str = "HTTP/1.0 202 Accepted\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 202 Accepted\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 204:
-    str = "HTTP/1.0 204 No Content\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 204 No Content\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 206:
-    str = "HTTP/1.0 206 Partial Content\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 206 Partial Content\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
 
   case 300:
-    str = "HTTP/1.0 300 Multiple Choices\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 300 Multiple Choices\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 301:
-    str = "HTTP/1.0 301 Moved Permanently\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 301 Moved Permanently\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 302:
-    str = "HTTP/1.0 302 Moved Temporarily\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 302 Moved Temporarily\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 304:
-    str = "HTTP/1.0 304 Not Modified\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 304 Not Modified\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
 
   case 400:
-    str = "HTTP/1.0 400 Bad Request\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 400 Bad Request\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 401:
-    str = "HTTP/1.401 Unauthorized\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 401 Unauthorized\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 403:
-    str = "HTTP/1.403 Forbidden\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 403 Forbidden\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 404:
-    str = "HTTP/1.0 404 Not Found\r\n",
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 404 Not Found\r\n",
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 405:
-    str = "HTTP/1.0 405 method not allowed\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 405 method not allowed\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 413:
-    str = "HTTP/1.0 413 Request Entity Too Large\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 413 Request Entity Too Large\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 416:
-    str = "HTTP/1.0 416 Range Not Satisfiable\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 416 Range Not Satisfiable\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
+    break;
+  case 431:
+    str = "HTTP/1.1 431 Request Header Fields Too Large\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
 
   case 500:
-    str = "HTTP/1.0 500 Internal Server Error\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 500 Internal Server Error\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 501:
-    str = "HTTP/1.0 501 Not Implemented\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 501 Not Implemented\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 502:
-    str = "HTTP/1.0 502 Bad Gateway\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 502 Bad Gateway\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   case 503:
-    str = "HTTP/1.0 503 Service Unavailable\r\n";
-    _nhttp_util_write_all(connfd, str, strlen(str));
+    str = "HTTP/1.1 503 Service Unavailable\r\n";
+    _nhttp_util_buf_write(w, str, strlen(str));
     break;
   default:
-    sprintf(buf, "HTTP/1.0 %d\r\n", status_code);
-    _nhttp_util_write_all(connfd, buf, strlen(buf));
+    sprintf(buf, "HTTP/1.1 %d\r\n", status_code);
+    _nhttp_util_buf_write(w, buf, strlen(buf));
     break;
   }
 }
@@ -472,7 +1253,7 @@ static void _nhttp_server_send_status_line(int connfd, int status_code) {
 
 const char *nhttp_get_request_header(const struct nhttp_ctx *ctx,
                                      const char             *key) {
-  return _nhttp_map_get(ctx->req_headers, key);
+  return _nhttp_server_request_header(ctx->req, key);
 }
 
 void nhttp_set_response_header(const struct nhttp_ctx *ctx, const char *key,
@@ -480,6 +1261,282 @@ void nhttp_set_response_header(const struct nhttp_ctx *ctx, const char *key,
   _nhttp_map_set(ctx->resp_headers, key, value);
 }
 
+/* request body */
+
+/* _nhttp_server_continue answers "Expect: 100-continue" before the first */
+/* read of the body, unless the client sent the body without waiting. */
+/* Responses to pipelined requests still buffered in `bufw` are sent */
+/* first, as interim responses must not overtake them. */
+static int _nhttp_server_continue(struct nhttp_ctx *c) {
+  static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+  int               ret;
+
+  if (!c->expect_continue)
+    return 0;
+  c->expect_continue = 0;
+  if (c->bufr->tail != c->bufr->head)
+    return 0;
+  if (_nhttp_util_buf_write(c->bufw, cont, sizeof(cont) - 1))
+    return -1;
+  /* outside of a handler coroutine, whatever doesn't fit in the socket */
+  /* buffer is sent along with the response */
+  while ((ret = _nhttp_util_buf_writer_flush(c->bufw)) == 1 &&
+         _nhttp_coro_self() != NULL) {
+    if (_nhttp_coro_wait(c->bufw->fd, POLLOUT, -1))
+      return -1;
+  }
+  c->written = c->bufw->len; /* the response starts after it */
+  return ret == -1 ? -1 : 0;
+}
+
+ssize_t nhttp_read_body(const struct nhttp_ctx *ctx, void *buf, size_t n) {
+  /* the context is allocated by _nhttp_server_handle, and only const for */
+  /* handlers, so the read bytes can be accounted for */
+  struct nhttp_ctx *c = (struct nhttp_ctx *)ctx;
+  const char       *data;
+  ssize_t           bytes_read;
+
+  if (_nhttp_server_continue(c))
+    return -1;
+  if (ctx->chunked) {
+    if (n && (bytes_read = _nhttp_server_chunked_next(
+                  ctx->bufr, ctx->chunked, &data, n)) > 0)
+      memcpy(buf, data, (size_t)bytes_read);
+    return n ? bytes_read : 0;
+  }
+  if (n > ctx->body_left)
+    n = ctx->body_left;
+  if (n == 0)
+    return 0;
+  bytes_read = _nhttp_util_buf_read(ctx->bufr, buf, n);
+  if (bytes_read == 0) { /* the client is gone before sending it all */
+    errno = ECONNRESET;
+    return -1;
+  }
+  if (bytes_read > 0)
+    c->body_left -= (size_t)bytes_read;
+  return bytes_read;
+}
+
+int nhttp_stream_body(const struct nhttp_ctx *ctx, nhttp_body_func fn,
+                      void *arg) {
+  struct nhttp_ctx         *c = (struct nhttp_ctx *)ctx;
+  struct _nhttp_buf_reader *r = ctx->bufr;
+  char                      chunk[NHTTP_SERVER_BODY_CHUNK];
+  const char               *data;
+  size_t                    n;
+  ssize_t                   bytes_read;
+
+  if (_nhttp_server_continue(c))
+    return -1;
+  if (ctx->chunked) {
+    /* chunk payloads are passed from the read buffer as they are decoded */
+    while ((bytes_read = _nhttp_server_chunked_next(
+                r, ctx->chunked, &data, NHTTP_UTIL_BUF_READER_SIZE)) > 0) {
+      if (fn(ctx, data, (size_t)bytes_read, arg))
+        return -1;
+    }
+    return bytes_read == 0 ? 0 : -1;
+  }
+
+  /* bytes received along with the head are passed from the read buffer */
+  n = r->tail - r->head;
+  if (n > ctx->body_left)
+    n = ctx->body_left;
+  if (n) {
+    r->head += (uint32_t)n;
+    r->consumed += n;
+    c->body_left -= n;
+    if (fn(ctx, &(r->buf[r->head - n]), n, arg))
+      return -1;
+  }
+  while ((bytes_read = nhttp_read_body(ctx, chunk, sizeof(chunk))) > 0) {
+    if (fn(ctx, chunk, (size_t)bytes_read, arg))
+      return -1;
+  }
+  return bytes_read == 0 ? 0 : -1;
+}
+
+/* _nhttp_server_save_chunk writes a chunk of a chunked body for */
+/* `nhttp_save_body_to_file`. */
+static int _nhttp_server_save_chunk(const struct nhttp_ctx *ctx,
+                                    const char *data, size_t len, void *arg) {
+  (void)ctx;
+  return _nhttp_util_write_all(*(int *)arg, data, len) == -1 ? -1 : 0;
+}
+
+ssize_t nhttp_save_body_to_file(const struct nhttp_ctx *ctx, int fd) {
+  struct nhttp_ctx *c     = (struct nhttp_ctx *)ctx;
+  size_t            start = ctx->bufr->consumed;
+  uint64_t          total;
+  int               rc;
+
+  if (_nhttp_server_continue(c))
+    return -1;
+  if (ctx->chunked) {
+    total = ctx->chunked->total;
+    if (nhttp_stream_body(ctx, _nhttp_server_save_chunk, &fd))
+      return -1;
+    return (ssize_t)(ctx->chunked->total - total);
+  }
+  rc = _nhttp_util_buf_splice(ctx->bufr, fd, ctx->body_left);
+  c->body_left -= ctx->bufr->consumed - start;
+  return rc ? -1 : (ssize_t)(ctx->bufr->consumed - start);
+}
+
+/* multipart */
+
+/* _nhttp_server_multipart is the state of `nhttp_parse_multipart`, which */
+/* parses the body passed by `nhttp_stream_body`. */
+struct _nhttp_server_multipart {
+  struct _nhttp_multipart       parser;
+  const struct nhttp_multipart *mp;
+  void                         *arg;
+  struct nhttp_part             part;
+  int                           fd; /* of the spooled file, -1 if none */
+  char                          path[PATH_MAX];
+};
+
+void nhttp_multipart_init(struct nhttp_multipart *mp) {
+  mp->on_part     = NULL;
+  mp->on_data     = NULL;
+  mp->on_part_end = NULL;
+  mp->spool_dir   = NULL;
+}
+
+/* _nhttp_server_multipart_spool creates the file the data of the current */
+/* part is spooled to. */
+static int _nhttp_server_multipart_spool(struct _nhttp_server_multipart *m) {
+  const char *dir = m->mp->spool_dir;
+
+  if (strlen(dir) + sizeof("/nhttp-XXXXXX") > sizeof(m->path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(m->path, dir);
+  strcat(m->path, "/nhttp-XXXXXX");
+  /* not inherited by the new process of an upgrade */
+  if ((m->fd = mkostemp(m->path, O_CLOEXEC)) == -1)
+    return -1;
+  m->part.path = m->path;
+  return 0;
+}
+
+/* _nhttp_server_multipart_end closes the spooled file of the current */
+/* part, if any, and passes the part to `on_part_end`. */
+static int _nhttp_server_multipart_end(const struct nhttp_ctx        *ctx,
+                                       struct _nhttp_server_multipart *m) {
+  if (m->fd != -1) {
+    if (close(m->fd)) {
+      m->fd = -1;
+      unlink(m->path);
+      return -1;
+    }
+    m->fd = -1;
+    if (!m->mp->on_part_end) {
+      unlink(m->path);
+      return 0;
+    }
+  }
+  return m->mp->on_part_end ? m->mp->on_part_end(ctx, &m->part, m->arg) : 0;
+}
+
+static int _nhttp_server_multipart_chunk(const struct nhttp_ctx *ctx,
+                                         const char *data, size_t len,
+                                         void *arg) {
+  struct _nhttp_server_multipart *m = arg;
+  const char                     *out;
+  size_t                          used, out_len;
+  int                             status;
+
+  while (len) {
+    status = _nhttp_multipart_execute(&m->parser, data, len, &used, &out,
+                                      &out_len);
+    data += used;
+    len -= used;
+    switch (status) {
+    case NHTTP_MULTIPART_PART:
+      m->part.name         = m->parser.name;
+      m->part.filename     = m->parser.filename;
+      m->part.content_type = m->parser.content_type;
+      m->part.path         = NULL;
+      m->part.size         = 0;
+      if (m->mp->spool_dir && m->part.filename &&
+          _nhttp_server_multipart_spool(m))
+        return -1;
+      if (m->mp->on_part && m->mp->on_part(ctx, &m->part, m->arg))
+        return -1;
+      break;
+    case NHTTP_MULTIPART_DATA:
+      m->part.size += out_len;
+      if (m->fd != -1) {
+        if (_nhttp_util_write_all(m->fd, out, out_len) == -1)
+          return -1;
+      } else if (m->mp->on_data &&
+                 m->mp->on_data(ctx, &m->part, out, out_len, m->arg)) {
+        return -1;
+      }
+      break;
+    case NHTTP_MULTIPART_PART_END:
+      if (_nhttp_server_multipart_end(ctx, m))
+        return -1;
+      break;
+    case NHTTP_MULTIPART_AGAIN:
+    case NHTTP_MULTIPART_DONE:
+      break;
+    default:
+      errno = EBADMSG;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int nhttp_parse_multipart(const struct nhttp_ctx       *ctx,
+                          const struct nhttp_multipart *mp, void *arg) {
+  const struct _nhttp_header    *ct;
+  struct _nhttp_server_multipart m;
+  char                           boundary[NHTTP_MULTIPART_MAX_BOUNDARY + 1];
+  int                            rc;
+
+  ct = ctx->req->known[NHTTP_HEADER_CONTENT_TYPE];
+  if (!ct || _nhttp_multipart_boundary(boundary, ct->value.ptr)) {
+    errno = EINVAL;
+    return -1;
+  }
+  _nhttp_multipart_init(&m.parser, boundary);
+  m.mp  = mp;
+  m.arg = arg;
+  m.fd  = -1;
+  rc    = nhttp_stream_body(ctx, _nhttp_server_multipart_chunk, &m);
+  if (m.fd != -1) { /* failed before the end of a spooled part */
+    close(m.fd);
+    unlink(m.path);
+  }
+  if (rc == 0 && m.parser.state != NHTTP_MULTIPART_FINISHED) {
+    errno = EBADMSG; /* the body ended before the close delimiter */
+    rc    = -1;
+  }
+  return rc;
+}
+
+/* async */
+
+int nhttp_await_readable(const struct nhttp_ctx *ctx, int fd, int timeout_ms) {
+  (void)ctx;
+  return _nhttp_coro_wait(fd, POLLIN, timeout_ms);
+}
+
+int nhttp_await_writable(const struct nhttp_ctx *ctx, int fd, int timeout_ms) {
+  (void)ctx;
+  return _nhttp_coro_wait(fd, POLLOUT, timeout_ms);
+}
+
+int nhttp_sleep(const struct nhttp_ctx *ctx, int ms) {
+  (void)ctx;
+  return _nhttp_coro_wait(-1, 0, ms < 0 ? 0 : ms);
+}
+
 /* path parameters */
 
 const char *nhttp_get_path_param(const struct nhttp_ctx *ctx,
@@ -491,5 +1548,21 @@ const char *nhttp_get_path_param(const struct nhttp_ctx *ctx,
 
 const char *nhttp_get_query_param(const struct nhttp_ctx *ctx,
                                   const char             *name) {
+  /* the context is allocated by _nhttp_server_handle, and only const for */
+  /* handlers, so the parameters can be parsed on first use */
+  struct nhttp_ctx *c = (struct nhttp_ctx *)ctx;
+
+  if (!ctx->req->query.len)
+    return NULL;
+  if (!ctx->query_params &&
+      !(c->query_params =
+            _nhttp_map_create_from_urlencoded(ctx->req->query.ptr)))
+    c->query_params = _nhttp_map_create(); /* malformed, has no parameters */
   return _nhttp_map_get(ctx->query_params, name);
 }
+
+/* url encoding */
+
+size_t nhttp_url_encode(char *dest, const char *src, size_t len) {
+  return _nhttp_util_url_encode(dest, src, len);
+}
@@ -1,25 +1,395 @@
 #ifndef NHTTP_SERVER_H
 #define NHTTP_SERVER_H
 
+#include "nhttp_chunked.h"
 #include "nhttp_handler.h"
+#include "nhttp_parser.h"
 #include "nhttp_router.h"
 
-/* as nhttp parses data using sscanf, neither one of the elements */
-/* of the string that is being parsed is not allowed to be smaller */
-/* than the entire string, as that is the only way to guarantee an overflow */
-/* won't happen. */
+/* size of the scratch buffers that the paths of routes are copied into */
+/* when they are registered, and that the keys and values of urlencoded */
+/* strings are decoded into (see `_nhttp_map_create_from_urlencoded`), so */
+/* neither may be longer. */
 #define NHTTP_SERVER_LINE_SIZE 4096
 
+/* nhttp_server_io selects how the server waits for connections and I/O. */
+/* NHTTP_SERVER_IO_EPOLL (default) serves all connections from a single */
+/* epoll(7) event loop using non-blocking sockets, so a slow client does not */
+/* block other connections. NHTTP_SERVER_IO_BLOCKING accepts and serves one */
+/* connection at a time, to completion. NHTTP_SERVER_IO_URING serves all */
+/* connections through io_uring(7), batching accepts, receives and sends */
+/* into few syscalls, and falls back to NHTTP_SERVER_IO_EPOLL if the kernel */
+/* lacks support (Linux 5.19 or newer is required). */
+enum nhttp_server_io {
+  NHTTP_SERVER_IO_EPOLL,
+  NHTTP_SERVER_IO_BLOCKING,
+  NHTTP_SERVER_IO_URING
+};
+
+/* default length of the queue of pending connections */
+#define NHTTP_SERVER_BACKLOG 4096
+
+/* time to stop accepting for, when running out of fds */
+#define NHTTP_SERVER_ACCEPT_BACKOFF_MS 100
+
+/* defaults for `nhttp_server_set_keepalive` */
+#define NHTTP_SERVER_KEEPALIVE_MAX_REQUESTS 100
+#define NHTTP_SERVER_KEEPALIVE_TIMEOUT_MS 5000
+
+/* defaults for `struct nhttp_server_timeouts` */
+#define NHTTP_SERVER_REQUEST_LINE_TIMEOUT_MS 10000
+#define NHTTP_SERVER_HEADERS_TIMEOUT_MS 10000
+#define NHTTP_SERVER_BODY_TIMEOUT_MS 30000
+#define NHTTP_SERVER_HANDLER_TIMEOUT_MS 60000
+#define NHTTP_SERVER_WRITE_TIMEOUT_MS 30000
+
+/* `ncpus` of `nhttp_server_set_cpu_affinity` which pins the workers to */
+/* the CPUs the process is allowed to run on */
+#define NHTTP_SERVER_CPUS_ALLOWED -1
+
+/* interval of load shedding, see `nhttp_server_set_load_shedding` */
+#define NHTTP_SERVER_SHED_INTERVAL_MS 100
+
+/* unread request bodies up to this size are read and discarded to keep the */
+/* connection alive, the connection is closed for larger ones. */
+#define NHTTP_SERVER_MAX_DISCARD (64 * 1024)
+
+/* default of `nhttp_server_set_max_body_size` */
+#define NHTTP_SERVER_MAX_BODY_SIZE (1024 * 1024)
+
+/* request bodies are passed to `nhttp_stream_body` callbacks in chunks of */
+/* at most this size */
+#define NHTTP_SERVER_BODY_CHUNK (16 * 1024)
+
+/* pipelined requests are handled back to back until their buffered */
+/* responses reach this size, after which they are flushed. */
+#define NHTTP_SERVER_PIPELINE_BYTES (64 * 1024)
+
+/* nhttp_server_config holds the options of the listening socket. */
+/* Initialize it with `nhttp_server_config_init` before changing fields, */
+/* so that the options added in the future get their defaults. */
+/* Accepted sockets inherit the socket options from the listening socket, */
+/* so they are applied to both without a syscall per connection. */
+struct nhttp_server_config {
+  /* IPv4 or IPv6 address to bind to, NULL (default) binds to all IPv4 */
+  /* interfaces. The string must stay valid while the server runs. */
+  const char *bind_address;
+  /* length of the queue of pending connections, see listen(2). It is */
+  /* silently capped by the kernel at net.core.somaxconn. */
+  int backlog;
+  /* SO_RCVBUF and SO_SNDBUF in bytes, 0 (default) keeps kernel defaults. */
+  int rcvbuf, sndbuf;
+  /* non-zero sets TCP_NODELAY, disabling Nagle's algorithm (default 1) */
+  int tcp_nodelay;
+  /* TCP_DEFER_ACCEPT in seconds, 0 (default) disables it. If set, a */
+  /* connection is only accepted once its first bytes have arrived, which */
+  /* saves a wakeup (and a blocking read) per connection. */
+  int tcp_defer_accept;
+  /* TCP_FASTOPEN queue length, 0 (default) disables it. */
+  int tcp_fastopen;
+  /* path of a Unix domain socket to listen on in place of TCP, which saves */
+  /* the loopback TCP stack behind a reverse proxy on the same host. NULL */
+  /* (default) listens on TCP. If set, the port passed to the run functions */
+  /* and the bind address and TCP options above are ignored. A leading '@' */
+  /* selects the Linux abstract namespace, without a socket file. A stale */
+  /* socket file left at the path by a previous run is removed, and the */
+  /* file isn't removed when the server returns, as the new process keeps */
+  /* listening on it after an upgrade. The string must stay valid while */
+  /* the server runs. */
+  const char *unix_path;
+  /* permissions of the socket file, e.g. 0660 to only let the proxy's */
+  /* group connect, 0 (default) keeps the ones given by the umask. Abstract */
+  /* sockets have no permissions. */
+  int unix_mode;
+};
+
+/* nhttp_server_timeouts bounds the time a connection may spend in each */
+/* phase of a request, in milliseconds. Connections that exceed a timeout */
+/* are closed, a timeout of 0 or less disables it. Initialize it with */
+/* `nhttp_server_timeouts_init` before changing fields. The idle time */
+/* between requests is bounded by the keep-alive timeout instead, see */
+/* `nhttp_server_set_keepalive`. */
+struct nhttp_server_timeouts {
+  /* from the first byte of the request until its request line is read */
+  int request_line_ms;
+  /* from the end of the request line until the headers are read */
+  int headers_ms;
+  /* between two reads of the request body */
+  int body_ms;
+  /* total run time of an async handler (see `nhttp_server_set_async`): */
+  /* once exceeded, the `nhttp_await_*` helpers fail right away. Handlers */
+  /* that don't run as coroutines can't be interrupted. */
+  int handler_ms;
+  /* between two writes of the response */
+  int write_ms;
+};
+
+/* _nhttp_server_phase is the phase of a request a connection is in, which */
+/* determines its timeout, see `_nhttp_server_phase_timeout`. */
+enum _nhttp_server_phase {
+  NHTTP_SERVER_PHASE_IDLE, /* waiting for the first byte of a request */
+  NHTTP_SERVER_PHASE_REQUEST_LINE,
+  NHTTP_SERVER_PHASE_HEADERS,
+  NHTTP_SERVER_PHASE_BODY,
+  NHTTP_SERVER_PHASE_HANDLER,
+  NHTTP_SERVER_PHASE_WRITE
+};
+
+/* _nhttp_server_body is the framing of the body of the request being */
+/* handled on a connection. It is kept once the request has been handled, */
+/* until the part of the body that the handler did not read has been */
+/* discarded, see `_nhttp_server_discard`. */
+struct _nhttp_server_body {
+  int                   pending;   /* the rest is yet to be discarded */
+  int                   chunked;   /* decoded by `decoder` if non-zero */
+  size_t                left;      /* bytes not read, without chunks */
+  size_t                discarded; /* since the request was handled */
+  struct _nhttp_chunked decoder;
+};
+
 struct nhttp_server {
-  struct _nhttp_route_node *router_root;
+  struct _nhttp_route_node    *router_root;
+  enum nhttp_server_io         io;
+  struct nhttp_server_config   config;
+  struct nhttp_server_timeouts timeouts;
+  int                          shed_target_ms; /* 0 if load isn't shed */
+  struct _nhttp_buf_writer    *shed_response;  /* pre-serialized 503 */
+  int                          upgrade_signal; /* 0 if upgrades are off */
+  int                          busy_poll_us;   /* 0 if not busy polling */
+  int                         *cpus; /* of the workers, NULL if not pinned */
+  int                          ncpus;
+  size_t                       max_body_size; /* 0 if unlimited */
+  int                       keepalive_max_requests;
+  int                       keepalive_timeout_ms;
+  int                       async;
 };
 
 /* basics */
 
 /* nhttp_server_create creates a nhttp server */
 struct nhttp_server *nhttp_server_create(void);
-/* nhttp_server_run starts the passed server on the specified port */
+/* nhttp_server_set_io sets the I/O mode used by `nhttp_server_run`. */
+void nhttp_server_set_io(struct nhttp_server *s, enum nhttp_server_io io);
+/* nhttp_server_set_keepalive configures HTTP persistent connections: at */
+/* most `max_requests` requests are served on a single connection, which */
+/* is closed once it has been idle for `idle_timeout_ms` milliseconds. */
+/* A `max_requests` of 1 or less disables keep-alive, and an */
+/* `idle_timeout_ms` of 0 or less disables the idle timeout. */
+void nhttp_server_set_keepalive(struct nhttp_server *s, int max_requests,
+                                int idle_timeout_ms);
+/* nhttp_server_set_max_body_size limits request bodies to `bytes` bytes */
+/* (NHTTP_SERVER_MAX_BODY_SIZE by default, 0 disables the limit). Requests */
+/* announcing a larger Content-Length are answered with 413 without */
+/* running their handler. */
+void nhttp_server_set_max_body_size(struct nhttp_server *s, size_t bytes);
+/* nhttp_server_config_init fills the passed config with the defaults. */
+void nhttp_server_config_init(struct nhttp_server_config *cfg);
+/* nhttp_server_set_config sets the options of the listening socket, the */
+/* passed config is copied. Must be called before running the server. */
+void nhttp_server_set_config(struct nhttp_server             *s,
+                             const struct nhttp_server_config *cfg);
+/* nhttp_server_timeouts_init fills the passed timeouts with the defaults. */
+void nhttp_server_timeouts_init(struct nhttp_server_timeouts *t);
+/* nhttp_server_set_timeouts sets the per-phase timeouts of requests, the */
+/* passed timeouts are copied. Must be called before running the server. */
+void nhttp_server_set_timeouts(struct nhttp_server                *s,
+                               const struct nhttp_server_timeouts *t);
+/* nhttp_server_set_load_shedding enables (or disables, if `target_ms` is */
+/* 0 or less) shedding load once requests queue up: every event loop (or */
+/* worker thread) measures how long the requests ready to be served have */
+/* been waiting for it, and once that stays above `target_ms` for */
+/* NHTTP_SERVER_SHED_INTERVAL_MS, the requests that have been waiting */
+/* for longer than twice `target_ms` are answered with a 503 without being */
+/* parsed, and their connections are closed, see `nhttp_codel.h`. */
+/* Doesn't apply to NHTTP_SERVER_IO_BLOCKING (without threads), which has */
+/* no queue of its own. */
+void nhttp_server_set_load_shedding(struct nhttp_server *s, int target_ms);
+/* nhttp_server_set_async enables (or disables, if `enabled` is 0) running */
+/* handlers as coroutines, each with its own stack of NHTTP_CORO_STACK_SIZE */
+/* bytes. A handler can then suspend while waiting on a backend with the */
+/* `nhttp_await_*` helpers, and the event loop serves other connections */
+/* in the meantime. Applies to NHTTP_SERVER_IO_EPOLL (and threads) and */
+/* NHTTP_SERVER_IO_URING, NHTTP_SERVER_IO_BLOCKING runs handlers to */
+/* completion, with the helpers blocking. */
+void nhttp_server_set_async(struct nhttp_server *s, int enabled);
+/* nhttp_server_set_upgrade_signal enables (or disables, if `sig` is 0) */
+/* zero-downtime upgrades triggered by `sig` (e.g. SIGUSR2): the server */
+/* re-executes its binary from the path it was started from, with the same */
+/* arguments, handing its listening sockets down to the new process, which */
+/* picks them up instead of binding new ones, so no connection is refused */
+/* while restarting. The old process then stops accepting, finishes the */
+/* requests in flight with `Connection: close`, closes its idle */
+/* connections, and the `nhttp_server_run*` call returns once all of them */
+/* are closed. The new process must run the server with the same port and */
+/* bind address. See `nhttp_upgrade.h`. */
+void nhttp_server_set_upgrade_signal(struct nhttp_server *s, int sig);
+/* nhttp_server_set_busy_poll enables (or disables, if `usec` is 0 or */
+/* less) busy polling, which trades CPU time for latency on dedicated */
+/* cores: every wait for I/O first polls without sleeping for up to `usec` */
+/* microseconds, saving the wakeup (and the scheduler latency) of events */
+/* arriving meanwhile. The sockets get SO_BUSY_POLL and */
+/* SO_PREFER_BUSY_POLL, and epoll instances the busy poll parameters */
+/* (Linux 6.9), so the kernel polls the NIC queues as well. Raising */
+/* SO_BUSY_POLL above net.core.busy_read requires CAP_NET_ADMIN, options */
+/* that can't be set are reported and skipped. Pair it with CPU affinity, */
+/* see `nhttp_server_set_cpu_affinity`. */
+void nhttp_server_set_busy_poll(struct nhttp_server *s, int usec);
+/* nhttp_server_set_cpu_affinity pins the workers of */
+/* `nhttp_server_run_workers` and `nhttp_server_run_threads` to CPUs: the */
+/* i-th worker runs on `cpus[i % ncpus]` only. An `ncpus` of */
+/* NHTTP_SERVER_CPUS_ALLOWED uses the CPUs the process is allowed to run */
+/* on (in place of `cpus`), and 0 disables pinning (default). The list is */
+/* copied, and run functions passed 0 workers start one per CPU of it. */
+/* Workers allocate their buffers after being pinned, so they are placed */
+/* on the NUMA node of their CPU. Connections are steered to the worker */
+/* pinned to the CPU which received their packets: by a SO_REUSEPORT BPF */
+/* program with workers (on TCP), and through SO_INCOMING_CPU with */
+/* threads. See `nhttp_cpu.h`. Pair it with RSS or RPS spreading the NIC */
+/* queues over the same CPUs. */
+void nhttp_server_set_cpu_affinity(struct nhttp_server *s, const int *cpus,
+                                   int ncpus);
+/* nhttp_server_run starts the passed server on the specified port. */
+/* Never returns, unless the server has been drained after an upgrade. */
 void nhttp_server_run(struct nhttp_server *s, int port);
+/* nhttp_server_run_workers starts the passed server on the specified port */
+/* in `nworkers` forked worker processes (one per online CPU if `nworkers` */
+/* is <= 0). Every worker serves its own SO_REUSEPORT socket, so the kernel */
+/* load-balances incoming connections between them (Unix domain sockets */
+/* can't be shared that way, with a `unix_path` all of the workers accept */
+/* from a single socket). Routes should be registered before calling it, */
+/* as the workers inherit the router. */
+/* The calling process becomes the supervisor: it respawns workers that */
+/* died, and forwards SIGTERM, SIGINT and SIGQUIT to all of the workers. */
+/* On an upgrade, the supervisor hands all of the worker sockets down to */
+/* the new process, and the workers drain. Returns once all workers have */
+/* exited after such a signal, or after draining. */
+void nhttp_server_run_workers(struct nhttp_server *s, int port, int nworkers);
+/* nhttp_server_run_threads starts the passed server on the specified port */
+/* with a pool of `nthreads` worker threads (one per online CPU if */
+/* `nthreads` is <= 0). The calling thread accepts connections and hands */
+/* them over to the workers through lock-free queues. Every worker owns all */
+/* of its per-connection and per-request state, the server (and its router) */
+/* is shared read-only, so routes must not be registered after the call. */
+/* Handlers run concurrently and must be thread-safe. Never returns, */
+/* unless the server has been drained after an upgrade. */
+/* Worker threads use NHTTP_SERVER_IO_EPOLL in place of */
+/* NHTTP_SERVER_IO_URING. */
+void nhttp_server_run_threads(struct nhttp_server *s, int port, int nthreads);
+
+/* _nhttp_server_listen creates a TCP socket listening on the passed port */
+/* (or a Unix domain socket, if the config has a `unix_path`), configured */
+/* per the server config, with SO_REUSEPORT set if `reuseport` is */
+/* non-zero. Unix domain sockets can't share a path, and must not be */
+/* created with it. SO_RCVTIMEO and SO_SNDTIMEO are set to the body and write */
+/* timeouts, for the blocking sockets accepted from it. A socket bound to */
+/* the same address inherited from the previous process on an upgrade is */
+/* reconfigured and reused instead. Panics on error. */
+int _nhttp_server_listen(struct nhttp_server *s, int port, int reuseport);
+
+/* _nhttp_server_parse_head resumes parsing the request head buffered in */
+/* `r` with `p`. Returns the same as `_nhttp_parser_execute`; the head */
+/* doesn't fit in `r` if NHTTP_PARSER_AGAIN is returned when `r` is full. */
+int _nhttp_server_parse_head(struct _nhttp_parser          *p,
+                             const struct _nhttp_buf_reader *r);
+
+/* _nhttp_server_head_phase returns the phase of reading the request head */
+/* buffered in `r`, as parsed so far by `p`: NHTTP_SERVER_PHASE_IDLE if */
+/* nothing is buffered, NHTTP_SERVER_PHASE_REQUEST_LINE until the request */
+/* line has been parsed, and NHTTP_SERVER_PHASE_HEADERS after it. */
+enum _nhttp_server_phase
+_nhttp_server_head_phase(const struct _nhttp_parser          *p,
+                         const struct _nhttp_buf_reader *r);
+
+/* _nhttp_server_awaits_body reports whether the request whose head has */
+/* been parsed by `p` carries a body that isn't completely buffered in `r` */
+/* yet: a chunked one, or one longer than the bytes buffered after the */
+/* head. Reading such a body may have to wait for the client. */
+int _nhttp_server_awaits_body(const struct _nhttp_parser     *p,
+                              const struct _nhttp_buf_reader *r);
+
+/* _nhttp_server_phase_timeout returns the timeout of the phase in ms, or */
+/* 0 if the phase has no timeout. */
+int _nhttp_server_phase_timeout(const struct nhttp_server *s,
+                                enum _nhttp_server_phase   phase);
+
+/* _nhttp_server_serve serves connections from the passed listening socket */
+/* using the I/O mode of the server. Returns once the server has been */
+/* drained after an upgrade, never otherwise. */
+void _nhttp_server_serve(struct nhttp_server *s, int sockfd);
+
+/* _nhttp_server_dispatch serves requests on the passed blocking connection */
+/* for as long as it is kept alive, and closes it. The request head is read */
+/* with poll(2) against the phase deadlines, while reads of the body and */
+/* writes of the response are bounded by the SO_RCVTIMEO and SO_SNDTIMEO */
+/* inherited from the listening socket. */
+void _nhttp_server_dispatch(struct nhttp_server *s, int connfd);
+
+/* _nhttp_server_handle handles the request whose head is buffered in */
+/* `bufr`, parsing it with `p` where the previous calls to */
+/* `_nhttp_server_parse_head` left off: it executes the matching handler */
+/* and writes the response into `bufw`, without flushing it. A malformed */
+/* head is answered with 400, and one with too many headers or that doesn't */
+/* fit in `bufr` with 431. `p` is then initialized for the next request. */
+/* The framing of the body is kept in `body`, which must not be pending */
+/* (it is zeroed for a new connection), and the part of the body the */
+/* handler did not read is discarded as far as it is buffered: `body` is */
+/* left pending if the rest has to be discarded once the response has been */
+/* flushed, see `_nhttp_server_discard`. */
+/* Returns 1 if the connection should be kept alive for the next request, */
+/* which is only allowed if `keepalive` is non-zero, and 0 if it should be */
+/* closed once the response has been flushed. */
+int _nhttp_server_handle(struct nhttp_server *s, struct _nhttp_parser *p,
+                         struct _nhttp_server_body *body,
+                         struct _nhttp_buf_reader  *bufr,
+                         struct _nhttp_buf_writer  *bufw, int keepalive);
+
+/* _nhttp_server_handle_pipeline handles the request at the head of `bufr`, */
+/* followed by the pipelined requests whose heads are already completely */
+/* buffered in `bufr` (as found by parsing them with `p`), so that all of */
+/* their responses are written into `bufw` to be flushed together. It */
+/* stops at a response that queued a file, once NHTTP_SERVER_PIPELINE_BYTES */
+/* have been buffered, when the connection is not kept alive, or when the */
+/* rest of a body is pending. Outside of a coroutine it also stops before */
+/* a request whose body may have to be waited for (see */
+/* `_nhttp_server_awaits_body`), so that it can be handled in one. */
+/* `requests` is the number of requests served on the connection so far, */
+/* used to enforce the keep-alive limit, and is incremented for every */
+/* handled request. Returns the same as `_nhttp_server_handle` for the last */
+/* handled request. */
+int _nhttp_server_handle_pipeline(struct nhttp_server       *s,
+                                  struct _nhttp_parser      *p,
+                                  struct _nhttp_server_body *body,
+                                  struct _nhttp_buf_reader  *bufr,
+                                  struct _nhttp_buf_writer  *bufw,
+                                  int                       *requests);
+
+/* _nhttp_server_discard discards the rest of the pending `body` from */
+/* `bufr`, so that the next request on the connection can be parsed. If */
+/* `read` is zero only the buffered bytes are discarded, otherwise the */
+/* connection is read like `_nhttp_util_buf_read` does, so it doesn't wait */
+/* for a non-blocking socket outside of a coroutine. Returns 0 once the */
+/* body has been discarded, 1 if more of it has to be received first, and */
+/* -1 if the connection has to be closed: on error, on EOF, and once more */
+/* than NHTTP_SERVER_MAX_DISCARD bytes would be discarded, as closing the */
+/* connection is cheaper then. */
+int _nhttp_server_discard(struct _nhttp_server_body *body,
+                          struct _nhttp_buf_reader *bufr, int read);
+
+/* _nhttp_server_send_empty writes a complete response with an empty body */
+/* and the passed status code into `w`, announcing whether the connection */
+/* is kept alive. */
+void _nhttp_server_send_empty(struct _nhttp_buf_writer *w, int status_code,
+                              int keepalive);
+
+/* _nhttp_server_send_shed writes the pre-serialized 503 response which */
+/* closes the connection into `w`. */
+void _nhttp_server_send_shed(const struct nhttp_server *s,
+                             struct _nhttp_buf_writer  *w);
+
+/* _nhttp_server_send_status_line writes the HTTP status line for the passed */
+/* status code into `w`. */
+void _nhttp_server_send_status_line(struct _nhttp_buf_writer *w,
+                                    int                       status_code);
 
 /* registering routes */
 
@@ -70,9 +440,12 @@ int nhttp_redirect(const struct nhttp_ctx *ctx, const char *to, int permanent);
 /* header manipulation */
 
 /* nhttp_get_request_header returns a char* to HTTP request header value if */
-/* the provided key exists, otherwise NULL. Returned char* points to the */
-/* internal string in map data structure, therefore it is const and string it */
-/* is pointing to must not be changed after the call. */
+/* the provided key exists, otherwise NULL. Keys are case-insensitive, and */
+/* common headers (e.g. Host or Range) are looked up in constant time. If */
+/* the header is repeated, the last value is returned. Returned char* */
+/* points into the request head in the read buffer, therefore it is const, */
+/* string it is pointing to must not be changed, and it is valid until the */
+/* handler returns. */
 const char *nhttp_get_request_header(const struct nhttp_ctx *ctx,
                                      const char             *key);
 
@@ -82,6 +455,126 @@ const char *nhttp_get_request_header(const struct nhttp_ctx *ctx,
 void nhttp_set_response_header(const struct nhttp_ctx *ctx, const char *key,
                                const char *value);
 
+/* request body */
+
+/* nhttp_body_func is called by `nhttp_stream_body` with consecutive chunks */
+/* of the request body, `data` is only valid during the call. Returning */
+/* non-zero stops the streaming. */
+typedef int (*nhttp_body_func)(const struct nhttp_ctx *ctx, const char *data,
+                               size_t len, void *arg);
+
+/* nhttp_read_body reads up to `n` bytes of the request body into `buf`, */
+/* as announced by its Content-Length, or decoded from its chunks if it is */
+/* sent with "Transfer-Encoding: chunked" (requests with neither have no */
+/* body). Bytes received along with the request head are returned first, */
+/* then the connection is read, waiting for data up to the body timeout */
+/* (see `nhttp_server_timeouts`). In NHTTP_SERVER_IO_EPOLL and */
+/* NHTTP_SERVER_IO_URING modes, handlers of requests whose body has yet to */
+/* arrive run as coroutines even without async mode, so waiting only */
+/* suspends the handler while the loop serves the other connections. */
+/* Returns the number of bytes read, which */
+/* may be less than `n`, 0 once the whole body has been read, and -1 on */
+/* error, e.g. if the client disconnects first (errno is set to EBADMSG */
+/* for malformed chunks, and EFBIG once a chunked body exceeds the maximum */
+/* body size, see `nhttp_server_set_max_body_size`). */
+/* Large reads go straight from the socket into `buf`. The unread part of */
+/* the body is discarded once the response has been sent, or the */
+/* connection is closed if that is cheaper. The first read of the body */
+/* answers "Expect: 100-continue" with "100 Continue", so handlers that */
+/* reject a request without reading its body spare the client from */
+/* sending it. */
+ssize_t nhttp_read_body(const struct nhttp_ctx *ctx, void *buf, size_t n);
+
+/* nhttp_stream_body passes the request body to `fn` chunk by chunk as it */
+/* arrives, so that it is never held in memory whole. Buffered bytes are */
+/* passed in place, without copying them. Returns 0 once the whole body has */
+/* been passed, and -1 on error or if `fn` returned non-zero. It waits for */
+/* the body like `nhttp_read_body`. */
+int nhttp_stream_body(const struct nhttp_ctx *ctx, nhttp_body_func fn,
+                      void *arg);
+
+/* nhttp_save_body_to_file writes the request body to `fd` (e.g. a file */
+/* opened for a PUT upload) at its offset. Bytes received along with the */
+/* request head are written first, and the rest is moved from the socket */
+/* with splice(2), without copying it through user space (chunked bodies, */
+/* which have to be decoded, are written like `nhttp_stream_body` passes */
+/* them). If `fd` is a regular file, space for a body with a */
+/* Content-Length is preallocated beforehand, where the filesystem */
+/* supports it. Returns the number of bytes written, and -1 on error, as */
+/* `nhttp_read_body`. The body is read to its end even if it has been */
+/* partly read before. */
+ssize_t nhttp_save_body_to_file(const struct nhttp_ctx *ctx, int fd);
+
+/* multipart */
+
+/* nhttp_part is a part of a multipart/form-data request body, see */
+/* `nhttp_parse_multipart`. Its strings are valid until the next part. */
+struct nhttp_part {
+  /* name of the form field */
+  const char *name;
+  /* file name sent by the client, NULL if the part isn't a file. It is */
+  /* passed as sent: never use it as a path without checking it. */
+  const char *filename;
+  /* NULL if the part doesn't have a Content-Type */
+  const char *content_type;
+  /* file the data of the part is spooled to, NULL if it isn't spooled */
+  const char *path;
+  /* bytes of data of the part so far */
+  size_t size;
+};
+
+/* nhttp_multipart holds the callbacks of `nhttp_parse_multipart`, which */
+/* may be NULL. Initialize it with `nhttp_multipart_init` before changing */
+/* fields. Callbacks returning non-zero stop the parsing. */
+struct nhttp_multipart {
+  /* called with the headers of each part, before its data */
+  int (*on_part)(const struct nhttp_ctx *ctx, const struct nhttp_part *part,
+                 void *arg);
+  /* called with consecutive chunks of the data of a part that isn't */
+  /* spooled, `data` is only valid during the call */
+  int (*on_data)(const struct nhttp_ctx *ctx, const struct nhttp_part *part,
+                 const char *data, size_t len, void *arg);
+  /* called after the last data of a part. A spooled file is the */
+  /* handler's from then on: it has to be renamed or removed. */
+  int (*on_part_end)(const struct nhttp_ctx  *ctx,
+                     const struct nhttp_part *part, void *arg);
+  /* directory to spool the data of file parts to, NULL (default) passes */
+  /* it to `on_data`. Each file part gets a new file in it, created with */
+  /* mkstemp(3), which is removed if the parsing fails before the part's */
+  /* `on_part_end`, or if there is no `on_part_end`. */
+  const char *spool_dir;
+};
+
+/* nhttp_multipart_init sets the fields of `mp` to their defaults. */
+void nhttp_multipart_init(struct nhttp_multipart *mp);
+
+/* nhttp_parse_multipart parses the multipart/form-data request body as it */
+/* arrives (see `nhttp_stream_body`), passing its parts to the callbacks */
+/* of `mp`. The data of a part is never held in memory whole, so the */
+/* memory used is the same for any size of upload. Returns 0 once the */
+/* whole body has been parsed, and -1 on error or if a callback returned */
+/* non-zero (errno is set to EINVAL if the request isn't */
+/* multipart/form-data, and to EBADMSG if the body is malformed). */
+int nhttp_parse_multipart(const struct nhttp_ctx       *ctx,
+                          const struct nhttp_multipart *mp, void *arg);
+
+/* async */
+
+/* nhttp_await_readable waits until `fd` is readable, for at most */
+/* `timeout_ms` milliseconds (-1 waits indefinitely). In async mode the */
+/* handler gets suspended while waiting, otherwise the call blocks. */
+/* Returns 0 once the fd is readable, and -1 on timeout or error. */
+/* An fd can only be awaited by one handler at a time. */
+int nhttp_await_readable(const struct nhttp_ctx *ctx, int fd, int timeout_ms);
+
+/* nhttp_await_writable is the same as `nhttp_await_readable`, but waits */
+/* until `fd` is writable. */
+int nhttp_await_writable(const struct nhttp_ctx *ctx, int fd, int timeout_ms);
+
+/* nhttp_sleep waits for `ms` milliseconds, suspending the handler in */
+/* async mode. Returns 0, or -1 on error. */
+int nhttp_sleep(const struct nhttp_ctx *ctx, int ms);
+
 /* path parameters */
 
 /* nhttp_get_path_param returns a char* to URL parameter if the provided name */
@@ -96,7 +589,20 @@ const char *nhttp_get_path_param(const struct nhttp_ctx *ctx, const char *name);
 /* name exists in URL parameters, otherwise NULL. Returned char* points to the*/
 /* internal string in map data structure, therefore it is const and string it */
 /* is pointing to must not be changed after the call. */
+/* The query is parsed on the first call, so handlers that don't read query */
+/* parameters don't pay for it. A malformed query (e.g. with an invalid %XX */
+/* triplet) has no parameters. */
 const char *nhttp_get_query_param(const struct nhttp_ctx *ctx,
                                   const char             *name);
 
+/* url encoding */
+
+/* nhttp_url_encode escapes the `len` bytes of `src` for use in a URL path */
+/* or query (e.g. of a link or of a `nhttp_redirect` target) into `dest`, */
+/* and terminates it. `dest` must have room for `3 * len + 1` bytes. */
+/* Control characters, non-ASCII bytes and the unsafe and reserved */
+/* characters of RFC1738 (including "/", "?", "&" and "=") are escaped as */
+/* %XX. Returns the length of the escaped string. */
+size_t nhttp_url_encode(char *dest, const char *src, size_t len);
+
 #endif /* NHTTP_SERVER_H */
@@ -0,0 +1,206 @@
+#include "nhttp_simd.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define NHTTP_SIMD_X86
+#include <immintrin.h> /* _mm_*, _mm256_* */
+#endif
+
+static size_t _nhttp_simd_find_any_init(const char *buf, size_t len,
+                                        const char *set, size_t nset);
+static size_t _nhttp_simd_find_ctl_init(const char *buf, size_t len,
+                                        unsigned char max);
+
+/* the selected implementations, which select the best one on first use */
+static size_t (*_nhttp_simd_any)(const char *, size_t, const char *,
+                                 size_t) = _nhttp_simd_find_any_init;
+static size_t (*_nhttp_simd_ctl)(const char *, size_t,
+                                 unsigned char) = _nhttp_simd_find_ctl_init;
+
+static size_t _nhttp_simd_find_any_scalar(const char *buf, size_t len,
+                                          const char *set, size_t nset) {
+  size_t i, j;
+  for (i = 0; i < len; i++) {
+    for (j = 0; j < nset; j++) {
+      if (buf[i] == set[j])
+        return i;
+    }
+  }
+  return len;
+}
+
+static size_t _nhttp_simd_find_ctl_scalar(const char *buf, size_t len,
+                                          unsigned char max) {
+  const unsigned char *s = (const unsigned char *)buf;
+  size_t               i;
+  for (i = 0; i < len; i++) {
+    if (s[i] <= max || s[i] == 0x7f)
+      return i;
+  }
+  return len;
+}
+
+#ifdef NHTTP_SIMD_X86
+/* Sets of less than 4 bytes are padded with their first byte, so that */
+/* every chunk is compared against 4 bytes without branching. Unsigned */
+/* `v <= max` is computed as `max(v, max) == max`, as SSE2 and AVX2 only */
+/* compare signed bytes. */
+
+__attribute__((target("sse2"))) static size_t
+_nhttp_simd_find_any_sse2(const char *buf, size_t len, const char *set,
+                          size_t nset) {
+  __m128i s0 = _mm_set1_epi8(set[0]);
+  __m128i s1 = _mm_set1_epi8(set[nset > 1 ? 1 : 0]);
+  __m128i s2 = _mm_set1_epi8(set[nset > 2 ? 2 : 0]);
+  __m128i s3 = _mm_set1_epi8(set[nset > 3 ? 3 : 0]);
+  __m128i v, m;
+  size_t  i;
+  int     mask;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    v = _mm_loadu_si128((const __m128i *)(buf + i));
+    m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, s0), _mm_cmpeq_epi8(v, s1)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, s2), _mm_cmpeq_epi8(v, s3)));
+    if ((mask = _mm_movemask_epi8(m)) != 0)
+      return i + (size_t)__builtin_ctz((unsigned)mask);
+  }
+  return i + _nhttp_simd_find_any_scalar(buf + i, len - i, set, nset);
+}
+
+__attribute__((target("sse2"))) static size_t
+_nhttp_simd_find_ctl_sse2(const char *buf, size_t len, unsigned char max) {
+  __m128i vmax = _mm_set1_epi8((char)max);
+  __m128i vdel = _mm_set1_epi8(0x7f);
+  __m128i v, m;
+  size_t  i;
+  int     mask;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    v = _mm_loadu_si128((const __m128i *)(buf + i));
+    m = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, vmax), vmax),
+                     _mm_cmpeq_epi8(v, vdel));
+    if ((mask = _mm_movemask_epi8(m)) != 0)
+      return i + (size_t)__builtin_ctz((unsigned)mask);
+  }
+  return i + _nhttp_simd_find_ctl_scalar(buf + i, len - i, max);
+}
+
+/* The AVX2 scanners finish with a 16 byte step, as most header values are */
+/* shorter than 32 bytes, VEX-encoded to avoid mixing in SSE2 code. */
+
+__attribute__((target("avx2"))) static size_t
+_nhttp_simd_find_any_avx2(const char *buf, size_t len, const char *set,
+                          size_t nset) {
+  __m256i s0 = _mm256_set1_epi8(set[0]);
+  __m256i s1 = _mm256_set1_epi8(set[nset > 1 ? 1 : 0]);
+  __m256i s2 = _mm256_set1_epi8(set[nset > 2 ? 2 : 0]);
+  __m256i s3 = _mm256_set1_epi8(set[nset > 3 ? 3 : 0]);
+  __m256i v, m;
+  __m128i v16, m16;
+  size_t  i;
+  int     mask;
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    v = _mm256_loadu_si256((const __m256i *)(buf + i));
+    m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, s0), _mm256_cmpeq_epi8(v, s1)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, s2), _mm256_cmpeq_epi8(v, s3)));
+    if ((mask = _mm256_movemask_epi8(m)) != 0)
+      return i + (size_t)__builtin_ctz((unsigned)mask);
+  }
+  if (i + 16 <= len) {
+    v16 = _mm_loadu_si128((const __m128i *)(buf + i));
+    m16 = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v16, _mm256_castsi256_si128(s0)),
+                     _mm_cmpeq_epi8(v16, _mm256_castsi256_si128(s1))),
+        _mm_or_si128(_mm_cmpeq_epi8(v16, _mm256_castsi256_si128(s2)),
+                     _mm_cmpeq_epi8(v16, _mm256_castsi256_si128(s3))));
+    if ((mask = _mm_movemask_epi8(m16)) != 0)
+      return i + (size_t)__builtin_ctz((unsigned)mask);
+    i += 16;
+  }
+  return i + _nhttp_simd_find_any_scalar(buf + i, len - i, set, nset);
+}
+
+__attribute__((target("avx2"))) static size_t
+_nhttp_simd_find_ctl_avx2(const char *buf, size_t len, unsigned char max) {
+  __m256i vmax = _mm256_set1_epi8((char)max);
+  __m256i vdel = _mm256_set1_epi8(0x7f);
+  __m128i vmax16 = _mm256_castsi256_si128(vmax);
+  __m128i vdel16 = _mm256_castsi256_si128(vdel);
+  __m256i v, m;
+  __m128i v16, m16;
+  size_t  i;
+  int     mask;
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    v = _mm256_loadu_si256((const __m256i *)(buf + i));
+    m = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, vmax), vmax),
+                        _mm256_cmpeq_epi8(v, vdel));
+    if ((mask = _mm256_movemask_epi8(m)) != 0)
+      return i + (size_t)__builtin_ctz((unsigned)mask);
+  }
+  if (i + 16 <= len) {
+    v16 = _mm_loadu_si128((const __m128i *)(buf + i));
+    m16 = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v16, vmax16), vmax16),
+                       _mm_cmpeq_epi8(v16, vdel16));
+    if ((mask = _mm_movemask_epi8(m16)) != 0)
+      return i + (size_t)__builtin_ctz((unsigned)mask);
+    i += 16;
+  }
+  return i + _nhttp_simd_find_ctl_scalar(buf + i, len - i, max);
+}
+#endif /* NHTTP_SIMD_X86 */
+
+int _nhttp_simd_use(enum _nhttp_simd_level level) {
+  switch (level) {
+#ifdef NHTTP_SIMD_X86
+  case NHTTP_SIMD_AVX2:
+    if (!__builtin_cpu_supports("avx2"))
+      return -1;
+    _nhttp_simd_any = _nhttp_simd_find_any_avx2;
+    _nhttp_simd_ctl = _nhttp_simd_find_ctl_avx2;
+    return 0;
+  case NHTTP_SIMD_SSE2:
+    if (!__builtin_cpu_supports("sse2"))
+      return -1;
+    _nhttp_simd_any = _nhttp_simd_find_any_sse2;
+    _nhttp_simd_ctl = _nhttp_simd_find_ctl_sse2;
+    return 0;
+#endif
+  case NHTTP_SIMD_SCALAR:
+    _nhttp_simd_any = _nhttp_simd_find_any_scalar;
+    _nhttp_simd_ctl = _nhttp_simd_find_ctl_scalar;
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+/* _nhttp_simd_use_best selects the best implementation supported. Threads */
+/* racing to select it all store the same pointers. */
+static void _nhttp_simd_use_best(void) {
+  if (_nhttp_simd_use(NHTTP_SIMD_AVX2) && _nhttp_simd_use(NHTTP_SIMD_SSE2))
+    _nhttp_simd_use(NHTTP_SIMD_SCALAR);
+}
+
+static size_t _nhttp_simd_find_any_init(const char *buf, size_t len,
+                                        const char *set, size_t nset) {
+  _nhttp_simd_use_best();
+  return _nhttp_simd_any(buf, len, set, nset);
+}
+
+static size_t _nhttp_simd_find_ctl_init(const char *buf, size_t len,
+                                        unsigned char max) {
+  _nhttp_simd_use_best();
+  return _nhttp_simd_ctl(buf, len, max);
+}
+
+size_t _nhttp_simd_find_any(const char *buf, size_t len, const char *set,
+                            size_t nset) {
+  return _nhttp_simd_any(buf, len, set, nset);
+}
+
+size_t _nhttp_simd_find_ctl(const char *buf, size_t len, unsigned char max) {
+  return _nhttp_simd_ctl(buf, len, max);
+}
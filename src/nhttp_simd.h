@@ -0,0 +1,36 @@
+#ifndef NHTTP_SIMD_H
+#define NHTTP_SIMD_H
+
+#include <sys/types.h> /* size_t, */
+
+/* nhttp simd scans request bytes for delimiters 16 (SSE2) or 32 (AVX2) */
+/* bytes at a time, instead of one byte at a time. The implementation is */
+/* picked on the first call, according to the instruction sets supported by */
+/* the CPU; a portable scalar one is used on other CPUs and compilers. */
+/* Vector loads never read past `buf + len`, the remaining bytes are */
+/* scanned one at a time. */
+
+enum _nhttp_simd_level {
+  NHTTP_SIMD_SCALAR,
+  NHTTP_SIMD_SSE2,
+  NHTTP_SIMD_AVX2
+};
+
+/* _nhttp_simd_use selects the implementation used by the scanners, in */
+/* place of the best one supported. Returns 0 on success, and -1 if the */
+/* CPU or compiler doesn't support `level`. */
+int _nhttp_simd_use(enum _nhttp_simd_level level);
+
+/* _nhttp_simd_find_any returns the offset of the first byte of the `len` */
+/* bytes of `buf` which is one of the `nset` bytes of `set` (1 to 4), or */
+/* `len` if there is none. */
+size_t _nhttp_simd_find_any(const char *buf, size_t len, const char *set,
+                            size_t nset);
+
+/* _nhttp_simd_find_ctl returns the offset of the first byte of the `len` */
+/* bytes of `buf` which is not greater than `max` or is DEL (0x7f), or `len` */
+/* if there is none. With `max` 0x1f it finds control characters, such as */
+/* the CR ending a header line, and with 0x20 also spaces. */
+size_t _nhttp_simd_find_ctl(const char *buf, size_t len, unsigned char max);
+
+#endif /* NHTTP_SIMD_H */
@@ -0,0 +1,181 @@
+#include "nhttp_codel.h"
+#include "nhttp_cpu.h"
+#include "nhttp_loop.h"
+#include "nhttp_queue.h"
+#include "nhttp_server.h"
+#include "nhttp_upgrade.h"
+#include "nhttp_util.h"
+#include <errno.h>      /* errno, */
+#include <poll.h>       /* poll, */
+#include <pthread.h>    /* pthread_create, */
+#include <signal.h>     /* signal, SIG* */
+#include <stdio.h>      /* printf, */
+#include <stdlib.h>     /* malloc, */
+#include <string.h>     /* strerror, */
+#include <sys/socket.h> /* SOCK_*, */
+#include <unistd.h>     /* close, sysconf */
+
+struct _nhttp_thread {
+  pthread_t            tid;
+  struct nhttp_server *s;
+  struct _nhttp_queue *inbox;
+  int                  cpu; /* -1 if not pinned */
+};
+
+static void *_nhttp_thread_main(void *arg) {
+  struct _nhttp_thread     *t    = arg;
+  struct _nhttp_buf_writer *shed = t->s->shed_response;
+  struct _nhttp_codel       codel;
+  int                       connfd;
+  long                      pushed_at, now;
+  ssize_t                   n;
+  char                      discard[4096];
+
+  /* pinned before serving, so its buffers are allocated locally */
+  if (t->cpu != -1 && _nhttp_cpu_pin(t->cpu)) {
+    printf("could not pin worker thread to cpu %d: %s\n", t->cpu,
+           strerror(errno));
+  }
+
+  if (t->s->io != NHTTP_SERVER_IO_BLOCKING) {
+    _nhttp_loop_run(t->s, -1, t->inbox); /* returns once drained */
+    return NULL;
+  }
+
+  /* blocking mode: serve handed over connections one at a time, shedding */
+  /* the ones that have been waiting in the queue for too long */
+  _nhttp_codel_init(&codel, t->s->shed_target_ms,
+                    NHTTP_SERVER_SHED_INTERVAL_MS, _nhttp_util_now_ms());
+  while (1) {
+    while ((connfd = _nhttp_queue_pop_timed(t->inbox, &pushed_at)) != -1) {
+      now = _nhttp_util_now_ms();
+      if (t->s->shed_target_ms &&
+          !_nhttp_codel_admit(&codel, now - pushed_at, now)) {
+        /* best effort, the request is not parsed, only drained so that */
+        /* closing with unread data doesn't reset the conn under the 503 */
+        n = recv(connfd, discard, sizeof(discard), MSG_DONTWAIT);
+        n = send(connfd, shed->buf, shed->len, MSG_DONTWAIT);
+        (void)n;
+        close(connfd);
+        continue;
+      }
+      _nhttp_server_dispatch(t->s, connfd);
+    }
+    /* the acceptor has stopped pushing before it started draining */
+    if (_nhttp_upgrade_draining())
+      break;
+    _nhttp_queue_wait(t->inbox);
+  }
+  return NULL;
+}
+
+/* _nhttp_threads_on_cpu returns the index of the first worker pinned to */
+/* `cpu`, or -1 if there is none. */
+static int _nhttp_threads_on_cpu(const struct _nhttp_thread *threads,
+                                 int nthreads, int cpu) {
+  int i;
+  for (i = 0; cpu != -1 && i < nthreads; i++) {
+    if (threads[i].cpu == cpu)
+      return i;
+  }
+  return -1;
+}
+
+void nhttp_server_run_threads(struct nhttp_server *s, int port, int nthreads) {
+  struct _nhttp_thread *threads;
+  int                   sockfd, connfd, i, next = 0, err;
+  int                   flags, spare_fd, first;
+  struct pollfd         pfd;
+
+  if (nthreads <= 0 && s->ncpus) {
+    nthreads = s->ncpus;
+  } else if (nthreads <= 0) {
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0) {
+      nthreads = 1;
+    }
+  }
+
+  /* ignore SIGPIPE which is raised when client closes the conn */
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    _nhttp_panicf("could not set ignoring SIGPIPE: %s", strerror(errno));
+  }
+
+  /* the upgrade signal is installed before creating the workers, which */
+  /* inherit it blocked, so that only the acceptor gets interrupted by it */
+  if (s->upgrade_signal) {
+    _nhttp_upgrade_install(s->upgrade_signal, 1);
+  }
+
+  sockfd = _nhttp_server_listen(s, port, 0);
+  _nhttp_upgrade_close_inherited();
+  threads = malloc((size_t)nthreads * sizeof(struct _nhttp_thread));
+  for (i = 0; i < nthreads; i++) {
+    threads[i].s     = s;
+    threads[i].inbox = _nhttp_queue_create();
+    threads[i].cpu   = s->ncpus ? s->cpus[i % s->ncpus] : -1;
+    if ((err = pthread_create(&threads[i].tid, NULL, _nhttp_thread_main,
+                              &threads[i]))) {
+      _nhttp_panicf("could not create worker thread: %s", strerror(err));
+    }
+  }
+  printf("server listening with %d threads!\n", nthreads);
+
+  /* workers in non-blocking modes get non-blocking connections */
+  flags    = s->io == NHTTP_SERVER_IO_BLOCKING ? SOCK_CLOEXEC
+                                               : SOCK_CLOEXEC | SOCK_NONBLOCK;
+  spare_fd = _nhttp_util_open_spare_fd();
+  pfd.fd     = sockfd;
+  pfd.events = POLLIN;
+  if (s->upgrade_signal) {
+    _nhttp_util_set_nonblocking(sockfd);
+  }
+  while (!_nhttp_upgrade_draining()) {
+    if (_nhttp_upgrade_requested()) {
+      _nhttp_upgrade_start(&sockfd, 1);
+      continue;
+    }
+    if (s->upgrade_signal && _nhttp_upgrade_poll(&pfd, 1, -1) == -1)
+      continue;
+    connfd = _nhttp_util_accept(sockfd, flags, &spare_fd);
+    if (connfd < 0) {
+      if (errno == EMFILE || errno == ENFILE) {
+        poll(NULL, 0, NHTTP_SERVER_ACCEPT_BACKOFF_MS);
+        spare_fd = spare_fd == -1 ? _nhttp_util_open_spare_fd() : spare_fd;
+      }
+      continue;
+    }
+    /* to the worker pinned to the cpu which received the connection, */
+    /* round-robin otherwise, skipping the workers whose queue is full */
+    first = s->ncpus ? _nhttp_threads_on_cpu(threads, nthreads,
+                                             _nhttp_cpu_incoming(connfd))
+                     : -1;
+    for (i = 0; i < nthreads; i++) {
+      if (_nhttp_queue_push(
+              threads[((first != -1 ? first : next) + i) % nthreads].inbox,
+              connfd) == 0) {
+        break;
+      }
+    }
+    if (first == -1) {
+      next = (next + i + 1) % nthreads;
+    }
+    if (i == nthreads) {
+      close(connfd); /* all of the workers are saturated */
+    }
+  }
+
+  /* drained after an upgrade: wake the workers up to notice it */
+  for (i = 0; i < nthreads; i++) {
+    _nhttp_queue_wake(threads[i].inbox);
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i].tid, NULL);
+    _nhttp_queue_free(threads[i].inbox);
+  }
+  free(threads);
+  if (spare_fd != -1) {
+    close(spare_fd);
+  }
+  close(sockfd);
+}
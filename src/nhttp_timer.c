@@ -0,0 +1,158 @@
+#include "nhttp_timer.h"
+
+/* _nhttp_timer_slot returns the head of the slot of level `level` which */
+/* covers `tick`. */
+#define _nhttp_timer_slot(w, level, tick)                                      \
+  (&(w)->slots[level][((tick) >> ((level) * NHTTP_TIMER_WHEEL_BITS)) &        \
+                      NHTTP_TIMER_WHEEL_MASK])
+
+static void _nhttp_timer_place(struct _nhttp_timer_wheel *w,
+                               struct _nhttp_timer       *t);
+static void _nhttp_timer_cascade(struct _nhttp_timer_wheel *w, int level);
+
+void _nhttp_timer_wheel_init(struct _nhttp_timer_wheel *w, long now) {
+  struct _nhttp_timer *head;
+  int                  level, i;
+
+  w->now   = now;
+  w->count = 0;
+  for (level = 0; level < NHTTP_TIMER_WHEEL_LEVELS; level++) {
+    for (i = 0; i < NHTTP_TIMER_WHEEL_SLOTS; i++) {
+      head       = &w->slots[level][i];
+      head->prev = head->next = head;
+    }
+  }
+}
+
+void _nhttp_timer_init(struct _nhttp_timer *t,
+                       void (*fn)(struct _nhttp_timer *t), void *data) {
+  t->prev = t->next = NULL;
+  t->expires        = 0;
+  t->fn             = fn;
+  t->data           = data;
+}
+
+void _nhttp_timer_add(struct _nhttp_timer_wheel *w, struct _nhttp_timer *t,
+                      long expires) {
+  long max = w->now + (1L << (NHTTP_TIMER_WHEEL_LEVELS *
+                              NHTTP_TIMER_WHEEL_BITS)) - 1;
+
+  _nhttp_timer_remove(w, t);
+  if (expires <= w->now) {
+    expires = w->now + 1;
+  } else if (expires > max) {
+    expires = max;
+  }
+  t->expires = expires;
+  _nhttp_timer_place(w, t);
+  w->count++;
+}
+
+void _nhttp_timer_remove(struct _nhttp_timer_wheel *w, struct _nhttp_timer *t) {
+  if (t->next == NULL)
+    return; /* not pending */
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->prev = t->next = NULL;
+  w->count--;
+}
+
+int _nhttp_timer_pending(const struct _nhttp_timer *t) {
+  return t->next != NULL;
+}
+
+/* _nhttp_timer_place links the timer into the slot of the lowest level */
+/* that covers its expiry, i.e. the level whose span of 64 slots starting */
+/* at the current tick contains it. */
+static void _nhttp_timer_place(struct _nhttp_timer_wheel *w,
+                               struct _nhttp_timer       *t) {
+  struct _nhttp_timer *head;
+  long                 delta = t->expires - w->now;
+  int                  level = 0;
+
+  while (level < NHTTP_TIMER_WHEEL_LEVELS - 1 &&
+         delta >= 1L << ((level + 1) * NHTTP_TIMER_WHEEL_BITS))
+    level++;
+  head             = _nhttp_timer_slot(w, level, t->expires);
+  t->prev          = head->prev;
+  t->next          = head;
+  head->prev->next = t;
+  head->prev       = t;
+}
+
+/* _nhttp_timer_cascade moves the timers of the slot of `level` covering */
+/* the current tick into the levels below. */
+static void _nhttp_timer_cascade(struct _nhttp_timer_wheel *w, int level) {
+  struct _nhttp_timer *head = _nhttp_timer_slot(w, level, w->now);
+  struct _nhttp_timer *t, *next;
+
+  t          = head->next;
+  head->prev = head->next = head;
+  for (; t != head; t = next) {
+    next = t->next;
+    _nhttp_timer_place(w, t);
+  }
+}
+
+void _nhttp_timer_advance(struct _nhttp_timer_wheel *w, long now) {
+  struct _nhttp_timer  expired, *head, *t;
+  int                  level;
+
+  while (w->now < now) {
+    if (w->count == 0) {
+      w->now = now; /* nothing to run or cascade */
+      return;
+    }
+    w->now++;
+
+    /* entering a new span of level 0 (and possibly of the levels above) */
+    for (level = 1; level < NHTTP_TIMER_WHEEL_LEVELS &&
+                    !(w->now & ((1L << (level * NHTTP_TIMER_WHEEL_BITS)) - 1));
+         level++)
+      ;
+    while (--level > 0)
+      _nhttp_timer_cascade(w, level);
+
+    /* detach the expired timers first, as `fn` may add timers */
+    head = _nhttp_timer_slot(w, 0, w->now);
+    if (head->next == head)
+      continue;
+    expired.next       = head->next;
+    expired.prev       = head->prev;
+    expired.next->prev = &expired;
+    expired.prev->next = &expired;
+    head->prev = head->next = head;
+    while ((t = expired.next) != &expired) {
+      expired.next  = t->next;
+      t->next->prev = &expired;
+      t->prev = t->next = NULL;
+      w->count--;
+      t->fn(t);
+    }
+  }
+}
+
+long _nhttp_timer_next(const struct _nhttp_timer_wheel *w) {
+  const struct _nhttp_timer *head;
+  long                       span, next = -1, start;
+  int                        level, i;
+
+  if (w->count == 0)
+    return -1;
+
+  /* the first non-empty slot of every level, level 0 slots expire on */
+  /* their tick, the slots above get cascaded at the start of their span */
+  for (level = 0; level < NHTTP_TIMER_WHEEL_LEVELS; level++) {
+    span = w->now >> (level * NHTTP_TIMER_WHEEL_BITS);
+    for (i = 1; i <= NHTTP_TIMER_WHEEL_SLOTS; i++) {
+      head = &w->slots[level][(span + i) & NHTTP_TIMER_WHEEL_MASK];
+      if (head->next != head) {
+        start = (span + i) << (level * NHTTP_TIMER_WHEEL_BITS);
+        if (next == -1 || start - w->now < next)
+          next = start - w->now;
+        break;
+      }
+    }
+  }
+  return next;
+}
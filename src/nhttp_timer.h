@@ -0,0 +1,70 @@
+#ifndef NHTTP_TIMER_H
+#define NHTTP_TIMER_H
+
+#include <stddef.h> /* size_t, */
+
+/* number of slots of a level of the timer wheel is 2^NHTTP_TIMER_WHEEL_BITS */
+#define NHTTP_TIMER_WHEEL_BITS 6
+#define NHTTP_TIMER_WHEEL_SLOTS (1 << NHTTP_TIMER_WHEEL_BITS)
+#define NHTTP_TIMER_WHEEL_MASK (NHTTP_TIMER_WHEEL_SLOTS - 1)
+/* number of levels of the timer wheel. With a tick of 1ms, they cover */
+/* 64^4ms (~4.6 hours), longer timeouts are clamped to that. */
+#define NHTTP_TIMER_WHEEL_LEVELS 4
+
+/* nhttp timer wheel is a hierarchical timing wheel with a tick of 1ms, */
+/* which keeps adding, removing and rescheduling timers O(1), regardless of */
+/* the number of connections they belong to. */
+/* Level 0 has a slot for each of the next 64 ticks, level 1 a slot for each */
+/* of the next 64 spans of 64 ticks, and so on. A timer goes into the slot */
+/* of the lowest level that covers its expiry, and whenever the wheel */
+/* enters a new span of a level, the timers of the corresponding slot of the */
+/* level above are moved down (cascaded) into finer slots. */
+/* Timers are embedded into the structures they belong to, so the wheel */
+/* never allocates. */
+
+struct _nhttp_timer {
+  struct _nhttp_timer *prev, *next; /* NULL if the timer is not pending */
+  long                 expires;     /* ms, see `_nhttp_util_now_ms` */
+  void (*fn)(struct _nhttp_timer *t); /* called once the timer expires */
+  void *data;
+};
+
+struct _nhttp_timer_wheel {
+  long   now;   /* ms, timers that expired by `now` have been run */
+  size_t count; /* number of pending timers */
+  /* heads of the circular lists of timers of every slot */
+  struct _nhttp_timer slots[NHTTP_TIMER_WHEEL_LEVELS][NHTTP_TIMER_WHEEL_SLOTS];
+};
+
+/* _nhttp_timer_wheel_init initializes an empty timer wheel, with `now` as */
+/* the current time in ms. */
+void _nhttp_timer_wheel_init(struct _nhttp_timer_wheel *w, long now);
+
+/* _nhttp_timer_init initializes a timer which calls `fn` once it expires. */
+/* `data` is not used by the wheel, it is left for `fn`. */
+void _nhttp_timer_init(struct _nhttp_timer *t,
+                       void (*fn)(struct _nhttp_timer *t), void *data);
+
+/* _nhttp_timer_add schedules the timer to expire at `expires` ms, */
+/* rescheduling it if it is already pending. Timers that expire before the */
+/* current time of the wheel expire on its next tick. */
+void _nhttp_timer_add(struct _nhttp_timer_wheel *w, struct _nhttp_timer *t,
+                      long expires);
+
+/* _nhttp_timer_remove unschedules the timer, if it is pending. */
+void _nhttp_timer_remove(struct _nhttp_timer_wheel *w, struct _nhttp_timer *t);
+
+/* _nhttp_timer_pending reports whether the timer is scheduled. */
+int _nhttp_timer_pending(const struct _nhttp_timer *t);
+
+/* _nhttp_timer_advance advances the wheel up to `now` ms, calling `fn` of */
+/* every timer that expires in the meantime, in the order of expiry. */
+/* `fn` is free to add and remove timers, including the expired one. */
+void _nhttp_timer_advance(struct _nhttp_timer_wheel *w, long now);
+
+/* _nhttp_timer_next returns the number of ms until the wheel has to be */
+/* advanced next, or -1 if there are no pending timers. It may be earlier */
+/* than the next expiry, when timers have to be cascaded, but never later. */
+long _nhttp_timer_next(const struct _nhttp_timer_wheel *w);
+
+#endif /* NHTTP_TIMER_H */
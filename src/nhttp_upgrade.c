@@ -0,0 +1,287 @@
+#define _GNU_SOURCE /* ppoll, pipe2 */
+#include "nhttp_upgrade.h"
+#include "nhttp_util.h"
+#include <errno.h>     /* errno, */
+#include <fcntl.h>     /* fcntl, open, O_* */
+#include <limits.h>    /* PATH_MAX, */
+#include <pthread.h>   /* pthread_self, pthread_sigmask */
+#include <stdio.h>     /* printf, sprintf */
+#include <stdlib.h>    /* malloc, realloc, free, getenv, unsetenv, strtol */
+#include <string.h>    /* memset, memcmp, strlen, strncmp, strerror */
+#include <sys/types.h> /* pid_t, */
+#include <sys/wait.h>  /* waitpid, */
+#include <unistd.h>    /* fork, execve, readlink, read, write, close */
+
+extern char **environ;
+
+enum _nhttp_upgrade_state {
+  NHTTP_UPGRADE_NONE,
+  NHTTP_UPGRADE_REQUESTED,
+  NHTTP_UPGRADE_DRAINING
+};
+
+/* written by the signal handler, and read by all of the serving threads */
+static volatile sig_atomic_t _nhttp_upgrade_state = NHTTP_UPGRADE_NONE;
+
+static int       _nhttp_upgrade_installed = 0;
+static pthread_t _nhttp_upgrade_thread; /* which installed the handler */
+static sigset_t  _nhttp_upgrade_wait_mask;
+
+/* inherited listening sockets, -1 once taken. Parsed on first use. */
+static int _nhttp_upgrade_fds[NHTTP_UPGRADE_MAX_FDS];
+static int _nhttp_upgrade_nfds = -1;
+
+static void _nhttp_upgrade_on_request(int sig) {
+  (void)sig;
+  if (_nhttp_upgrade_state == NHTTP_UPGRADE_NONE)
+    _nhttp_upgrade_state = NHTTP_UPGRADE_REQUESTED;
+}
+
+static void _nhttp_upgrade_on_drain(int sig) {
+  (void)sig;
+  _nhttp_upgrade_state = NHTTP_UPGRADE_DRAINING;
+}
+
+void _nhttp_upgrade_install(int sig, int owner) {
+  struct sigaction sa;
+  sigset_t         mask;
+
+  /* no SA_RESTART, so that blocking waits get interrupted */
+  memset(&sa, 0, sizeof(struct sigaction));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = owner ? _nhttp_upgrade_on_request : _nhttp_upgrade_on_drain;
+  if (sigaction(sig, &sa, NULL)) {
+    _nhttp_panicf("could not set upgrade signal handler: %s", strerror(errno));
+  }
+
+  sigemptyset(&mask);
+  sigaddset(&mask, sig);
+  pthread_sigmask(SIG_BLOCK, &mask, &_nhttp_upgrade_wait_mask);
+  sigdelset(&_nhttp_upgrade_wait_mask, sig);
+  _nhttp_upgrade_thread    = pthread_self();
+  _nhttp_upgrade_installed = 1;
+}
+
+static int _nhttp_upgrade_load_state(void) {
+  return __atomic_load_n(&_nhttp_upgrade_state, __ATOMIC_ACQUIRE);
+}
+
+int _nhttp_upgrade_requested(void) {
+  return _nhttp_upgrade_load_state() == NHTTP_UPGRADE_REQUESTED;
+}
+
+int _nhttp_upgrade_draining(void) {
+  return _nhttp_upgrade_load_state() == NHTTP_UPGRADE_DRAINING;
+}
+
+int _nhttp_upgrade_pending(void) {
+  return _nhttp_upgrade_load_state() != NHTTP_UPGRADE_NONE;
+}
+
+const sigset_t *_nhttp_upgrade_sigmask(void) {
+  if (!_nhttp_upgrade_installed ||
+      !pthread_equal(pthread_self(), _nhttp_upgrade_thread))
+    return NULL;
+  return &_nhttp_upgrade_wait_mask;
+}
+
+int _nhttp_upgrade_poll(struct pollfd *fds, nfds_t nfds, int timeout_ms) {
+  struct timespec ts;
+  ts.tv_sec  = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  return ppoll(fds, nfds, timeout_ms < 0 ? NULL : &ts,
+               _nhttp_upgrade_sigmask());
+}
+
+/* _nhttp_upgrade_read_file reads the whole (small, e.g. procfs) file into */
+/* a malloc'd buffer. Returns its length, or -1 on error. */
+static ssize_t _nhttp_upgrade_read_file(const char *path, char **out) {
+  size_t  cap = 4096, len = 0;
+  ssize_t n;
+  int     fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    return -1;
+  *out = malloc(cap);
+  while ((n = read(fd, *out + len, cap - len)) != 0) {
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      free(*out);
+      close(fd);
+      return -1;
+    }
+    len += (size_t)n;
+    if (len == cap) {
+      cap *= 2;
+      *out = realloc(*out, cap);
+    }
+  }
+  close(fd);
+  return (ssize_t)len;
+}
+
+/* _nhttp_upgrade_exec forks and executes the binary the process was */
+/* started from, with the same arguments and environment, plus the passed */
+/* fds listed in NHTTP_UPGRADE_ENV. Everything the child needs is prepared */
+/* before forking, as the child of a multithreaded process may only call */
+/* async-signal-safe functions. The child reports a failed execve through */
+/* a close-on-exec pipe, which gets closed by a successful one instead. */
+/* Returns 0 once the exec succeeded, -1 with errno set otherwise. */
+static int _nhttp_upgrade_exec(const int *fds, int nfds) {
+  char     path[PATH_MAX], *cmdline = NULL, **argv = NULL, **envp = NULL;
+  char    *env = NULL, *p;
+  ssize_t  len, n;
+  size_t   deleted = strlen(" (deleted)");
+  size_t   env_len = strlen(NHTTP_UPGRADE_ENV);
+  int      argc = 0, nenv = 0, i, j, err = 0, errpipe[2];
+  pid_t    pid;
+  sigset_t empty;
+
+  /* the binary has usually been replaced by the deploy, in which case the */
+  /* link points to the path of the unlinked old one */
+  if ((len = readlink("/proc/self/exe", path, PATH_MAX - 1)) == -1)
+    return -1;
+  path[len] = '\0';
+  if ((size_t)len > deleted &&
+      !strcmp(path + (size_t)len - deleted, " (deleted)"))
+    path[(size_t)len - deleted] = '\0';
+
+  if ((len = _nhttp_upgrade_read_file("/proc/self/cmdline", &cmdline)) <= 0)
+    return -1;
+  for (i = 0; i < len; i++)
+    argc += cmdline[i] == '\0';
+  argv = malloc((size_t)(argc + 1) * sizeof(char *));
+  for (p = cmdline, i = 0; i < argc; p += strlen(p) + 1, i++)
+    argv[i] = p;
+  argv[argc] = NULL;
+
+  env = malloc(env_len + 2 + (size_t)nfds * 12);
+  p   = env + sprintf(env, "%s=", NHTTP_UPGRADE_ENV);
+  for (i = 0; i < nfds; i++)
+    p += sprintf(p, i ? ",%d" : "%d", fds[i]);
+  while (environ[nenv] != NULL)
+    nenv++;
+  envp = malloc((size_t)(nenv + 2) * sizeof(char *));
+  for (i = 0, j = 0; i < nenv; i++) {
+    if (strncmp(environ[i], NHTTP_UPGRADE_ENV, env_len) ||
+        environ[i][env_len] != '=')
+      envp[j++] = environ[i];
+  }
+  envp[j++] = env;
+  envp[j]   = NULL;
+
+  if (pipe2(errpipe, O_CLOEXEC)) {
+    err = errno;
+  } else if ((pid = fork()) == -1) {
+    err = errno;
+    close(errpipe[0]);
+    close(errpipe[1]);
+  } else if (pid == 0) {
+    /* the sockets are inherited, and the new process starts with no */
+    /* signals blocked */
+    close(errpipe[0]);
+    for (i = 0; i < nfds; i++)
+      fcntl(fds[i], F_SETFD, 0);
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+    execve(path, argv, envp);
+    err = errno;
+    n   = write(errpipe[1], &err, sizeof(int));
+    (void)n;
+    _exit(127);
+  } else {
+    close(errpipe[1]);
+    while ((n = read(errpipe[0], &err, sizeof(int))) == -1 && errno == EINTR)
+      ;
+    close(errpipe[0]);
+    if (n == sizeof(int)) {
+      waitpid(pid, NULL, 0);
+    } else {
+      err = 0; /* the pipe got closed by the exec */
+    }
+  }
+
+  free(envp);
+  free(env);
+  free(argv);
+  free(cmdline);
+  errno = err;
+  return err ? -1 : 0;
+}
+
+int _nhttp_upgrade_start(const int *fds, int nfds) {
+  if (_nhttp_upgrade_exec(fds, nfds)) {
+    printf("upgrade failed, could not execute the new binary: %s\n",
+           strerror(errno));
+    __atomic_store_n(&_nhttp_upgrade_state, NHTTP_UPGRADE_NONE,
+                     __ATOMIC_RELEASE);
+    return -1;
+  }
+  printf("upgrade started, draining connections\n");
+  __atomic_store_n(&_nhttp_upgrade_state, NHTTP_UPGRADE_DRAINING,
+                   __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* _nhttp_upgrade_parse parses NHTTP_UPGRADE_ENV, keeping the fds which */
+/* are listening sockets, and removes it from the environment so that */
+/* processes started by the server don't see it. */
+static void _nhttp_upgrade_parse(void) {
+  const char *env = getenv(NHTTP_UPGRADE_ENV);
+  char       *end;
+  long        fd;
+  int         listening;
+  socklen_t   len = sizeof(int);
+
+  _nhttp_upgrade_nfds = 0;
+  if (env == NULL)
+    return;
+  while (*env && _nhttp_upgrade_nfds < NHTTP_UPGRADE_MAX_FDS) {
+    fd = strtol(env, &end, 10);
+    if (end == env)
+      break;
+    if (fd >= 0 && fd <= INT_MAX &&
+        getsockopt((int)fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) ==
+            0 &&
+        listening) {
+      _nhttp_upgrade_fds[_nhttp_upgrade_nfds++] = (int)fd;
+    }
+    env = *end == ',' ? end + 1 : end;
+  }
+  unsetenv(NHTTP_UPGRADE_ENV);
+}
+
+int _nhttp_upgrade_take(const struct sockaddr *addr, socklen_t addrlen) {
+  struct sockaddr_storage bound;
+  socklen_t               len;
+  int                     i, fd;
+
+  if (_nhttp_upgrade_nfds == -1)
+    _nhttp_upgrade_parse();
+  for (i = 0; i < _nhttp_upgrade_nfds; i++) {
+    if ((fd = _nhttp_upgrade_fds[i]) == -1)
+      continue;
+    len = sizeof(struct sockaddr_storage);
+    memset(&bound, 0, sizeof(struct sockaddr_storage));
+    if (getsockname(fd, (struct sockaddr *)&bound, &len) == 0 &&
+        len == addrlen && !memcmp(&bound, addr, addrlen)) {
+      _nhttp_upgrade_fds[i] = -1;
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      return fd;
+    }
+  }
+  return -1;
+}
+
+void _nhttp_upgrade_close_inherited(void) {
+  int i;
+  if (_nhttp_upgrade_nfds == -1)
+    _nhttp_upgrade_parse();
+  for (i = 0; i < _nhttp_upgrade_nfds; i++) {
+    if (_nhttp_upgrade_fds[i] != -1) {
+      close(_nhttp_upgrade_fds[i]);
+      _nhttp_upgrade_fds[i] = -1;
+    }
+  }
+}
@@ -0,0 +1,76 @@
+#ifndef NHTTP_UPGRADE_H
+#define NHTTP_UPGRADE_H
+
+#include <poll.h>       /* struct pollfd, nfds_t */
+#include <signal.h>     /* sigset_t, */
+#include <sys/socket.h> /* struct sockaddr, socklen_t */
+
+/* nhttp upgrade replaces a running server with a new instance of its */
+/* binary (e.g. after deploying a new build) without refusing connections: */
+/* 1: on the upgrade signal (see `nhttp_server_set_upgrade_signal`), the */
+/*    process which owns the listening sockets re-executes the binary at */
+/*    the path it was started from, with the same arguments, passing the */
+/*    listening sockets down as inherited fds listed in NHTTP_UPGRADE_ENV. */
+/* 2: the new process picks them up in place of creating its own sockets */
+/*    (`_nhttp_upgrade_take`), so the accept backlog and the connections */
+/*    queued in it survive the restart. */
+/* 3: once the exec succeeded, the old process drains: it stops accepting, */
+/*    closes its idle keep-alive connections, answers the requests in */
+/*    flight with `Connection: close`, and its serving loops return once */
+/*    all of its connections are closed. */
+/* If the exec fails, the old process logs the error and keeps serving. */
+/* The signal is blocked outside of the waits of the thread which installed */
+/* its handler (`_nhttp_upgrade_sigmask`), so it is never missed between */
+/* checking the state and going to sleep. */
+
+/* environment variable listing the inherited fds, comma separated */
+#define NHTTP_UPGRADE_ENV "NHTTP_LISTEN_FDS"
+/* at most this many listening sockets are passed down */
+#define NHTTP_UPGRADE_MAX_FDS 256
+
+/* _nhttp_upgrade_install installs the handler of `sig` and blocks it in */
+/* the calling thread (and in the threads it creates afterwards). If */
+/* `owner` is non-zero, the signal requests an upgrade, to be carried out */
+/* by the caller with `_nhttp_upgrade_start`. Otherwise (e.g. in worker */
+/* processes, whose supervisor owns the sockets) it starts draining. */
+void _nhttp_upgrade_install(int sig, int owner);
+
+/* _nhttp_upgrade_requested reports whether an upgrade has been requested, */
+/* but not started yet. */
+int _nhttp_upgrade_requested(void);
+
+/* _nhttp_upgrade_draining reports whether the process is draining. */
+int _nhttp_upgrade_draining(void);
+
+/* _nhttp_upgrade_pending reports whether an upgrade has been requested or */
+/* the process is draining, i.e. whether connections must not be kept */
+/* alive anymore. Safe to call from any thread. */
+int _nhttp_upgrade_pending(void);
+
+/* _nhttp_upgrade_start executes the new binary with the passed listening */
+/* sockets, and starts draining. Returns 0 once the exec succeeded, and -1 */
+/* if it failed, in which case the request is dropped. */
+int _nhttp_upgrade_start(const int *fds, int nfds);
+
+/* _nhttp_upgrade_sigmask returns the signal mask to wait with, which */
+/* unblocks the upgrade signal, for the thread which installed its */
+/* handler. Returns NULL (i.e. keep the current mask) for other threads, */
+/* or if no handler was installed. */
+const sigset_t *_nhttp_upgrade_sigmask(void);
+
+/* _nhttp_upgrade_poll is poll(2), waiting with `_nhttp_upgrade_sigmask`. */
+/* Fails with EINTR once the upgrade signal arrived. */
+int _nhttp_upgrade_poll(struct pollfd *fds, nfds_t nfds, int timeout_ms);
+
+/* _nhttp_upgrade_take returns the listening socket bound to `addr` that */
+/* was inherited from the previous process, or -1 if there is none. */
+/* Every inherited socket is only returned once, and gets its */
+/* close-on-exec flag back. */
+int _nhttp_upgrade_take(const struct sockaddr *addr, socklen_t addrlen);
+
+/* _nhttp_upgrade_close_inherited closes the inherited listening sockets */
+/* which haven't been taken, as connections queued on them would never */
+/* get accepted. Call it once all of the listening sockets are created. */
+void _nhttp_upgrade_close_inherited(void);
+
+#endif /* NHTTP_UPGRADE_H */
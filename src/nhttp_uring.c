@@ -0,0 +1,852 @@
+#define _GNU_SOURCE /* F_SETPIPE_SZ, F_GETPIPE_SZ, pipe2 */
+#include "nhttp_uring.h"
+#include "nhttp_codel.h"
+#include "nhttp_coro.h"
+#include "nhttp_upgrade.h"
+#include "nhttp_util.h"
+#include <errno.h>          /* errno, E* */
+#include <fcntl.h>          /* fcntl, F_SETPIPE_SZ, O_* */
+#include <linux/io_uring.h> /* io_uring_*, IORING_* */
+#include <linux/time_types.h> /* __kernel_timespec, */
+#include <poll.h>           /* POLLIN, POLLOUT */
+#include <stdlib.h>         /* malloc, free */
+#include <string.h>         /* memset, memcpy, strerror */
+#include <sys/mman.h>       /* mmap, */
+#include <sys/socket.h>     /* SOCK_CLOEXEC, shutdown */
+#include <sys/syscall.h>    /* __NR_io_uring_* */
+#include <unistd.h>         /* syscall, close, pipe2 */
+
+/* operation kinds, encoded in the low bits of the sqe/cqe user_data next */
+/* to the (16 byte aligned) conn pointer. Accept uses user_data 0, the */
+/* timeout that backs accepting off uses NHTTP_URING_OP_TIMEOUT, and the */
+/* cancellation of the accept when draining uses NHTTP_URING_OP_CANCEL. */
+#define NHTTP_URING_OP_ACCEPT 0
+#define NHTTP_URING_OP_RECV 1
+#define NHTTP_URING_OP_SEND 2
+#define NHTTP_URING_OP_SPLICE_IN 3
+#define NHTTP_URING_OP_SPLICE_OUT 4
+#define NHTTP_URING_OP_TIMEOUT 5
+#define NHTTP_URING_OP_CANCEL 6
+#define NHTTP_URING_OP_POLL 7 /* the socket became writable */
+#define NHTTP_URING_OP_WAIT 8 /* a wait of a suspended handler */
+#define NHTTP_URING_OP_MASK 15UL
+
+struct _nhttp_uring {
+  int                  ring_fd;
+  int                  listenfd;
+  int                  spare_fd; /* see `_nhttp_util_accept` */
+  struct __kernel_timespec accept_backoff;
+  struct nhttp_server *s;
+  struct _nhttp_codel  codel;    /* if load shedding is enabled */
+  long                 ready_at; /* ms, since when the cqes of the last wait */
+                                 /* are pending, at most */
+  int                  accepting; /* the multishot accept is armed */
+  int                  draining;  /* after an upgrade */
+  struct _nhttp_uring_conn *conns; /* all of the open conns */
+  /* submission queue */
+  unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned             sq_entries;
+  unsigned             sq_local_tail; /* includes prepared, unpublished sqes */
+  struct io_uring_sqe *sqes;
+  /* completion queue */
+  unsigned            *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  /* provided buffer ring, buffer group 0 */
+  struct io_uring_buf_ring *br;
+  char                     *bufs;
+  unsigned short            br_tail;
+};
+
+/* the conn is advanced only when none of its operations are in flight, */
+/* which keeps it independent of how a chain of linked operations ended. */
+/* Handlers run as coroutines in async mode, and when the body of the */
+/* request has yet to be received: a suspended handler waits for a poll */
+/* of the awaited fd (or a timeout), and is resumed once it completed. */
+struct _nhttp_uring_conn {
+  int                       fd;
+  unsigned                  inflight; /* submitted, but not completed ops */
+  int                       failed;   /* close once inflight drops to 0 */
+  int                       responded;
+  int                       blocked; /* a splice found the socket full */
+  struct nhttp_server      *s;
+  struct _nhttp_coro       *coro;  /* running handlers, see above */
+  int                       woken; /* the wait of the coroutine succeeded */
+  long handler_deadline; /* ms, 0 if the handler has no timeout */
+  struct _nhttp_buf_reader *bufr;
+  struct _nhttp_buf_writer *bufw;
+  struct _nhttp_parser      parser;    /* of the next request head */
+  struct _nhttp_server_body body;      /* of the last request */
+  int                       pipefd[2]; /* created on first file send */
+  size_t                    pipe_size;
+  size_t                    pipe_fill; /* bytes spliced in, not yet out */
+  int                       requests;  /* number of requests served */
+  int                       keepalive; /* keep open after the response */
+  enum _nhttp_server_phase  phase;
+  long                      deadline; /* ms, of the phase, 0 if none */
+  struct __kernel_timespec  recv_ts, send_ts, wait_ts; /* of the timeouts */
+  long ready_since; /* ms, since when a request waits for the ring, or 0 */
+  struct _nhttp_uring_conn *prev, *next; /* in the list of conns */
+};
+
+static int _nhttp_uring_setup(struct _nhttp_uring *u);
+static struct io_uring_sqe *_nhttp_uring_get_sqe(struct _nhttp_uring *u);
+static int  _nhttp_uring_submit_and_wait(struct _nhttp_uring *u);
+static void _nhttp_uring_recycle_buf(struct _nhttp_uring *u, unsigned bid);
+static void _nhttp_uring_arm_accept(struct _nhttp_uring *u);
+static void _nhttp_uring_arm_accept_backoff(struct _nhttp_uring *u);
+static void _nhttp_uring_arm_recv(struct _nhttp_uring      *u,
+                                  struct _nhttp_uring_conn *c);
+static void _nhttp_uring_link_timeout(struct _nhttp_uring      *u,
+                                      struct _nhttp_uring_conn *c,
+                                      struct io_uring_sqe      *sqe,
+                                      struct __kernel_timespec *ts, long ms,
+                                      unsigned long op);
+static void _nhttp_uring_on_cqe(struct _nhttp_uring *u,
+                                struct io_uring_cqe *cqe);
+static void _nhttp_uring_on_recv(struct _nhttp_uring      *u,
+                                 struct _nhttp_uring_conn *c,
+                                 struct io_uring_cqe      *cqe);
+static void _nhttp_uring_process(struct _nhttp_uring      *u,
+                                 struct _nhttp_uring_conn *c);
+static void _nhttp_uring_coro_main(void *arg);
+static int  _nhttp_uring_resume(struct _nhttp_uring      *u,
+                                struct _nhttp_uring_conn *c);
+static void _nhttp_uring_on_wait(struct _nhttp_uring      *u,
+                                 struct _nhttp_uring_conn *c,
+                                 struct io_uring_cqe      *cqe);
+static void _nhttp_uring_advance(struct _nhttp_uring      *u,
+                                 struct _nhttp_uring_conn *c);
+static void _nhttp_uring_drain(struct _nhttp_uring *u);
+static void _nhttp_uring_close(struct _nhttp_uring      *u,
+                               struct _nhttp_uring_conn *c);
+
+int _nhttp_uring_run(struct nhttp_server *s, int listenfd) {
+  struct _nhttp_uring u;
+  unsigned            head, tail;
+  long                waited_at, woke_at;
+
+  memset(&u, 0, sizeof(struct _nhttp_uring));
+  u.s        = s;
+  u.listenfd = listenfd;
+  if (_nhttp_uring_setup(&u)) {
+    return -1;
+  }
+  u.spare_fd = _nhttp_util_open_spare_fd();
+  /* the listening socket is only accepted on directly when shedding */
+  /* connections, which must not block */
+  _nhttp_util_set_nonblocking(listenfd);
+  _nhttp_codel_init(&u.codel, s->shed_target_ms, NHTTP_SERVER_SHED_INTERVAL_MS,
+                    _nhttp_util_now_ms());
+
+  _nhttp_uring_arm_accept(&u);
+  woke_at = _nhttp_util_now_ms();
+  while (1) {
+    waited_at = _nhttp_util_now_ms();
+    if (_nhttp_uring_submit_and_wait(&u) == -1 && errno != EINTR) {
+      _nhttp_panicf("io_uring_enter failed: %s", strerror(errno));
+    }
+    /* cqes reaped without blocking were already pending, possibly ever */
+    /* since the previous wait returned */
+    u.ready_at = woke_at;
+    woke_at    = _nhttp_util_now_ms();
+    if (woke_at > waited_at)
+      u.ready_at = woke_at;
+    head = *u.cq_head; /* only this thread advances the cq head */
+    tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      _nhttp_uring_on_cqe(&u, &u.cqes[head & *u.cq_mask]);
+    }
+    __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+
+    if (_nhttp_upgrade_requested())
+      _nhttp_upgrade_start(&u.listenfd, 1);
+    if (!u.draining && _nhttp_upgrade_draining())
+      _nhttp_uring_drain(&u);
+    /* a connection accepted by the multishot accept is only reported */
+    /* through its cqe, so the ring is kept until the accept terminated */
+    if (u.draining && u.conns == NULL && !u.accepting)
+      break;
+  }
+
+  close(u.ring_fd);
+  free(u.bufs);
+  if (u.spare_fd != -1)
+    close(u.spare_fd);
+  return 0;
+}
+
+static int _nhttp_uring_setup(struct _nhttp_uring *u) {
+  struct io_uring_params  p;
+  struct io_uring_buf_reg reg;
+  struct io_uring_probe  *probe;
+  size_t                  ring_sz;
+  char                   *sq_ptr;
+  unsigned                i;
+  int                     ops[7] = {IORING_OP_ACCEPT,       IORING_OP_RECV,
+                                    IORING_OP_SEND,         IORING_OP_SPLICE,
+                                    IORING_OP_TIMEOUT,      IORING_OP_POLL_ADD,
+                                    IORING_OP_LINK_TIMEOUT};
+
+  memset(&p, 0, sizeof(struct io_uring_params));
+  p.flags      = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+  p.cq_entries = NHTTP_URING_CQ_ENTRIES;
+  u->ring_fd   = (int)syscall(__NR_io_uring_setup, NHTTP_URING_ENTRIES, &p);
+  if (u->ring_fd == -1) {
+    return -1;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    close(u->ring_fd);
+    return -1;
+  }
+
+  /* check that all of the used operations are supported */
+  probe = malloc(sizeof(struct io_uring_probe) +
+                 256 * sizeof(struct io_uring_probe_op));
+  memset(probe, 0,
+         sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+  if (syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_PROBE, probe,
+              256)) {
+    free(probe);
+    close(u->ring_fd);
+    return -1;
+  }
+  for (i = 0; i < 7; i++) {
+    if (ops[i] > probe->last_op ||
+        !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+      free(probe);
+      close(u->ring_fd);
+      return -1;
+    }
+  }
+  free(probe);
+
+  /* sq and cq rings share a single mapping (IORING_FEAT_SINGLE_MMAP) */
+  ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > ring_sz) {
+    ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  }
+  sq_ptr = mmap(NULL, ring_sz, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED) {
+    close(u->ring_fd);
+    return -1;
+  }
+  u->sq_head    = (unsigned *)(sq_ptr + p.sq_off.head);
+  u->sq_tail    = (unsigned *)(sq_ptr + p.sq_off.tail);
+  u->sq_mask    = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+  u->sq_array   = (unsigned *)(sq_ptr + p.sq_off.array);
+  u->sq_entries = p.sq_entries;
+  u->cq_head    = (unsigned *)(sq_ptr + p.cq_off.head);
+  u->cq_tail    = (unsigned *)(sq_ptr + p.cq_off.tail);
+  u->cq_mask    = (unsigned *)(sq_ptr + p.cq_off.ring_mask);
+  u->cqes       = (struct io_uring_cqe *)(sq_ptr + p.cq_off.cqes);
+  u->sq_local_tail = *u->sq_tail;
+
+  u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd,
+                 IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    close(u->ring_fd);
+    return -1;
+  }
+
+  /* provided buffer ring (since Linux 5.19, as is multishot accept) */
+  u->br = mmap(NULL, NHTTP_URING_BUF_COUNT * sizeof(struct io_uring_buf),
+               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->br == MAP_FAILED) {
+    close(u->ring_fd);
+    return -1;
+  }
+  memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+  reg.ring_addr    = (unsigned long)u->br;
+  reg.ring_entries = NHTTP_URING_BUF_COUNT;
+  reg.bgid         = 0;
+  if (syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1)) {
+    close(u->ring_fd);
+    return -1;
+  }
+  u->bufs = malloc(NHTTP_URING_BUF_COUNT * NHTTP_URING_BUF_SIZE);
+  for (i = 0; i < NHTTP_URING_BUF_COUNT; i++) {
+    _nhttp_uring_recycle_buf(u, i);
+  }
+  return 0;
+}
+
+static struct io_uring_sqe *_nhttp_uring_get_sqe(struct _nhttp_uring *u) {
+  struct io_uring_sqe *sqe;
+  unsigned             idx;
+
+  /* sq is full: publish and submit what has been prepared so far */
+  while (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+         u->sq_entries) {
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    syscall(__NR_io_uring_enter, u->ring_fd, u->sq_entries, 0, 0, NULL, 0);
+  }
+
+  idx = u->sq_local_tail & *u->sq_mask;
+  sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  u->sq_array[idx] = idx;
+  u->sq_local_tail++;
+  return sqe;
+}
+
+/* _nhttp_uring_submit_and_wait submits the prepared sqes, and waits for */
+/* a cqe with `_nhttp_upgrade_sigmask`, failing with EINTR once the upgrade */
+/* signal arrived (unless some sqes got submitted). When busy polling, it */
+/* reaps cqes without sleeping for up to the busy poll time first. */
+static int _nhttp_uring_submit_and_wait(struct _nhttp_uring *u) {
+  unsigned        to_submit = u->sq_local_tail - *u->sq_tail;
+  const sigset_t *sigmask   = _nhttp_upgrade_sigmask();
+  long            until;
+
+  __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+  if (u->s->busy_poll_us > 0) {
+    until = _nhttp_util_now_us() + u->s->busy_poll_us;
+    do {
+      if (syscall(__NR_io_uring_enter, u->ring_fd, to_submit, 0,
+                  IORING_ENTER_GETEVENTS, NULL, 0) == -1)
+        return -1;
+      to_submit = 0;
+      if (*u->cq_head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    } while (_nhttp_util_now_us() < until);
+  }
+  return (int)syscall(__NR_io_uring_enter, u->ring_fd, to_submit, 1,
+                      IORING_ENTER_GETEVENTS, sigmask,
+                      sigmask != NULL ? _NSIG / 8 : 0);
+}
+
+static void _nhttp_uring_recycle_buf(struct _nhttp_uring *u, unsigned bid) {
+  struct io_uring_buf *buf =
+      &u->br->bufs[u->br_tail & (NHTTP_URING_BUF_COUNT - 1)];
+  buf->addr = (unsigned long)(u->bufs + bid * NHTTP_URING_BUF_SIZE);
+  buf->len  = NHTTP_URING_BUF_SIZE;
+  buf->bid  = (unsigned short)bid;
+  u->br_tail++;
+  __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static void _nhttp_uring_arm_accept(struct _nhttp_uring *u) {
+  struct io_uring_sqe *sqe = _nhttp_uring_get_sqe(u);
+  sqe->opcode              = IORING_OP_ACCEPT;
+  sqe->fd                  = u->listenfd;
+  sqe->ioprio              = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags        = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data           = NHTTP_URING_OP_ACCEPT;
+  u->accepting             = 1;
+}
+
+static void _nhttp_uring_arm_accept_backoff(struct _nhttp_uring *u) {
+  struct io_uring_sqe *sqe = _nhttp_uring_get_sqe(u);
+  if (u->spare_fd == -1)
+    u->spare_fd = _nhttp_util_open_spare_fd();
+  u->accept_backoff.tv_sec  = 0;
+  u->accept_backoff.tv_nsec = NHTTP_SERVER_ACCEPT_BACKOFF_MS * 1000000L;
+  sqe->opcode               = IORING_OP_TIMEOUT;
+  sqe->fd                   = -1;
+  sqe->addr                 = (unsigned long)&u->accept_backoff;
+  sqe->len                  = 1;
+  sqe->user_data            = NHTTP_URING_OP_TIMEOUT;
+}
+
+static void _nhttp_uring_prep(struct _nhttp_uring_conn *c,
+                              struct io_uring_sqe *sqe, unsigned char opcode,
+                              unsigned long op) {
+  sqe->opcode    = opcode;
+  sqe->fd        = c->fd;
+  sqe->user_data = (unsigned long)c | op;
+  c->inflight++;
+}
+
+/* _nhttp_uring_link_timeout links a timeout to the passed sqe, which */
+/* cancels its operation unless it completes within `ms` milliseconds. */
+/* The timeout completes with -ETIME if it fired, which fails the conn */
+/* for NHTTP_URING_OP_TIMEOUT as `op`. */
+static void _nhttp_uring_link_timeout(struct _nhttp_uring      *u,
+                                      struct _nhttp_uring_conn *c,
+                                      struct io_uring_sqe      *sqe,
+                                      struct __kernel_timespec *ts, long ms,
+                                      unsigned long op) {
+  sqe->flags |= IOSQE_IO_LINK;
+  ts->tv_sec  = ms / 1000;
+  ts->tv_nsec = (ms % 1000) * 1000000L;
+  sqe         = _nhttp_uring_get_sqe(u);
+  _nhttp_uring_prep(c, sqe, IORING_OP_LINK_TIMEOUT, op);
+  sqe->fd   = -1;
+  sqe->addr = (unsigned long)ts;
+  sqe->len  = 1;
+}
+
+static void _nhttp_uring_arm_recv(struct _nhttp_uring      *u,
+                                  struct _nhttp_uring_conn *c) {
+  struct io_uring_sqe      *sqe;
+  struct _nhttp_buf_reader *r = c->bufr;
+  size_t                    free_space;
+  enum _nhttp_server_phase  phase;
+  long                      now, timeout;
+
+  /* make room at the end of the buffered reader */
+  if (r->head == r->tail) {
+    r->head = r->tail = 0;
+  } else if (r->head > 0) {
+    memmove(r->buf, &(r->buf[r->head]), r->tail - r->head);
+    r->tail -= r->head;
+    r->head = 0;
+  }
+  free_space = NHTTP_UTIL_BUF_READER_SIZE - r->tail;
+  if (free_space == 0) { /* request head does not fit in the buffer */
+    _nhttp_server_send_empty(c->bufw, 431, 0);
+    c->keepalive = 0;
+    c->responded = 1;
+    _nhttp_uring_advance(u, c);
+    return;
+  }
+
+  sqe = _nhttp_uring_get_sqe(u);
+  _nhttp_uring_prep(c, sqe, IORING_OP_RECV, NHTTP_URING_OP_RECV);
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->len       = (unsigned)(free_space < NHTTP_URING_BUF_SIZE
+                                  ? free_space
+                                  : NHTTP_URING_BUF_SIZE);
+
+  /* the recv gets canceled if it doesn't complete by the deadline of the */
+  /* phase of reading the head (idle, request line or headers), or the rest */
+  /* of the body of the last request, which closes the connection. */
+  now   = _nhttp_util_now_ms();
+  phase = c->body.pending ? NHTTP_SERVER_PHASE_BODY
+                          : _nhttp_server_head_phase(&c->parser, r);
+  if (phase != c->phase) {
+    c->phase    = phase;
+    timeout     = _nhttp_server_phase_timeout(u->s, phase);
+    c->deadline = timeout ? now + timeout : 0;
+  }
+  if (c->deadline) {
+    _nhttp_uring_link_timeout(u, c, sqe, &c->recv_ts,
+                              c->deadline > now ? c->deadline - now : 1,
+                              NHTTP_URING_OP_TIMEOUT);
+  }
+}
+
+static void _nhttp_uring_on_cqe(struct _nhttp_uring *u,
+                                struct io_uring_cqe *cqe) {
+  struct _nhttp_uring_conn *c;
+  unsigned long             op = cqe->user_data & NHTTP_URING_OP_MASK;
+  int                       timeout;
+
+  if (cqe->user_data == NHTTP_URING_OP_ACCEPT) {
+    if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+      /* out of fds, shed the pending connection with the spare fd */
+      cqe->res = _nhttp_util_accept(u->listenfd, SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                    &u->spare_fd);
+      if (cqe->res == -1 && errno != ECONNABORTED &&
+          !(cqe->flags & IORING_CQE_F_MORE) && !u->draining) {
+        /* nothing to shed, re-arming right away would spin */
+        u->accepting = 0;
+        _nhttp_uring_arm_accept_backoff(u);
+        return;
+      }
+    }
+    if (cqe->res >= 0) {
+      c         = malloc(sizeof(struct _nhttp_uring_conn));
+      memset(c, 0, sizeof(struct _nhttp_uring_conn));
+      c->fd        = cqe->res;
+      c->bufr      = _nhttp_util_buf_reader_create(c->fd);
+      c->bufw      = _nhttp_util_buf_writer_create(c->fd);
+      _nhttp_parser_init(&c->parser);
+      c->s         = u->s;
+      c->pipefd[0] = c->pipefd[1] = -1;
+      /* the body is read while handling the request */
+      timeout = _nhttp_server_phase_timeout(u->s, NHTTP_SERVER_PHASE_BODY);
+      c->bufr->timeout_ms = timeout ? timeout : -1;
+      c->phase     = NHTTP_SERVER_PHASE_HANDLER; /* i.e. not reading */
+      c->next      = u->conns;
+      if (u->conns != NULL)
+        u->conns->prev = c;
+      u->conns = c;
+      _nhttp_uring_arm_recv(u, c);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      /* multishot accept got terminated, or canceled when draining */
+      u->accepting = 0;
+      if (!u->draining)
+        _nhttp_uring_arm_accept(u);
+    }
+    return;
+  }
+
+  if (cqe->user_data == NHTTP_URING_OP_TIMEOUT) {
+    if (!u->draining)
+      _nhttp_uring_arm_accept(u); /* accept backoff is over */
+    return;
+  }
+
+  if (cqe->user_data == NHTTP_URING_OP_CANCEL) {
+    return;
+  }
+
+  c = (struct _nhttp_uring_conn *)(cqe->user_data & ~NHTTP_URING_OP_MASK);
+  c->inflight--;
+
+  switch (op) {
+  case NHTTP_URING_OP_RECV:
+    _nhttp_uring_on_recv(u, c, cqe);
+    return;
+  case NHTTP_URING_OP_WAIT:
+    _nhttp_uring_on_wait(u, c, cqe);
+    return;
+  case NHTTP_URING_OP_SEND:
+    if (cqe->res > 0) {
+      c->bufw->off += (size_t)cqe->res;
+    } else if (cqe->res != -ECANCELED) {
+      c->failed = 1;
+    }
+    break;
+  case NHTTP_URING_OP_SPLICE_IN:
+    if (cqe->res > 0) {
+      c->pipe_fill += (size_t)cqe->res;
+      c->bufw->file_off += cqe->res;
+      c->bufw->file_rem -= (size_t)cqe->res;
+    } else if (cqe->res != -ECANCELED) {
+      c->failed = 1; /* includes 0, i.e. file got truncated */
+    }
+    break;
+  case NHTTP_URING_OP_SPLICE_OUT:
+    if (cqe->res > 0) {
+      c->pipe_fill -= (size_t)cqe->res;
+    } else if (cqe->res == -EAGAIN) {
+      c->blocked = 1; /* splices aren't retried once the socket is full */
+    } else if (cqe->res != -ECANCELED) {
+      c->failed = 1;
+    }
+    break;
+  case NHTTP_URING_OP_POLL:
+    if (cqe->res < 0 && cqe->res != -ECANCELED)
+      c->failed = 1;
+    break;
+  case NHTTP_URING_OP_TIMEOUT:
+    if (cqe->res == -ETIME) {
+      c->failed = 1; /* the linked operation timed out */
+      if (c->phase != NHTTP_SERVER_PHASE_IDLE)
+        _nhttp_util_set_abortive_close(c->fd);
+    }
+    break;
+  }
+  _nhttp_uring_advance(u, c);
+}
+
+static void _nhttp_uring_on_recv(struct _nhttp_uring      *u,
+                                 struct _nhttp_uring_conn *c,
+                                 struct io_uring_cqe      *cqe) {
+  struct _nhttp_buf_reader *r = c->bufr;
+  unsigned                  bid;
+
+  if (cqe->res == -ENOBUFS) { /* ran out of provided buffers, retry */
+    _nhttp_uring_arm_recv(u, c);
+    return;
+  }
+  if (cqe->res <= 0) { /* EOF or error */
+    c->failed = 1;
+    _nhttp_uring_advance(u, c);
+    return;
+  }
+
+  if (!c->ready_since)
+    c->ready_since = u->ready_at;
+  bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  memcpy(&(r->buf[r->tail]), u->bufs + bid * NHTTP_URING_BUF_SIZE,
+         (size_t)cqe->res);
+  r->tail += (uint32_t)cqe->res;
+  _nhttp_uring_recycle_buf(u, bid);
+
+  _nhttp_uring_process(u, c);
+}
+
+/* _nhttp_uring_process handles the request if its head is buffered, along */
+/* with the pipelined requests buffered after it, and receives more bytes */
+/* otherwise. The responses are sent together. With load shedding enabled, */
+/* a request that waited for too long is answered with a 503 instead. The */
+/* rest of the body of the last request is discarded first, as it is */
+/* received. */
+static void _nhttp_uring_process(struct _nhttp_uring      *u,
+                                 struct _nhttp_uring_conn *c) {
+  long now;
+  int  timeout;
+
+  switch (_nhttp_server_discard(&c->body, c->bufr, 0)) {
+  case 1:
+    _nhttp_uring_arm_recv(u, c);
+    return;
+  case -1:
+    c->failed = 1;
+    _nhttp_uring_advance(u, c);
+    return;
+  }
+  if (_nhttp_server_parse_head(&c->parser, c->bufr) == NHTTP_PARSER_AGAIN) {
+    _nhttp_uring_arm_recv(u, c);
+    return;
+  }
+  c->phase = NHTTP_SERVER_PHASE_HANDLER;
+  if (u->s->shed_target_ms) {
+    now = _nhttp_util_now_ms();
+    if (!_nhttp_codel_admit(&u->codel,
+                            c->ready_since ? now - c->ready_since : 0, now)) {
+      _nhttp_server_send_shed(u->s, c->bufw);
+      c->keepalive = 0;
+      c->responded = 1;
+      _nhttp_uring_advance(u, c);
+      return;
+    }
+    c->ready_since = 0;
+  }
+  if (u->s->async || _nhttp_server_awaits_body(&c->parser, c->bufr)) {
+    /* without async, only the reads of the body are bounded */
+    timeout = _nhttp_server_phase_timeout(u->s, NHTTP_SERVER_PHASE_HANDLER);
+    c->handler_deadline =
+        u->s->async && timeout ? _nhttp_util_now_ms() + timeout : 0;
+    c->coro = _nhttp_coro_create(_nhttp_uring_coro_main, c);
+    if (_nhttp_uring_resume(u, c))
+      return; /* handler got suspended */
+  } else {
+    c->keepalive = _nhttp_server_handle_pipeline(
+        u->s, &c->parser, &c->body, c->bufr, c->bufw, &c->requests);
+  }
+  c->responded = 1;
+  _nhttp_uring_advance(u, c);
+}
+
+static void _nhttp_uring_coro_main(void *arg) {
+  struct _nhttp_uring_conn *c = arg;
+  c->keepalive                = _nhttp_server_handle_pipeline(
+      c->s, &c->parser, &c->body, c->bufr, c->bufw, &c->requests);
+}
+
+/* _nhttp_uring_resume resumes the conn's coroutine. Returns 0 once it has */
+/* finished. Returns -1 if it got suspended, with the operation it waits */
+/* for submitted: a poll of the awaited fd, or a timeout for a sleep, */
+/* either of which is bounded by the handler deadline too. */
+static int _nhttp_uring_resume(struct _nhttp_uring      *u,
+                               struct _nhttp_uring_conn *c) {
+  struct _nhttp_coro  *co = c->coro;
+  struct io_uring_sqe *sqe;
+  long                 now, timeout;
+
+  while (1) {
+    _nhttp_coro_resume(co);
+    now = _nhttp_util_now_ms();
+    if (co->done) {
+      _nhttp_coro_free(co);
+      c->coro = NULL;
+      if (c->handler_deadline && now >= c->handler_deadline) {
+        c->keepalive = 0; /* the handler timed out */
+      }
+      return 0;
+    }
+
+    if (c->handler_deadline && now >= c->handler_deadline) {
+      co->wait_result = -1; /* out of time, fail waits right away */
+      continue;
+    }
+    timeout = co->wait_timeout;
+    if (c->handler_deadline &&
+        (timeout < 0 || c->handler_deadline - now < timeout))
+      timeout = c->handler_deadline - now;
+    if (co->wait_fd == -1 && timeout < 0) {
+      co->wait_result = -1; /* would never be resumed */
+      continue;
+    }
+    c->woken = 0;
+    sqe      = _nhttp_uring_get_sqe(u);
+    if (co->wait_fd != -1) {
+      _nhttp_uring_prep(c, sqe, IORING_OP_POLL_ADD, NHTTP_URING_OP_WAIT);
+      sqe->fd            = co->wait_fd;
+      sqe->poll32_events = (co->wait_events & POLLOUT) ? POLLOUT : POLLIN;
+      if (timeout >= 0) {
+        _nhttp_uring_link_timeout(u, c, sqe, &c->wait_ts, timeout,
+                                  NHTTP_URING_OP_WAIT);
+      }
+    } else {
+      _nhttp_uring_prep(c, sqe, IORING_OP_TIMEOUT, NHTTP_URING_OP_WAIT);
+      c->wait_ts.tv_sec  = timeout / 1000;
+      c->wait_ts.tv_nsec = (timeout % 1000) * 1000000L;
+      sqe->fd            = -1;
+      sqe->addr          = (unsigned long)&c->wait_ts;
+      sqe->len           = 1;
+    }
+    return -1;
+  }
+}
+
+/* _nhttp_uring_on_wait completes an operation the suspended handler waits */
+/* for, and resumes it once the poll and its timeout have both completed. */
+/* Like on the event loop, a sleep succeeds once its timeout expired, */
+/* unless the handler ran out of time, and a wait for an fd only succeeds */
+/* if the fd became ready. */
+static void _nhttp_uring_on_wait(struct _nhttp_uring      *u,
+                                 struct _nhttp_uring_conn *c,
+                                 struct io_uring_cqe      *cqe) {
+  struct _nhttp_coro *co = c->coro;
+  int                 expired;
+
+  if (co->wait_fd != -1 ? cqe->res > 0 : cqe->res == -ETIME)
+    c->woken = 1;
+  if (c->inflight)
+    return;
+  expired = c->handler_deadline && _nhttp_util_now_ms() >= c->handler_deadline;
+  co->wait_result = c->woken && (co->wait_fd != -1 || !expired) ? 0 : -1;
+  if (_nhttp_uring_resume(u, c))
+    return; /* suspended again */
+  c->responded = 1;
+  _nhttp_uring_advance(u, c);
+}
+
+/* _nhttp_uring_advance submits the next step of sending the response, */
+/* once all of the previously submitted operations have completed. */
+static void _nhttp_uring_advance(struct _nhttp_uring      *u,
+                                 struct _nhttp_uring_conn *c) {
+  struct _nhttp_buf_writer *w = c->bufw;
+  struct io_uring_sqe      *sqe;
+  size_t                    chunk;
+  int                       pipe_size;
+  long write_ms = _nhttp_server_phase_timeout(u->s, NHTTP_SERVER_PHASE_WRITE);
+
+  if (c->inflight) {
+    return;
+  }
+  if (c->failed) {
+    _nhttp_uring_close(u, c);
+    return;
+  }
+
+  /* 1: buffered response bytes, followed by 2: queued file range, once */
+  /* they have been sent. Every write to the socket is bounded by the */
+  /* write timeout. */
+  if (w->off < w->len) {
+    sqe = _nhttp_uring_get_sqe(u);
+    _nhttp_uring_prep(c, sqe, IORING_OP_SEND, NHTTP_URING_OP_SEND);
+    sqe->addr  = (unsigned long)&(w->buf[w->off]);
+    sqe->len   = (unsigned)(w->len - w->off);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    if (write_ms) {
+      _nhttp_uring_link_timeout(u, c, sqe, &c->send_ts, write_ms,
+                                NHTTP_URING_OP_TIMEOUT);
+    }
+    return;
+  } else {
+    w->off = w->len = 0;
+  }
+
+  if (w->file_rem || c->pipe_fill) {
+    if (c->blocked) { /* resume splicing once the socket is writable */
+      c->blocked = 0;
+      sqe        = _nhttp_uring_get_sqe(u);
+      _nhttp_uring_prep(c, sqe, IORING_OP_POLL_ADD, NHTTP_URING_OP_POLL);
+      sqe->poll32_events = POLLOUT;
+      if (write_ms) {
+        _nhttp_uring_link_timeout(u, c, sqe, &c->send_ts, write_ms,
+                                  NHTTP_URING_OP_TIMEOUT);
+      }
+      return;
+    }
+    if (c->pipefd[0] == -1) {
+      if (pipe2(c->pipefd, O_CLOEXEC)) {
+        c->failed = 1;
+        if (!c->inflight) {
+          _nhttp_uring_close(u, c);
+        }
+        return;
+      }
+      fcntl(c->pipefd[1], F_SETPIPE_SZ, NHTTP_URING_PIPE_SIZE);
+      pipe_size    = fcntl(c->pipefd[1], F_GETPIPE_SZ);
+      c->pipe_size = pipe_size > 0 ? (size_t)pipe_size : 65536;
+    }
+    /* refilled only once drained: the pages of a partial send stay in the */
+    /* pipe, which can be full before it holds pipe_size bytes, and a */
+    /* file -> pipe splice would then wait for room that never comes */
+    chunk = c->pipe_fill ? 0 : c->pipe_size;
+    if (chunk > w->file_rem) {
+      chunk = w->file_rem;
+    }
+    /* file -> pipe, linked with pipe -> socket. A short splice breaks the */
+    /* link, the rest is resubmitted once the chain has completed. */
+    if (chunk) {
+      sqe = _nhttp_uring_get_sqe(u);
+      _nhttp_uring_prep(c, sqe, IORING_OP_SPLICE, NHTTP_URING_OP_SPLICE_IN);
+      sqe->fd            = c->pipefd[1];
+      sqe->splice_fd_in  = w->file_fd;
+      sqe->splice_off_in = (unsigned long)w->file_off;
+      sqe->off           = (unsigned long)-1;
+      sqe->len           = (unsigned)chunk;
+      sqe->flags         = IOSQE_IO_LINK;
+    }
+    sqe = _nhttp_uring_get_sqe(u);
+    _nhttp_uring_prep(c, sqe, IORING_OP_SPLICE, NHTTP_URING_OP_SPLICE_OUT);
+    sqe->splice_fd_in  = c->pipefd[0];
+    sqe->splice_off_in = (unsigned long)-1;
+    sqe->off           = (unsigned long)-1;
+    sqe->len           = (unsigned)(chunk + c->pipe_fill);
+    if (write_ms) {
+      _nhttp_uring_link_timeout(u, c, sqe, &c->send_ts, write_ms,
+                                NHTTP_URING_OP_TIMEOUT);
+    }
+    return;
+  }
+
+  if (w->file_fd != -1) { /* file range has been sent */
+    close(w->file_fd);
+    w->file_fd = -1;
+  }
+
+  if (c->inflight == 0 && c->responded) { /* response has been sent */
+    if (!c->keepalive || u->draining) {
+      _nhttp_uring_close(u, c);
+      return;
+    }
+    c->responded = 0;
+    _nhttp_uring_process(u, c); /* the next head may already be buffered */
+  }
+}
+
+/* _nhttp_uring_drain cancels the multishot accept, and shuts the reading */
+/* side of the conns which are idle after a response down, which completes */
+/* their pending recv with EOF and gets them closed. The others are closed */
+/* once their response has been sent. */
+static void _nhttp_uring_drain(struct _nhttp_uring *u) {
+  struct _nhttp_uring_conn *c;
+  struct io_uring_sqe      *sqe;
+
+  u->draining = 1;
+  if (u->accepting) {
+    sqe            = _nhttp_uring_get_sqe(u);
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = NHTTP_URING_OP_ACCEPT;
+    sqe->user_data = NHTTP_URING_OP_CANCEL;
+  }
+  for (c = u->conns; c != NULL; c = c->next) {
+    if ((c->phase == NHTTP_SERVER_PHASE_IDLE && c->requests > 0) ||
+        c->phase == NHTTP_SERVER_PHASE_BODY)
+      shutdown(c->fd, SHUT_RD);
+  }
+}
+
+static void _nhttp_uring_close(struct _nhttp_uring      *u,
+                               struct _nhttp_uring_conn *c) {
+  if (c->prev != NULL)
+    c->prev->next = c->next;
+  else
+    u->conns = c->next;
+  if (c->next != NULL)
+    c->next->prev = c->prev;
+  close(c->fd);
+  if (c->pipefd[0] != -1) {
+    close(c->pipefd[0]);
+    close(c->pipefd[1]);
+  }
+  _nhttp_util_buf_reader_free(c->bufr);
+  _nhttp_util_buf_writer_free(c->bufw);
+  free(c);
+}
@@ -0,0 +1,43 @@
+#ifndef NHTTP_URING_H
+#define NHTTP_URING_H
+
+#include "nhttp_server.h"
+
+#define NHTTP_URING_ENTRIES 1024
+#define NHTTP_URING_CQ_ENTRIES 8192
+/* number (power of two) and size of provided buffers used for recv */
+#define NHTTP_URING_BUF_COUNT 512
+#define NHTTP_URING_BUF_SIZE 4096
+/* requested capacity of the pipe used for splicing files into sockets */
+#define NHTTP_URING_PIPE_SIZE (1 << 20)
+
+/* nhttp io_uring backend serves all connections of a server from a single */
+/* thread, talking to the kernel through io_uring(7) submission and */
+/* completion queues instead of issuing a syscall per operation. */
+/* Operations prepared while processing a batch of completions are */
+/* submitted together, with a single io_uring_enter(2) call which also waits */
+/* for the next completions: */
+/* - connections are accepted with a single multishot accept, */
+/* - request bytes are received into buffers from a provided buffer ring, */
+/*   so idle connections don't pin a receive buffer in the kernel, and are */
+/*   copied into the conn's buffered reader until the request head is */
+/*   complete, */
+/* - responses are sent from the conn's buffered writer, with the queued */
+/*   file range (`nhttp_send_file`) moved through a pipe by splice */
+/*   operations linked behind the send. Sockets are non-blocking, a splice */
+/*   that finds the socket full is retried once a poll reports it */
+/*   writable, */
+/* - handlers run as coroutines in async mode, and for requests whose body */
+/*   has yet to arrive, their waits (`nhttp_read_body`, `nhttp_await_*`, */
+/*   `nhttp_sleep`) submitted as poll and timeout operations. */
+/* The liburing library is not used, the rings are set up via raw syscalls. */
+
+/* _nhttp_uring_run runs the io_uring backend, accepting connections on the */
+/* passed listening socket. Once it has started serving, it only returns */
+/* (0) after draining on an upgrade, see `nhttp_upgrade.h`. */
+/* Returns -1 right away if the kernel does not support io_uring or one of */
+/* the features the backend relies on, so the caller can fall back to */
+/* another backend. */
+int _nhttp_uring_run(struct nhttp_server *s, int listenfd);
+
+#endif /* NHTTP_URING_H */
@@ -1,10 +1,19 @@
+#define _GNU_SOURCE /* accept4 */
 #include "nhttp_util.h"
+#include "nhttp_coro.h"
+#include "nhttp_simd.h"
+#include <errno.h>        /* errno, E* */
+#include <fcntl.h>        /* fcntl, fallocate, splice, O_*, F_* */
+#include <poll.h>         /* poll, */
+#include <stdarg.h>       /* va_list, va_start, va_end */
 #include <stdio.h>        /* printf, */
 #include <stdlib.h>       /* malloc, exit */
-#include <string.h>       /* memcpy, strlen */
+#include <string.h>       /* memcpy, memmove, memset, strlen */
 #include <sys/sendfile.h> /* sendfile */
+#include <sys/socket.h>   /* accept4, */
 #include <sys/stat.h>     /* stat, */
-#include <unistd.h>       /* write, */
+#include <time.h>         /* clock_gettime, */
+#include <unistd.h>       /* write, pipe2, lseek */
 
 ssize_t _nhttp_util_write_all(int fd, const void *buf, size_t n) {
   size_t  remaining;
@@ -21,69 +30,214 @@ struct _nhttp_buf_reader *_nhttp_util_buf_reader_create(int fd) {
   {
     r->fd   = fd;
     r->head = r->tail = 0;
+    r->pin            = 0;
+    r->consumed       = 0;
+    r->timeout_ms     = -1;
   }
   return r;
 }
 
 void _nhttp_util_buf_reader_free(struct _nhttp_buf_reader *r) { free(r); }
 
+/* _nhttp_util_wait_readable waits for the fd of `r` to become readable */
+/* after a read of it failed with EAGAIN. Only a coroutine can wait without */
+/* blocking its thread, which may be the event loop serving every other */
+/* connection, so outside of one it fails right away, with errno set to */
+/* EAGAIN. Returns 0 once the fd may be readable, and -1 otherwise (with */
+/* errno set to ETIMEDOUT after `r->timeout_ms`). */
+static int _nhttp_util_wait_readable(struct _nhttp_buf_reader *r) {
+  if (_nhttp_coro_self() == NULL) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (_nhttp_coro_wait(r->fd, POLLIN, r->timeout_ms)) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  return 0;
+}
+
+/* _nhttp_util_buf_reader_read reads up to `count` bytes from the fd of `r` */
+/* into `buf`. If the fd is non-blocking, it waits for it to become */
+/* readable (see `_nhttp_util_wait_readable`), unless `ready` bytes are */
+/* already buffered, in which case it returns 0 instead of waiting. */
+static ssize_t _nhttp_util_buf_reader_read(struct _nhttp_buf_reader *r,
+                                           void *buf, size_t count,
+                                           size_t ready) {
+  ssize_t bytes_read = read(r->fd, buf, count);
+  while (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    if (ready) /* return what is already buffered instead of waiting */
+      return 0;
+    if (_nhttp_util_wait_readable(r))
+      return -1;
+    bytes_read = read(r->fd, buf, count);
+  }
+  return bytes_read;
+}
+
 ssize_t _nhttp_util_buf_read(struct _nhttp_buf_reader *r, void *buf,
                              size_t count) {
   /* NOTE: tail is the index of the first "FREE" byte (i.e. index */
   /* of first byte that is *NOT* buffered content) -- *NOT* the index of the */
   /* last byte of buffered content. */
-  size_t ready;
-  size_t bytes_to_copy;
+  size_t  ready;
+  size_t  bytes_to_copy;
+  ssize_t bytes_read;
 
   /* special case: reached end of buffer */
   if (r->tail == NHTTP_UTIL_BUF_READER_SIZE &&
       r->head == NHTTP_UTIL_BUF_READER_SIZE) {
-    r->head = r->tail = 0;
+    r->head = r->tail = r->pin;
   }
 
   ready = r->tail - r->head;
+  if (ready == 0 && (r->tail == NHTTP_UTIL_BUF_READER_SIZE ||
+                     count > NHTTP_UTIL_BUF_READER_SIZE)) {
+    /* the pinned bytes take up the whole buffer, or the read is larger */
+    /* than it, so read around it instead of copying */
+    if ((bytes_read = _nhttp_util_buf_reader_read(r, buf, count, 0)) > 0)
+      r->consumed += (size_t)bytes_read;
+    return bytes_read;
+  }
   if (ready < count && r->tail != NHTTP_UTIL_BUF_READER_SIZE) {
     /* attempt to read into [tail, end of buffer] */
-    uint32_t free       = NHTTP_UTIL_BUF_READER_SIZE - r->tail;
-    ssize_t  bytes_read = read(r->fd, &(r->buf[r->tail]), free);
+    bytes_read = _nhttp_util_buf_reader_read(
+        r, &(r->buf[r->tail]), NHTTP_UTIL_BUF_READER_SIZE - r->tail, ready);
     if (bytes_read < 0)
       return bytes_read;
-    r->tail += bytes_read;
+    r->tail += (uint32_t)bytes_read;
     ready = r->tail - r->head; /* TODO(sbrki): avail += bytes_read; */
   }
 
   bytes_to_copy = count < ready ? count : ready;
   memcpy(buf, &(r->buf[r->head]), bytes_to_copy);
   r->head += bytes_to_copy;
+  r->consumed += bytes_to_copy;
 
   return (ssize_t)bytes_to_copy;
 }
 
-int _nhttp_util_buf_read_until_crlf(struct _nhttp_buf_reader *r, char *buf,
-                                    size_t maxcount) {
-  uint32_t i;
-  ssize_t  read;
-  char     c, last_char_was_cr;
-  last_char_was_cr = 0;
-  for (i = 0; i < maxcount; i++) {
-    read = _nhttp_util_buf_read(r, &c, 1);
-    while (read == 0) {
-      /* TODO(sbrki): this is incorrect, handle EOF properly */
-      read = _nhttp_util_buf_read(r, &c, 1);
+/* _nhttp_util_buf_reader_compact makes room at the end of the buffer of */
+/* `r` if the tail has reached it. Returns -1 with errno set to ENOBUFS if */
+/* the buffer is full. */
+static int _nhttp_util_buf_reader_compact(struct _nhttp_buf_reader *r) {
+  if (r->head == r->tail) {
+    r->head = r->tail = r->pin;
+  } else if (r->tail == NHTTP_UTIL_BUF_READER_SIZE && r->head > r->pin) {
+    memmove(&(r->buf[r->pin]), &(r->buf[r->head]), r->tail - r->head);
+    r->tail -= r->head - r->pin;
+    r->head = r->pin;
+  }
+
+  if (r->tail == NHTTP_UTIL_BUF_READER_SIZE) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  return 0;
+}
+
+ssize_t _nhttp_util_buf_reader_fill(struct _nhttp_buf_reader *r) {
+  ssize_t bytes_read;
+
+  if (_nhttp_util_buf_reader_compact(r))
+    return -1;
+  bytes_read =
+      read(r->fd, &(r->buf[r->tail]), NHTTP_UTIL_BUF_READER_SIZE - r->tail);
+  if (bytes_read > 0) {
+    r->tail += (uint32_t)bytes_read;
+  }
+  return bytes_read;
+}
+
+ssize_t _nhttp_util_buf_reader_more(struct _nhttp_buf_reader *r) {
+  ssize_t bytes_read;
+
+  if (_nhttp_util_buf_reader_compact(r))
+    return -1;
+  bytes_read = _nhttp_util_buf_reader_read(
+      r, &(r->buf[r->tail]), NHTTP_UTIL_BUF_READER_SIZE - r->tail, 0);
+  if (bytes_read > 0) {
+    r->tail += (uint32_t)bytes_read;
+  }
+  return bytes_read;
+}
+
+struct _nhttp_buf_writer *_nhttp_util_buf_writer_create(int fd) {
+  struct _nhttp_buf_writer *w = malloc(sizeof(struct _nhttp_buf_writer));
+  memset(w, 0, sizeof(struct _nhttp_buf_writer));
+  w->fd      = fd;
+  w->file_fd = -1;
+  return w;
+}
+
+void _nhttp_util_buf_writer_free(struct _nhttp_buf_writer *w) {
+  if (w->file_fd != -1) {
+    close(w->file_fd);
+  }
+  free(w->buf);
+  free(w);
+}
+
+int _nhttp_util_buf_write(struct _nhttp_buf_writer *w, const void *buf,
+                          size_t n) {
+  if (w->len + n > w->cap) {
+    size_t cap = w->cap ? w->cap : NHTTP_UTIL_BUF_WRITER_SIZE;
+    char  *tmp;
+    while (cap < w->len + n) {
+      cap *= 2;
+    }
+    if ((tmp = realloc(w->buf, cap)) == NULL) {
+      return -1;
     }
-    *buf++ = c;
+    w->buf = tmp;
+    w->cap = cap;
+  }
+  memcpy(&(w->buf[w->len]), buf, n);
+  w->len += n;
+  return 0;
+}
 
-    if (last_char_was_cr && c == '\n') {
-      return 0;
+void _nhttp_util_buf_writer_sendfile(struct _nhttp_buf_writer *w, int file_fd,
+                                     off_t offset, size_t count) {
+  if (w->file_fd != -1) {
+    _nhttp_panic("_nhttp_util_buf_writer_sendfile: file range already queued");
+  }
+  w->file_fd  = file_fd;
+  w->file_off = offset;
+  w->file_rem = count;
+}
+
+int _nhttp_util_buf_writer_flush(struct _nhttp_buf_writer *w) {
+  ssize_t sent;
+
+  while (w->off < w->len) {
+    sent = write(w->fd, &(w->buf[w->off]), w->len - w->off);
+    if (sent == -1) {
+      if (errno == EINTR)
+        continue;
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
     }
+    w->off += (size_t)sent;
+  }
+  w->off = w->len = 0;
 
-    if (c == '\r') {
-      last_char_was_cr = 1;
-    } else {
-      last_char_was_cr = 0;
+  while (w->file_rem) {
+    sent = sendfile(w->fd, w->file_fd, &(w->file_off), w->file_rem);
+    if (sent == -1) {
+      if (errno == EINTR)
+        continue;
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+    }
+    if (sent == 0) { /* file got truncated in the meantime */
+      return -1;
     }
+    w->file_rem -= (size_t)sent;
   }
-  return -1;
+  if (w->file_fd != -1) {
+    close(w->file_fd);
+    w->file_fd = -1;
+  }
+  return 0;
 }
 
 ssize_t _nhttp_util_sendfile_all(int out_fd, int in_fd, off_t offset,
@@ -99,6 +253,143 @@ ssize_t _nhttp_util_sendfile_all(int out_fd, int in_fd, off_t offset,
   return 0;
 }
 
+/* _nhttp_util_splice_out moves the `n` bytes in the pipe `pipefd` to */
+/* `out_fd`, copying them through `scratch` (of `size` bytes) if `*copy` */
+/* is set, or once splice turns out to be unsupported, setting `*copy`. */
+static int _nhttp_util_splice_out(int pipefd, int out_fd, size_t n,
+                                  char *scratch, size_t size, int *copy) {
+  ssize_t moved;
+
+  while (n) {
+    if (!*copy) {
+      moved = splice(pipefd, NULL, out_fd, NULL, n, SPLICE_F_MOVE);
+      if (moved == -1 && errno == EINVAL) {
+        *copy = 1;
+        continue;
+      }
+    } else if ((moved = read(pipefd, scratch, n < size ? n : size)) > 0 &&
+               _nhttp_util_write_all(out_fd, scratch, (size_t)moved) == -1) {
+      return -1;
+    }
+    if (moved <= 0)
+      return -1;
+    n -= (size_t)moved;
+  }
+  return 0;
+}
+
+int _nhttp_util_buf_splice(struct _nhttp_buf_reader *r, int out_fd,
+                           size_t count) {
+  char        scratch[16 * 1024];
+  struct stat st;
+  size_t      n, pipe_size;
+  ssize_t     moved;
+  int         pipefd[2], size, copy = 0;
+
+  if (fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode) && count) {
+    /* a hint, which reduces fragmentation, so errors are ignored */
+    fallocate(out_fd, FALLOC_FL_KEEP_SIZE, lseek(out_fd, 0, SEEK_CUR),
+              (off_t)count);
+  }
+
+  /* the buffered bytes first */
+  n = r->tail - r->head < count ? r->tail - r->head : count;
+  if (n) {
+    if (_nhttp_util_write_all(out_fd, &(r->buf[r->head]), n) == -1)
+      return -1;
+    r->head += (uint32_t)n;
+    r->consumed += n;
+    count -= n;
+  }
+  if (!count)
+    return 0;
+
+  if (pipe2(pipefd, O_CLOEXEC) == -1)
+    return -1;
+  fcntl(pipefd[1], F_SETPIPE_SZ, NHTTP_UTIL_SPLICE_PIPE_SIZE);
+  size      = fcntl(pipefd[1], F_GETPIPE_SZ);
+  pipe_size = size > 0 ? (size_t)size : 65536;
+  while (count) {
+    /* the pipe is empty, so at most its capacity is moved without */
+    /* blocking on it */
+    n = count < pipe_size ? count : pipe_size;
+    while ((moved = splice(r->fd, NULL, pipefd[1], NULL, n,
+                           SPLICE_F_MOVE)) < 0 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (_nhttp_util_wait_readable(r))
+        break;
+    }
+    if (moved <= 0) {
+      if (moved == 0) /* the peer is gone before sending it all */
+        errno = ECONNRESET;
+      break;
+    }
+    r->consumed += (size_t)moved;
+    count -= (size_t)moved;
+    if (_nhttp_util_splice_out(pipefd[0], out_fd, (size_t)moved, scratch,
+                               sizeof(scratch), &copy))
+      break;
+  }
+  close(pipefd[0]);
+  close(pipefd[1]);
+  return count ? -1 : 0;
+}
+
+long _nhttp_util_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long _nhttp_util_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int _nhttp_util_accept(int listenfd, int flags, int *spare_fd) {
+  int connfd;
+  while (1) {
+    connfd = accept4(listenfd, NULL, NULL, flags);
+    if (connfd != -1)
+      return connfd;
+    if (errno == EINTR)
+      continue;
+    if ((errno != EMFILE && errno != ENFILE) || *spare_fd == -1)
+      return -1;
+
+    /* out of fds: free up the spare one to accept and drop the connection */
+    close(*spare_fd);
+    connfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (connfd != -1)
+      close(connfd);
+    *spare_fd = _nhttp_util_open_spare_fd();
+    if (connfd == -1)
+      return -1; /* e.g. EAGAIN, accept4 checks for free fds first */
+    errno = ECONNABORTED;
+    return -1;
+  }
+}
+
+int _nhttp_util_open_spare_fd(void) {
+  return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+int _nhttp_util_set_abortive_close(int fd) {
+  struct linger l;
+  l.l_onoff  = 1;
+  l.l_linger = 0;
+  return setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(struct linger));
+}
+
+int _nhttp_util_set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ? -1 : 0;
+}
+
 void _nhttp_util_remove_trailing_slash(char *str) {
   size_t len;
   if (!str) {
@@ -134,114 +425,94 @@ void _nhttp_util_remove_leading_slash(char *str) {
   }
 }
 
-void _nhttp_util_cut_path_query_params(char *dest, char *path) {
-  size_t len = strlen(path);
-  size_t i;
-  int    mode = 0; /* 0 = before query, 1 = in query, 2 = in fragment */
-  for (i = 0; i < len; i++) {
-    if (mode == 0) {
-      if (path[i] == '?') {
-        mode    = 1;
-        path[i] = 0;
-        continue;
-      }
-    } else if (mode == 1) {
-      if (path[i] == '#') {
-        mode    = 2;
-        path[i] = 0;
-        continue;
-      } else {
-        *dest++ = path[i];
-        path[i] = 0;
-      }
-    } else if (mode == 2) {
-      path[i] = 0;
-    }
-  }
-}
+/* values of hex digits, X for other characters */
+#define X 0xff
+static const unsigned char _nhttp_util_hex[256] = {
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+    X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
 
-int _nhttp_util_str_triplets_validate(const char *str) {
-  size_t len = strlen(str);
-  size_t i, j;
-  for (i = 0; i < len; i++) {
-    if (str[i] == '%') {
-      /* check for out-of-bounds */
-      if (i + 2 >= len) {
-        return -1;
-      }
-      /* check next two chars */
-      for (j = 1; j < 3; j++) {
-        if (!((str[i + j] >= '0' && str[i + j] <= '9') ||
-              (str[i + j] >= 'a' && str[i + j] <= 'f') ||
-              (str[i + j] >= 'A' && str[i + j] <= 'F'))) {
-          return -1;
-        }
-      }
-    }
-  }
-  return 0;
-}
+/* characters escaped by `_nhttp_util_url_encode`: controls, non-ASCII, */
+/* and the unsafe and reserved characters of RFC1738 */
+static const unsigned char _nhttp_util_url_escaped[256] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 0, 1, 1, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
+    1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 0,
+    1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
 
-char *_nhttp_util_str_escape(const char *str) {
-  size_t i;
-  size_t len = strlen(str);
-  char  *res = malloc(3 * len + 1);
-  char  *tmp = res;
-  memset(res, 0, 3 * len + 1);
+size_t _nhttp_util_url_encode(char *dest, const char *src, size_t len) {
+  static const char    digits[] = "0123456789ABCDEF";
+  const unsigned char *s        = (const unsigned char *)src;
+  char                *d        = dest;
+  size_t               i;
 
   for (i = 0; i < len; i++) {
-    if (str[i] == ' ' || str[i] == '<' || str[i] == '>' || str[i] == '"' ||
-        str[i] == '#' || str[i] == '%' || str[i] == '{' || str[i] == '}' ||
-        str[i] == '|' || str[i] == '\\' || str[i] == '^' || str[i] == '~' ||
-        str[i] == '[' || str[i] == ']' || str[i] == '`' || str[i] == ';' ||
-        str[i] == '/' || str[i] == '?' || str[i] == ':' || str[i] == '@' ||
-        str[i] == '=' || str[i] == '&') {
-      *tmp++ = '%';
-      sprintf(tmp, "%2X", str[i]);
-      tmp += 2;
+    if (_nhttp_util_url_escaped[s[i]]) {
+      d[0] = '%';
+      d[1] = digits[s[i] >> 4];
+      d[2] = digits[s[i] & 0xf];
+      d += 3;
     } else {
-      *tmp++ = str[i];
+      *d++ = (char)s[i];
     }
   }
-
-  return res;
+  *d = '\0';
+  return (size_t)(d - dest);
 }
 
-char *_nhttp_util_str_unescape(const char *str) {
-  size_t i;
-  size_t len = strlen(str);
-  char  *res = malloc(len + 1);
-  char  *tmp = res;
-  char   hex[2];
-  int    c;
-  memset(res, 0, len + 1);
+ssize_t _nhttp_util_url_decode(char *dest, const char *src, size_t len) {
+  const unsigned char *s = (const unsigned char *)src;
+  size_t               i = 0, n = 0, run;
+  unsigned char        hi, lo;
 
-  for (i = 0; i < len; i++) {
-    if (str[i] == '%') {
-      hex[0] = str[i + 1];
-      hex[1] = str[i + 2];
-      sscanf(hex, "%2X", &c);
-      *tmp++ = (char)c;
-      i += 2;
-    } else {
-      *tmp++ = str[i];
-    }
-  }
-  return res;
-}
-
-void _nhttp_util_str_triplets_to_upper(char *str) {
-  size_t len = strlen(str);
-  size_t i, j;
-  for (i = 0; i < len; i++) {
-    if (str[i] == '%') {
-      for (j = 1; j < 3; j++) {
-        if (str[i + j] >= 'a' && str[i + j] <= 'f') {
-          str[i + j] -= 'a' - 'A';
-        }
-      }
-    }
+  for (;;) {
+    /* copy the run of bytes up to the next escape as a whole */
+    run = _nhttp_simd_find_any(src + i, len - i, "%", 1);
+    if (dest + n != src + i)
+      memmove(dest + n, src + i, run);
+    n += run;
+    i += run;
+    if (i == len)
+      break;
+    if (len - i < 3)
+      return -1;
+    hi = _nhttp_util_hex[s[i + 1]];
+    lo = _nhttp_util_hex[s[i + 2]];
+    if ((hi | lo) & 0xf0)
+      return -1;
+    dest[n++] = (char)(hi << 4 | lo);
+    i += 3;
   }
+  dest[n] = '\0';
+  return (ssize_t)n;
 }
 
 void _nhttp_panic(const char *msg) {
@@ -12,6 +12,13 @@
 /* otherwise it returns 1 . */
 ssize_t _nhttp_util_write_all(int fd, const void *buf, size_t n);
 
+/* _nhttp_view is a string that is not owned, `len` bytes at `ptr`, e.g. a */
+/* part of a request in the read buffer. */
+struct _nhttp_view {
+  char  *ptr;
+  size_t len;
+};
+
 #define NHTTP_UTIL_BUF_READER_SIZE 4096
 
 /* _nhttp_buf_reader is a buffered fd reader. */
@@ -19,6 +26,9 @@ struct _nhttp_buf_reader {
   int      fd;
   char     buf[NHTTP_UTIL_BUF_READER_SIZE];
   uint32_t head, tail;
+  uint32_t pin;      /* bytes before it are never moved or overwritten */
+  size_t   consumed; /* total number of bytes returned by buf_read */
+  int      timeout_ms; /* of waits of coroutines in buf_read, -1 if none */
 };
 
 /* _nhttp_util_buf_reader_create creates a new buffered redaer. */
@@ -34,20 +44,77 @@ void _nhttp_util_buf_reader_free(struct _nhttp_buf_reader *r);
 /* passed count (due to data/device not being available at the moment).*/
 /* Returns 0 on EOF, and -1 on error. */
 /* Under the hood it calls read(2) in blocking mode - calls will block when */
-/* there is no available data whatsoever. */
+/* there is no available data whatsoever. If the fd is non-blocking, a */
+/* calling coroutine is suspended until the fd becomes readable, for at */
+/* most `r->timeout_ms` milliseconds (returns -1 with errno set to */
+/* ETIMEDOUT). Outside of a coroutine it never waits, and returns -1 with */
+/* errno set to EAGAIN instead, as the thread may be serving other */
+/* connections (blocking fds only fail that way once SO_RCVTIMEO expired). */
+/* Bytes before `r->pin` are kept in place, and reads bypass the buffer */
+/* when they leave no room in it, or when nothing is buffered and `count` */
+/* is larger than NHTTP_UTIL_BUF_READER_SIZE. */
 ssize_t _nhttp_util_buf_read(struct _nhttp_buf_reader *r, void *buf,
                              size_t count);
 
-/* _nhttp_util_buf_read_until_crlf reads from the passed buffered reader */
-/* into passed `buf` until it encouters CR LF byte sequence */
-/* (HTTP end-of-line marker) (including it), or when it reads `maxcount` bytes*/
-/* Returns 0 if CR LF sequence was encountered, even if `maxcount` was reached*/
-/* (buf[maxcount-2] = CR, buf[maxcount-1] = LF ). */
-/* Returns -1 if CR LF sequence was not encountered AND total of `maxcount` */
-/* bytes were read from `r` and written to `buf`. */
-/* It calls `_nhttp_util_buf_read` in a loop which can block. */
-int _nhttp_util_buf_read_until_crlf(struct _nhttp_buf_reader *r, char *buf,
-                                    size_t maxcount);
+/* _nhttp_util_buf_reader_fill performs a single read(2) call into the free */
+/* space of the buffered reader, moving the buffered content to the start of */
+/* the buffer (or right after `r->pin`) first if the tail has reached the */
+/* end of it. */
+/* Returns the value returned by read(2), so it can be used on non-blocking */
+/* fds (returns -1 with errno set to EAGAIN when no data is available). */
+/* Returns -1 with errno set to ENOBUFS if the buffer is full. */
+ssize_t _nhttp_util_buf_reader_fill(struct _nhttp_buf_reader *r);
+
+/* _nhttp_util_buf_reader_more is `_nhttp_util_buf_reader_fill` for */
+/* handlers: if the fd is non-blocking, it waits for it to become readable */
+/* like `_nhttp_util_buf_read` does, failing with EAGAIN only outside of a */
+/* coroutine. */
+ssize_t _nhttp_util_buf_reader_more(struct _nhttp_buf_reader *r);
+
+#define NHTTP_UTIL_BUF_WRITER_SIZE 4096
+
+/* _nhttp_buf_writer is a buffered fd writer. Written bytes are appended to */
+/* a growable in-memory buffer, and are written out to the fd only when */
+/* `_nhttp_util_buf_writer_flush` is called. A single file range can be */
+/* queued after the buffered bytes, which gets sent via sendfile(2). */
+/* Flushing works with both blocking and non-blocking fds, as it continues */
+/* where the previous call left off. */
+struct _nhttp_buf_writer {
+  int    fd;
+  char  *buf;
+  size_t len, cap;
+  size_t off; /* number of buffered bytes that were already written */
+  int    file_fd; /* -1 if there is no queued file range */
+  off_t  file_off;
+  size_t file_rem;
+};
+
+/* _nhttp_util_buf_writer_create creates a new buffered writer. */
+/* The in-memory buffer is allocated lazily, on first write. */
+struct _nhttp_buf_writer *_nhttp_util_buf_writer_create(int fd);
+
+/* _nhttp_util_buf_writer_free frees the buffered writer, discarding any */
+/* unflushed data and closing the queued file, if any. */
+/* Does not close the fd. */
+void _nhttp_util_buf_writer_free(struct _nhttp_buf_writer *w);
+
+/* _nhttp_util_buf_write appends n bytes from buf to the writer. */
+/* Returns -1 if the buffer could not be grown, otherwise 0. */
+int _nhttp_util_buf_write(struct _nhttp_buf_writer *w, const void *buf,
+                          size_t n);
+
+/* _nhttp_util_buf_writer_sendfile queues `count` bytes of `file_fd`, */
+/* starting at `offset`, to be sent after the currently buffered bytes. */
+/* The writer takes ownership of `file_fd` and closes it once it has been */
+/* sent (or when the writer is freed). Only one file range can be queued. */
+void _nhttp_util_buf_writer_sendfile(struct _nhttp_buf_writer *w, int file_fd,
+                                     off_t offset, size_t count);
+
+/* _nhttp_util_buf_writer_flush writes out buffered bytes and the queued */
+/* file range. Returns 0 once everything has been written, 1 if the fd is */
+/* non-blocking and would block (call it again once the fd is writable), */
+/* and -1 on error. */
+int _nhttp_util_buf_writer_flush(struct _nhttp_buf_writer *w);
 
 /* _nhttp_util_sendfile_all calls sendfile() in a loop until count bytes have */
 /* been successfully read and written. Returns -1 if sendfile returned an err */
@@ -55,6 +122,55 @@ int _nhttp_util_buf_read_until_crlf(struct _nhttp_buf_reader *r, char *buf,
 ssize_t _nhttp_util_sendfile_all(int out_fd, int in_fd, off_t offset,
                                  size_t count);
 
+/* requested capacity of the pipe used by `_nhttp_util_buf_splice` */
+#define NHTTP_UTIL_SPLICE_PIPE_SIZE (1 << 20)
+
+/* _nhttp_util_buf_splice moves `count` bytes from the buffered reader `r` */
+/* to `out_fd` at its offset, which is the counterpart of */
+/* `_nhttp_util_sendfile_all` for uploads: the buffered bytes are written */
+/* first, then the rest is moved by splice(2) through a pipe, so it never */
+/* enters user space, waiting for a non-blocking fd like */
+/* `_nhttp_util_buf_read`. The bytes are copied instead if `out_fd` doesn't */
+/* support splice (e.g. a file opened with O_APPEND). If `out_fd` is a */
+/* regular file, `count` bytes are preallocated at its offset with */
+/* fallocate(2) beforehand, where the filesystem supports it. Returns 0 */
+/* once count bytes have been moved, and -1 on error (ECONNRESET on EOF). */
+/* The bytes moved are accounted for in `r->consumed` either way. */
+int _nhttp_util_buf_splice(struct _nhttp_buf_reader *r, int out_fd,
+                           size_t count);
+
+/* _nhttp_util_now_ms returns the current value of the monotonic clock, */
+/* in milliseconds. */
+long _nhttp_util_now_ms(void);
+/* _nhttp_util_now_us is `_nhttp_util_now_ms` in microseconds. */
+long _nhttp_util_now_us(void);
+
+/* _nhttp_util_accept accepts a connection on the listening socket with */
+/* accept4(2), passing it `flags` (SOCK_NONBLOCK, SOCK_CLOEXEC). */
+/* `spare_fd` points to an fd reserved for running out of fds: on EMFILE or */
+/* ENFILE it is closed to accept the pending connection and close it right */
+/* away, so the client isn't left hanging in the backlog (and the listening */
+/* socket doesn't stay readable), after which it is reopened. */
+/* Returns the accepted fd, or -1 with errno set: EAGAIN once the pending */
+/* connections have been drained (on a non-blocking socket), ECONNABORTED */
+/* if a connection was shed, and EMFILE or ENFILE if there was no spare fd */
+/* to shed it with, in which case the caller should back off. */
+int _nhttp_util_accept(int listenfd, int flags, int *spare_fd);
+
+/* _nhttp_util_open_spare_fd opens an fd to be reserved for */
+/* `_nhttp_util_accept`. Returns -1 on error. */
+int _nhttp_util_open_spare_fd(void);
+
+/* _nhttp_util_set_abortive_close makes close(2) of the passed socket reset */
+/* the connection, discarding unsent data right away instead of keeping it */
+/* queued in the kernel while the peer isn't reading. Used for connections */
+/* that timed out. Returns 0 on success and -1 on error. */
+int _nhttp_util_set_abortive_close(int fd);
+
+/* _nhttp_util_set_nonblocking sets O_NONBLOCK flag on the passed fd. */
+/* Returns 0 on success and -1 on error. */
+int _nhttp_util_set_nonblocking(int fd);
+
 /* _nhttp_util_remove_trailing_slash removes the trailing slash from passed */
 /* string, not changing the starting point of the str. It terminates the str */
 /* early if last character is a slash. */
@@ -70,49 +186,23 @@ void _nhttp_util_remove_trailing_slash(char *str);
 /* Panics if the passed str is NULL. */
 void _nhttp_util_remove_leading_slash(char *str);
 
-/* TODO(sbrki): This also (forever!) wipes out fragment (aka URL Anchor) */
-
-/* _nhttp_util_cut_path_query_params removes query params and anchor from */
-/* path (zeroes it out), and copies the query params into dest. */
-/* passed `path` has to be url encoded per RFC1738, i.e. question mark char */
-/* (?) has to be escaped if it is part of the path, as its verbatim occurance */
-/* is interpreted as start of the query params. Same goes for ladder character*/
-/* (#) which has to be escaped if it is part of the path or query arguments. */
-void _nhttp_util_cut_path_query_params(char *dest, char *path);
-
-/*  _nhttp_util_str_escape escapes unsafe and reserved characters from the */
-/* passed `str`, per RFC1738. Unsafe and reserved characters are escaped using*/
-/* hex encoding trigrams (%XX) of character ASCII value. */
-/* Returned string has to be freed by the caller. */
-/* List of characters escaped by this function: */
+/* _nhttp_util_url_encode escapes the `len` bytes of `src` per RFC1738 into */
+/* `dest`, which must have room for `3 * len + 1` bytes, and terminates it. */
+/* Control characters, non-ASCII bytes, and unsafe and reserved characters */
+/* are escaped using hex encoding trigrams (%XX) of the byte value: */
 /* * Unsafe characters: <,>,space,",#,%,{,},|,\,^,~,[,],`  */
 /* * Reserved characters: ;,/,?,:,@,=,&   */
-char *_nhttp_util_str_escape(const char *str);
-
-/* _nhttp_util_str_unescape unescapes hex encoded trigrams from the passed */
-/* `str`. Returned string has to be freed by the caller. */
-/* Passed str is expected to be properly encoded per RFC1738, in particular */
-/* percent sign must denote a start of encoded triple -> if a percent sign is */
-/* a part of the content, it must be escaped (to %25). */
-/* Passed str should be validated via call to */
-/* `_nhttp_util_str_triplets_validate` prior to calling this function. */
-char *_nhttp_util_str_unescape(const char *str);
-
-/* _nhttp_util_str_triplets_validate validates that encoding triplets (%XX) */
-/* are valid hexadecimal numbers (either lowercase or uppercase, if they  */
-/* contain alpha chars). Also checks that there are no unencoded percent signs*/
-/* per RFC1738. Returns 0 if string is valid, otherwise -1 . */
-int _nhttp_util_str_triplets_validate(const char *str);
-
-/* _nhttp_util_str_triplets_to_upper transforms encoding triplets (%XX) into */
-/* uppercase letters if they are lowercase, e.g.: %a1%B2 -> %A1%B2 . */
-/* The transformations are done in-place. */
-/* Passed str is expected to be properly encoded per RFC1738, in particular */
-/* percent sign must denote a start of encoded triple -> if a percent sign is */
-/* a part of the content, it must be escaped (to %25). */
-/* Passed str should be validated via call to */
-/* `_nhttp_util_str_triplets_validate` prior to calling this function. */
-void _nhttp_util_str_triplets_to_upper(char *str);
+/* Returns the length of the escaped string. */
+size_t _nhttp_util_url_encode(char *dest, const char *src, size_t len);
+
+/* _nhttp_util_url_decode unescapes the hex encoding trigrams (%XX, with */
+/* either lowercase or uppercase hex digits) of the `len` bytes of `src` */
+/* into `dest`, which must have room for `len + 1` bytes, and terminates */
+/* it. `dest` may be `src`, to unescape in place. The trigrams are */
+/* validated while unescaping: a percent sign not followed by two hex */
+/* digits (i.e. an unescaped one, which must be sent as %25) is rejected. */
+/* Returns the length of the unescaped string, or -1 if `src` is invalid. */
+ssize_t _nhttp_util_url_decode(char *dest, const char *src, size_t len);
 
 /* _nhttp_panic prints the passed message and terminates the process with */
 /* exit code 1. */
@@ -0,0 +1,204 @@
+#include "nhttp_cpu.h"
+#include "nhttp_server.h"
+#include "nhttp_upgrade.h"
+#include "nhttp_util.h"
+#include <errno.h>     /* errno, */
+#include <signal.h>    /* sigaction, sigprocmask, sigsuspend, kill */
+#include <stdio.h>     /* printf, */
+#include <stdlib.h>    /* malloc, free, exit */
+#include <string.h>    /* memset, strerror */
+#include <sys/types.h> /* pid_t, */
+#include <sys/wait.h>  /* waitpid, */
+#include <time.h>      /* time, */
+#include <unistd.h>    /* fork, close, sleep, sysconf */
+
+/* a worker that dies sooner than this (in seconds) after being spawned is */
+/* respawned only after the same delay, so a worker that crashes on startup */
+/* does not turn the supervisor into a fork loop. */
+#define NHTTP_WORKERS_RESPAWN_DELAY 1
+
+struct _nhttp_worker {
+  pid_t  pid; /* 0 if the worker is not running */
+  int    sockfd;
+  time_t started;
+};
+
+static volatile sig_atomic_t _nhttp_workers_shutdown_sig = 0;
+
+static void _nhttp_workers_on_shutdown(int sig) {
+  _nhttp_workers_shutdown_sig = sig;
+}
+
+/* SIGCHLD only needs a handler so that it interrupts sigsuspend(2) */
+static void _nhttp_workers_on_child(int sig) { (void)sig; }
+
+static int _nhttp_workers_spawn(struct nhttp_server  *s,
+                                struct _nhttp_worker *workers, int nworkers,
+                                int i, const sigset_t *orig_mask) {
+  pid_t pid;
+  int   j;
+
+  if ((pid = fork()) == -1) {
+    printf("could not fork worker: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (pid == 0) {
+    /* worker: restore default signal handling, keep only its own socket */
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    if (s->upgrade_signal) {
+      signal(s->upgrade_signal, SIG_DFL);
+    }
+    sigprocmask(SIG_SETMASK, orig_mask, NULL);
+    /* the supervisor carries out upgrades, workers only drain */
+    if (s->upgrade_signal) {
+      _nhttp_upgrade_install(s->upgrade_signal, 0);
+    }
+    for (j = 0; j < nworkers; j++) {
+      if (workers[j].sockfd != workers[i].sockfd) {
+        close(workers[j].sockfd);
+      }
+    }
+    /* pinned before serving, so its buffers are allocated locally */
+    if (s->ncpus && _nhttp_cpu_pin(s->cpus[i % s->ncpus])) {
+      printf("could not pin worker to cpu %d: %s\n", s->cpus[i % s->ncpus],
+             strerror(errno));
+    }
+    _nhttp_server_serve(s, workers[i].sockfd);
+    exit(0);
+  }
+
+  workers[i].pid     = pid;
+  workers[i].started = time(NULL);
+  return 0;
+}
+
+void nhttp_server_run_workers(struct nhttp_server *s, int port, int nworkers) {
+  struct _nhttp_worker *workers;
+  struct sigaction      sa;
+  sigset_t              mask, orig_mask;
+  pid_t                 pid;
+  int                   i, status, alive = 0, forwarded = 0;
+  int                  *sockfds, nsockfds;
+
+  if (nworkers <= 0 && s->ncpus) {
+    nworkers = s->ncpus;
+  } else if (nworkers <= 0) {
+    nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers <= 0) {
+      nworkers = 1;
+    }
+  }
+
+  /* ignore SIGPIPE which is raised when client closes the conn */
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    _nhttp_panicf("could not set ignoring SIGPIPE: %s", strerror(errno));
+  }
+
+  /* sockets are created by the supervisor and outlive the workers, so */
+  /* connections queued on a dead worker's socket get served once it */
+  /* is respawned instead of being refused. A Unix domain socket path */
+  /* can't be bound more than once, so all of the workers share its socket. */
+  workers  = malloc((size_t)nworkers * sizeof(struct _nhttp_worker));
+  sockfds  = malloc((size_t)nworkers * sizeof(int));
+  nsockfds = s->config.unix_path != NULL ? 1 : nworkers;
+  for (i = 0; i < nsockfds; i++) {
+    sockfds[i] = _nhttp_server_listen(s, port, s->config.unix_path == NULL);
+  }
+  for (i = 0; i < nworkers; i++) {
+    workers[i].pid    = 0;
+    workers[i].sockfd = sockfds[i % nsockfds];
+  }
+  _nhttp_upgrade_close_inherited();
+
+  /* the i-th socket of the group belongs to the worker pinned to the i-th */
+  /* cpu, to which the connections received on that cpu are steered */
+  if (s->ncpus && nsockfds > 1 &&
+      _nhttp_cpu_steer(sockfds[0], s->cpus,
+                       s->ncpus < nsockfds ? s->ncpus : nsockfds)) {
+    printf("could not steer connections to cpus: %s\n", strerror(errno));
+  }
+
+  /* signals are blocked outside of sigsuspend(2), which avoids missing */
+  /* a signal delivered between checking the flags and going to sleep. */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGQUIT);
+  sigprocmask(SIG_BLOCK, &mask, &orig_mask);
+
+  memset(&sa, 0, sizeof(struct sigaction));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = _nhttp_workers_on_shutdown;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGQUIT, &sa, NULL);
+  sa.sa_handler = _nhttp_workers_on_child;
+  sigaction(SIGCHLD, &sa, NULL);
+  /* blocked along with the others, outside of sigsuspend(2) */
+  if (s->upgrade_signal) {
+    _nhttp_upgrade_install(s->upgrade_signal, 1);
+  }
+
+  for (i = 0; i < nworkers; i++) {
+    if (_nhttp_workers_spawn(s, workers, nworkers, i, &orig_mask) == 0) {
+      alive++;
+    }
+  }
+  printf("server listening with %d workers!\n", alive);
+
+  while (1) {
+    /* reap (and respawn) exited workers */
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      for (i = 0; i < nworkers && workers[i].pid != pid; i++) {
+      }
+      if (i == nworkers) {
+        continue;
+      }
+      workers[i].pid = 0;
+      alive--;
+      if (_nhttp_workers_shutdown_sig) {
+        continue;
+      }
+      printf("worker %d exited, respawning\n", (int)pid);
+      if (time(NULL) - workers[i].started < NHTTP_WORKERS_RESPAWN_DELAY) {
+        sleep(NHTTP_WORKERS_RESPAWN_DELAY);
+      }
+      if (_nhttp_workers_spawn(s, workers, nworkers, i, &orig_mask) == 0) {
+        alive++;
+      }
+    }
+
+    /* on an upgrade, the new process takes all of the sockets over, and */
+    /* the workers get the signal forwarded to drain */
+    if (_nhttp_upgrade_requested() &&
+        _nhttp_upgrade_start(sockfds, nsockfds) == 0) {
+      _nhttp_workers_shutdown_sig = s->upgrade_signal;
+    }
+
+    if (_nhttp_workers_shutdown_sig && !forwarded) {
+      for (i = 0; i < nworkers; i++) {
+        if (workers[i].pid > 0) {
+          kill(workers[i].pid, _nhttp_workers_shutdown_sig);
+        }
+      }
+      forwarded = 1;
+    }
+
+    if (alive == 0 && (forwarded || pid == -1)) {
+      break;
+    }
+    sigsuspend(&orig_mask);
+  }
+
+  for (i = 0; i < nsockfds; i++) {
+    close(sockfds[i]);
+  }
+  free(workers);
+  free(sockfds);
+  sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+}
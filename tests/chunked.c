@@ -0,0 +1,165 @@
+// clang-format off
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <cmocka.h>
+
+#include <string.h>
+
+#include "../src/nhttp_chunked.h"
+// clang-format on
+
+/* decode feeds `body` to a new decoder `step` bytes at a time (or all of */
+/* it, if `step` is 0), collecting the payload into `out`. Returns the */
+/* final status, with `*end` set to the offset after the body. */
+static int decode(const char *body, size_t step, uint64_t max_total,
+                  char *out, size_t *end) {
+  struct _nhttp_chunked c;
+  const char           *data;
+  size_t                off = 0, avail = 0, used, len;
+  int                   status;
+
+  _nhttp_chunked_init(&c, max_total);
+  *out = '\0';
+  for (;;) {
+    avail  = step && off + step < strlen(body) ? step : strlen(body) - off;
+    status = _nhttp_chunked_execute(&c, body + off, avail, &used, &data, &len);
+    assert_true(used <= avail);
+    off += used;
+    if (status == NHTTP_CHUNKED_DATA) {
+      assert_ptr_equal(data + len, body + off);
+      strncat(out, data, len);
+    } else if (status != NHTTP_CHUNKED_AGAIN || off == strlen(body)) {
+      break;
+    }
+  }
+  *end = off;
+  return status;
+}
+
+static void test_chunked_body(void **state) {
+  const char body[] = "5\r\nhello\r\n"
+                      "7;name=value; other\r\n, world\r\n"
+                      "A \r\n, chunked!\r\n"
+                      "0\r\n"
+                      "Expires: never\r\n"
+                      "X-Checksum: \tabc\r\n"
+                      "\r\n"
+                      "GET / HTTP/1.1\r\n\r\n";
+  char   out[64];
+  size_t step, end;
+
+  /* fed all at once, and split at every possible point */
+  for (step = 0; step < sizeof(body); step++) {
+    assert_int_equal(decode(body, step, 0, out, &end), NHTTP_CHUNKED_DONE);
+    assert_string_equal(out, "hello, world, chunked!");
+    assert_string_equal(body + end, "GET / HTTP/1.1\r\n\r\n");
+  }
+}
+
+static void test_chunked_done(void **state) {
+  struct _nhttp_chunked c;
+  const char            body[] = "0\r\n\r\n";
+  const char           *data;
+  size_t                used, len;
+
+  _nhttp_chunked_init(&c, 0);
+  assert_int_equal(_nhttp_chunked_execute(&c, body, 5, &used, &data, &len),
+                   NHTTP_CHUNKED_DONE);
+  assert_int_equal(used, 5);
+  /* done decoders stay done */
+  assert_int_equal(_nhttp_chunked_execute(&c, body, 5, &used, &data, &len),
+                   NHTTP_CHUNKED_DONE);
+  assert_int_equal(used, 0);
+}
+
+static void test_chunked_invalid(void **state) {
+  const char *bodies[] = {
+      "\r\n0\r\n\r\n",              /* no size */
+      "x\r\n\r\n",                  /* not hex */
+      "-1\r\n\r\n",                 /* negative size */
+      "5\nhello\r\n0\r\n\r\n",      /* bare LF */
+      "5\r\nhello\n0\r\n\r\n",      /* bare LF after the payload */
+      "5\r\nhelloo\r\n0\r\n\r\n",   /* payload longer than its size */
+      "1;a\x01\r\nx\r\n0\r\n\r\n",  /* control character in an extension */
+      "0\r\n folded\r\n\r\n",       /* obsolete line folding in trailers */
+      "0\r\nX: a\rb\r\n\r\n",       /* bare CR in a trailer */
+      "0\r\n\r\r",                  /* bare CR at the end */
+  };
+  char   out[64];
+  size_t i, end;
+
+  for (i = 0; i < sizeof(bodies) / sizeof(bodies[0]); i++)
+    assert_int_equal(decode(bodies[i], 0, 0, out, &end),
+                     NHTTP_CHUNKED_INVALID);
+}
+
+static void test_chunked_limits(void **state) {
+  char   body[3 * NHTTP_CHUNKED_MAX_TRAILER], out[64];
+  size_t end, i;
+
+  /* total payload */
+  assert_int_equal(decode("5\r\nhello\r\n0\r\n\r\n", 0, 5, out, &end),
+                   NHTTP_CHUNKED_DONE);
+  assert_int_equal(decode("5\r\nhello\r\n1\r\n!\r\n0\r\n\r\n", 0, 5, out,
+                          &end),
+                   NHTTP_CHUNKED_TOO_LARGE);
+  assert_string_equal(out, "hello");
+
+  /* chunk size, which can't overflow */
+  assert_int_equal(decode("40000001\r\n", 0, 0, out, &end),
+                   NHTTP_CHUNKED_TOO_LARGE);
+  assert_int_equal(decode("10000000000000001\r\n", 0, 0, out, &end),
+                   NHTTP_CHUNKED_TOO_LARGE);
+
+  /* digits of the chunk size, leading zeros included */
+  assert_int_equal(decode("0000000000000005\r\nhello\r\n0\r\n\r\n", 3, 0,
+                          out, &end),
+                   NHTTP_CHUNKED_DONE);
+  assert_string_equal(out, "hello");
+  assert_int_equal(decode("00000000000000005\r\nhello\r\n0\r\n\r\n", 3, 0,
+                          out, &end),
+                   NHTTP_CHUNKED_TOO_LARGE);
+
+  /* extensions and trailers */
+  strcpy(body, "1;");
+  for (i = 0; i <= NHTTP_CHUNKED_MAX_EXTENSION; i++)
+    strcat(body, "e");
+  strcat(body, "\r\nx\r\n0\r\n\r\n");
+  assert_int_equal(decode(body, 100, 0, out, &end), NHTTP_CHUNKED_TOO_LARGE);
+  strcpy(body, "0\r\n");
+  for (i = 0; i < NHTTP_CHUNKED_MAX_TRAILER / 6 + 1; i++) /* w/o CRLFs */
+    strcat(body, "X: abc\r\n");
+  strcat(body, "\r\n");
+  assert_int_equal(decode(body, 100, 0, out, &end), NHTTP_CHUNKED_TOO_LARGE);
+}
+
+static void test_chunked_max_chunks(void **state) {
+  struct _nhttp_chunked c;
+  const char            chunk[] = "1\r\nx\r\n";
+  const char           *data;
+  size_t                used, len, off;
+  uint32_t              i;
+  int                   status = NHTTP_CHUNKED_AGAIN;
+
+  _nhttp_chunked_init(&c, 0);
+  for (i = 0; i <= NHTTP_CHUNKED_MAX_CHUNKS && status >= 0; i++) {
+    for (off = 0; off < sizeof(chunk) - 1 && status >= 0; off += used)
+      status = _nhttp_chunked_execute(&c, chunk + off, sizeof(chunk) - 1 - off,
+                                      &used, &data, &len);
+  }
+  assert_int_equal(status, NHTTP_CHUNKED_TOO_LARGE);
+  assert_int_equal(i, NHTTP_CHUNKED_MAX_CHUNKS + 1);
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_chunked_body),
+      cmocka_unit_test(test_chunked_done),
+      cmocka_unit_test(test_chunked_invalid),
+      cmocka_unit_test(test_chunked_limits),
+      cmocka_unit_test(test_chunked_max_chunks),
+  };
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
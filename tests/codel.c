@@ -0,0 +1,65 @@
+// clang-format off
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <cmocka.h>
+
+#include "../src/nhttp_codel.h"
+// clang-format on
+
+static void test_codel_burst(void **state) {
+  struct _nhttp_codel c;
+  long                now = 1000;
+
+  _nhttp_codel_init(&c, 5, 100, now);
+  /* a burst with a short minimum sojourn is not an overload */
+  for (; now < 1300; now += 10) {
+    assert_int_equal(_nhttp_codel_admit(&c, now % 100 ? 50 : 1, now), 1);
+  }
+  assert_int_equal(c.overloaded, 0);
+}
+
+static void test_codel_standing_queue(void **state) {
+  struct _nhttp_codel c;
+  long                now = 0;
+
+  _nhttp_codel_init(&c, 5, 100, now);
+  /* first interval only records the standing queue */
+  for (; now < 100; now += 10) {
+    assert_int_equal(_nhttp_codel_admit(&c, 20, now), 1);
+  }
+  /* overloaded: requests waiting for longer than twice the target are */
+  /* shed, the others are served */
+  assert_int_equal(_nhttp_codel_admit(&c, 20, now), 0);
+  assert_int_equal(c.overloaded, 1);
+  assert_int_equal(_nhttp_codel_admit(&c, 10, now), 1);
+  assert_int_equal(_nhttp_codel_admit(&c, 11, now), 0);
+
+  /* the queue drains, shedding stops after the next interval */
+  for (now += 10; now < 200; now += 10) {
+    _nhttp_codel_admit(&c, 2, now);
+  }
+  assert_int_equal(_nhttp_codel_admit(&c, 20, now), 1);
+  assert_int_equal(c.overloaded, 0);
+}
+
+static void test_codel_idle_interval(void **state) {
+  struct _nhttp_codel c;
+
+  _nhttp_codel_init(&c, 5, 100, 0);
+  _nhttp_codel_admit(&c, 50, 10);
+  _nhttp_codel_admit(&c, 50, 150); /* overloaded from here on */
+  assert_int_equal(_nhttp_codel_admit(&c, 50, 160), 0);
+  /* no requests during a whole interval, no standing queue */
+  assert_int_equal(_nhttp_codel_admit(&c, 50, 1000), 1);
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_codel_burst),
+      cmocka_unit_test(test_codel_standing_queue),
+      cmocka_unit_test(test_codel_idle_interval),
+  };
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,78 @@
+// clang-format off
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <cmocka.h>
+#include <poll.h>
+#include <unistd.h> /* pipe,write,close */
+
+#include "../src/nhttp_coro.h"
+// clang-format on
+
+static int steps;
+
+static void waiting_fn(void *arg) {
+  int *fds = arg;
+  steps++;
+  assert_int_equal(_nhttp_coro_wait(fds[0], POLLIN, 100), -1);
+  steps++;
+  assert_int_equal(_nhttp_coro_wait(-1, 0, 10), 0);
+  steps++;
+}
+
+static void test_coro_resume(void **state) {
+  int fds[2];
+  assert_int_equal(pipe(fds), 0);
+  steps = 0;
+
+  struct _nhttp_coro *co = _nhttp_coro_create(waiting_fn, fds);
+  assert_ptr_equal(_nhttp_coro_self(), NULL);
+
+  /* runs until the first wait, which describes what it waits for */
+  _nhttp_coro_resume(co);
+  assert_int_equal(steps, 1);
+  assert_int_equal(co->done, 0);
+  assert_int_equal(co->wait_fd, fds[0]);
+  assert_int_equal(co->wait_events, POLLIN);
+  assert_int_equal(co->wait_timeout, 100);
+
+  /* the resumer decides on the outcome of the wait */
+  co->wait_result = -1;
+  _nhttp_coro_resume(co);
+  assert_int_equal(steps, 2);
+  assert_int_equal(co->wait_fd, -1);
+  assert_int_equal(co->wait_timeout, 10);
+
+  co->wait_result = 0;
+  _nhttp_coro_resume(co);
+  assert_int_equal(steps, 3);
+  assert_int_equal(co->done, 1);
+  assert_ptr_equal(_nhttp_coro_self(), NULL);
+
+  _nhttp_coro_free(co);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+static void test_coro_wait_blocking(void **state) {
+  int fds[2];
+  assert_int_equal(pipe(fds), 0);
+
+  /* outside of a coroutine, waits block in poll(2) */
+  assert_int_equal(_nhttp_coro_wait(fds[0], POLLIN, 10), -1);
+  assert_int_equal(write(fds[1], "x", 1), 1);
+  assert_int_equal(_nhttp_coro_wait(fds[0], POLLIN, 10), 0);
+  assert_int_equal(_nhttp_coro_wait(-1, 0, 1), 0);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+int main(void) {
+  const struct CMUnitTest coro_tests[] = {
+      cmocka_unit_test(test_coro_resume),
+      cmocka_unit_test(test_coro_wait_blocking),
+  };
+  return cmocka_run_group_tests(coro_tests, NULL, NULL);
+}
@@ -0,0 +1,82 @@
+#define _GNU_SOURCE /* sched_getcpu */
+// clang-format off
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <cmocka.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../src/nhttp_cpu.h"
+// clang-format on
+
+static int listen_reuseport(struct sockaddr_in *addr) {
+  socklen_t len = sizeof(struct sockaddr_in);
+  int       fd  = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  int       one = 1;
+
+  assert_int_equal(
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(int)), 0);
+  assert_int_equal(bind(fd, (struct sockaddr *)addr, len), 0);
+  assert_int_equal(listen(fd, 16), 0);
+  assert_int_equal(getsockname(fd, (struct sockaddr *)addr, &len), 0);
+  return fd;
+}
+
+static void test_cpu_pin(void **state) {
+  int *cpus, n;
+
+  n = _nhttp_cpu_allowed(&cpus);
+  assert_true(n >= 1);
+  assert_int_equal(_nhttp_cpu_pin(cpus[n - 1]), 0);
+  assert_int_equal(sched_getcpu(), cpus[n - 1]);
+  assert_int_equal(_nhttp_cpu_pin(-1), -1);
+  free(cpus);
+}
+
+static void test_cpu_steer(void **state) {
+  struct sockaddr_in addr;
+  int               *cpus, steer[2], fds[2], client, conn;
+
+  assert_true(_nhttp_cpu_allowed(&cpus) >= 1);
+  assert_int_equal(_nhttp_cpu_pin(cpus[0]), 0);
+
+  memset(&addr, 0, sizeof(struct sockaddr_in));
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  fds[0]               = listen_reuseport(&addr);
+  fds[1]               = listen_reuseport(&addr);
+
+  /* loopback packets are received on the sending cpu, the second socket */
+  /* is the one of that cpu */
+  steer[0] = cpus[0] + 1;
+  steer[1] = cpus[0];
+  assert_int_equal(_nhttp_cpu_steer(fds[0], steer, 2), 0);
+  client = socket(AF_INET, SOCK_STREAM, 0);
+  assert_int_equal(
+      connect(client, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)),
+      0);
+  assert_int_equal(accept(fds[0], NULL, NULL), -1);
+  assert_true((conn = accept(fds[1], NULL, NULL)) != -1);
+  assert_int_equal(_nhttp_cpu_incoming(conn), cpus[0]);
+
+  close(conn);
+  close(client);
+  close(fds[0]);
+  close(fds[1]);
+  free(cpus);
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_cpu_pin),
+      cmocka_unit_test(test_cpu_steer),
+  };
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
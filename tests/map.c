@@ -6,7 +6,6 @@
 #include <cmocka.h>
 
 #include "../src/nhttp_map.h"
-#include "./sockmock.h"
 // clang-format on
 
 static void test_nhttp_map_set_single_element(void **state) {
@@ -124,44 +123,6 @@ static void test_nhttp_map_remove(void **state) {
   // TODO(sbrki): add test case for removing middle entry
 }
 
-static void test_nhttp_map_create_from_http_headers(void **state) {
-  /* edge case: no headers */
-  {
-    struct sockmock           s = sockmock_create("\r\n");
-    struct _nhttp_buf_reader *br =
-        _nhttp_util_buf_reader_create(s.serv_conn_fd);
-
-    struct _nhttp_map *m = _nhttp_map_create_from_http_headers(br);
-    assert_non_null(m);
-
-    _nhttp_map_free(m);
-    free(br);
-    close(s.serv_conn_fd);
-    sockmock_free(s, 0);
-  }
-  {
-    struct sockmock           s = sockmock_create("Key1:Val1\r\n"
-                                                            "Key2: Val2\r\n"
-                                                            "key-3: val-3\r\n"
-                                                            "Key4: val with spaces\r\n"
-                                                            "\r\n");
-    struct _nhttp_buf_reader *br =
-        _nhttp_util_buf_reader_create(s.serv_conn_fd);
-
-    struct _nhttp_map *m = _nhttp_map_create_from_http_headers(br);
-    assert_non_null(m);
-    assert_string_equal(_nhttp_map_get(m, "Key1"), "Val1");
-    assert_string_equal(_nhttp_map_get(m, "Key2"), "Val2");
-    assert_string_equal(_nhttp_map_get(m, "key-3"), "val-3");
-    assert_string_equal(_nhttp_map_get(m, "Key4"), "val with spaces");
-
-    _nhttp_map_free(m);
-    free(br);
-    close(s.serv_conn_fd);
-    sockmock_free(s, 0);
-  }
-}
-
 static void test_nhttp_map_create_from_urlencoded(void **state) {
   /* TODO(sbrki): write more tests */
   {
@@ -244,7 +205,6 @@ int main(void) {
       cmocka_unit_test(test_nhttp_map_set_overwrite),
       cmocka_unit_test(test_nhttp_map_get),
       cmocka_unit_test(test_nhttp_map_remove),
-      cmocka_unit_test(test_nhttp_map_create_from_http_headers),
       cmocka_unit_test(test_nhttp_map_create_from_urlencoded),
   };
   return cmocka_run_group_tests(map_tests, NULL, NULL);
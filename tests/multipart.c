@@ -0,0 +1,172 @@
+// clang-format off
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <cmocka.h>
+
+#include <string.h>
+
+#include "../src/nhttp_multipart.h"
+// clang-format on
+
+/* parse feeds `body` to a new parser `step` bytes at a time (or all of it, */
+/* if `step` is 0), and writes the events into `out`: each part as */
+/* "[name|filename|content type]", followed by its data and "$" at its */
+/* end. Returns the final status. */
+static int parse(const char *boundary, const char *body, size_t step,
+                 char *out) {
+  struct _nhttp_multipart m;
+  const char             *data;
+  size_t                  off = 0, avail, used, len, n = strlen(body);
+  int                     status;
+
+  _nhttp_multipart_init(&m, boundary);
+  *out = '\0';
+  for (;;) {
+    avail  = step && off + step < n ? step : n - off;
+    status = _nhttp_multipart_execute(&m, body + off, avail, &used, &data,
+                                      &len);
+    assert_true(used <= avail);
+    off += used;
+    if (status == NHTTP_MULTIPART_DATA) {
+      assert_true(len > 0);
+      strncat(out, data, len);
+    } else if (status == NHTTP_MULTIPART_PART) {
+      strcat(out, "[");
+      strcat(out, m.name);
+      strcat(out, "|");
+      strcat(out, m.filename ? m.filename : "-");
+      strcat(out, "|");
+      strcat(out, m.content_type ? m.content_type : "-");
+      strcat(out, "]");
+    } else if (status == NHTTP_MULTIPART_PART_END) {
+      strcat(out, "$");
+    } else if (status != NHTTP_MULTIPART_AGAIN || off == n) {
+      break;
+    }
+  }
+  return status;
+}
+
+static void test_multipart_boundary(void **state) {
+  char dest[NHTTP_MULTIPART_MAX_BOUNDARY + 1];
+
+  assert_int_equal(_nhttp_multipart_boundary(
+                       dest, "multipart/form-data; boundary=----abc123"),
+                   0);
+  assert_string_equal(dest, "----abc123");
+  assert_int_equal(_nhttp_multipart_boundary(
+                       dest, "Multipart/Form-Data;charset=utf-8; "
+                             "BOUNDARY=\"a b:c\""),
+                   0);
+  assert_string_equal(dest, "a b:c");
+
+  assert_int_equal(_nhttp_multipart_boundary(dest, "multipart/form-data"), -1);
+  assert_int_equal(_nhttp_multipart_boundary(
+                       dest, "multipart/mixed; boundary=abc"),
+                   -1);
+  assert_int_equal(_nhttp_multipart_boundary(
+                       dest, "multipart/form-data; boundary=\"\""),
+                   -1);
+  assert_int_equal(_nhttp_multipart_boundary(
+                       dest, "multipart/form-data; boundary=\"ab \""),
+                   -1);
+  assert_int_equal(_nhttp_multipart_boundary(
+                       dest, "multipart/form-data; boundary=\"a\rb\""),
+                   -1);
+  assert_int_equal(
+      _nhttp_multipart_boundary(
+          dest, "multipart/form-data; boundary="
+                "12345678901234567890123456789012345678901234567890"
+                "123456789012345678901"),
+      -1);
+}
+
+static void test_multipart_body(void **state) {
+  const char body[] =
+      "preamble\r\n"
+      "--xyz\r\n"
+      "Content-Disposition: form-data; name=\"title\"\r\n"
+      "\r\n"
+      "hello\r\n--xy\r\n-\r\n"
+      "--xyz  \r\n"
+      "content-disposition: form-data; filename=\"a \\\"b\\\".txt\"; "
+      "name=file\r\n"
+      "Content-Type: text/plain \r\n"
+      "X-Other: ignored\r\n"
+      "\r\n"
+      "\r\r\n\r\n-\r\n--\r\n--xyz\r\n"
+      "Content-Disposition: form-data; name=\"empty\"\r\n"
+      "\r\n"
+      "\r\n--xyz--\r\n"
+      "epilogue";
+  char   out[512];
+  size_t step;
+
+  /* fed all at once, and split at every possible point */
+  for (step = 0; step < sizeof(body); step++) {
+    assert_int_equal(parse("xyz", body, step, out), NHTTP_MULTIPART_DONE);
+    assert_string_equal(out, "[title|-|-]hello\r\n--xy\r\n-$"
+                             "[file|a \"b\".txt|text/plain]"
+                             "\r\r\n\r\n-\r\n--$"
+                             "[empty|-|-]$");
+  }
+}
+
+static void test_multipart_start(void **state) {
+  char out[64];
+
+  /* without a preamble, and without parts */
+  assert_int_equal(parse("b", "--b\r\nContent-Disposition: form-data; "
+                              "name=x\r\n\r\n1\r\n--b--",
+                         0, out),
+                   NHTTP_MULTIPART_DONE);
+  assert_string_equal(out, "[x|-|-]1$");
+  assert_int_equal(parse("b", "--b--\r\n", 0, out), NHTTP_MULTIPART_DONE);
+  assert_string_equal(out, "");
+  /* no delimiter at all */
+  assert_int_equal(parse("b", "-b--\r\n--c--", 0, out), NHTTP_MULTIPART_AGAIN);
+}
+
+static void test_multipart_invalid(void **state) {
+  const char *bodies[] = {
+      "--bX\r\n",                                   /* text after delimiter */
+      "--b\n",                                      /* bare LF */
+      "--b-\r\n",                                   /* one dash */
+      "--b\r\n\r\nx\r\n--b--",                      /* no disposition */
+      "--b\r\nContent-Disposition: form-data\r\n\r\n", /* no name */
+      "--b\r\nContent-Disposition: attachment; name=a\r\n\r\n",
+      "--b\r\nContent-Disposition: form-data; name=\"a\r\n\r\n",
+      "--b\r\nContent-Disposition: form-data; name=a\n\r\n\r\n",
+      "--b\r\nX: 1\r\n folded\r\n\r\n",
+      "--b\r\nno colon\r\n\r\n",
+  };
+  char   out[64];
+  size_t i;
+
+  for (i = 0; i < sizeof(bodies) / sizeof(bodies[0]); i++)
+    assert_int_equal(parse("b", bodies[i], 0, out), NHTTP_MULTIPART_INVALID);
+}
+
+static void test_multipart_head_limit(void **state) {
+  char   body[2 * NHTTP_MULTIPART_MAX_HEAD], out[64];
+  size_t i;
+
+  strcpy(body, "--b\r\nContent-Disposition: form-data; name=a\r\n");
+  for (i = 0; i < NHTTP_MULTIPART_MAX_HEAD / 8; i++)
+    strcat(body, "X: abc\r\n");
+  strcat(body, "\r\n");
+  assert_int_equal(parse("b", body, 100, out), NHTTP_MULTIPART_TOO_LARGE);
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_multipart_boundary),
+      cmocka_unit_test(test_multipart_body),
+      cmocka_unit_test(test_multipart_start),
+      cmocka_unit_test(test_multipart_invalid),
+      cmocka_unit_test(test_multipart_head_limit),
+  };
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,135 @@
+// clang-format off
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <cmocka.h>
+
+#include <string.h>
+
+#include "../src/nhttp_parser.h"
+// clang-format on
+
+static int slice_equal(const char *buf, struct _nhttp_parser_slice s,
+                       const char *str) {
+  return s.len == strlen(str) && !memcmp(buf + s.off, str, s.len);
+}
+
+static void test_parser_head(void **state) {
+  const char head[] = "\r\nGET /a?b=c HTTP/1.1\r\n"
+                      "Host: example.com\r\n"
+                      "X-Empty:\r\n"
+                      "X-Padded: \t padded value \t\r\n"
+                      "\r\n"
+                      "body";
+  struct _nhttp_parser p;
+
+  _nhttp_parser_init(&p);
+  assert_int_equal(_nhttp_parser_execute(&p, head, sizeof(head) - 1),
+                   NHTTP_PARSER_DONE);
+  assert_int_equal(p.pos, sizeof(head) - 1 - strlen("body"));
+  assert_true(slice_equal(head, p.method, "GET"));
+  assert_true(slice_equal(head, p.target, "/a?b=c"));
+  assert_true(slice_equal(head, p.version, "HTTP/1.1"));
+  assert_int_equal(p.nheaders, 3);
+  assert_true(slice_equal(head, p.headers[0].name, "Host"));
+  assert_true(slice_equal(head, p.headers[0].value, "example.com"));
+  assert_true(slice_equal(head, p.headers[1].name, "X-Empty"));
+  assert_true(slice_equal(head, p.headers[1].value, ""));
+  assert_true(slice_equal(head, p.headers[2].name, "X-Padded"));
+  assert_true(slice_equal(head, p.headers[2].value, "padded value"));
+  assert_int_equal(p.headers[0].id, NHTTP_HEADER_HOST);
+  assert_int_equal(p.headers[1].id, NHTTP_HEADER_OTHER);
+  /* done parsers stay done */
+  assert_int_equal(_nhttp_parser_execute(&p, head, sizeof(head) - 1),
+                   NHTTP_PARSER_DONE);
+}
+
+static void test_parser_resume(void **state) {
+  const char head[] = "POST /upload HTTP/1.0\r\n"
+                      "Content-Length: 5\r\n"
+                      "Connection: keep-alive\r\n"
+                      "\r\n";
+  struct _nhttp_parser p;
+  size_t               i;
+
+  /* fed one byte at a time, as if every byte arrived in its own read */
+  _nhttp_parser_init(&p);
+  for (i = 1; i < sizeof(head) - 1; i++) {
+    assert_int_equal(_nhttp_parser_execute(&p, head, i), NHTTP_PARSER_AGAIN);
+    assert_int_equal(p.pos, i);
+  }
+  assert_int_equal(_nhttp_parser_execute(&p, head, i), NHTTP_PARSER_DONE);
+  assert_int_equal(p.pos, sizeof(head) - 1);
+  assert_true(slice_equal(head, p.method, "POST"));
+  assert_true(slice_equal(head, p.version, "HTTP/1.0"));
+  assert_int_equal(p.nheaders, 2);
+  assert_true(slice_equal(head, p.headers[1].name, "Connection"));
+  assert_true(slice_equal(head, p.headers[1].value, "keep-alive"));
+}
+
+static void test_parser_invalid(void **state) {
+  const char *heads[] = {
+      "GET /\r\n\r\n",                          /* no version */
+      "GET  / HTTP/1.1\r\n\r\n",                /* empty target */
+      "GET / HTTP/1.1 \r\n\r\n",                /* trailing space */
+      "GET / HTTP/11\r\n\r\n",                  /* malformed version */
+      "GET / HTTP/1.1\n\r\n",                   /* bare LF */
+      "GET / HTTP/1.1\r\nHost: x\n\r\n",        /* bare LF after a header */
+      "GET / HTTP/1.1\r\nHost: x\r\r\n\r\n",    /* bare CR */
+      "G(T / HTTP/1.1\r\n\r\n",                 /* not a token */
+      "GET / HTTP/1.1\r\nHost : x\r\n\r\n",     /* space before the colon */
+      "GET / HTTP/1.1\r\n: x\r\n\r\n",          /* empty name */
+      "GET / HTTP/1.1\r\nA: x\r\n y\r\n\r\n",   /* obsolete line folding */
+      "GET / HTTP/1.1\r\nA: \x01\r\n\r\n",      /* control in a value */
+      "GET / HTTP/1.1\r\nHost\r\n\r\n",         /* no colon */
+  };
+  struct _nhttp_parser p;
+  size_t               i;
+
+  for (i = 0; i < sizeof(heads) / sizeof(heads[0]); i++) {
+    _nhttp_parser_init(&p);
+    assert_int_equal(_nhttp_parser_execute(&p, heads[i], strlen(heads[i])),
+                     NHTTP_PARSER_INVALID);
+    assert_int_equal(p.state, NHTTP_PARSER_FAILED);
+  }
+}
+
+static void test_parser_too_many_headers(void **state) {
+  char                 head[4096] = "GET / HTTP/1.1\r\n";
+  struct _nhttp_parser p;
+  int                  i;
+
+  for (i = 0; i < NHTTP_PARSER_MAX_HEADERS; i++)
+    strcat(head, "A: b\r\n");
+  _nhttp_parser_init(&p);
+  assert_int_equal(_nhttp_parser_execute(&p, head, strlen(head)),
+                   NHTTP_PARSER_AGAIN);
+  assert_int_equal(p.nheaders, NHTTP_PARSER_MAX_HEADERS);
+
+  strcat(head, "A: b\r\n\r\n");
+  assert_int_equal(_nhttp_parser_execute(&p, head, strlen(head)),
+                   NHTTP_PARSER_TOO_MANY_HEADERS);
+}
+
+static void test_parser_header_id(void **state) {
+  assert_int_equal(_nhttp_parser_header_id("Host", 4), NHTTP_HEADER_HOST);
+  assert_int_equal(_nhttp_parser_header_id("content-LENGTH", 14),
+                   NHTTP_HEADER_CONTENT_LENGTH);
+  assert_int_equal(_nhttp_parser_header_id("User-Agent", 10),
+                   NHTTP_HEADER_USER_AGENT);
+  assert_int_equal(_nhttp_parser_header_id("Hos", 3), NHTTP_HEADER_OTHER);
+  assert_int_equal(_nhttp_parser_header_id("Hostx", 5), NHTTP_HEADER_OTHER);
+  assert_int_equal(_nhttp_parser_header_id("Rangf", 5), NHTTP_HEADER_OTHER);
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_parser_head),
+      cmocka_unit_test(test_parser_resume),
+      cmocka_unit_test(test_parser_invalid),
+      cmocka_unit_test(test_parser_too_many_headers),
+      cmocka_unit_test(test_parser_header_id),
+  };
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,88 @@
+// clang-format off
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <cmocka.h>
+#include <pthread.h>
+
+#include "../src/nhttp_queue.h"
+// clang-format on
+
+static void test_queue_push_pop(void **state) {
+  struct _nhttp_queue *q = _nhttp_queue_create();
+
+  assert_int_equal(_nhttp_queue_pop(q), -1);
+  assert_int_equal(_nhttp_queue_push(q, 3), 0);
+  assert_int_equal(_nhttp_queue_push(q, 4), 0);
+  assert_int_equal(_nhttp_queue_pop(q), 3);
+  assert_int_equal(_nhttp_queue_pop(q), 4);
+  assert_int_equal(_nhttp_queue_pop(q), -1);
+
+  /* pending wakeup makes wait return immediately */
+  assert_int_equal(_nhttp_queue_push(q, 5), 0);
+  _nhttp_queue_wait(q);
+  assert_int_equal(_nhttp_queue_pop(q), 5);
+
+  _nhttp_queue_free(q);
+}
+
+static void test_queue_full(void **state) {
+  struct _nhttp_queue *q = _nhttp_queue_create();
+  int                  i;
+
+  for (i = 0; i < NHTTP_QUEUE_SIZE; i++) {
+    assert_int_equal(_nhttp_queue_push(q, i), 0);
+  }
+  assert_int_equal(_nhttp_queue_push(q, i), -1);
+
+  /* wraps around after popping */
+  assert_int_equal(_nhttp_queue_pop(q), 0);
+  assert_int_equal(_nhttp_queue_push(q, i), 0);
+  for (i = 1; i <= NHTTP_QUEUE_SIZE; i++) {
+    assert_int_equal(_nhttp_queue_pop(q), i);
+  }
+  assert_int_equal(_nhttp_queue_pop(q), -1);
+
+  _nhttp_queue_free(q);
+}
+
+#define PRODUCED 100000
+
+static void *_producer(void *arg) {
+  struct _nhttp_queue *q = arg;
+  int                  i;
+  for (i = 0; i < PRODUCED; i++) {
+    while (_nhttp_queue_push(q, i) == -1) {
+    }
+  }
+  return NULL;
+}
+
+static void test_queue_concurrent(void **state) {
+  struct _nhttp_queue *q = _nhttp_queue_create();
+  pthread_t            producer;
+  int                  expected = 0, fd;
+
+  pthread_create(&producer, NULL, _producer, q);
+  while (expected < PRODUCED) {
+    if ((fd = _nhttp_queue_pop(q)) == -1) {
+      _nhttp_queue_wait(q);
+      continue;
+    }
+    assert_int_equal(fd, expected);
+    expected++;
+  }
+  pthread_join(producer, NULL);
+
+  _nhttp_queue_free(q);
+}
+
+int main(void) {
+  const struct CMUnitTest queue_tests[] = {
+      cmocka_unit_test(test_queue_push_pop),
+      cmocka_unit_test(test_queue_full),
+      cmocka_unit_test(test_queue_concurrent),
+  };
+  return cmocka_run_group_tests(queue_tests, NULL, NULL);
+}
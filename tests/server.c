@@ -5,20 +5,54 @@
 #include <stdint.h>
 #include <cmocka.h>
 
+#include <errno.h>
+#include <fcntl.h> /* open,fcntl */
+#include <poll.h>
+#include <stdio.h> /* rename,sprintf */
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h> /* pipe,write,close */
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include "../src/nhttp_server.h"
+#include "../src/nhttp_coro.h"
 #include "../src/nhttp_map.h"
+#include "../src/nhttp_util.h"
 // clang-format on
 
 static void test_get_request_header(void **state) {
-  struct nhttp_ctx *ctx = malloc(sizeof(struct nhttp_ctx));
-  ctx->req_headers      = _nhttp_map_create();
-  _nhttp_map_set(ctx->req_headers, "foo", "bar");
+  struct nhttp_ctx     *ctx = malloc(sizeof(struct nhttp_ctx));
+  struct _nhttp_request req;
+  char                  head[]  = "foo:bar";
+  char                  range[] = "range:bytes=0-1";
+
+  memset(&req, 0, sizeof(req));
+  req.nheaders             = 2;
+  req.headers[0].name.ptr  = head;
+  req.headers[0].name.len  = 3;
+  req.headers[0].value.ptr = head + 4;
+  req.headers[0].value.len = 3;
+  head[3]                  = '\0';
+  req.headers[1].name.ptr  = range;
+  req.headers[1].name.len  = 5;
+  req.headers[1].value.ptr = range + 6;
+  req.headers[1].value.len = 9;
+  range[5]                 = '\0';
+  ctx->req                 = &req;
+  /* as recognized by the parser */
+  req.known[NHTTP_HEADER_RANGE] = &req.headers[1];
 
   assert_string_equal(nhttp_get_request_header(ctx, "foo"), "bar");
+  assert_string_equal(nhttp_get_request_header(ctx, "FOO"), "bar");
   assert_ptr_equal(nhttp_get_request_header(ctx, "baz"), NULL);
+  assert_ptr_equal(nhttp_get_request_header(ctx, "fo"), NULL);
+  /* known headers are looked up by their id */
+  assert_string_equal(nhttp_get_request_header(ctx, "Range"), "bytes=0-1");
+  assert_ptr_equal(nhttp_get_request_header(ctx, "Host"), NULL);
 
-  _nhttp_map_free(ctx->req_headers);
   free(ctx);
 }
 
@@ -48,23 +82,785 @@ static void test_get_path_param(void **state) {
 }
 
 static void test_get_query_param(void **state) {
-  struct nhttp_ctx *ctx = malloc(sizeof(struct nhttp_ctx));
-  ctx->query_params     = _nhttp_map_create();
-  _nhttp_map_set(ctx->query_params, "foo", "bar");
+  struct nhttp_ctx     *ctx = malloc(sizeof(struct nhttp_ctx));
+  struct _nhttp_request req;
+  char                  query[] = "foo=bar&q=a%20b";
 
+  req.query.ptr     = query;
+  req.query.len     = strlen(query);
+  ctx->req          = &req;
+  ctx->query_params = NULL;
+
+  /* parsed on first use */
   assert_string_equal(nhttp_get_query_param(ctx, "foo"), "bar");
+  assert_ptr_not_equal(ctx->query_params, NULL);
+  assert_string_equal(nhttp_get_query_param(ctx, "q"), "a b");
   assert_ptr_equal(nhttp_get_query_param(ctx, "baz"), NULL);
+  _nhttp_map_free(ctx->query_params);
 
+  /* malformed queries have no parameters */
+  strcpy(query, "foo=%zz");
+  req.query.len     = strlen(query);
+  ctx->query_params = NULL;
+  assert_ptr_equal(nhttp_get_query_param(ctx, "foo"), NULL);
   _nhttp_map_free(ctx->query_params);
+
+  /* empty queries are not parsed */
+  req.query.len     = 0;
+  ctx->query_params = NULL;
+  assert_ptr_equal(nhttp_get_query_param(ctx, "foo"), NULL);
+  assert_ptr_equal(ctx->query_params, NULL);
+
   free(ctx);
 }
 
+static int hello_handler(const struct nhttp_ctx *ctx) {
+  return nhttp_send_string(ctx, "hello", 200);
+}
+
+static int count_occurrences(const char *buf, size_t len, const char *str) {
+  int    n = 0;
+  size_t i, slen = strlen(str);
+  for (i = 0; i + slen <= len; i++) {
+    if (!memcmp(buf + i, str, slen))
+      n++;
+  }
+  return n;
+}
+
+static void test_handle_pipeline(void **state) {
+  struct nhttp_server *s = nhttp_server_create();
+  nhttp_on_get(s, "/hello", hello_handler);
+  {
+    /* all pipelined requests are handled in one go */
+    const char req[] = "GET /hello HTTP/1.1\r\n\r\n"
+                       "GET /nope HTTP/1.1\r\n\r\n"
+                       "GET /hello HTTP/1.1\r\nHost: x\r\n\r\n";
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    assert_int_equal(write(fds[1], req, sizeof(req) - 1), sizeof(req) - 1);
+    struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(fds[0]);
+    struct _nhttp_buf_writer *w = _nhttp_util_buf_writer_create(-1);
+    assert_true(_nhttp_util_buf_reader_fill(r) > 0);
+
+    struct _nhttp_parser      p;
+    struct _nhttp_server_body b = {0};
+    _nhttp_parser_init(&p);
+    int requests = 0;
+    assert_int_equal(
+        _nhttp_server_handle_pipeline(s, &p, &b, r, w, &requests), 1);
+    assert_int_equal(requests, 3);
+    assert_int_equal(count_occurrences(w->buf, w->len, "HTTP/1.1 200"), 2);
+    assert_int_equal(count_occurrences(w->buf, w->len, "HTTP/1.1 404"), 1);
+    assert_int_equal(r->head, r->tail);
+
+    _nhttp_util_buf_writer_free(w);
+    _nhttp_util_buf_reader_free(r);
+    close(fds[0]);
+    close(fds[1]);
+  }
+  {
+    /* the batch stops at a request that closes the connection */
+    const char req[] = "GET /hello HTTP/1.1\r\nConnection: close\r\n\r\n"
+                       "GET /hello HTTP/1.1\r\n\r\n";
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    assert_int_equal(write(fds[1], req, sizeof(req) - 1), sizeof(req) - 1);
+    struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(fds[0]);
+    struct _nhttp_buf_writer *w = _nhttp_util_buf_writer_create(-1);
+    assert_true(_nhttp_util_buf_reader_fill(r) > 0);
+
+    struct _nhttp_parser      p;
+    struct _nhttp_server_body b = {0};
+    _nhttp_parser_init(&p);
+    int requests = 0;
+    assert_int_equal(
+        _nhttp_server_handle_pipeline(s, &p, &b, r, w, &requests), 0);
+    assert_int_equal(requests, 1);
+    assert_int_equal(count_occurrences(w->buf, w->len, "HTTP/1.1 200"), 1);
+    assert_int_equal(count_occurrences(w->buf, w->len, "Connection:close"), 1);
+
+    _nhttp_util_buf_writer_free(w);
+    _nhttp_util_buf_reader_free(r);
+    close(fds[0]);
+    close(fds[1]);
+  }
+  {
+    /* a malformed head is rejected, and the connection closed */
+    const char req[] = "GET /hello HTTP/1.1\r\nHost : x\r\n\r\n";
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    assert_int_equal(write(fds[1], req, sizeof(req) - 1), sizeof(req) - 1);
+    struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(fds[0]);
+    struct _nhttp_buf_writer *w = _nhttp_util_buf_writer_create(-1);
+    assert_true(_nhttp_util_buf_reader_fill(r) > 0);
+
+    struct _nhttp_parser      p;
+    struct _nhttp_server_body b = {0};
+    _nhttp_parser_init(&p);
+    int requests = 0;
+    assert_int_equal(
+        _nhttp_server_handle_pipeline(s, &p, &b, r, w, &requests), 0);
+    assert_int_equal(count_occurrences(w->buf, w->len, "HTTP/1.1 400"), 1);
+
+    _nhttp_util_buf_writer_free(w);
+    _nhttp_util_buf_reader_free(r);
+    close(fds[0]);
+    close(fds[1]);
+  }
+}
+
+static char   body[20000];
+static size_t body_len;
+
+static int read_body_handler(const struct nhttp_ctx *ctx) {
+  ssize_t n;
+  body_len = 0;
+  /* small reads, which are served from the read buffer */
+  while ((n = nhttp_read_body(ctx, body + body_len, 1000)) > 0)
+    body_len += (size_t)n;
+  return nhttp_send_string(ctx, n == 0 ? "read" : "error", 200);
+}
+
+static int append_chunk(const struct nhttp_ctx *ctx, const char *data,
+                        size_t len, void *arg) {
+  (void)ctx;
+  assert_ptr_equal(arg, body);
+  assert_true(len <= NHTTP_SERVER_BODY_CHUNK);
+  memcpy(body + body_len, data, len);
+  body_len += len;
+  return 0;
+}
+
+static int stream_body_handler(const struct nhttp_ctx *ctx) {
+  body_len = 0;
+  if (nhttp_stream_body(ctx, append_chunk, body))
+    return nhttp_send_string(ctx, "error", 200);
+  return nhttp_send_string(ctx, "streamed", 200);
+}
+
+static void test_request_body(void **state) {
+  struct nhttp_server *s = nhttp_server_create();
+  char                 head[128], expected[sizeof(body)];
+  size_t               i, len;
+  int                  fds[2], requests;
+  const char           next[] = "GET /hello HTTP/1.1\r\n\r\n";
+
+  nhttp_on_get(s, "/hello", hello_handler);
+  nhttp_on_post(s, "/read", read_body_handler);
+  nhttp_on_post(s, "/stream", stream_body_handler);
+  nhttp_server_set_max_body_size(s, sizeof(body));
+  for (i = 0; i < sizeof(expected); i++)
+    expected[i] = (char)('a' + i % 26);
+
+  for (i = 0; i < 4; i++) {
+    /* bodies that fit in the read buffer and ones that don't, each */
+    /* followed by a pipelined request */
+    const char *path = i % 2 ? "/stream" : "/read";
+    len              = i < 2 ? 100 : sizeof(body);
+    sprintf(head, "POST %s HTTP/1.1\r\nContent-Length: %lu\r\n\r\n", path,
+            (unsigned long)len);
+    assert_int_equal(pipe(fds), 0);
+    assert_true(write(fds[1], head, strlen(head)) > 0);
+    assert_true(write(fds[1], expected, len) > 0);
+    assert_true(write(fds[1], next, sizeof(next) - 1) > 0);
+    struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(fds[0]);
+    struct _nhttp_buf_writer *w = _nhttp_util_buf_writer_create(-1);
+    struct _nhttp_parser      p;
+    struct _nhttp_server_body b = {0};
+    _nhttp_parser_init(&p);
+    requests = 0;
+    while (requests < 2) {
+      assert_true(_nhttp_util_buf_reader_fill(r) > 0);
+      assert_int_equal(
+          _nhttp_server_handle_pipeline(s, &p, &b, r, w, &requests), 1);
+    }
+    assert_int_equal(body_len, len);
+    assert_memory_equal(body, expected, len);
+    assert_int_equal(count_occurrences(w->buf, w->len, i % 2 ? "streamed"
+                                                              : "read"),
+                     1);
+    assert_int_equal(count_occurrences(w->buf, w->len, "hello"), 1);
+    _nhttp_util_buf_writer_free(w);
+    _nhttp_util_buf_reader_free(r);
+    close(fds[0]);
+    close(fds[1]);
+  }
+
+  for (i = 0; i < 2; i++) {
+    /* chunked bodies, larger than the read buffer */
+    const char *path = i ? "/stream" : "/read";
+    size_t      off, n;
+    sprintf(head, "POST %s HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n",
+            path);
+    assert_int_equal(pipe(fds), 0);
+    assert_true(write(fds[1], head, strlen(head)) > 0);
+    for (off = 0; off < sizeof(body); off += n) {
+      n = sizeof(body) - off < 3000 ? sizeof(body) - off : 3000;
+      sprintf(head, "%lx;ext=1\r\n", (unsigned long)n);
+      assert_true(write(fds[1], head, strlen(head)) > 0);
+      assert_true(write(fds[1], expected + off, n) > 0);
+      assert_true(write(fds[1], "\r\n", 2) > 0);
+    }
+    assert_true(write(fds[1], "0\r\nX-Sum: 1\r\n\r\n", 15) > 0);
+    assert_true(write(fds[1], next, sizeof(next) - 1) > 0);
+    struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(fds[0]);
+    struct _nhttp_buf_writer *w = _nhttp_util_buf_writer_create(-1);
+    struct _nhttp_parser      p;
+    struct _nhttp_server_body b = {0};
+    _nhttp_parser_init(&p);
+    requests = 0;
+    while (requests < 2) {
+      assert_true(_nhttp_util_buf_reader_fill(r) > 0);
+      assert_int_equal(
+          _nhttp_server_handle_pipeline(s, &p, &b, r, w, &requests), 1);
+    }
+    assert_int_equal(body_len, sizeof(body));
+    assert_memory_equal(body, expected, sizeof(body));
+    assert_int_equal(
+        count_occurrences(w->buf, w->len, i ? "streamed" : "read"), 1);
+    assert_int_equal(count_occurrences(w->buf, w->len, "hello"), 1);
+    _nhttp_util_buf_writer_free(w);
+    _nhttp_util_buf_reader_free(r);
+    close(fds[0]);
+    close(fds[1]);
+  }
+
+  {
+    /* bodies over the limit are rejected without running the handler */
+    sprintf(head, "POST /read HTTP/1.1\r\nContent-Length: %lu\r\n\r\n",
+            (unsigned long)sizeof(body) + 1);
+    assert_int_equal(pipe(fds), 0);
+    assert_true(write(fds[1], head, strlen(head)) > 0);
+    struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(fds[0]);
+    struct _nhttp_buf_writer *w = _nhttp_util_buf_writer_create(-1);
+    struct _nhttp_parser      p;
+    struct _nhttp_server_body b = {0};
+    _nhttp_parser_init(&p);
+    requests = 0;
+    body_len = 1;
+    assert_true(_nhttp_util_buf_reader_fill(r) > 0);
+    assert_int_equal(
+        _nhttp_server_handle_pipeline(s, &p, &b, r, w, &requests), 0);
+    assert_int_equal(count_occurrences(w->buf, w->len, "HTTP/1.1 413"), 1);
+    assert_int_equal(body_len, 1);
+    _nhttp_util_buf_writer_free(w);
+    _nhttp_util_buf_reader_free(r);
+    close(fds[0]);
+    close(fds[1]);
+  }
+
+  for (i = 0; i < 6; i++) {
+    /* lengths that aren't 1*DIGIT, or that disagree, are rejected, while */
+    /* repeated equal ones are accepted */
+    const char *lengths[] = {"+5",
+                             "0x5",
+                             "5 5",
+                             "5\r\nContent-Length: 6",
+                             "99999999999999999999999",
+                             "5\r\ncontent-length: 5"};
+    sprintf(head, "POST /read HTTP/1.1\r\nContent-Length: %s\r\n\r\n12345",
+            lengths[i]);
+    assert_int_equal(pipe(fds), 0);
+    assert_true(write(fds[1], head, strlen(head)) > 0);
+    struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(fds[0]);
+    struct _nhttp_buf_writer *w = _nhttp_util_buf_writer_create(-1);
+    struct _nhttp_parser      p;
+    struct _nhttp_server_body b = {0};
+    _nhttp_parser_init(&p);
+    requests = 0;
+    body_len = 0;
+    assert_true(_nhttp_util_buf_reader_fill(r) > 0);
+    assert_int_equal(
+        _nhttp_server_handle_pipeline(s, &p, &b, r, w, &requests), i == 5);
+    assert_int_equal(count_occurrences(w->buf, w->len, "HTTP/1.1 400"),
+                     i != 5);
+    assert_int_equal(body_len, i == 5 ? 5 : 0);
+    _nhttp_util_buf_writer_free(w);
+    _nhttp_util_buf_reader_free(r);
+    close(fds[0]);
+    close(fds[1]);
+  }
+}
+
+static void test_expect_continue(void **state) {
+  struct nhttp_server *s = nhttp_server_create();
+  const char           head[] = "POST /read HTTP/1.1\r\n"
+                                "Expect: 100-continue\r\n"
+                                "Content-Length: 5\r\n\r\n";
+  char                 out[64];
+  size_t               i;
+  int                  fds[2], outfds[2], requests;
+  ssize_t              n;
+
+  nhttp_on_post(s, "/read", read_body_handler);
+  nhttp_on_post(s, "/ignore", hello_handler);
+
+  for (i = 0; i < 3; i++) {
+    /* "100 Continue" is only sent if the body hasn't been sent already, */
+    /* and the connection is closed if the handler never asked for it */
+    assert_int_equal(pipe(fds), 0);
+    assert_int_equal(pipe(outfds), 0);
+    if (i == 2) {
+      assert_true(write(fds[1], "POST /ignore", 12) > 0);
+      assert_true(write(fds[1], head + 10, sizeof(head) - 11) > 0);
+    } else {
+      assert_true(write(fds[1], head, sizeof(head) - 1) > 0);
+    }
+    if (i == 1)
+      assert_true(write(fds[1], "hello", 5) > 0);
+    struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(fds[0]);
+    struct _nhttp_buf_writer *w = _nhttp_util_buf_writer_create(outfds[1]);
+    struct _nhttp_parser      p;
+    struct _nhttp_server_body b = {0};
+    _nhttp_parser_init(&p);
+    requests = 0;
+    body_len = 0;
+    assert_true(_nhttp_util_buf_reader_fill(r) > 0);
+    if (i == 0) /* the client waited */
+      assert_true(write(fds[1], "hello", 5) > 0);
+    assert_int_equal(
+        _nhttp_server_handle_pipeline(s, &p, &b, r, w, &requests), i < 2);
+    assert_int_equal(body_len, i < 2 ? 5 : 0);
+    assert_int_equal(_nhttp_util_buf_writer_flush(w), 0);
+    close(outfds[1]);
+    assert_true((n = read(outfds[0], out, sizeof(out) - 1)) > 0);
+    out[n] = '\0';
+    assert_int_equal(count_occurrences(out, (size_t)n,
+                                       "HTTP/1.1 100 Continue\r\n\r\n"),
+                     i == 0);
+    assert_int_equal(count_occurrences(out, (size_t)n, "HTTP/1.1 200"), 1);
+    _nhttp_util_buf_writer_free(w);
+    _nhttp_util_buf_reader_free(r);
+    close(outfds[0]);
+    close(fds[0]);
+    close(fds[1]);
+  }
+}
+
+static void test_discard_body(void **state) {
+  struct nhttp_server *s = nhttp_server_create();
+  const char          *heads[] = {
+      "POST /nope HTTP/1.1\r\nContent-Length: 10\r\n\r\nhel",
+      "POST /nope HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhe",
+      "POST /nope HTTP/1.1\r\nContent-Length: 100000\r\n\r\nhel",
+  };
+  const char *rests[] = {"lo12345", "llo\r\n0\r\n\r\n"};
+  const char  next[]  = "GET /hello HTTP/1.1\r\n\r\n";
+  int         fds[2], requests, i;
+
+  nhttp_on_get(s, "/hello", hello_handler);
+  for (i = 0; i < 3; i++) {
+    /* the rest of an unread body is discarded once it arrives, unless */
+    /* it's too large */
+    assert_int_equal(pipe(fds), 0);
+    assert_true(write(fds[1], heads[i], strlen(heads[i])) > 0);
+    struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(fds[0]);
+    struct _nhttp_buf_writer *w = _nhttp_util_buf_writer_create(-1);
+    struct _nhttp_parser      p;
+    struct _nhttp_server_body b = {0};
+    _nhttp_parser_init(&p);
+    requests = 0;
+    assert_true(_nhttp_util_buf_reader_fill(r) > 0);
+    assert_int_equal(
+        _nhttp_server_handle_pipeline(s, &p, &b, r, w, &requests), i < 2);
+    assert_int_equal(count_occurrences(w->buf, w->len, "HTTP/1.1 404"), 1);
+    if (i < 2) {
+      assert_int_equal(b.pending, 1);
+      assert_int_equal(_nhttp_server_discard(&b, r, 0), 1);
+      assert_true(write(fds[1], rests[i], strlen(rests[i])) > 0);
+      assert_true(write(fds[1], next, sizeof(next) - 1) > 0);
+      assert_int_equal(_nhttp_server_discard(&b, r, 1), 0);
+      assert_int_equal(b.pending, 0);
+      assert_int_equal(
+          _nhttp_server_handle_pipeline(s, &p, &b, r, w, &requests), 1);
+      assert_int_equal(requests, 2);
+      assert_int_equal(count_occurrences(w->buf, w->len, "HTTP/1.1 200"), 1);
+      assert_int_equal(r->head, r->tail);
+    }
+    _nhttp_util_buf_writer_free(w);
+    _nhttp_util_buf_reader_free(r);
+    close(fds[0]);
+    close(fds[1]);
+  }
+}
+
+struct pipeline_args {
+  struct nhttp_server       *s;
+  struct _nhttp_parser      *p;
+  struct _nhttp_server_body *b;
+  struct _nhttp_buf_reader  *r;
+  struct _nhttp_buf_writer  *w;
+  int                        requests, keepalive;
+};
+
+static void run_pipeline(void *arg) {
+  struct pipeline_args *a = arg;
+  a->keepalive =
+      _nhttp_server_handle_pipeline(a->s, a->p, a->b, a->r, a->w, &a->requests);
+}
+
+static void test_nonblocking_body(void **state) {
+  struct nhttp_server *s = nhttp_server_create();
+  char                 head[128], expected[sizeof(body)];
+  const char           get[] = "GET /hello HTTP/1.1\r\n\r\n";
+  size_t               i, off, n;
+  int                  fds[2], waits;
+
+  nhttp_on_get(s, "/hello", hello_handler);
+  nhttp_on_post(s, "/read", read_body_handler);
+  nhttp_on_post(s, "/stream", stream_body_handler);
+  nhttp_server_set_max_body_size(s, sizeof(body));
+  for (i = 0; i < sizeof(expected); i++)
+    expected[i] = (char)('a' + i % 26);
+
+  for (i = 0; i < 2; i++) {
+    /* a body larger than the read buffer arrives piece by piece on a */
+    /* non-blocking fd, and the handler waits for every piece as a */
+    /* coroutine, as it does on the event loop */
+    sprintf(head, "POST %s HTTP/1.1\r\nContent-Length: %lu\r\n\r\n",
+            i ? "/stream" : "/read", (unsigned long)sizeof(body));
+    assert_int_equal(pipe(fds), 0);
+    assert_int_equal(fcntl(fds[0], F_SETFL, O_NONBLOCK), 0);
+    assert_true(write(fds[1], get, sizeof(get) - 1) > 0);
+    assert_true(write(fds[1], head, strlen(head)) > 0);
+    assert_true(write(fds[1], expected, 1000) > 0);
+    struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(fds[0]);
+    struct _nhttp_buf_writer *w = _nhttp_util_buf_writer_create(-1);
+    struct _nhttp_parser      p;
+    struct _nhttp_server_body b    = {0};
+    struct pipeline_args      args = {s, &p, &b, r, w, 0, 0};
+    _nhttp_parser_init(&p);
+    assert_true(_nhttp_util_buf_reader_fill(r) > 0);
+
+    /* outside of a coroutine, the batch stops before the body */
+    assert_int_equal(_nhttp_server_parse_head(&p, r), NHTTP_PARSER_DONE);
+    assert_int_equal(_nhttp_server_awaits_body(&p, r), 0);
+    assert_int_equal(
+        _nhttp_server_handle_pipeline(s, &p, &b, r, w, &args.requests), 1);
+    assert_int_equal(args.requests, 1);
+    assert_int_equal(_nhttp_server_parse_head(&p, r), NHTTP_PARSER_DONE);
+    assert_int_equal(_nhttp_server_awaits_body(&p, r), 1);
+
+    struct _nhttp_coro *co = _nhttp_coro_create(run_pipeline, &args);
+    body_len               = 0;
+    waits                  = 0;
+    _nhttp_coro_resume(co);
+    for (off = 1000; !co->done; off += n) {
+      assert_int_equal(co->wait_fd, fds[0]);
+      assert_int_equal(co->wait_events, POLLIN);
+      n = sizeof(body) - off < 3000 ? sizeof(body) - off : 3000;
+      assert_true(write(fds[1], expected + off, n) > 0);
+      waits++;
+      co->wait_result = 0;
+      _nhttp_coro_resume(co);
+    }
+    _nhttp_coro_free(co);
+    assert_int_equal(off, sizeof(body));
+    assert_true(waits > 1);
+    assert_int_equal(args.keepalive, 1);
+    assert_int_equal(args.requests, 2);
+    assert_int_equal(body_len, sizeof(body));
+    assert_memory_equal(body, expected, sizeof(body));
+    assert_int_equal(count_occurrences(w->buf, w->len, i ? "streamed"
+                                                          : "read"),
+                     1);
+    _nhttp_util_buf_writer_free(w);
+    _nhttp_util_buf_reader_free(r);
+    close(fds[0]);
+    close(fds[1]);
+  }
+}
+
+static int save_fd;
+
+static int save_body_handler(const struct nhttp_ctx *ctx) {
+  body_len = (size_t)nhttp_save_body_to_file(ctx, save_fd);
+  return nhttp_send_string(ctx, "saved", 200);
+}
+
+static void test_save_body(void **state) {
+  struct nhttp_server *s = nhttp_server_create();
+  char                 head[128], expected[sizeof(body)];
+  char                 path[] = "/tmp/nhttp-test-XXXXXX";
+  size_t               i;
+  int                  fds[2], requests;
+  const char           next[] = "GET /hello HTTP/1.1\r\n\r\n";
+
+  nhttp_on_get(s, "/hello", hello_handler);
+  nhttp_on_put(s, "/save", save_body_handler);
+  nhttp_server_set_max_body_size(s, sizeof(body));
+  for (i = 0; i < sizeof(expected); i++)
+    expected[i] = (char)('a' + i % 26);
+
+  for (i = 0; i < 3; i++) {
+    /* spliced, copied as the file is opened with O_APPEND, and chunked, */
+    /* each followed by a pipelined request */
+    assert_true((save_fd = mkstemp(path)) != -1);
+    if (i == 1)
+      assert_int_equal(fcntl(save_fd, F_SETFL, O_APPEND), 0);
+    assert_int_equal(pipe(fds), 0);
+    if (i < 2) {
+      sprintf(head, "PUT /save HTTP/1.1\r\nContent-Length: %lu\r\n\r\n",
+              (unsigned long)sizeof(body));
+      assert_true(write(fds[1], head, strlen(head)) > 0);
+      assert_true(write(fds[1], expected, sizeof(body)) > 0);
+    } else {
+      sprintf(head, "PUT /save HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+                    "\r\n%lx\r\n",
+              (unsigned long)sizeof(body));
+      assert_true(write(fds[1], head, strlen(head)) > 0);
+      assert_true(write(fds[1], expected, sizeof(body)) > 0);
+      assert_true(write(fds[1], "\r\n0\r\n\r\n", 7) > 0);
+    }
+    assert_true(write(fds[1], next, sizeof(next) - 1) > 0);
+    struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(fds[0]);
+    struct _nhttp_buf_writer *w = _nhttp_util_buf_writer_create(-1);
+    struct _nhttp_parser      p;
+    struct _nhttp_server_body b = {0};
+    _nhttp_parser_init(&p);
+    requests = 0;
+    while (requests < 2) {
+      assert_true(_nhttp_util_buf_reader_fill(r) > 0);
+      assert_int_equal(
+          _nhttp_server_handle_pipeline(s, &p, &b, r, w, &requests), 1);
+    }
+    assert_int_equal(body_len, sizeof(body));
+    assert_int_equal(count_occurrences(w->buf, w->len, "saved"), 1);
+    assert_int_equal(count_occurrences(w->buf, w->len, "hello"), 1);
+    memset(body, 0, sizeof(body));
+    assert_int_equal(pread(save_fd, body, sizeof(body), 0), sizeof(body));
+    assert_memory_equal(body, expected, sizeof(body));
+    _nhttp_util_buf_writer_free(w);
+    _nhttp_util_buf_reader_free(r);
+    close(fds[0]);
+    close(fds[1]);
+    close(save_fd);
+    unlink(path);
+    strcpy(path, "/tmp/nhttp-test-XXXXXX");
+  }
+}
+
+static char   spool_dir[] = "/tmp/nhttp-test-XXXXXX";
+static char   parts[256];
+static int    parse_result;
+
+static int on_part(const struct nhttp_ctx *ctx, const struct nhttp_part *part,
+                   void *arg) {
+  (void)ctx;
+  assert_ptr_equal(arg, parts);
+  strcat(parts, part->name);
+  strcat(parts, part->path ? "(spooled)" : "");
+  return 0;
+}
+
+static int on_data(const struct nhttp_ctx *ctx, const struct nhttp_part *part,
+                   const char *data, size_t len, void *arg) {
+  (void)ctx;
+  (void)arg;
+  assert_null(part->path);
+  memcpy(body + body_len, data, len);
+  body_len += len;
+  return 0;
+}
+
+static int on_part_end(const struct nhttp_ctx  *ctx,
+                       const struct nhttp_part *part, void *arg) {
+  char path[64];
+  (void)ctx;
+  (void)arg;
+  sprintf(path, "%s/%s", spool_dir, part->filename);
+  if (part->path)
+    assert_int_equal(rename(part->path, path), 0);
+  sprintf(parts + strlen(parts), "=%lu;", (unsigned long)part->size);
+  return 0;
+}
+
+static int parse_multipart(const struct nhttp_ctx *ctx, const char *dir) {
+  struct nhttp_multipart mp;
+  nhttp_multipart_init(&mp);
+  mp.on_part     = on_part;
+  mp.on_data     = on_data;
+  mp.on_part_end = on_part_end;
+  mp.spool_dir   = dir;
+  body_len       = 0;
+  parts[0]       = '\0';
+  parse_result   = nhttp_parse_multipart(ctx, &mp, parts);
+  return nhttp_send_string(ctx, "parsed", 200);
+}
+
+static int spool_handler(const struct nhttp_ctx *ctx) {
+  return parse_multipart(ctx, spool_dir);
+}
+
+static int parse_handler(const struct nhttp_ctx *ctx) {
+  return parse_multipart(ctx, NULL);
+}
+
+static void test_multipart(void **state) {
+  struct nhttp_server *s = nhttp_server_create();
+  char                 head[256], expected[sizeof(body)], path[64];
+  const char           part1[] = "--xyz\r\n"
+                                 "Content-Disposition: form-data; "
+                                 "name=title\r\n"
+                                 "\r\n"
+                                 "hello\r\n";
+  const char           part2[] = "--xyz\r\n"
+                                 "Content-Disposition: form-data; name=file; "
+                                 "filename=upload\r\n"
+                                 "\r\n";
+  const char           end[]   = "\r\n--xyz--\r\n";
+  size_t               i, len;
+  int                  fds[2], requests, fd;
+
+  assert_non_null(mkdtemp(spool_dir));
+  nhttp_on_post(s, "/spool", spool_handler);
+  nhttp_on_post(s, "/parse", parse_handler);
+  for (i = 0; i < sizeof(expected); i++)
+    expected[i] = (char)('a' + i % 26);
+
+  for (i = 0; i < 3; i++) {
+    /* a field and a file larger than the read buffer, which is spooled, */
+    /* passed to on_data, or cut short */
+    const char *target = i == 1 ? "/parse" : "/spool";
+    len = sizeof(part1) - 1 + sizeof(part2) - 1 + 10000 + sizeof(end) - 1;
+    sprintf(head,
+            "POST %s HTTP/1.1\r\nContent-Length: %lu\r\n"
+            "Content-Type: multipart/form-data; boundary=\"xyz\"\r\n\r\n",
+            target, (unsigned long)(i == 2 ? len - 9 : len));
+    assert_int_equal(pipe(fds), 0);
+    assert_true(write(fds[1], head, strlen(head)) > 0);
+    assert_true(write(fds[1], part1, sizeof(part1) - 1) > 0);
+    assert_true(write(fds[1], part2, sizeof(part2) - 1) > 0);
+    assert_true(write(fds[1], expected, 10000) > 0);
+    assert_true(write(fds[1], end, sizeof(end) - 1 - (i == 2 ? 9 : 0)) > 0);
+    struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(fds[0]);
+    struct _nhttp_buf_writer *w = _nhttp_util_buf_writer_create(-1);
+    struct _nhttp_parser      p;
+    struct _nhttp_server_body b = {0};
+    _nhttp_parser_init(&p);
+    requests = 0;
+    while (requests < 1) {
+      assert_true(_nhttp_util_buf_reader_fill(r) > 0);
+      assert_int_equal(
+          _nhttp_server_handle_pipeline(s, &p, &b, r, w, &requests), 1);
+    }
+    assert_int_equal(count_occurrences(w->buf, w->len, "parsed"), 1);
+    sprintf(path, "%s/upload", spool_dir);
+    if (i == 0) {
+      assert_int_equal(parse_result, 0);
+      assert_string_equal(parts, "title=5;file(spooled)=10000;");
+      assert_int_equal(body_len, 5);
+      assert_true((fd = open(path, O_RDONLY)) != -1);
+      assert_int_equal(read(fd, body, sizeof(body)), 10000);
+      assert_memory_equal(body, expected, 10000);
+      close(fd);
+      assert_int_equal(unlink(path), 0);
+    } else if (i == 1) {
+      assert_int_equal(parse_result, 0);
+      assert_string_equal(parts, "title=5;file=10000;");
+      assert_int_equal(body_len, 5 + 10000);
+      assert_memory_equal(body + 5, expected, 10000);
+    } else {
+      /* the unfinished file is removed */
+      assert_int_equal(parse_result, -1);
+      assert_int_equal(errno, EBADMSG);
+      assert_string_equal(parts, "title=5;file(spooled)");
+    }
+    _nhttp_util_buf_writer_free(w);
+    _nhttp_util_buf_reader_free(r);
+    close(fds[0]);
+    close(fds[1]);
+  }
+  assert_int_equal(rmdir(spool_dir), 0);
+}
+
+static void test_listen_config(void **state) {
+  struct nhttp_server       *s = nhttp_server_create();
+  struct nhttp_server_config cfg;
+  struct sockaddr_in         addr;
+  socklen_t                  len = sizeof(struct sockaddr_in);
+  int                        fd, val;
+
+  nhttp_server_config_init(&cfg);
+  assert_int_equal(cfg.backlog, NHTTP_SERVER_BACKLOG);
+  assert_int_equal(cfg.tcp_nodelay, 1);
+  cfg.bind_address     = "127.0.0.1";
+  cfg.tcp_defer_accept = 5;
+  nhttp_server_set_config(s, &cfg);
+
+  fd = _nhttp_server_listen(s, 0, 0); /* port 0, any free port */
+  assert_int_equal(getsockname(fd, (struct sockaddr *)&addr, &len), 0);
+  assert_int_equal(addr.sin_family, AF_INET);
+  assert_int_equal(ntohl(addr.sin_addr.s_addr), INADDR_LOOPBACK);
+
+  len = sizeof(int);
+  assert_int_equal(getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, &len), 0);
+  assert_int_not_equal(val, 0);
+  assert_int_equal(getsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &val, &len),
+                   0);
+  assert_int_not_equal(val, 0);
+  close(fd);
+}
+
+static void test_listen_unix(void **state) {
+  struct nhttp_server       *s = nhttp_server_create();
+  struct nhttp_server_config cfg;
+  struct sockaddr_un         addr;
+  struct stat                st;
+  socklen_t                  len = sizeof(struct sockaddr_un);
+  int                        fd, stale;
+
+  /* a stale socket file is replaced, the mode is applied */
+  stale = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, "/tmp/nhttp_listen.sock");
+  unlink(addr.sun_path);
+  assert_int_equal(bind(stale, (struct sockaddr *)&addr, len), 0);
+  close(stale);
+
+  nhttp_server_config_init(&cfg);
+  cfg.unix_path = "/tmp/nhttp_listen.sock";
+  cfg.unix_mode = 0600;
+  nhttp_server_set_config(s, &cfg);
+  fd = _nhttp_server_listen(s, 0, 0);
+  assert_int_equal(stat(cfg.unix_path, &st), 0);
+  assert_true(S_ISSOCK(st.st_mode));
+  assert_int_equal(st.st_mode & 0777, 0600);
+  assert_int_equal(getsockname(fd, (struct sockaddr *)&addr, &len), 0);
+  assert_int_equal(addr.sun_family, AF_UNIX);
+  assert_string_equal(addr.sun_path, cfg.unix_path);
+  close(fd);
+  unlink(cfg.unix_path);
+
+  /* abstract sockets have no file */
+  cfg.unix_path = "@nhttp_listen_test";
+  nhttp_server_set_config(s, &cfg);
+  fd = _nhttp_server_listen(s, 0, 0);
+  len = sizeof(struct sockaddr_un);
+  assert_int_equal(getsockname(fd, (struct sockaddr *)&addr, &len), 0);
+  assert_int_equal(addr.sun_path[0], '\0');
+  assert_memory_equal(addr.sun_path + 1, "nhttp_listen_test",
+                      strlen("nhttp_listen_test"));
+  close(fd);
+}
+
 int main(void) {
   const struct CMUnitTest map_tests[] = {
       cmocka_unit_test(test_get_request_header),
       cmocka_unit_test(test_set_response_header),
       cmocka_unit_test(test_get_path_param),
       cmocka_unit_test(test_get_query_param),
+      cmocka_unit_test(test_handle_pipeline),
+      cmocka_unit_test(test_request_body),
+      cmocka_unit_test(test_expect_continue),
+      cmocka_unit_test(test_discard_body),
+      cmocka_unit_test(test_nonblocking_body),
+      cmocka_unit_test(test_save_body),
+      cmocka_unit_test(test_multipart),
+      cmocka_unit_test(test_listen_config),
+      cmocka_unit_test(test_listen_unix),
   };
   return cmocka_run_group_tests(map_tests, NULL, NULL);
 }
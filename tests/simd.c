@@ -0,0 +1,87 @@
+// clang-format off
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h> /* mmap, mprotect, munmap */
+#include <unistd.h>   /* sysconf */
+
+#include "../src/nhttp_simd.h"
+// clang-format on
+
+static size_t ref_find_any(const char *buf, size_t len, const char *set,
+                           size_t nset) {
+  size_t i;
+  for (i = 0; i < len && !memchr(set, buf[i], nset); i++)
+    ;
+  return i;
+}
+
+static size_t ref_find_ctl(const char *buf, size_t len, unsigned char max) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    if ((unsigned char)buf[i] <= max || buf[i] == 0x7f)
+      break;
+  }
+  return i;
+}
+
+/* check_level compares the scanners against the reference ones on every */
+/* length and position of a delimiter, with the scanned bytes ending right */
+/* before an inaccessible page, so that reads past the end would fault. */
+static void check_level(enum _nhttp_simd_level level) {
+  long   page = sysconf(_SC_PAGESIZE);
+  char  *mem  = mmap(NULL, (size_t)(2 * page), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char  *end  = mem + page;
+  char  *buf;
+  size_t len, pos;
+
+  assert_int_equal(_nhttp_simd_use(level), 0);
+  assert_int_equal(mprotect(end, (size_t)page, PROT_NONE), 0);
+  for (len = 0; len <= 100; len++) {
+    buf = end - len;
+    for (pos = 0; pos <= len; pos++) {
+      /* plain header value bytes, including obs-text */
+      memset(buf, 'a', len);
+      if (len > 0)
+        buf[len / 2] = (char)0xe9;
+      if (pos < len)
+        buf[pos] = pos % 2 ? '\r' : '?';
+      assert_int_equal(_nhttp_simd_find_any(buf, len, "\r\n", 2),
+                       ref_find_any(buf, len, "\r\n", 2));
+      assert_int_equal(_nhttp_simd_find_any(buf, len, "?#/%", 4),
+                       ref_find_any(buf, len, "?#/%", 4));
+      assert_int_equal(_nhttp_simd_find_ctl(buf, len, 0x1f),
+                       ref_find_ctl(buf, len, 0x1f));
+      if (pos < len)
+        buf[pos] = pos % 2 ? 0x7f : ' ';
+      assert_int_equal(_nhttp_simd_find_ctl(buf, len, 0x1f),
+                       ref_find_ctl(buf, len, 0x1f));
+      assert_int_equal(_nhttp_simd_find_ctl(buf, len, ' '),
+                       ref_find_ctl(buf, len, ' '));
+    }
+  }
+  munmap(mem, (size_t)(2 * page));
+}
+
+static void test_simd_scalar(void **state) { check_level(NHTTP_SIMD_SCALAR); }
+
+static void test_simd_vector(void **state) {
+  if (_nhttp_simd_use(NHTTP_SIMD_SSE2) == 0)
+    check_level(NHTTP_SIMD_SSE2);
+  if (_nhttp_simd_use(NHTTP_SIMD_AVX2) == 0)
+    check_level(NHTTP_SIMD_AVX2);
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_simd_scalar),
+      cmocka_unit_test(test_simd_vector),
+  };
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,133 @@
+// clang-format off
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <cmocka.h>
+
+#include "../src/nhttp_timer.h"
+// clang-format on
+
+static long fired[16];
+static int  nfired;
+static long fired_at;
+
+static struct _nhttp_timer_wheel wheel;
+
+static void record_fn(struct _nhttp_timer *t) {
+  fired[nfired++] = (long)(intptr_t)t->data;
+  fired_at        = wheel.now;
+}
+
+static void test_timer_order(void **state) {
+  struct _nhttp_timer a, b, c;
+
+  _nhttp_timer_wheel_init(&wheel, 1000);
+  nfired = 0;
+  _nhttp_timer_init(&a, record_fn, (void *)1);
+  _nhttp_timer_init(&b, record_fn, (void *)2);
+  _nhttp_timer_init(&c, record_fn, (void *)3);
+
+  _nhttp_timer_add(&wheel, &a, 1030);
+  _nhttp_timer_add(&wheel, &b, 1010);
+  _nhttp_timer_add(&wheel, &c, 1020);
+  assert_int_equal(_nhttp_timer_next(&wheel), 10);
+
+  _nhttp_timer_advance(&wheel, 1009);
+  assert_int_equal(nfired, 0);
+  _nhttp_timer_advance(&wheel, 1025);
+  assert_int_equal(nfired, 2);
+  assert_int_equal(fired[0], 2);
+  assert_int_equal(fired[1], 3);
+  assert_int_equal(_nhttp_timer_next(&wheel), 5);
+  _nhttp_timer_advance(&wheel, 2000);
+  assert_int_equal(nfired, 3);
+  assert_int_equal(fired[2], 1);
+  assert_int_equal(_nhttp_timer_next(&wheel), -1);
+  assert_false(_nhttp_timer_pending(&a));
+}
+
+static void test_timer_remove(void **state) {
+  struct _nhttp_timer a, b;
+
+  _nhttp_timer_wheel_init(&wheel, 0);
+  nfired = 0;
+  _nhttp_timer_init(&a, record_fn, (void *)1);
+  _nhttp_timer_init(&b, record_fn, (void *)2);
+
+  _nhttp_timer_add(&wheel, &a, 50);
+  _nhttp_timer_add(&wheel, &b, 50);
+  assert_true(_nhttp_timer_pending(&a));
+  _nhttp_timer_remove(&wheel, &a);
+  _nhttp_timer_remove(&wheel, &a); /* no-op */
+  assert_false(_nhttp_timer_pending(&a));
+
+  /* rescheduling moves the timer */
+  _nhttp_timer_add(&wheel, &b, 70);
+  _nhttp_timer_advance(&wheel, 60);
+  assert_int_equal(nfired, 0);
+  _nhttp_timer_advance(&wheel, 70);
+  assert_int_equal(nfired, 1);
+  assert_int_equal(fired[0], 2);
+  assert_int_equal(wheel.count, 0);
+}
+
+static void test_timer_cascade(void **state) {
+  struct _nhttp_timer a, b, c;
+
+  _nhttp_timer_wheel_init(&wheel, 123);
+  nfired = 0;
+  _nhttp_timer_init(&a, record_fn, (void *)1);
+  _nhttp_timer_init(&b, record_fn, (void *)2);
+  _nhttp_timer_init(&c, record_fn, (void *)3);
+
+  _nhttp_timer_add(&wheel, &a, 123 + 5000);    /* level 2 */
+  _nhttp_timer_add(&wheel, &b, 123 + 300000);  /* level 3 */
+  _nhttp_timer_add(&wheel, &c, 123 + 100);     /* level 1 */
+
+  /* wakeups are never later than the next expiry */
+  while (nfired < 3) {
+    long next = _nhttp_timer_next(&wheel);
+    assert_true(next > 0);
+    _nhttp_timer_advance(&wheel, wheel.now + next);
+    if (nfired == 1)
+      assert_int_equal(fired_at, 123 + 100);
+    if (nfired == 2)
+      assert_int_equal(fired_at, 123 + 5000);
+  }
+  assert_int_equal(fired_at, 123 + 300000);
+  assert_int_equal(fired[0], 3);
+  assert_int_equal(fired[1], 1);
+  assert_int_equal(fired[2], 2);
+}
+
+static void readd_fn(struct _nhttp_timer *t) {
+  nfired++;
+  if (nfired < 3)
+    _nhttp_timer_add(&wheel, t, wheel.now); /* expires on the next tick */
+}
+
+static void test_timer_readd(void **state) {
+  struct _nhttp_timer a;
+
+  _nhttp_timer_wheel_init(&wheel, 0);
+  nfired = 0;
+  _nhttp_timer_init(&a, readd_fn, NULL);
+  _nhttp_timer_add(&wheel, &a, 10);
+  _nhttp_timer_advance(&wheel, 10);
+  assert_int_equal(nfired, 1);
+  assert_int_equal(_nhttp_timer_next(&wheel), 1);
+  _nhttp_timer_advance(&wheel, 100);
+  assert_int_equal(nfired, 3);
+  assert_false(_nhttp_timer_pending(&a));
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_timer_order),
+      cmocka_unit_test(test_timer_remove),
+      cmocka_unit_test(test_timer_cascade),
+      cmocka_unit_test(test_timer_readd),
+  };
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,94 @@
+// clang-format off
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../src/nhttp_upgrade.h"
+// clang-format on
+
+static int listen_any(struct sockaddr_in *addr) {
+  socklen_t len = sizeof(struct sockaddr_in);
+  int       fd  = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(addr, 0, sizeof(struct sockaddr_in));
+  addr->sin_family      = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert_int_equal(bind(fd, (struct sockaddr *)addr, len), 0);
+  assert_int_equal(listen(fd, 1), 0);
+  assert_int_equal(getsockname(fd, (struct sockaddr *)addr, &len), 0);
+  return fd;
+}
+
+static void test_upgrade_take(void **state) {
+  struct sockaddr_in a, b, other;
+  struct sockaddr_un un;
+  socklen_t          unlen;
+  int                fa, fb, fun, not_listening;
+  char               env[64];
+
+  fa            = listen_any(&a);
+  fb            = listen_any(&b);
+  not_listening = socket(AF_INET, SOCK_STREAM, 0);
+
+  /* an abstract Unix domain socket, whose name is delimited by the length */
+  memset(&un, 0, sizeof(struct sockaddr_un));
+  un.sun_family = AF_UNIX;
+  strcpy(un.sun_path + 1, "nhttp_upgrade_test");
+  unlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 +
+                      strlen("nhttp_upgrade_test"));
+  fun   = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert_int_equal(bind(fun, (struct sockaddr *)&un, unlen), 0);
+  assert_int_equal(listen(fun, 1), 0);
+
+  sprintf(env, "%d,%d,%d,%d,x", fa, not_listening, fun, fb);
+  setenv(NHTTP_UPGRADE_ENV, env, 1);
+
+  /* sockets are matched by the address they are bound to */
+  other          = a;
+  other.sin_port = 0;
+  assert_int_equal(
+      _nhttp_upgrade_take((struct sockaddr *)&other, sizeof(other)), -1);
+  assert_null(getenv(NHTTP_UPGRADE_ENV));
+  assert_int_equal(_nhttp_upgrade_take((struct sockaddr *)&b, sizeof(b)), fb);
+  assert_int_equal(_nhttp_upgrade_take((struct sockaddr *)&b, sizeof(b)), -1);
+  assert_int_equal(_nhttp_upgrade_take((struct sockaddr *)&un, unlen - 1), -1);
+  assert_int_equal(_nhttp_upgrade_take((struct sockaddr *)&un, unlen), fun);
+
+  /* the sockets which weren't taken are closed */
+  _nhttp_upgrade_close_inherited();
+  assert_int_equal(close(fa), -1);
+  assert_int_equal(close(fb), 0);
+  assert_int_equal(close(fun), 0);
+  assert_int_equal(close(not_listening), 0);
+}
+
+static void test_upgrade_signal(void **state) {
+  _nhttp_upgrade_install(SIGUSR2, 1);
+  assert_false(_nhttp_upgrade_pending());
+
+  /* the signal is blocked outside of waits */
+  raise(SIGUSR2);
+  assert_false(_nhttp_upgrade_requested());
+  assert_int_equal(_nhttp_upgrade_poll(NULL, 0, 0), -1);
+  assert_int_equal(errno, EINTR);
+  assert_true(_nhttp_upgrade_requested());
+  assert_true(_nhttp_upgrade_pending());
+  assert_false(_nhttp_upgrade_draining());
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_upgrade_take),
+      cmocka_unit_test(test_upgrade_signal),
+  };
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -6,6 +6,8 @@
 #include <cmocka.h>
 #include <stdio.h> 
 #include <stdlib.h> 
+#include <string.h>
+#include <errno.h>
 
 #include "../src/nhttp_util.h"
 // clang-format on
@@ -126,6 +128,34 @@ static void test_buf_read_normal(void **state) {
   _nhttp_util_buf_reader_free(r);
 }
 
+static void test_buf_read_pinned(void **state) {
+  char dest[2 * NHTTP_UTIL_BUF_READER_SIZE];
+  struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(0xbeef);
+  {
+    /* once drained, reading starts over right after the pinned bytes */
+    r->head = r->tail = NHTTP_UTIL_BUF_READER_SIZE;
+    r->pin            = 100;
+    expect_value(__wrap_read, n, NHTTP_UTIL_BUF_READER_SIZE - 100);
+    will_return(__wrap_read, 10);
+    size_t ret = _nhttp_util_buf_read(r, dest, 5);
+    assert_int_equal(ret, 5);
+    assert_int_equal(r->head, 105);
+    assert_int_equal(r->tail, 110);
+  }
+  {
+    /* the pinned bytes take up the whole buffer, reads bypass it */
+    r->head = r->tail = NHTTP_UTIL_BUF_READER_SIZE;
+    r->pin            = NHTTP_UTIL_BUF_READER_SIZE;
+    expect_value(__wrap_read, n, 20);
+    will_return(__wrap_read, 20);
+    size_t ret = _nhttp_util_buf_read(r, dest, 20);
+    assert_int_equal(ret, 20);
+    assert_int_equal(r->head, NHTTP_UTIL_BUF_READER_SIZE);
+    assert_int_equal(r->consumed, 25);
+  }
+  _nhttp_util_buf_reader_free(r);
+}
+
 ssize_t __wrap_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
   check_expected(out_fd);
   check_expected(in_fd);
@@ -165,6 +195,68 @@ static void test_sendfile_all(void **state) {
   }
 }
 
+static void test_buf_reader_fill(void **state) {
+  struct _nhttp_buf_reader *r = _nhttp_util_buf_reader_create(0xbeef);
+  {
+    /* buffered content gets moved to the start of the buffer */
+    r->head = NHTTP_UTIL_BUF_READER_SIZE - 10;
+    r->tail = NHTTP_UTIL_BUF_READER_SIZE;
+    expect_value(__wrap_read, n, NHTTP_UTIL_BUF_READER_SIZE - 10);
+    will_return(__wrap_read, 5);
+    ssize_t ret = _nhttp_util_buf_reader_fill(r);
+    assert_int_equal(ret, 5);
+    assert_int_equal(r->head, 0);
+    assert_int_equal(r->tail, 15);
+  }
+  {
+    /* full buffer */
+    r->head = 0;
+    r->tail = NHTTP_UTIL_BUF_READER_SIZE;
+    ssize_t ret = _nhttp_util_buf_reader_fill(r);
+    assert_int_equal(ret, -1);
+    assert_int_equal(errno, ENOBUFS);
+  }
+  _nhttp_util_buf_reader_free(r);
+}
+
+static void test_buf_writer(void **state) {
+  struct _nhttp_buf_writer *w = _nhttp_util_buf_writer_create(1);
+  {
+    /* nothing gets written until flush */
+    assert_int_equal(_nhttp_util_buf_write(w, "hello ", 6), 0);
+    assert_int_equal(_nhttp_util_buf_write(w, "world", 5), 0);
+    assert_int_equal(w->len, 11);
+
+    expect_value(__wrap_write, n, 11);
+    will_return(__wrap_write, 11);
+    assert_int_equal(_nhttp_util_buf_writer_flush(w), 0);
+    assert_int_equal(w->len, 0);
+  }
+  {
+    /* flush continues where it left off */
+    _nhttp_util_buf_write(w, "hello world", 11);
+    expect_value(__wrap_write, n, 11);
+    will_return(__wrap_write, 4);
+    expect_value(__wrap_write, n, 7);
+    will_return(__wrap_write, 7);
+    assert_int_equal(_nhttp_util_buf_writer_flush(w), 0);
+  }
+  {
+    /* queued file range is sent after the buffered bytes */
+    _nhttp_util_buf_write(w, "hdr", 3);
+    _nhttp_util_buf_writer_sendfile(w, 2, 10, 20);
+    expect_value(__wrap_write, n, 3);
+    will_return(__wrap_write, 3);
+    expect_value(__wrap_sendfile, out_fd, 1);
+    expect_value(__wrap_sendfile, in_fd, 2);
+    expect_value(__wrap_sendfile, count, 20);
+    will_return(__wrap_sendfile, 20);
+    assert_int_equal(_nhttp_util_buf_writer_flush(w), 0);
+    assert_int_equal(w->file_fd, -1);
+  }
+  _nhttp_util_buf_writer_free(w);
+}
+
 static void test_remove_trailing_slash(void **state) {
   {
     char input[] = "/hello/world/";
@@ -221,250 +313,103 @@ static void test_remove_leading_slash(void **state) {
   }
 }
 
-static void test_cut_path_query_params(void **state) {
+static void test_url_encode(void **state) {
+  char buf[3 * 64 + 1];
   {
-    char dest[20] = {0};
-    char path[] = "";
-    _nhttp_util_cut_path_query_params(dest, path);
-    assert_int_equal(dest[0], 0);
-    assert_string_equal(path, "");
+    assert_int_equal(_nhttp_util_url_encode(buf, "", 0), 0);
+    assert_string_equal(buf, "");
   }
   {
-    char dest[20] = {0};
-    char path[] = "foo";
-    _nhttp_util_cut_path_query_params(dest, path);
-    assert_int_equal(dest[0], 0);
-    assert_string_equal(path, "foo");
+    assert_int_equal(_nhttp_util_url_encode(buf, "foo", 3), 3);
+    assert_string_equal(buf, "foo");
   }
   {
-    char dest[20] = {0};
-    char path[] = "foo?bar=baz";
-    _nhttp_util_cut_path_query_params(dest, path);
-    assert_string_equal(dest, "bar=baz");
-    assert_string_equal(path, "foo");
+    assert_int_equal(_nhttp_util_url_encode(buf, " ", 1), 3);
+    assert_string_equal(buf, "%20");
   }
   {
-    char dest[20] = {0};
-    char path[] = "foo?bar=baz#frag";
-    _nhttp_util_cut_path_query_params(dest, path);
-    assert_string_equal(dest, "bar=baz");
-    assert_string_equal(path, "foo");
+    _nhttp_util_url_encode(buf, "foo bar", 7);
+    assert_string_equal(buf, "foo%20bar");
   }
-  /* edge case */
   {
-    char dest[20] = {0};
-    char path[] = "foo?";
-    _nhttp_util_cut_path_query_params(dest, path);
-    assert_int_equal(dest[0], 0);
-    assert_string_equal(path, "foo");
+    _nhttp_util_url_encode(buf, "<foo bar baz>", 13);
+    assert_string_equal(buf, "%3Cfoo%20bar%20baz%3E");
   }
-  /* edge case */
   {
-    char dest[20] = {0};
-    char path[] = "foo?bar=baz#";
-    _nhttp_util_cut_path_query_params(dest, path);
-    assert_string_equal(dest, "bar=baz");
-    assert_string_equal(path, "foo");
+    const char *input = " <>\"#%{}|\\^~[]`;/?:@=&";
+    _nhttp_util_url_encode(buf, input, strlen(input));
+    assert_string_equal(
+        buf,
+        "%20%3C%3E%22%23%25%7B%7D%7C%5C%5E%7E%5B%5D%60%3B%2F%3F%3A%40%3D%26");
   }
-  /* edge case */
+  /* controls, DEL and non-ASCII bytes */
   {
-    char dest[20] = {0};
-    char path[] = "foo?#";
-    _nhttp_util_cut_path_query_params(dest, path);
-    assert_int_equal(dest[0], 0);
-    assert_string_equal(path, "foo");
+    _nhttp_util_url_encode(buf, "\r\n\x7f\xc3\xa9.-_", 8);
+    assert_string_equal(buf, "%0D%0A%7F%C3%A9.-_");
   }
-  /* incorrect input */
+  /* only `len` bytes are encoded */
   {
-    char dest[20] = {0};
-    char path[] = "foo#?";
-    _nhttp_util_cut_path_query_params(dest, path);
-    assert_int_equal(dest[0], 0);
-    assert_string_equal(path, "foo#");
+    assert_int_equal(_nhttp_util_url_encode(buf, "a b", 2), 4);
+    assert_string_equal(buf, "a%20");
   }
 }
 
-static void test_str_triplets_validate(void **state) {
+static void test_url_decode(void **state) {
+  char buf[128];
   {
-    char *input = "";
-    int res = _nhttp_util_str_triplets_validate(input);
-    assert_int_equal(res, 0);
+    assert_int_equal(_nhttp_util_url_decode(buf, "", 0), 0);
+    assert_string_equal(buf, "");
   }
   {
-    char *input = "foobar";
-    int res = _nhttp_util_str_triplets_validate(input);
-    assert_int_equal(res, 0);
+    assert_int_equal(_nhttp_util_url_decode(buf, "foo", 3), 3);
+    assert_string_equal(buf, "foo");
   }
   {
-    char *input = "%20";
-    int res = _nhttp_util_str_triplets_validate(input);
-    assert_int_equal(res, 0);
+    assert_int_equal(_nhttp_util_url_decode(buf, "%20", 3), 1);
+    assert_string_equal(buf, " ");
   }
   {
-    char *input = "%aa%bb";
-    int res = _nhttp_util_str_triplets_validate(input);
-    assert_int_equal(res, 0);
+    _nhttp_util_url_decode(buf, "foo%20bar", 9);
+    assert_string_equal(buf, "foo bar");
   }
   {
-    char *input = "%AA%BB";
-    int res = _nhttp_util_str_triplets_validate(input);
-    assert_int_equal(res, 0);
+    _nhttp_util_url_decode(buf, "%3Cfoo%20bar%20baz%3E", 21);
+    assert_string_equal(buf, "<foo bar baz>");
   }
-
-  /* percent sign not encoded (out-of-bounds prevention) */
   {
-    char *input = "%2";
-    int res = _nhttp_util_str_triplets_validate(input);
-    assert_int_equal(res, -1);
-  }
-  {
-    char *input = "foo%20%2";
-    int res = _nhttp_util_str_triplets_validate(input);
-    assert_int_equal(res, -1);
-  }
-  {
-    char *input = "foo%";
-    int res = _nhttp_util_str_triplets_validate(input);
-    assert_int_equal(res, -1);
-  }
-
-  /* invalid hex number */
-  {
-    char *input = "%0z";
-    int res = _nhttp_util_str_triplets_validate(input);
-    assert_int_equal(res, -1);
-  }
-  {
-    char *input = "%20%0z";
-    int res = _nhttp_util_str_triplets_validate(input);
-    assert_int_equal(res, -1);
-  }
-
-  /* just a mixed-bag stress test */
-  {
-    char *input = "foo%20bar/baz%30@";
-    int res = _nhttp_util_str_triplets_validate(input);
-    assert_int_equal(res, 0);
-  }
-  {
-    char *input = "foo%%20bar";
-    int res = _nhttp_util_str_triplets_validate(input);
-    assert_int_equal(res, -1);
-  }
-}
-
-static void test_str_triplets_to_upper(void **state) {
-  {
-    char input[] = "";
-    _nhttp_util_str_triplets_to_upper(input);
-    assert_string_equal(input, "");
-  }
-  {
-    char input[] = "foo";
-    _nhttp_util_str_triplets_to_upper(input);
-    assert_string_equal(input, "foo");
-  }
-  {
-    char input[] = "%00 %a0 %0a %aa";
-    _nhttp_util_str_triplets_to_upper(input);
-    assert_string_equal(input, "%00 %A0 %0A %AA");
+    const char *input =
+        "%20%3C%3E%22%23%25%7B%7D%7C%5C%5E%7E%5B%5D%60%3B%2F%3F%3A%40%3D%26";
+    _nhttp_util_url_decode(buf, input, strlen(input));
+    assert_string_equal(buf, " <>\"#%{}|\\^~[]`;/?:@=&");
   }
+  /* hex digits of either case */
   {
-    char input[] = "%00 %A0 %0A %AA";
-    _nhttp_util_str_triplets_to_upper(input);
-    assert_string_equal(input, "%00 %A0 %0A %AA");
+    assert_int_equal(_nhttp_util_url_decode(buf, "%aF%Af%af%AF", 12), 4);
+    assert_string_equal(buf, "\xaf\xaf\xaf\xaf");
   }
   {
-    char input[] = "%aF %Af %af %AF";
-    _nhttp_util_str_triplets_to_upper(input);
-    assert_string_equal(input, "%AF %AF %AF %AF");
+    _nhttp_util_url_decode(buf, "foo%20bar/baz%30@", 17);
+    assert_string_equal(buf, "foo bar/baz0@");
   }
+  /* in place */
   {
-    char input[] = "foo%afbar";
-    _nhttp_util_str_triplets_to_upper(input);
-    assert_string_equal(input, "foo%AFbar");
+    char input[] = "foo%2fbar%2Fbaz";
+    assert_int_equal(_nhttp_util_url_decode(input, input, strlen(input)), 11);
+    assert_string_equal(input, "foo/bar/baz");
   }
-}
 
-static void test_str_escape(void **state) {
-  {
-    char *input = "";
-    char *res = _nhttp_util_str_escape(input);
-    assert_string_equal(res, "");
-    free(res);
-  }
-  {
-    char *input = "foo";
-    char *res = _nhttp_util_str_escape(input);
-    assert_string_equal(res, "foo");
-    free(res);
-  }
-  {
-    char *input = " ";
-    char *res = _nhttp_util_str_escape(input);
-    assert_string_equal(res, "%20");
-    free(res);
-  }
-  {
-    char *input = "foo bar";
-    char *res = _nhttp_util_str_escape(input);
-    assert_string_equal(res, "foo%20bar");
-    free(res);
-  }
-  {
-    char *input = "<foo bar baz>";
-    char *res = _nhttp_util_str_escape(input);
-    assert_string_equal(res, "%3Cfoo%20bar%20baz%3E");
-    free(res);
-  }
-  {
-    char *input = " <>\"#%{}|\\^~[]`;/?:@=&";
-    char *res = _nhttp_util_str_escape(input);
-    assert_string_equal(
-        res,
-        "%20%3C%3E%22%23%25%7B%7D%7C%5C%5E%7E%5B%5D%60%3B%2F%3F%3A%40%3D%26");
-    free(res);
-  }
-}
+  /* percent sign not encoded (out-of-bounds prevention) */
+  assert_int_equal(_nhttp_util_url_decode(buf, "%2", 2), -1);
+  assert_int_equal(_nhttp_util_url_decode(buf, "foo%20%2", 8), -1);
+  assert_int_equal(_nhttp_util_url_decode(buf, "foo%", 4), -1);
+  assert_int_equal(_nhttp_util_url_decode(buf, "foo%%20bar", 10), -1);
+  /* only `len` bytes are decoded */
+  assert_int_equal(_nhttp_util_url_decode(buf, "%20", 2), -1);
 
-static void test_str_unescape(void **state) {
-  {
-    char *input = "";
-    char *res = _nhttp_util_str_unescape(input);
-    assert_string_equal(res, "");
-    free(res);
-  }
-  {
-    char *input = "foo";
-    char *res = _nhttp_util_str_unescape(input);
-    assert_string_equal(res, "foo");
-    free(res);
-  }
-  {
-    char *input = "%20";
-    char *res = _nhttp_util_str_unescape(input);
-    assert_string_equal(res, " ");
-    free(res);
-  }
-  {
-    char *input = "foo%20bar";
-    char *res = _nhttp_util_str_unescape(input);
-    assert_string_equal(res, "foo bar");
-    free(res);
-  }
-  {
-    char *input = "%3Cfoo%20bar%20baz%3E";
-    char *res = _nhttp_util_str_unescape(input);
-    assert_string_equal(res, "<foo bar baz>");
-    free(res);
-  }
-  {
-    char *input =
-        "%20%3C%3E%22%23%25%7B%7D%7C%5C%5E%7E%5B%5D%60%3B%2F%3F%3A%40%3D%26";
-    char *res = _nhttp_util_str_unescape(input);
-    assert_string_equal(res, " <>\"#%{}|\\^~[]`;/?:@=&");
-    free(res);
-  }
+  /* invalid hex number */
+  assert_int_equal(_nhttp_util_url_decode(buf, "%0z", 3), -1);
+  assert_int_equal(_nhttp_util_url_decode(buf, "%20%0z", 6), -1);
+  assert_int_equal(_nhttp_util_url_decode(buf, "%z0", 3), -1);
 }
 
 int main(void) {
@@ -473,14 +418,14 @@ int main(void) {
       cmocka_unit_test(test_buf_read_eof),
       cmocka_unit_test(test_buf_read_error),
       cmocka_unit_test(test_buf_read_normal),
+      cmocka_unit_test(test_buf_read_pinned),
       cmocka_unit_test(test_sendfile_all),
+      cmocka_unit_test(test_buf_reader_fill),
+      cmocka_unit_test(test_buf_writer),
       cmocka_unit_test(test_remove_trailing_slash),
-      cmocka_unit_test(test_cut_path_query_params),
       cmocka_unit_test(test_remove_leading_slash),
-      cmocka_unit_test(test_str_triplets_validate),
-      cmocka_unit_test(test_str_triplets_to_upper),
-      cmocka_unit_test(test_str_escape),
-      cmocka_unit_test(test_str_unescape),
+      cmocka_unit_test(test_url_encode),
+      cmocka_unit_test(test_url_decode),
   };
   return cmocka_run_group_tests(util_tests, NULL, NULL);
 }